@@ -0,0 +1,464 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <signal.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+
+#include "profile.h"
+
+// Launch benchmark for barcov2.
+//
+// usage: bench_launch <barcov2> <payload> <output prefix>
+//
+// - launch: containers started per second, spawn-to-exec and teardown
+// latency percentiles and per-phase latency percentiles (taken from
+// --profile-startup) at several concurrency levels
+// - syscall: getpid / read cost of the payload on the host, in a container
+// without seccomp (namespaces only) and in a container with its filter
+//
+// Results are written to <output prefix>.csv and <output prefix>.json as
+// (benchmark, concurrency, metric, value) records so runs can be diffed.
+
+enum {
+    // Launches measured per concurrency level
+    BENCH_LAUNCHES      = 512,
+    // Maximum stderr output kept per launch
+    BENCH_OUTPUT_MAX    = 64 * 1024,
+    // Exit code telling meson the benchmark was skipped
+    BENCH_SKIP          = 77,
+};
+
+static const int bench_concurrency[] = {1, 8, 64, 256};
+
+// A barcov2 process being measured
+struct bench_launch {
+    pid_t pid;
+    int pidfd;
+    int err_fd;
+    int status;
+    uint64_t spawn_ns;
+    uint64_t exit_ns;
+    size_t len;
+    char buf[BENCH_OUTPUT_MAX];
+};
+
+// Samples collected for one concurrency level
+struct bench_samples {
+    size_t count;
+    uint64_t exec[BENCH_LAUNCHES];
+    uint64_t teardown[BENCH_LAUNCHES];
+    uint64_t phases[PROFILE_PHASE_MAX][BENCH_LAUNCHES];
+};
+
+static struct {
+    const char *barco;
+    const char *payload;
+    char rootfs[PATH_MAX];
+    FILE *csv;
+    FILE *json;
+    bool first_record;
+} B;
+
+static uint64_t bench_now(void) {
+    struct timespec ts = {0};
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void bench_record(const char *benchmark, int concurrency,
+                         const char *metric, double value) {
+    fprintf(B.csv, "%s,%d,%s,%.2f\n", benchmark, concurrency, metric, value);
+    fprintf(B.json, "%s\n  {\"benchmark\":\"%s\",\"concurrency\":%d,"
+            "\"metric\":\"%s\",\"value\":%.2f}",
+            B.first_record ? "" : ",", benchmark, concurrency, metric, value);
+    B.first_record = false;
+    printf("%-8s %4d %-28s %14.2f\n", benchmark, concurrency, metric, value);
+}
+
+static int bench_compare(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+// Records the p50 / p99 / p999 of the samples (sorted in place)
+static void bench_record_percentiles(const char *benchmark, int concurrency,
+                                     const char *metric, uint64_t *samples,
+                                     size_t count) {
+    static const struct {
+        const char *suffix;
+        double rank;
+    } percentiles[] = {{"p50", 0.50}, {"p99", 0.99}, {"p999", 0.999}};
+    char name[128] = {0};
+
+    if (!count)
+        return;
+
+    qsort(samples, count, sizeof(*samples), bench_compare);
+    for (size_t i = 0; i < sizeof(percentiles) / sizeof(*percentiles); i++) {
+        size_t index = (size_t)(percentiles[i].rank * (double)count);
+
+        if (index >= count)
+            index = count - 1;
+        snprintf(name, sizeof(name), "%s_%s_ns", metric, percentiles[i].suffix);
+        bench_record(benchmark, concurrency, name, (double)samples[index]);
+    }
+}
+
+// Copies the payload into a fresh rootfs directory
+static int bench_rootfs_create(void) {
+    char path[PATH_MAX] = {0};
+    struct stat st = {0};
+    int in = -1;
+    int out = -1;
+    int result = -1;
+
+    strcpy(B.rootfs, "/tmp/barco-bench.XXXXXX");
+    if (!mkdtemp(B.rootfs) || chmod(B.rootfs, 0755)) {
+        perror("rootfs");
+        return -1;
+    }
+
+    snprintf(path, sizeof(path), "%s/payload", B.rootfs);
+    if ((in = open(B.payload, O_RDONLY | O_CLOEXEC)) == -1 || fstat(in, &st) ||
+        (out = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0755)) == -1 ||
+        sendfile(out, in, NULL, st.st_size) != st.st_size) {
+        perror("payload");
+        goto exit;
+    }
+    result = 0;
+
+exit:
+    if (in >= 0)
+        close(in);
+    if (out >= 0)
+        close(out);
+    return result;
+}
+
+static void bench_rootfs_remove(void) {
+    char path[PATH_MAX] = {0};
+
+    snprintf(path, sizeof(path), "%s/payload", B.rootfs);
+    unlink(path);
+    rmdir(B.rootfs);
+}
+
+// Starts argv with stdout or stderr (fd) redirected to a pipe and the other one
+// to /dev/null. Returns the read end of the pipe.
+static int bench_spawn(char **argv, int fd, pid_t *pid) {
+    int pipe_fds[2] = {-1, -1};
+
+    if (pipe2(pipe_fds, O_CLOEXEC)) {
+        perror("pipe2");
+        return -1;
+    }
+
+    if ((*pid = fork()) == -1) {
+        perror("fork");
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        return -1;
+    }
+
+    if (!*pid) {
+        int null_fd = open("/dev/null", O_WRONLY);
+
+        dup2(pipe_fds[1], fd);
+        dup2(null_fd, fd == STDOUT_FILENO ? STDERR_FILENO : STDOUT_FILENO);
+        execv(argv[0], argv);
+        _exit(127);
+    }
+
+    close(pipe_fds[1]);
+    return pipe_fds[0];
+}
+
+// Extracts the phase durations and the execve timestamp from the
+// --profile-startup line of a launch
+static int bench_parse_profile(struct bench_launch *launch,
+                               struct bench_samples *samples) {
+    const char *profile = NULL;
+    char key[64] = {0};
+    unsigned long long begin = 0;
+    unsigned long long end = 0;
+    size_t index = samples->count;
+
+    launch->buf[launch->len] = '\0';
+    if (!(profile = strstr(launch->buf, "{\"event\":\"startup\"")))
+        return -1;
+
+    for (int phase = 0; phase < PROFILE_PHASE_MAX; phase++) {
+        const char *value = NULL;
+
+        snprintf(key, sizeof(key), "\"%s\":{", profile_phase_name(phase));
+        if (!(value = strstr(profile, key)) ||
+            sscanf(value + strlen(key), "\"begin_ns\":%llu,\"end_ns\":%llu",
+                   &begin, &end) != 2)
+            return -1;
+        samples->phases[phase][index] = end - begin;
+    }
+
+    // end is now the end of child_execve, the last phase
+    samples->exec[index] = end - launch->spawn_ns;
+    samples->teardown[index] = launch->exit_ns - end;
+    samples->count++;
+
+    return 0;
+}
+
+// Kills a launch still running and releases it. A launch whose pidfd is
+// closed was already reaped, its pid may belong to another process.
+static void bench_launch_stop(struct bench_launch *launch) {
+    if (launch->pid == -1)
+        return;
+
+    if (launch->pidfd >= 0) {
+        kill(launch->pid, SIGKILL);
+        waitpid(launch->pid, NULL, 0);
+        close(launch->pidfd);
+        launch->pidfd = -1;
+    }
+    if (launch->err_fd >= 0) {
+        close(launch->err_fd);
+        launch->err_fd = -1;
+    }
+    launch->pid = -1;
+}
+
+static int bench_launch_start(struct bench_launch *launch, int concurrency,
+                              int index) {
+    char hostname[64] = {0};
+    char *argv[] = {
+        (char *)B.barco, "--profile-startup", "-u", "0", "-m", B.rootfs,
+        "-c", "/payload", "-n", hostname, NULL,
+    };
+
+    snprintf(hostname, sizeof(hostname), "barco-bench-%d-%d", concurrency, index);
+    launch->len = 0;
+    launch->status = 0;
+    launch->spawn_ns = bench_now();
+    if ((launch->err_fd = bench_spawn(argv, STDERR_FILENO, &launch->pid)) == -1)
+        return -1;
+
+    if ((launch->pidfd = syscall(SYS_pidfd_open, launch->pid, 0)) == -1) {
+        perror("pidfd_open");
+        kill(launch->pid, SIGKILL);
+        waitpid(launch->pid, NULL, 0);
+        close(launch->err_fd);
+        launch->err_fd = -1;
+        launch->pid = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+// Handles poll events of a launch. Returns 1 once the launch is complete.
+static int bench_launch_update(struct bench_launch *launch, struct pollfd *err,
+                               struct pollfd *pid) {
+    if (err && err->revents) {
+        ssize_t n = read(launch->err_fd, launch->buf + launch->len,
+                         sizeof(launch->buf) - 1 - launch->len);
+
+        if (n > 0) {
+            launch->len += n;
+        } else {
+            close(launch->err_fd);
+            launch->err_fd = -1;
+        }
+    }
+
+    if (pid && pid->revents) {
+        launch->exit_ns = bench_now();
+        waitpid(launch->pid, &launch->status, 0);
+        close(launch->pidfd);
+        launch->pidfd = -1;
+    }
+
+    return launch->err_fd == -1 && launch->pidfd == -1;
+}
+
+// Keeps `concurrency` launches in flight until BENCH_LAUNCHES are complete
+static int bench_launch_level(int concurrency) {
+    struct bench_launch *launches = calloc(concurrency, sizeof(*launches));
+    struct bench_samples *samples = calloc(1, sizeof(*samples));
+    struct pollfd *fds = calloc(2 * concurrency, sizeof(*fds));
+    int started = 0;
+    int completed = 0;
+    int failures = 0;
+    uint64_t begin = 0;
+    uint64_t elapsed = 0;
+    int result = -1;
+
+    if (!launches || !samples || !fds) {
+        perror("calloc");
+        goto exit;
+    }
+    for (int i = 0; i < concurrency; i++)
+        launches[i] = (struct bench_launch){.pid = -1, .err_fd = -1, .pidfd = -1};
+
+    begin = bench_now();
+    while (completed < BENCH_LAUNCHES) {
+        for (int i = 0; i < concurrency && started < BENCH_LAUNCHES; i++) {
+            if (launches[i].pid != -1)
+                continue;
+            if (bench_launch_start(&launches[i], concurrency, started++))
+                goto exit;
+        }
+
+        for (int i = 0; i < concurrency; i++) {
+            fds[2 * i] = (struct pollfd){.fd = launches[i].err_fd, .events = POLLIN};
+            fds[2 * i + 1] = (struct pollfd){.fd = launches[i].pidfd, .events = POLLIN};
+            if (launches[i].pid == -1)
+                fds[2 * i].fd = fds[2 * i + 1].fd = -1;
+        }
+
+        if (poll(fds, 2 * concurrency, -1) == -1) {
+            perror("poll");
+            goto exit;
+        }
+
+        for (int i = 0; i < concurrency; i++) {
+            struct bench_launch *launch = &launches[i];
+
+            if (launch->pid == -1 ||
+                !bench_launch_update(launch, &fds[2 * i], &fds[2 * i + 1]))
+                continue;
+
+            if (!WIFEXITED(launch->status) || WEXITSTATUS(launch->status) ||
+                bench_parse_profile(launch, samples))
+                failures++;
+            launch->pid = -1;
+            completed++;
+        }
+    }
+    elapsed = bench_now() - begin;
+
+    bench_record("launch", concurrency, "starts_per_sec",
+                 (double)BENCH_LAUNCHES * 1e9 / (double)elapsed);
+    bench_record("launch", concurrency, "failures", failures);
+    bench_record_percentiles("launch", concurrency, "spawn_to_exec",
+                             samples->exec, samples->count);
+    bench_record_percentiles("launch", concurrency, "teardown",
+                             samples->teardown, samples->count);
+    for (int phase = 0; phase < PROFILE_PHASE_MAX; phase++)
+        bench_record_percentiles("launch", concurrency, profile_phase_name(phase),
+                                 samples->phases[phase], samples->count);
+    result = 0;
+
+exit:
+    // Launches still running after an error
+    for (int i = 0; launches && i < concurrency; i++)
+        bench_launch_stop(&launches[i]);
+    free(launches);
+    free(samples);
+    free(fds);
+    return result;
+}
+
+// Runs the syscall loop of the payload and records its output
+static int bench_syscall(const char *where, char **argv) {
+    char buf[BENCH_OUTPUT_MAX] = {0};
+    size_t len = 0;
+    ssize_t n = 0;
+    double getpid_ns = 0;
+    double read_ns = 0;
+    const char *line = NULL;
+    pid_t pid = -1;
+    int status = 0;
+    int fd = -1;
+    char metric[64] = {0};
+
+    if ((fd = bench_spawn(argv, STDOUT_FILENO, &pid)) == -1)
+        return -1;
+    while ((n = read(fd, buf + len, sizeof(buf) - 1 - len)) > 0)
+        len += n;
+    close(fd);
+    waitpid(pid, &status, 0);
+
+    if (!(line = strstr(buf, "syscall ")) ||
+        sscanf(line, "syscall getpid_ns=%lf read_ns=%lf", &getpid_ns, &read_ns) != 2) {
+        fprintf(stderr, "syscall benchmark %s failed\n", where);
+        return -1;
+    }
+
+    snprintf(metric, sizeof(metric), "%s_getpid_ns", where);
+    bench_record("syscall", 1, metric, getpid_ns);
+    snprintf(metric, sizeof(metric), "%s_read_ns", where);
+    bench_record("syscall", 1, metric, read_ns);
+
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    char path[PATH_MAX] = {0};
+    int result = 1;
+
+    if (argc != 4) {
+        fprintf(stderr, "usage: %s <barcov2> <payload> <output prefix>\n", argv[0]);
+        return 1;
+    }
+    B.barco = argv[1];
+    B.payload = argv[2];
+    B.first_record = true;
+
+    if (geteuid() != 0) {
+        fprintf(stderr, "skipping: barcov2 needs to run as root\n");
+        return BENCH_SKIP;
+    }
+
+    snprintf(path, sizeof(path), "%s.csv", argv[3]);
+    if (!(B.csv = fopen(path, "w"))) {
+        perror(path);
+        return 1;
+    }
+    snprintf(path, sizeof(path), "%s.json", argv[3]);
+    if (!(B.json = fopen(path, "w"))) {
+        perror(path);
+        fclose(B.csv);
+        return 1;
+    }
+    fprintf(B.csv, "benchmark,concurrency,metric,value\n");
+    fprintf(B.json, "[");
+
+    if (bench_rootfs_create())
+        goto exit;
+
+    // Each layer is measured on its own: the namespaces, then the namespaces
+    // and the seccomp filter
+    if (bench_syscall("host", (char *[]){(char *)B.payload, "syscall", NULL}) ||
+        bench_syscall("namespaces", (char *[]){
+            (char *)B.barco, "--no-seccomp", "-u", "0", "-m", B.rootfs, "-c", "/payload",
+            "-a", "syscall", "-n", "barco-bench-syscall", NULL}) ||
+        bench_syscall("container", (char *[]){
+            (char *)B.barco, "-u", "0", "-m", B.rootfs, "-c", "/payload",
+            "-a", "syscall", "-n", "barco-bench-syscall", NULL}))
+        goto exit;
+
+    for (size_t i = 0; i < sizeof(bench_concurrency) / sizeof(*bench_concurrency); i++) {
+        if (bench_launch_level(bench_concurrency[i]))
+            goto exit;
+    }
+    result = 0;
+
+exit:
+    bench_rootfs_remove();
+    fprintf(B.json, "\n]\n");
+    fclose(B.csv);
+    fclose(B.json);
+    return result;
+}
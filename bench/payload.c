@@ -0,0 +1,57 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/syscall.h>
+
+// Trivial static workload copied into the benchmark rootfs.
+// Without arguments it exits immediately (launch benchmark), with "syscall"
+// it times tight getpid / read loops and prints the cost per call.
+
+enum {
+    PAYLOAD_SYSCALL_ITERATIONS = 1000000,
+};
+
+static double payload_now_ns(void) {
+    struct timespec ts = {0};
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+int main(int argc, char **argv) {
+    int fds[2] = {-1, -1};
+    char c = 0;
+    double start = 0;
+    double getpid_ns = 0;
+    double read_ns = 0;
+
+    if (argc < 2 || strcmp(argv[1], "syscall"))
+        return 0;
+
+    // An empty non-blocking pipe makes read() return EAGAIN without touching
+    // any file system, so the loop measures the syscall entry/exit path (and
+    // the seccomp filter when run in the container).
+    if (pipe2(fds, O_NONBLOCK)) {
+        perror("pipe2");
+        return 1;
+    }
+
+    // getpid is called through syscall() so that no libc caching applies
+    start = payload_now_ns();
+    for (int i = 0; i < PAYLOAD_SYSCALL_ITERATIONS; i++)
+        syscall(SYS_getpid);
+    getpid_ns = (payload_now_ns() - start) / PAYLOAD_SYSCALL_ITERATIONS;
+
+    start = payload_now_ns();
+    for (int i = 0; i < PAYLOAD_SYSCALL_ITERATIONS; i++) {
+        if (read(fds[0], &c, sizeof(c)) != -1)
+            return 1;
+    }
+    read_ns = (payload_now_ns() - start) / PAYLOAD_SYSCALL_ITERATIONS;
+
+    printf("syscall getpid_ns=%.2f read_ns=%.2f\n", getpid_ns, read_ns);
+    return 0;
+}
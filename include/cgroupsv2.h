@@ -1,6 +1,9 @@
 #ifndef __CGROUPSV2_H__
 #define __CGROUPSV2_H__
 
+#include <stdbool.h>
+#include <limits.h>
+#include <stddef.h>
 #include <unistd.h>
 
 // Used for cgroups limits initialization
@@ -9,14 +12,79 @@
 #define CGROUPS_PIDS_MAX        "64"
 #define CGROUPS_CGROUP_PROCS    "cgroup.procs"
 
+#define CGROUPS_SUBTREE_CONTROL "/sys/fs/cgroup/cgroup.subtree_control"
+
+// Cgroups of the pool are named <prefix><hash of the settings>-<pid>-<seq>
+#define CGROUPS_POOL_PREFIX     "barco-pool-"
+
 enum {
-    CGROUPS_CONTROL_FIELD_SIZE = 256
+    CGROUPS_CONTROL_FIELD_SIZE = 256,
+    // cpuset.cpus values can be long on large hosts
+    CGROUPS_CPUSET_SIZE = 4096,
+    // Maximum number of io.max, io.weight and io.latency settings
+    CGROUPS_IO_MAX = 16,
+    // Settings written when a cgroup is created (see cgroupsv2_settings)
+    CGROUPS_SETTINGS_MAX = 7 + CGROUPS_IO_MAX,
+    // Maximum number of operations submitted at once to io_uring
+    CGROUPS_URING_ENTRIES = 4096,
 };
 
-// Initializes cgroups for the hostname
-int cgroupsv2_init(const char *hostname, pid_t pid);
+// A setting of a block device: "MAJ:MIN value" is written to file once the
+// device of path is resolved.
+typedef struct {
+    // io.max, io.weight or io.latency
+    const char *file;
+    // A block device, or any file on the device (its whole disk is used).
+    // Empty for the default of io.weight.
+    char path[PATH_MAX];
+    // e.g. "rbps=1048576 wiops=100" for io.max
+    char value[CGROUPS_CONTROL_FIELD_SIZE];
+} cgroupsv2_io;
+
+// Represents the settings of a cgroup that differ between containers.
+typedef struct {
+    // cpuset.cpus and cpuset.mems, not written when empty
+    char cpus[CGROUPS_CPUSET_SIZE];
+    char mems[CGROUPS_CONTROL_FIELD_SIZE];
+    // Makes the cgroup a cpuset partition, so that its cpus are not used by
+    // the rest of the system
+    bool cpus_exclusive;
+    // memory.max (default CGROUPS_MEMORY_MAX), and memory.high,
+    // memory.swap.max and memory.zswap.max when not NULL, as bytes or "max"
+    const char *memory_max;
+    const char *memory_high;
+    const char *memory_swap_max;
+    const char *memory_zswap_max;
+    // The OOM killer kills the whole container instead of one of its processes
+    bool memory_oom_group;
+    // Block I/O settings, the io controller is enabled when there are some
+    cgroupsv2_io io[CGROUPS_IO_MAX];
+    int io_count;
+    // Number of cgroups with these settings kept for the containers and
+    // recycled between them, 0 to create and remove a cgroup for each
+    int pool_size;
+} cgroupsv2_config;
+
+// Adds a block I/O setting to the configuration, arg being:
+// - io.max: "<path> [rbps=<n>] [wbps=<n>] [riops=<n>] [wiops=<n>]"
+// - io.weight: "<weight>" (default) or "<path> <weight>"
+// - io.latency: "<path> <target in us>"
+int cgroupsv2_parse_io(cgroupsv2_config *config, const char *file, const char *arg);
+
+// Initializes cgroups for the hostname, returns an fd of the cgroup directory.
+// With a pool, an idle cgroup with the same settings is claimed instead. name
+// receives the name of the cgroup directory (the hostname or the idle one).
+int cgroupsv2_init(const char *hostname, const cgroupsv2_config *config, char *name,
+                   size_t size);
+
+// Creates cgroups until the pool of the configuration is full
+int cgroupsv2_pool_fill(const cgroupsv2_config *config);
+
+// Adds the process to the cgroup
+int cgroupsv2_attach(int cgroup_fd, pid_t pid);
 
-// Cleans up cgroups for the hostname
-int cgroupsv2_free(const char *hostname);
+// Cleans up the cgroup name (see cgroupsv2_init). A cgroup of the pool is
+// idle again once barco closes its fd.
+int cgroupsv2_free(const char *name);
 
 #endif
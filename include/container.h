@@ -1,8 +1,20 @@
 #ifndef __CONTAINER_H__
 #define __CONTAINER_H__
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
 #include <sys/types.h>
 
+#include "mount.h"
+#include "cpuset.h"
+#include "cgroupsv2.h"
+#include "net.h"
+#include "output.h"
+#include "ns.h"
+#include "user.h"
+
 enum {
     // The stack size for the container
     CONTAINER_STACK_SIZE = (1024 * 1024),
@@ -15,21 +27,117 @@ enum {
     ARGV_MAX                = 3,
 };
 
+enum {
+    // Size of the step of a container_error
+    CONTAINER_STEP_SIZE         = 32,
+    // Maximum size of a launch message sent to a parked container
+    CONTAINER_LAUNCH_MSG_MAX    = (32 * 1024),
+    // Maximum number of argv or envp entries in a launch message
+    CONTAINER_LAUNCH_ARGS_MAX   = 256,
+};
+
 // Represents the configuration for a container.
 typedef struct {
     uid_t uid;
     int fd;
     const char *hostname;
     const char *cmd;
-    const char *mnt;
+    mount_config mount;
     char *argv[ARGV_MAX];
+    // A parked container is fully set up but waits for a launch message
+    // (see container_launch) before calling execve.
+    bool parked;
+    // The syscalls are reported to barco instead of being filtered (see
+    // sec_learn_set_filter)
+    bool seccomp_learn;
+    // No seccomp filter at all (--no-seccomp)
+    bool seccomp_disabled;
+    // JSON seccomp profile the filter was prepared from, NULL for the
+    // default deny list (see sec_seccomp_prepare)
+    const char *seccomp_profile;
+    // Placement of the container on the cpus and memory nodes of the host
+    cpuset_request cpuset;
+    // Memory nodes of the placement, set by container_create
+    uint64_t mems;
+    // Settings of the cgroup shared by the containers (block I/O), may be
+    // NULL. cpus and mems are filled in from the placement.
+    const cgroupsv2_config *cgroups;
+    // Network of the container, set up by barco before the container runs
+    net_config net;
+    // Logs of the output of the container, may be NULL to share the stdio of
+    // barco
+    const output_config *output;
+    // Container ends of the output pipes, set by container_create (-1 for
+    // none)
+    int output_fds[OUTPUT_STREAMS];
+    // Namespaces pinned or joined by the container
+    ns_config ns;
+    // Namespaces joined by the container, set by container_create (-1 for
+    // the ones it creates)
+    int ns_fds[NS_TYPES];
+    // Set by container_create when clone creates the user namespace of the
+    // container (see container_start)
+    bool userns_cloned;
 } container_config;
 
-// Initializes the container.
-int container_init(container_config *config, char *stack);
+// Sent by a container that fails to start, on the socket pair. barco sees
+// EOF instead once execve succeeded.
+typedef struct {
+    // errno of the failure, 0 if unknown
+    int32_t error;
+    // What failed, e.g. "mount"
+    char step[CONTAINER_STEP_SIZE];
+} container_error;
+
+// Represents a container started by barco.
+typedef struct {
+    // The configuration of the container, hostname points to name
+    container_config config;
+    char name[HOST_NAME_MAX + 1];
+    pid_t pid;
+    // pidfd of the container, -1 if not supported by the kernel
+    int pidfd;
+    // barco end of the socket pair
+    int fd;
+    // fd of the cgroup directory of the container, and its name (the name of
+    // the container, or a cgroup of the pool, see cgroupsv2_init)
+    int cgroup_fd;
+    char cgroup_name[HOST_NAME_MAX + 1];
+    // Only allocated when clone() is used instead of clone3()
+    char *stack;
+    bool cgroup;
+    // Set when the container holds an allocation of cpus (see cpuset_place)
+    bool cpuset;
+    // Output of the container, relayed by the monitor
+    output output;
+    // Set when the container can be found by barco exec (see exec_register)
+    bool registered;
+    // Host uids and gids of the container
+    user_range uids;
+} container;
+
+// Initializes the container (clone3 into its cgroup, or clone and attach).
+int container_init(container *container);
+
+// Creates the container: socket pair, cpu placement, output pipes, stack,
+// clone, cgroups and user namespace mappings. container_destroy must be called even on failure.
+int container_create(container *container, const container_config *config);
+
+// Releases the resources of the container (stack, sockets, cgroups).
+void container_destroy(container *container);
+
+// Sends a launch message to a parked container, which then calls execve.
+// The message is made of two uint32_t (argc, envc) followed by argc + envc
+// NUL terminated strings, argv[0] being the path of the command to run.
+int container_launch(container *container, const char *msg, size_t len);
+
+// Parses a launch message in place. argv and envp must have room for
+// CONTAINER_LAUNCH_ARGS_MAX + 1 entries and are NULL terminated.
+int container_launch_parse(char *msg, size_t len, char **argv, char **envp);
 
-// Waits for the container to exit.
-int container_wait(int container_pid);
+// Logs the error reported by the container name, returns false if msg is
+// not a container_error
+bool container_report_error(const char *name, const void *msg, size_t len);
 
 // Stops the container.
 void container_stop(int container_pid);
@@ -0,0 +1,81 @@
+#ifndef __CPUSET_H__
+#define __CPUSET_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/types.h>
+
+// Allocations of all the barco processes of the host, see cpuset_place
+#define CPUSET_STATE_DIR    "/run/barco"
+#define CPUSET_STATE_PATH   CPUSET_STATE_DIR "/cpuset"
+
+enum {
+    CPUSET_CPUS_MAX         = 1024,
+    // Memory nodes are handled as a 64 bits mask
+    CPUSET_NODES_MAX        = 64,
+    // Containers placed at the same time on the host
+    CPUSET_ALLOCATIONS_MAX  = 1024,
+    // Size of a cpu list such as "0-3,8-11"
+    CPUSET_LIST_SIZE        = 4096,
+};
+
+typedef enum {
+    CPUSET_MEMPOLICY_NONE,
+    // Allocate on the nodes of the placement only
+    CPUSET_MEMPOLICY_BIND,
+    // Prefer the first node of the placement
+    CPUSET_MEMPOLICY_PREFERRED,
+    // Spread allocations over the nodes of the placement
+    CPUSET_MEMPOLICY_INTERLEAVE,
+    // Allocate on the node of the cpu the thread runs on
+    CPUSET_MEMPOLICY_LOCAL,
+} cpuset_mempolicy;
+
+typedef struct {
+    uint64_t bits[CPUSET_CPUS_MAX / 64];
+} cpuset_mask;
+
+// Where a container should run. No placement is done when cpus is 0.
+typedef struct {
+    unsigned int cpus;
+    // The cpus are not shared with other containers, and are allocated as
+    // whole cores (with their SMT siblings)
+    bool exclusive;
+    // NUMA node to place the container on, -1 for the best one
+    int node;
+    cpuset_mempolicy mempolicy;
+} cpuset_request;
+
+typedef struct {
+    cpuset_mask cpus;
+    // Memory nodes of the cpus
+    uint64_t mems;
+} cpuset_placement;
+
+// Picks cpus and memory nodes for the container name and records them in
+// CPUSET_STATE_PATH, so that concurrent barco processes see each other's
+// allocations. Containers are kept on a single NUMA node when possible.
+int cpuset_place(const char *name, const cpuset_request *request,
+                 cpuset_placement *placement);
+
+// Releases the allocation of the container name
+int cpuset_release(const char *name);
+
+// Parses a cpu list such as "0-3,8-11", up to a newline
+int cpuset_parse(const char *list, cpuset_mask *mask);
+
+// Formats a cpu mask as a cpu list (e.g. "0-3,8")
+int cpuset_format(const cpuset_mask *mask, char *list, size_t size);
+
+// Formats a node mask as a node list
+int cpuset_format_nodes(uint64_t nodes, char *list, size_t size);
+
+// Parses a memory policy name (bind, preferred, interleave or local)
+int cpuset_parse_mempolicy(const char *name, cpuset_mempolicy *mempolicy);
+
+// Sets the memory policy of the calling process on the nodes mems
+int cpuset_set_mempolicy(cpuset_mempolicy mempolicy, uint64_t mems);
+
+#endif
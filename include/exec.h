@@ -0,0 +1,34 @@
+#ifndef __EXEC_H__
+#define __EXEC_H__
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "container.h"
+
+// Directory of the state of the running containers, <dir>/<name>.pid
+#define EXEC_STATE_DIR "/run/barco"
+
+// A command to run in a running container
+typedef struct {
+    // Name of the container (its hostname)
+    const char *name;
+    char **argv;
+    // uid and gid of the command, the ones of the container when -1
+    uid_t uid;
+} exec_config;
+
+// Records the pid, uid, cgroup and seccomp filter of the container, so that
+// exec finds it by name. Returns -1 if the container cannot be found by exec.
+int exec_register(const container *container);
+
+// Forgets the container
+void exec_unregister(const container *container);
+
+// Runs the command in the namespaces and cgroup of the container, with the
+// capabilities of the containers and the seccomp filter of the container.
+// barco waits for the command, the exit code of the command is returned, -1 on
+// error.
+int exec_run(const exec_config *config);
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef __JSON_H__
+#define __JSON_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum {
+    // Maximum nesting of arrays and objects
+    JSON_DEPTH_MAX = 64,
+};
+
+typedef enum {
+    JSON_NULL,
+    JSON_BOOL,
+    JSON_NUMBER,
+    JSON_STRING,
+    JSON_ARRAY,
+    JSON_OBJECT,
+} json_type;
+
+// Represents a parsed JSON value. Numbers are kept as text so that 64 bits
+// integers (e.g. seccomp masks) are not rounded through a double.
+typedef struct json_value {
+    json_type type;
+    // Name of the member when the value is in an object
+    char *key;
+    // Text of a string or of a number
+    char *string;
+    bool boolean;
+    // Elements of an array or members of an object
+    struct json_value *items;
+    size_t count;
+} json_value;
+
+// Parses a JSON document, returns NULL on error
+json_value *json_parse(const char *text, size_t len);
+
+// Reads and parses a JSON file, returns NULL on error
+json_value *json_load(const char *path);
+
+// Releases a parsed document
+void json_free(json_value *value);
+
+// Returns the member of an object, or NULL if missing or not an object
+const json_value *json_get(const json_value *object, const char *key);
+
+// Returns the string of a member, or NULL if missing or not a string
+const char *json_get_string(const json_value *object, const char *key);
+
+// Converts a number to an unsigned 64 bits integer
+int json_uint64(const json_value *value, uint64_t *out);
+
+#endif
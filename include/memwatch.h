@@ -0,0 +1,89 @@
+#ifndef __MEMWATCH_H__
+#define __MEMWATCH_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+
+enum {
+    // Maximum number of containers watched
+    MEMWATCH_SOURCES_MAX    = 256,
+    // Size of the buffer memory.events is read into
+    MEMWATCH_READ_SIZE      = 512,
+    // Events waiting for their action, the next ones are only logged
+    MEMWATCH_PENDING_MAX    = 64,
+};
+
+// The counters of memory.events that are reported
+typedef enum {
+    // The usage went over memory.high, the container is throttled
+    MEMWATCH_HIGH,
+    // The usage was about to go over memory.max
+    MEMWATCH_MAX,
+    // The usage reached memory.max and reclaim failed
+    MEMWATCH_OOM,
+    // A process was killed by the OOM killer
+    MEMWATCH_OOM_KILL,
+    // The whole cgroup was killed (memory.oom.group)
+    MEMWATCH_OOM_GROUP_KILL,
+    MEMWATCH_EVENTS_MAX,
+} memwatch_event;
+
+// memory.events of a container, kept open between events
+typedef struct {
+    char name[HOST_NAME_MAX + 1];
+    int fd;
+    // inotify watch of memory.events
+    int wd;
+    uint64_t counts[MEMWATCH_EVENTS_MAX];
+} memwatch_source;
+
+// An event waiting for its action
+typedef struct {
+    char name[HOST_NAME_MAX + 1];
+    memwatch_event event;
+    uint64_t count;
+} memwatch_report;
+
+// Reports the memory events of containers as they happen from a background
+// thread, and runs an action for each of them. The actions are run by the
+// thread, without the lock, so that they never block memwatch_add and
+// memwatch_remove.
+typedef struct {
+    // Shell command run for each event, may be NULL
+    const char *action;
+    int inotify_fd;
+    // Wakes the thread up to run the pending actions, or to stop it
+    int wake_fd;
+
+    // Watched containers, events waiting for their action and whether the
+    // thread is stopping, protected by lock
+    memwatch_source sources[MEMWATCH_SOURCES_MAX];
+    int sources_count;
+    memwatch_report pending[MEMWATCH_PENDING_MAX];
+    int pending_count;
+    bool stopping;
+    pthread_mutex_t lock;
+    pthread_t thread;
+    bool started;
+    bool initialized;
+} memwatch;
+
+// Initializes the watcher, action is run with sh -c
+int memwatch_init(memwatch *watch, const char *action);
+
+// Watches the memory.events of the cgroup (directory fd) of the container
+int memwatch_add(memwatch *watch, const char *name, int cgroup_fd);
+
+// Stops watching the container name
+void memwatch_remove(memwatch *watch, const char *name);
+
+// Starts the watching thread
+int memwatch_start(memwatch *watch);
+
+// Stops the watching thread and closes all the files. Does nothing if
+// memwatch_init was not called.
+void memwatch_free(memwatch *watch);
+
+#endif
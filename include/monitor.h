@@ -0,0 +1,65 @@
+#ifndef __MONITOR_H__
+#define __MONITOR_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "container.h"
+
+enum {
+    // Maximum number of containers monitored
+    MONITOR_CONTAINERS_MAX  = 4096,
+    // Maximum number of events handled per epoll_wait
+    MONITOR_EVENTS_MAX      = 64,
+    // Default delay between SIGTERM and SIGKILL, in ms
+    MONITOR_GRACE_MS        = 10000,
+};
+
+// A monitored container. It is done once its init exited and its cgroup is
+// empty: processes that escaped the pid namespace teardown (e.g. still in
+// uninterruptible sleep) keep the cgroup populated.
+typedef struct {
+    container *container;
+    // cgroup.events of the container, -1 if not available
+    int events_fd;
+    bool started;
+    bool exited;
+    bool populated;
+    int status;
+    // Time the container is stopped at (0 for none), then killed at
+    uint64_t stop_at;
+    uint64_t kill_at;
+} monitor_entry;
+
+// Supervises containers from a single thread with an epoll loop over:
+// - the pidfd of each container (SIGCHLD without pidfd support)
+// - the socket pair of each container, closed by execve
+// - the cgroup.events file of each container
+// - the output pipes of each container, relayed to its log (see output_relay)
+// - a signalfd for SIGINT and SIGTERM, which stop all the containers
+typedef struct {
+    int epoll_fd;
+    int signal_fd;
+    // Delay between SIGTERM and SIGKILL when stopping a container
+    unsigned int grace_ms;
+    monitor_entry *entries;
+    int count;
+    int size;
+    bool stopping;
+} monitor;
+
+// Initializes the monitor and blocks the signals it handles. It must be
+// called before any thread is started, so that they inherit the mask.
+int monitor_init(monitor *mon, int size, unsigned int grace_ms);
+
+// Monitors the container, stopped after timeout_ms if not 0
+int monitor_add(monitor *mon, container *container, unsigned int timeout_ms);
+
+// Runs the loop until all the containers are done. Returns 0 if they all
+// exited with 0, -1 on error. Reaped containers get a pid of -1.
+int monitor_run(monitor *mon);
+
+// Releases the monitor, the signals stay blocked
+void monitor_free(monitor *mon);
+
+#endif
@@ -1,7 +1,40 @@
 #ifndef __MOUNT_H__
 #define __MOUNT_H__
 
+enum {
+    // Maximum number of overlayfs lower layers
+    MOUNT_LAYERS_MAX = 32,
+    // Size of the overlayfs mount options (a page is the kernel limit)
+    MOUNT_OPTIONS_SIZE = 4096,
+    // Attempts to get a free loop device, other processes race for them
+    MOUNT_LOOP_RETRIES = 8,
+};
+
+// Represents the root filesystem of a container: either a directory bind
+// mounted as root, read-only layers assembled with overlayfs, or a read-only
+// EROFS or SquashFS image file.
+typedef struct {
+    // Directory to mount as root, NULL when layers or an image are used
+    const char *mnt;
+    // Image file mounted read-only as root through a loop device
+    const char *image;
+    // Read-only lower layers, from the bottom one to the top one
+    const char *layers[MOUNT_LAYERS_MAX];
+    int layers_count;
+    // Writable upper layer and overlayfs work directory, both or none. Without
+    // them the root filesystem is read-only.
+    const char *upper;
+    const char *work;
+    // Detached mount tree prepared by barco, -1 to mount in the container
+    int tree_fd;
+} mount_config;
+
+// Prepares the root filesystem as a detached mount tree, idmapped with the
+// user namespace (if userns_fd >= 0). Returns -1 if the kernel does not
+// support the new mount API, the container then mounts it itself.
+int mount_prepare(const mount_config *config, int userns_fd);
+
 // Set the mount directory for the process
-int mount_set(const char *mnt);
+int mount_set(const mount_config *config);
 
 #endif
@@ -0,0 +1,59 @@
+#ifndef __NET_H__
+#define __NET_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// Name of the interface of the container (veth, macvlan and ipvlan)
+#define NET_IFNAME  "eth0"
+
+enum {
+    // Size of the netlink messages sent by barco
+    NET_MSG_SIZE        = 4096,
+    // Queueing delay allowed by the rate limit, in ms
+    NET_RATE_LATENCY_MS = 50,
+};
+
+typedef enum {
+    // The network namespace is left as is: a down loopback
+    NET_MODE_NONE,
+    // The loopback only
+    NET_MODE_LOOPBACK,
+    // A veth pair, the host end attached to a bridge
+    NET_MODE_VETH,
+    // A macvlan (bridge mode) of a host interface, no bridge needed
+    NET_MODE_MACVLAN,
+    // An ipvlan (L2 mode) of a host interface, shares its MAC address
+    NET_MODE_IPVLAN,
+} net_mode;
+
+// Represents the network of a container
+typedef struct {
+    net_mode mode;
+    // Bridge of the host end of a veth pair, may be NULL
+    const char *bridge;
+    // Host interface of a macvlan or ipvlan
+    const char *parent;
+    // Address of the container with its prefix, e.g. 10.0.0.2/24 or
+    // fd00::2/64, may be NULL
+    const char *address;
+    // Default route, may be NULL
+    const char *gateway;
+    // MTU of the interface, 0 for the default
+    unsigned int mtu;
+    // Rate limit of the interface in bytes per second (tbf qdisc), 0 for none
+    uint64_t rate;
+} net_config;
+
+// Parses a mode name (none, loopback, veth, macvlan or ipvlan)
+int net_parse_mode(const char *name, net_mode *mode);
+
+// Parses a rate in bytes per second, with an optional k, m or g suffix
+int net_parse_rate(const char *text, uint64_t *rate);
+
+// Configures the network namespace of the container pid from barco, before
+// the container is released: the interface is created in the host namespace
+// and moved, then configured from within the namespace.
+int net_setup(const net_config *config, pid_t pid);
+
+#endif
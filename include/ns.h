@@ -0,0 +1,50 @@
+#ifndef __NS_H__
+#define __NS_H__
+
+#include <sys/types.h>
+
+// Directory of the pinned namespaces, <dir>/<name>/<type>
+#define NS_PIN_DIR "/run/barco/ns"
+
+// Namespaces that containers can share. The others stay private to each
+// container: they hold its mounts, processes and cgroup view, or its
+// capabilities (user namespace).
+typedef enum {
+    NS_NET,
+    NS_IPC,
+    NS_UTS,
+    NS_TYPES,
+} ns_type;
+
+// Namespaces of a container
+typedef struct {
+    // Name under which the namespaces of the container are pinned once it is
+    // set up, may be NULL
+    const char *pin;
+    // Name of the pinned namespaces joined by the container instead of
+    // creating its own, may be NULL
+    const char *join;
+} ns_config;
+
+// Returns the CLONE_NEW* flag of the namespace type
+int ns_flag(ns_type type);
+
+// Keeps the shareable namespaces of the process alive as name, with bind
+// mounts of /proc/<pid>/ns/<type>, until ns_unpin
+int ns_pin(const char *name, pid_t pid);
+
+// Removes the bind mounts of name, the namespaces go away with their last
+// process
+int ns_unpin(const char *name);
+
+// Opens the namespaces pinned as name, one fd per type (close-on-exec)
+int ns_open(const char *name, int fds[NS_TYPES]);
+
+// Joins the namespaces of fds (-1 for the ones not shared), called by the
+// container before it creates its user namespace
+int ns_join(const int fds[NS_TYPES]);
+
+// Closes the fds of ns_open
+void ns_close(int fds[NS_TYPES]);
+
+#endif
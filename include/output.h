@@ -0,0 +1,73 @@
+#ifndef __OUTPUT_H__
+#define __OUTPUT_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+
+enum {
+    // Size asked for the pipes of the container, the container only blocks
+    // once that much output is waiting for the disk
+    OUTPUT_PIPE_SIZE    = (1024 * 1024),
+    // Bytes relayed per wake up, so that a chatty container does not starve
+    // the others
+    OUTPUT_RELAY_MAX    = (4 * 1024 * 1024),
+    // Default number of rotated files kept
+    OUTPUT_KEEP         = 5,
+};
+
+typedef enum {
+    OUTPUT_STDOUT,
+    OUTPUT_STDERR,
+    OUTPUT_STREAMS,
+} output_stream;
+
+// Where the output of the containers goes
+typedef struct {
+    // Directory of the logs, <dir>/<name>.log. The containers share the
+    // stdio of barco when NULL.
+    const char *dir;
+    // The log is rotated above max_size bytes, or after max_age seconds (0
+    // for no limit), to <name>.log.1 up to <name>.log.<keep>
+    uint64_t max_size;
+    unsigned int max_age;
+    int keep;
+    // Each chunk is preceded by a line "<time> <stream> <length>", e.g.
+    // "2024-05-01T12:00:00.000000000Z stdout 4096", so that the chunks of
+    // stdout and stderr can be told apart
+    bool framed;
+    // The output is also passed to the stdout and stderr of barco when they
+    // are pipes (best effort)
+    bool echo;
+} output_config;
+
+// The output of a container, relayed from its pipes to its log file with
+// splice (and tee for the echo), the bytes never go through barco.
+typedef struct {
+    const output_config *config;
+    char path[PATH_MAX];
+    int fd;
+    uint64_t size;
+    time_t opened;
+    // barco ends of the pipes, -1 once closed
+    int pipes[OUTPUT_STREAMS];
+} output;
+
+// Parses a size in bytes, with an optional k, m or g suffix
+int output_parse_size(const char *text, uint64_t *size);
+
+// Opens the log of the container name and creates its pipes. The container
+// ends are returned in child_fds, barco closes them once the container is
+// cloned.
+int output_init(output *out, const output_config *config, const char *name,
+                int child_fds[OUTPUT_STREAMS]);
+
+// Relays what is in the pipe of the stream. Returns 1 once the pipe is
+// closed by the container (hangup) and empty, -1 on error.
+int output_relay(output *out, output_stream stream, bool hangup);
+
+// Closes the pipes and the log
+void output_free(output *out);
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "container.h"
+
+enum {
+    // Maximum number of clients connected to the pool socket
+    POOL_CLIENTS_MAX    = 64,
+    // Delay before retrying after a failed refill, in ms
+    POOL_RETRY_DELAY_MS = 1000,
+};
+
+// A pool of parked containers: cloned, in their cgroup and user namespace,
+// with mounts, capabilities and seccomp set, waiting for a launch message.
+// A background thread refills the pool after each launch.
+typedef struct {
+    // Template used for the parked containers (hostname is used as prefix)
+    container_config config;
+    // Number of parked containers to keep
+    int size;
+    // Maximum number of containers parked per second (0 for no limit)
+    int refill_rate;
+    // Used to give unique names to the containers
+    unsigned long seq;
+
+    // Parked containers, protected by lock
+    container *parked;
+    int parked_count;
+
+    // Launched containers, only used by the thread serving requests
+    container *launched;
+    int launched_count;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t refill;
+    bool stop;
+} container_pool;
+
+// Initializes the pool and starts the refill thread
+int pool_init(container_pool *pool, const container_config *config, int size,
+              int refill_rate);
+
+// Launches a parked container (or a new one if the pool is empty) with the
+// launch message. Returns the pid of the container or -1.
+pid_t pool_launch(container_pool *pool, const char *msg, size_t len);
+
+// Reaps and releases the containers of the pool that exited. Each container
+// is waited for by its pid: the ones still being created by the refill thread
+// are left to it, so that it never kills or waits for a pid reaped here.
+void pool_reap(container_pool *pool);
+
+// Serves launch requests sent to a SOCK_SEQPACKET unix socket until SIGINT
+// or SIGTERM. A request is a launch message (see container_launch), the
+// reply is the pid of the container as an int (-1 on failure).
+int pool_serve(container_pool *pool, const char *path);
+
+// Stops the refill thread, kills and releases all the containers
+void pool_free(container_pool *pool);
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef __PROFILE_H__
+#define __PROFILE_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// USDT probes are compiled in when systemtap's sys/sdt.h is available. They
+// are a single nop each when no tracer is attached, so they are always on:
+//   bpftrace -e 'usdt:./barcov2:barco:phase__begin { ... }'
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define PROFILE_PROBE(name, phase) DTRACE_PROBE1(barco, name, phase)
+#else
+#define PROFILE_PROBE(name, phase) do { (void)(phase); } while (0)
+#endif
+
+// Phases of the container launch path, in the order they happen. Phases that
+// do not happen are reported as 0: the stack is only allocated (within the
+// clone phase) when clone3 is not available, and the network is only set up
+// with --net. Phases prefixed with CHILD are timed inside the container and
+// reported back to barco over the socket pair.
+typedef enum {
+    PROFILE_SOCKETPAIR,
+    PROFILE_CGROUPS,
+    PROFILE_MOUNT_PREPARE,
+    PROFILE_STACK,
+    PROFILE_CLONE,
+    PROFILE_USERNS_MAPPINGS,
+    PROFILE_NET,
+    PROFILE_CHILD_HOSTNAME,
+    PROFILE_CHILD_MOUNT,
+    PROFILE_CHILD_USERNS,
+    PROFILE_CHILD_CAPS,
+    PROFILE_CHILD_SECCOMP,
+    PROFILE_CHILD_EXECVE,
+    PROFILE_PHASE_MAX,
+} profile_phase;
+
+// Monotonic timestamps (CLOCK_MONOTONIC, ns) of a single phase.
+// CLOCK_MONOTONIC is not namespaced (barco does not create a time namespace),
+// so timestamps taken in the container are comparable with barco's.
+typedef struct {
+    uint64_t begin_ns;
+    uint64_t end_ns;
+} profile_span;
+
+// Returns the name of the phase, the JSON key of profile_write_json
+const char *profile_phase_name(profile_phase phase);
+
+// Enables recording of the phase timestamps
+void profile_enable(bool enable);
+
+// Returns true if recording is enabled
+bool profile_enabled(void);
+
+// Marks the beginning of a phase
+void profile_begin(profile_phase phase);
+
+// Marks the end of a phase
+void profile_end(profile_phase phase);
+
+// Sends the phases recorded by the container to barco
+int profile_send(int fd);
+
+// Receives the phases recorded by the container. The execve phase ends when
+// the socket reaches EOF, i.e. when the close-on-exec socket of the container
+// is closed by a successful execve (or by the container exiting).
+int profile_recv(int fd);
+
+// Writes the recorded phases as a single JSON line
+int profile_write_json(FILE *fp);
+
+#endif
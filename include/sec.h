@@ -1,16 +1,31 @@
 #ifndef __SEC_H__
 #define __SEC_H__
 
+#include <stdbool.h>
+
 // Used to represent the result of a seccomp rule.
 // #define	EPERM		 1	/* Operation not permitted */
 #define SEC_SCMP_FAIL SCMP_ACT_ERRNO(1)
 
+// Directory of the compiled seccomp filters
+#define SEC_CACHE_DIR "/var/cache/barco"
+
 // Setup capabilities for the calling process
 // libcap: used to set container capabilities
 int sec_set_caps(void);
 
+// Returns true if the capability (e.g. "CAP_SYS_CHROOT") is not dropped by
+// sec_set_caps
+bool sec_cap_kept(const char *name);
+
 // Setup seccomp for the calling process
 // libseccomp: used to set up seccomp filters
 int sec_set_seccomp(void);
 
+// Compiles the seccomp filter once (or loads it from SEC_CACHE_DIR when only
+// root can write there), so that sec_set_seccomp only has to load it in the
+// container. The filter is built from the JSON profile at profile_path, or
+// from the default deny list when profile_path is NULL.
+int sec_seccomp_prepare(const char *profile_path);
+
 #endif
@@ -0,0 +1,30 @@
+#ifndef __SEC_LEARN_H__
+#define __SEC_LEARN_H__
+
+enum {
+    // Syscall numbers recorded in learn mode
+    SEC_LEARN_SYSCALLS_MAX = 1024,
+    // Distinct values recorded per syscall argument before it is considered
+    // to take any value
+    SEC_LEARN_VALUES_MAX = 4,
+};
+
+// Loads the learn filter in the calling process (the container) and sends
+// its notification fd to barco over fd. Every syscall is then reported to
+// barco, which lets it continue, until the container exits.
+int sec_learn_set_filter(int fd);
+
+// Receives the notification fd sent by sec_learn_set_filter
+int sec_learn_recv(int fd);
+
+// Lets the syscalls of the container through and records them until the
+// container exits, then writes a JSON allow-list profile (see
+// sec_profile_load) to path, with the syscalls ordered by number of calls.
+//
+// Learning also stops on SIGINT or SIGTERM, read from the signalfd of the
+// monitor and raised again for it, or once timeout_ms is over (0 for none).
+// timeout_ms is decreased by the time spent learning, at least 1 ms is left.
+int sec_learn_run(int notify_fd, int pidfd, int signal_fd, unsigned int *timeout_ms,
+                  const char *path);
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef __SEC_PROFILE_H__
+#define __SEC_PROFILE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <seccomp.h>
+
+enum {
+    // Maximum number of argument comparisons of a rule (one per argument)
+    SEC_PROFILE_ARGS_MAX = 6,
+};
+
+// A seccomp rule: the action taken when the syscall is called with arguments
+// matching all the comparisons.
+typedef struct {
+    int syscall;
+    uint32_t action;
+    unsigned int arg_cnt;
+    struct scmp_arg_cmp args[SEC_PROFILE_ARGS_MAX];
+} sec_profile_rule;
+
+// Represents a seccomp profile, either the built-in deny list of barco or an
+// allow-list loaded from a Docker/OCI compatible JSON file.
+typedef struct {
+    // Action of the syscalls matching no rule
+    uint32_t default_action;
+    // Disables the Speculative Store Bypass mitigation that the kernel
+    // otherwise forces on seccomp'd processes (SECCOMP_FILTER_FLAG_SPEC_ALLOW)
+    bool spec_allow;
+    const sec_profile_rule *rules;
+    size_t rules_count;
+    // Syscalls ordered from the most to the least frequently called
+    const int *priorities;
+    size_t priorities_count;
+    // Set when the rules and priorities are allocated by sec_profile_load
+    bool allocated;
+} sec_profile;
+
+// Loads a JSON seccomp profile, in the format used by Docker:
+//   {
+//     "defaultAction": "SCMP_ACT_ERRNO",
+//     "defaultErrnoRet": 1,
+//     "flags": ["SECCOMP_FILTER_FLAG_SPEC_ALLOW"],
+//     "syscalls": [
+//       {"names": ["read", "write"], "action": "SCMP_ACT_ALLOW"},
+//       {"names": ["personality"], "action": "SCMP_ACT_ALLOW",
+//        "args": [{"index": 0, "value": 0, "op": "SCMP_CMP_EQ"}]}
+//     ],
+//     "priorities": ["read", "write"]
+//   }
+// "priorities" is specific to barco and lists the hottest syscalls first.
+// Syscalls unknown on this architecture are ignored, like Docker does.
+int sec_profile_load(sec_profile *profile, const char *path);
+
+// Releases a profile loaded by sec_profile_load
+void sec_profile_free(sec_profile *profile);
+
+#endif
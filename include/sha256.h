@@ -0,0 +1,26 @@
+#ifndef __SHA256_H__
+#define __SHA256_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum {
+    SHA256_DIGEST_SIZE  = 32,
+    SHA256_BLOCK_SIZE   = 64,
+};
+
+// Running sha256 digest (FIPS 180-4)
+typedef struct {
+    uint32_t state[8];
+    uint64_t length;
+    unsigned char block[SHA256_BLOCK_SIZE];
+    size_t used;
+} sha256_ctx;
+
+void sha256_init(sha256_ctx *ctx);
+
+void sha256_update(sha256_ctx *ctx, const void *data, size_t len);
+
+void sha256_final(sha256_ctx *ctx, unsigned char digest[SHA256_DIGEST_SIZE]);
+
+#endif
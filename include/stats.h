@@ -0,0 +1,89 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <limits.h>
+#include <pthread.h>
+
+enum {
+    // Maximum number of clients connected to the stats socket
+    STATS_CLIENTS_MAX   = 16,
+    // Maximum number of containers sampled by an exporter
+    STATS_SOURCES_MAX   = 256,
+    // cgroup files sampled for each container (see stats.c)
+    STATS_FILES_MAX     = 8,
+    // Size of the buffer a cgroup file is read into
+    STATS_READ_SIZE     = 8192,
+};
+
+typedef enum {
+    // Prometheus text exposition format, sent back for each request
+    STATS_FORMAT_PROMETHEUS,
+    // One JSON line per container and per sample, streamed to the clients
+    STATS_FORMAT_JSON,
+} stats_format;
+
+// The cgroup files of a container, kept open between samples
+typedef struct {
+    char name[HOST_NAME_MAX + 1];
+    int fds[STATS_FILES_MAX];
+} stats_source;
+
+// A client of the stats socket. What the socket does not take at once waits
+// in pending, sent as the client reads.
+typedef struct {
+    int fd;
+    char *pending;
+    size_t len;
+    size_t sent;
+    // Prometheus clients get one answer per connection
+    bool answered;
+} stats_client;
+
+// Samples the cgroups of containers at a fixed interval from a background
+// thread, and serves the samples on a SOCK_STREAM unix socket.
+typedef struct {
+    stats_format format;
+    unsigned int interval_ms;
+    const char *path;
+    int listen_fd;
+    // Wakes the thread up to stop it
+    int wake_fd;
+    stats_client clients[STATS_CLIENTS_MAX];
+    int clients_count;
+
+    // Sampled containers, protected by lock
+    stats_source sources[STATS_SOURCES_MAX];
+    int sources_count;
+    pthread_mutex_t lock;
+    pthread_t thread;
+    bool started;
+
+    // Last sample, only used by the thread
+    char *buffer;
+    size_t len;
+    size_t size;
+} stats_exporter;
+
+// Parses a format name (prometheus or json)
+int stats_parse_format(const char *name, stats_format *format);
+
+// Listens on the unix socket path
+int stats_init(stats_exporter *stats, const char *path, stats_format format,
+               unsigned int interval_ms);
+
+// Samples the cgroup (directory fd) of the container name
+int stats_add(stats_exporter *stats, const char *name, int cgroup_fd);
+
+// Stops sampling the container name
+void stats_remove(stats_exporter *stats, const char *name);
+
+// Starts the sampling thread
+int stats_start(stats_exporter *stats);
+
+// Stops the sampling thread and closes all the files and sockets. Does
+// nothing if stats_init was not called.
+void stats_free(stats_exporter *stats);
+
+#endif
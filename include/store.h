@@ -0,0 +1,46 @@
+#ifndef __STORE_H__
+#define __STORE_H__
+
+#include <limits.h>
+
+#include "mount.h"
+
+// Default directory of the image store
+#define STORE_ROOT  "/var/lib/barco"
+
+enum {
+    // Size of the hexadecimal form of a sha256 digest
+    STORE_DIGEST_HEX_SIZE   = 2 * 32 + 1,
+    // Maximum length of an image reference
+    STORE_REF_MAX           = 128,
+    // Size of the reads of the layers
+    STORE_BLOCK_SIZE        = (128 * 1024),
+};
+
+// Local store of images, made of tar layers (plain or compressed):
+//   <root>/layers/sha256/<digest>/  a layer, extracted once whatever the
+//                                   images it belongs to
+//   <root>/files/<digest>-<mode>-<uid>-<gid>
+//                                   the regular files of all the layers, the
+//                                   identical ones being hard links of one
+//                                   file
+//   <root>/refs/<ref>               the digests of the layers of an image,
+//                                   bottom first, one per line
+//
+// The digest of a layer is the sha256 of its tar file, as in OCI image
+// manifests. Whiteouts are converted to the overlayfs ones, so that the
+// layers are used as is as the lower layers of overlayfs.
+typedef struct {
+    char paths[MOUNT_LAYERS_MAX][PATH_MAX];
+    int count;
+} store_layers;
+
+// Imports the tar files of the layers (bottom first) as the image ref. The
+// layers that are not in the store yet are extracted by up to workers threads.
+int store_import(const char *root, const char *ref, const char **tars, int count,
+                 int workers);
+
+// Finds the directories of the layers of the image ref
+int store_resolve(const char *root, const char *ref, store_layers *layers);
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef __SUPERVISOR_H__
+#define __SUPERVISOR_H__
+
+#include <stdbool.h>
+#include <limits.h>
+
+#include "container.h"
+#include "json.h"
+
+enum {
+    // Maximum number of containers in a manifest
+    SUPERVISOR_CONTAINERS_MAX   = 4096,
+    // Maximum number of threads creating the containers
+    SUPERVISOR_WORKERS_MAX      = 256,
+};
+
+// A container of the manifest
+typedef struct {
+    char name[HOST_NAME_MAX + 1];
+    // Configuration of the container, hostname points to name
+    container_config config;
+    container container;
+    bool created;
+    // The container is stopped after timeout_ms if not 0 (see monitor_add)
+    unsigned int timeout_ms;
+} supervisor_entry;
+
+// Runs the containers of a manifest from a single barco process. Each
+// container gets its own name, used as hostname and cgroup directory.
+//
+// The manifest is a JSON document:
+// {
+//   "containers": [
+//     {"name": "web", "cmd": "/bin/httpd", "arg": "-f", "uid": 0,
+//      "mnt": "/srv/web", "cpus": 2, "timeout_ms": 60000,
+//      "net": "veth", "address": "10.0.0.2/24", "gateway": "10.0.0.1"},
+//     {"layers": ["/srv/base", "/srv/app"], "upper": "/srv/upper",
+//      "work": "/srv/work", "cmd": "/bin/app"},
+//     {"image": "/srv/app.erofs", "cmd": "/bin/app", "ns_join": "pod"}
+//   ]
+// }
+// Members that are missing are taken from the command line. ns_join names
+// namespaces pinned beforehand (see ns_pin).
+typedef struct {
+    json_value *manifest;
+    supervisor_entry *entries;
+    int count;
+    // Next entry to create, shared by the workers
+    int next;
+} supervisor;
+
+// Reads the manifest, defaults being the configuration and the timeout of
+// the command line
+int supervisor_load(supervisor *sup, const char *path, const container_config *defaults,
+                    unsigned int timeout_ms);
+
+// Creates all the containers with a pool of workers threads. Fails if any
+// container could not be created, the others are left to supervisor_free.
+int supervisor_start(supervisor *sup, int workers);
+
+// Kills the containers that are still running, waits for them and releases
+// them along with the manifest
+void supervisor_free(supervisor *sup);
+
+#endif
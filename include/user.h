@@ -1,20 +1,76 @@
 #ifndef __USER_H__
 #define __USER_H__
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <sys/types.h>
 
+// Owners of the ranges of the pool, shared by the barco processes of the host
+#define USER_STATE_DIR "/run/barco"
+#define USER_POOL_PATH USER_STATE_DIR "/uids"
+
 enum {
     // User namespace settings
     USER_NAMESPACE_UID_PARENT_RANGE_START   = 0,
     USER_NAMESPACE_UID_CHILD_RANGE_START    = 10000,
     USER_NAMESPACE_UID_CHILD_RANGE_SIZE     = 2000,
+    // Ranges of the pool given to a container, one line of uid_map each
+    // (Linux < 4.15 takes up to 5 lines)
+    USER_RANGE_EXTENTS_MAX                  = 5,
+    // Ranges of a pool
+    USER_POOL_SLOTS_MAX                     = 65536,
 };
 
-// Setup the user namespace for the process
-int user_namespace_init(uid_t uid, int fd);
+// Host ids of a container. Its ids start at 0 in its user namespace, extent i
+// maps ids [i * size, (i + 1) * size) to [hosts[i], hosts[i] + size). The
+// same range is used for uids and gids.
+typedef struct {
+    uid_t hosts[USER_RANGE_EXTENTS_MAX];
+    // Slots of the ranges in the pool, -1 for the fixed range
+    // (USER_NAMESPACE_UID_CHILD_RANGE_START) used without a pool
+    int slots[USER_RANGE_EXTENTS_MAX];
+    int count;
+    uid_t size;
+} user_range;
+
+// A pool of slots ranges of size host ids from start, each container gets
+// extents ranges that do not overlap with the ones of other containers
+typedef struct {
+    uid_t start;
+    uid_t size;
+    int slots;
+    int extents;
+} user_pool_config;
+
+// Switches to the uid and gid of the user in the current user namespace
+int user_namespace_set_user(uid_t uid);
+
+// Configures the user and group mappings of the range for the namespace of
+// the process so that it can set its own user and group
+int user_namespace_prepare_mappings(pid_t pid, const user_range *range);
+
+// Returns an fd of a user namespace with the mappings of the range, used to
+// idmap the root filesystem of the container. The fd is shared unless owned
+// is set, in which case the caller closes it.
+int user_namespace_idmap(const user_range *range, bool *owned);
+
+// Parses a pool as <start>:<slots>:<size>, e.g. 100000:1024:65536
+int user_pool_parse(const char *text, user_pool_config *config);
+
+// Maps the owners of the ranges of the pool (USER_POOL_PATH), before any
+// container is created. Every barco process sharing the pool must use the
+// same start, slots and size.
+int user_pool_init(const user_pool_config *config);
+
+// Allocates the range of a container, the fixed range without a pool. The
+// slots are owned by barco until user_range_own.
+int user_range_alloc(user_range *range);
+
+// Makes the container pid the owner of the slots of the range, they are
+// reclaimed if it exits without user_range_free (e.g. barco was killed)
+void user_range_own(const user_range *range, pid_t pid);
 
-// Configures the user and group mappings for the namespace
-// so that the child process can set its own user and group
-int user_namespace_prepare_mappings(pid_t pid, int fd);
+// Releases the slots of the range
+void user_range_free(user_range *range);
 
 #endif
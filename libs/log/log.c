@@ -20,10 +20,57 @@
  * IN THE SOFTWARE.
  */
 
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
 #include "log.h"
 
 #define MAX_CALLBACKS 32
 
+/* Slots of the async ring (a power of two), and their message size */
+#define ASYNC_SLOTS 1024
+#define ASYNC_MESSAGE_SIZE 512
+/* Longest conversion specification replayed by the writer, e.g. %-08.3lld */
+#define ASYNC_SPEC_SIZE 32
+/* Size of the writes of the writer thread */
+#define ASYNC_BATCH_SIZE 65536
+
+/* A message of the async ring. Its sequence number tells whose turn it is:
+ * the callers claim it when seq == position, the writer reads it when
+ * seq == position + 1 (bounded MPMC queue of D. Vyukov). The callers copy
+ * the arguments of fmt into data, the writer formats them. fmt is NULL when
+ * the caller had to format the message itself into data. */
+typedef struct {
+  unsigned long seq;
+  struct timespec time;
+  const char *file;
+  const char *fmt;
+  int line;
+  int level;
+  int error;
+  char data[ASYNC_MESSAGE_SIZE];
+} Record;
+
+/* A conversion of a format: its flags, width and precision, the number of
+ * them given as arguments (*), its length modifier and conversion */
+typedef struct {
+  const char *flags;
+  const char *length;
+  int stars;
+  bool star_precision;
+  int precision;
+  char modifier;
+  char conversion;
+} Spec;
+
 typedef struct {
   log_LogFn fn;
   void *udata;
@@ -35,9 +82,27 @@ static struct {
   log_LockFn lock;
   int level;
   bool quiet;
+  bool raw;
   Callback callbacks[MAX_CALLBACKS];
+  struct {
+    bool enabled;
+    bool sleeping;
+    bool stop;
+    pid_t pid;
+    int wake_fd;
+    Record *records;
+    unsigned long head;
+    unsigned long tail;
+    pthread_t thread;
+  } async;
 } L;
 
+int log_threshold = LOG_TRACE;
+
+/* Callers using the async ring, it is only freed once there are none. It is
+ * not part of L.async, which is reset when async mode is turned on. */
+static int async_users;
+
 
 static const char *level_strings[] = {
   "TRACE", "DEBUG", "INFO", "WARN", "ERROR", "FATAL"
@@ -102,13 +167,25 @@ void log_set_lock(log_LockFn fn, void *udata) {
 }
 
 
+static void update_threshold(void) {
+  int threshold = L.quiet ? LOG_FATAL + 1 : L.level;
+
+  for (int i = 0; i < MAX_CALLBACKS && L.callbacks[i].fn; i++) {
+    if (L.callbacks[i].level < threshold) { threshold = L.callbacks[i].level; }
+  }
+  log_threshold = threshold;
+}
+
+
 void log_set_level(int level) {
   L.level = level;
+  update_threshold();
 }
 
 
 void log_set_quiet(bool enable) {
   L.quiet = enable;
+  update_threshold();
 }
 
 
@@ -116,6 +193,7 @@ int log_add_callback(log_LogFn fn, void *udata, int level) {
   for (int i = 0; i < MAX_CALLBACKS; i++) {
     if (!L.callbacks[i].fn) {
       L.callbacks[i] = (Callback) { fn, udata, level };
+      update_threshold();
       return 0;
     }
   }
@@ -129,14 +207,549 @@ int log_add_fp(FILE *fp, int level) {
 
 
 static void init_event(log_Event *ev, void *udata) {
+  static __thread struct tm tm;
   if (!ev->time) {
     time_t t = time(NULL);
-    ev->time = localtime(&t);
+    ev->time = localtime_r(&t, &tm);
   }
   ev->udata = udata;
 }
 
 
+static bool async_ready(unsigned long position) {
+  Record *r = &L.async.records[position & (ASYNC_SLOTS - 1)];
+  return __atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) == position + 1;
+}
+
+
+static void async_wake(void) {
+  uint64_t one = 1;
+
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_exchange_n(&L.async.sleeping, false, __ATOMIC_SEQ_CST)) {
+    (void)!write(L.async.wake_fd, &one, sizeof(one));
+  }
+}
+
+
+/* Parses the conversion after a %, returns the end of the conversion or NULL
+ * if the writer cannot replay it (%n, wide characters, too long) */
+static const char *parse_spec(const char *p, Spec *spec) {
+  const char *start = p;
+
+  memset(spec, 0, sizeof(*spec));
+  spec->flags = p;
+  spec->precision = -1;
+  while (*p && strchr("-+ #0'", *p)) { p++; }
+  if (*p == '*') {
+    spec->stars++;
+    p++;
+  }
+  while (*p >= '0' && *p <= '9') { p++; }
+  if (*p == '.') {
+    p++;
+    if (*p == '*') {
+      spec->stars++;
+      spec->star_precision = true;
+      p++;
+    } else {
+      spec->precision = 0;
+      while (*p >= '0' && *p <= '9') { spec->precision = spec->precision * 10 + *p++ - '0'; }
+    }
+  }
+
+  spec->length = p;
+  if (p[0] == 'h' && p[1] == 'h') {
+    spec->modifier = 'H';
+    p += 2;
+  } else if (p[0] == 'l' && p[1] == 'l') {
+    spec->modifier = 'q';
+    p += 2;
+  } else if (*p && strchr("hljztLq", *p)) {
+    spec->modifier = *p++;
+  }
+
+  spec->conversion = *p;
+  if (!*p || !strchr("diouxXcspmeEfFgGaA%", *p) ||
+      (spec->modifier == 'l' && strchr("cs", *p)) ||
+      p - start + 4 > ASYNC_SPEC_SIZE) {
+    return NULL;
+  }
+  return p + 1;
+}
+
+
+static bool pack(char *data, size_t size, size_t *len, const void *value,
+                 size_t value_size) {
+  if (*len + value_size > size) { return false; }
+  memcpy(data + *len, value, value_size);
+  *len += value_size;
+  return true;
+}
+
+
+/* Copies the arguments of fmt into data, in order: integers as long long,
+ * floating point numbers as long double and strings inline. Returns false if
+ * they do not fit or if fmt cannot be replayed by the writer. */
+static bool async_pack(const char *fmt, va_list ap, char *data, size_t size) {
+  size_t len = 0;
+
+  for (const char *p = fmt; (p = strchr(p, '%')); ) {
+    Spec spec;
+
+    if (!(p = parse_spec(p + 1, &spec))) { return false; }
+
+    for (int i = 0; i < spec.stars; i++) {
+      int star = va_arg(ap, int);
+      /* A negative precision is no precision */
+      if (spec.star_precision && i == spec.stars - 1) {
+        spec.precision = star < 0 ? -1 : star;
+      }
+      if (!pack(data, size, &len, &star, sizeof(star))) { return false; }
+    }
+
+    switch (spec.conversion) {
+    case 'd': case 'i': {
+      long long value;
+      switch (spec.modifier) {
+      case 'H': value = (signed char)va_arg(ap, int); break;
+      case 'h': value = (short)va_arg(ap, int); break;
+      case 'l': value = va_arg(ap, long); break;
+      case 'q': value = va_arg(ap, long long); break;
+      case 'j': value = va_arg(ap, intmax_t); break;
+      case 'z': value = va_arg(ap, ssize_t); break;
+      case 't': value = va_arg(ap, ptrdiff_t); break;
+      default: value = va_arg(ap, int); break;
+      }
+      if (!pack(data, size, &len, &value, sizeof(value))) { return false; }
+      break;
+    }
+    case 'o': case 'u': case 'x': case 'X': {
+      unsigned long long value;
+      switch (spec.modifier) {
+      case 'H': value = (unsigned char)va_arg(ap, unsigned int); break;
+      case 'h': value = (unsigned short)va_arg(ap, unsigned int); break;
+      case 'l': value = va_arg(ap, unsigned long); break;
+      case 'q': value = va_arg(ap, unsigned long long); break;
+      case 'j': value = va_arg(ap, uintmax_t); break;
+      case 'z': value = va_arg(ap, size_t); break;
+      case 't': value = (unsigned long long)va_arg(ap, ptrdiff_t); break;
+      default: value = va_arg(ap, unsigned int); break;
+      }
+      if (!pack(data, size, &len, &value, sizeof(value))) { return false; }
+      break;
+    }
+    case 'c': {
+      int value = va_arg(ap, int);
+      if (!pack(data, size, &len, &value, sizeof(value))) { return false; }
+      break;
+    }
+    case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A': {
+      long double value = spec.modifier == 'L' ? va_arg(ap, long double) : va_arg(ap, double);
+      if (!pack(data, size, &len, &value, sizeof(value))) { return false; }
+      break;
+    }
+    case 'p': {
+      void *value = va_arg(ap, void *);
+      if (!pack(data, size, &len, &value, sizeof(value))) { return false; }
+      break;
+    }
+    case 's': {
+      /* Strings are only valid during the call, they are copied up to the
+       * precision: they do not have to be terminated past it */
+      const char *value = va_arg(ap, const char *);
+      size_t n;
+
+      if (!value) { value = "(null)"; }
+      n = spec.precision >= 0 ? strnlen(value, spec.precision) : strlen(value);
+      if (!pack(data, size, &len, value, n) || !pack(data, size, &len, "", 1)) {
+        return false;
+      }
+      break;
+    }
+    default:
+      /* %m is the errno of the call, saved in the record, and %% has no
+       * argument */
+      break;
+    }
+  }
+
+  return true;
+}
+
+
+static void unpack(const char **data, void *value, size_t value_size) {
+  memcpy(value, *data, value_size);
+  *data += value_size;
+}
+
+
+/* Formats a message of the ring, replaying each conversion of its format
+ * with the arguments copied by the caller */
+static void async_format(const Record *r, char *message, size_t size) {
+  const char *data = r->data;
+  size_t len = 0;
+
+  if (!r->fmt) {
+    snprintf(message, size, "%s", r->data);
+    return;
+  }
+
+  message[0] = '\0';
+  for (const char *p = r->fmt; *p && len < size - 1; ) {
+    const char *next = strchr(p, '%');
+    char spec_fmt[ASYNC_SPEC_SIZE];
+    int stars[2] = {0};
+    Spec spec;
+    int n = 0;
+
+    if (!next) { next = p + strlen(p); }
+    n = snprintf(message + len, size - len, "%.*s", (int)(next - p), p);
+    len = len + n < size ? len + n : size - 1;
+    if (!*next || len >= size - 1) { break; }
+
+    /* async_pack checked the format */
+    p = parse_spec(next + 1, &spec);
+    for (int i = 0; i < spec.stars; i++) { unpack(&data, &stars[i], sizeof(int)); }
+
+    /* The length modifier is replaced by the one of the copied value */
+    n = (int)(spec.length - spec.flags);
+    switch (spec.conversion) {
+    case 'd': case 'i': case 'o': case 'u': case 'x': case 'X':
+      snprintf(spec_fmt, sizeof(spec_fmt), "%%%.*sll%c", n, spec.flags, spec.conversion);
+      break;
+    case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+      snprintf(spec_fmt, sizeof(spec_fmt), "%%%.*sL%c", n, spec.flags, spec.conversion);
+      break;
+    default:
+      snprintf(spec_fmt, sizeof(spec_fmt), "%%%.*s%c", n, spec.flags, spec.conversion);
+      break;
+    }
+
+#define REPLAY(...) \
+    (spec.stars == 0 ? snprintf(message + len, size - len, spec_fmt, ##__VA_ARGS__) : \
+     spec.stars == 1 ? snprintf(message + len, size - len, spec_fmt, stars[0], ##__VA_ARGS__) : \
+     snprintf(message + len, size - len, spec_fmt, stars[0], stars[1], ##__VA_ARGS__))
+
+    switch (spec.conversion) {
+    case 'd': case 'i': {
+      long long value;
+      unpack(&data, &value, sizeof(value));
+      n = REPLAY(value);
+      break;
+    }
+    case 'o': case 'u': case 'x': case 'X': {
+      unsigned long long value;
+      unpack(&data, &value, sizeof(value));
+      n = REPLAY(value);
+      break;
+    }
+    case 'c': {
+      int value;
+      unpack(&data, &value, sizeof(value));
+      n = REPLAY(value);
+      break;
+    }
+    case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A': {
+      long double value;
+      unpack(&data, &value, sizeof(value));
+      n = REPLAY(value);
+      break;
+    }
+    case 'p': {
+      void *value;
+      unpack(&data, &value, sizeof(value));
+      n = REPLAY(value);
+      break;
+    }
+    case 's':
+      n = REPLAY(data);
+      data += strlen(data) + 1;
+      break;
+    case 'm':
+      errno = r->error;
+      n = REPLAY();
+      break;
+    default:
+      n = REPLAY();
+      break;
+    }
+#undef REPLAY
+
+    if (n > 0) { len = len + n < size ? len + n : size - 1; }
+  }
+}
+
+
+/* Copies the message into a free slot of the ring, returns false if the
+ * ring is full. Only the arguments are copied by the caller, the writer
+ * formats them: a message it cannot replay is formatted here. */
+static bool async_push(int level, const char *file, int line,
+                       const char *fmt, va_list ap) {
+  unsigned long position = __atomic_load_n(&L.async.head, __ATOMIC_RELAXED);
+  int error = errno;
+  Record *r;
+  va_list copy;
+
+  for (;;) {
+    long diff;
+
+    r = &L.async.records[position & (ASYNC_SLOTS - 1)];
+    diff = (long)(__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) - position);
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&L.async.head, &position, position + 1,
+                                      true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        break;
+      }
+    } else if (diff < 0) {
+      return false;
+    } else {
+      position = __atomic_load_n(&L.async.head, __ATOMIC_RELAXED);
+    }
+  }
+
+  clock_gettime(CLOCK_REALTIME_COARSE, &r->time);
+  r->file = file;
+  r->line = line;
+  r->level = level;
+  r->error = error;
+  r->fmt = fmt;
+
+  va_copy(copy, ap);
+  if (!async_pack(fmt, copy, r->data, sizeof(r->data))) {
+    r->fmt = NULL;
+    errno = error;
+    vsnprintf(r->data, sizeof(r->data), fmt, ap);
+  }
+  va_end(copy);
+  __atomic_store_n(&r->seq, position + 1, __ATOMIC_RELEASE);
+
+  async_wake();
+  errno = error;
+  return true;
+}
+
+
+static void write_all(const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(STDERR_FILENO, buf, len);
+    if (n <= 0) { return; }
+    buf += n;
+    len -= n;
+  }
+}
+
+
+static void call_callback(Callback *cb, log_Event *ev, ...) {
+  va_start(ev->ap, ev);
+  cb->fn(ev);
+  va_end(ev->ap);
+}
+
+
+/* Writes the messages of the ring, stderr ones in batches */
+static void async_drain(char *batch) {
+  static time_t last;
+  static struct tm tm;
+  static char time_buf[16];
+  static char message[ASYNC_MESSAGE_SIZE];
+  size_t len = 0;
+
+  while (async_ready(L.async.tail)) {
+    Record *r = &L.async.records[L.async.tail & (ASYNC_SLOTS - 1)];
+
+    async_format(r, message, sizeof(message));
+
+    if (r->time.tv_sec != last) {
+      last = r->time.tv_sec;
+      localtime_r(&last, &tm);
+      time_buf[strftime(time_buf, sizeof(time_buf), "%H:%M:%S", &tm)] = '\0';
+    }
+
+    if (!L.quiet && r->level >= L.level) {
+      if (len + ASYNC_MESSAGE_SIZE + 256 > ASYNC_BATCH_SIZE) {
+        write_all(batch, len);
+        len = 0;
+      }
+#ifdef LOG_USE_COLOR
+      len += snprintf(
+        batch + len, ASYNC_BATCH_SIZE - len,
+        "%s %s%-5s\x1b[0m \x1b[90m%s:%d:\x1b[0m %s\n",
+        time_buf, level_colors[r->level], level_strings[r->level],
+        r->file, r->line, message);
+#else
+      len += snprintf(
+        batch + len, ASYNC_BATCH_SIZE - len, "%s %-5s %s:%d: %s\n",
+        time_buf, level_strings[r->level], r->file, r->line, message);
+#endif
+    }
+
+    for (int i = 0; i < MAX_CALLBACKS && L.callbacks[i].fn; i++) {
+      Callback *cb = &L.callbacks[i];
+      log_Event ev = {
+        .fmt   = "%s",
+        .file  = r->file,
+        .line  = r->line,
+        .level = r->level,
+        .time  = &tm,
+        .udata = cb->udata,
+      };
+      if (r->level >= cb->level) { call_callback(cb, &ev, message); }
+    }
+
+    __atomic_store_n(&r->seq, L.async.tail + ASYNC_SLOTS, __ATOMIC_RELEASE);
+    __atomic_store_n(&L.async.tail, L.async.tail + 1, __ATOMIC_RELEASE);
+  }
+
+  write_all(batch, len);
+}
+
+
+static void *async_writer(void *arg) {
+  char *batch = arg;
+  uint64_t count;
+
+  for (;;) {
+    async_drain(batch);
+    if (__atomic_load_n(&L.async.stop, __ATOMIC_ACQUIRE)) { break; }
+
+    /* Sleeps unless a message came in meanwhile */
+    __atomic_store_n(&L.async.sleeping, true, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (async_ready(L.async.tail) || __atomic_load_n(&L.async.stop, __ATOMIC_ACQUIRE)) {
+      __atomic_store_n(&L.async.sleeping, false, __ATOMIC_SEQ_CST);
+      continue;
+    }
+    (void)!read(L.async.wake_fd, &count, sizeof(count));
+  }
+
+  return NULL;
+}
+
+
+static bool async_active(void) {
+  return __atomic_load_n(&L.async.enabled, __ATOMIC_ACQUIRE);
+}
+
+
+/* Starts using the ring, returns false if async mode is off. The ring stays
+ * allocated until async_leave. */
+static bool async_enter(void) {
+  if (!async_active()) { return false; }
+
+  __atomic_fetch_add(&async_users, 1, __ATOMIC_SEQ_CST);
+  if (!__atomic_load_n(&L.async.enabled, __ATOMIC_SEQ_CST)) {
+    __atomic_fetch_sub(&async_users, 1, __ATOMIC_SEQ_CST);
+    return false;
+  }
+  return true;
+}
+
+
+static void async_leave(void) {
+  __atomic_fetch_sub(&async_users, 1, __ATOMIC_RELEASE);
+}
+
+
+/* Waits until the writer caught up with the messages pushed so far */
+static void async_wait(void) {
+  unsigned long head = __atomic_load_n(&L.async.head, __ATOMIC_ACQUIRE);
+
+  while (__atomic_load_n(&L.async.tail, __ATOMIC_ACQUIRE) < head) {
+    async_wake();
+    sched_yield();
+  }
+}
+
+
+int log_set_async(bool enable) {
+  static char *batch;
+  sigset_t all, old;
+
+  if (enable == async_active()) { return 0; }
+
+  if (!enable) {
+    __atomic_store_n(&L.async.enabled, false, __ATOMIC_SEQ_CST);
+    /* The writer is not in child processes */
+    if (L.async.pid != getpid()) { return 0; }
+
+    /* Callers that saw async mode on may still be pushing */
+    while (__atomic_load_n(&async_users, __ATOMIC_SEQ_CST)) { sched_yield(); }
+
+    __atomic_store_n(&L.async.stop, true, __ATOMIC_RELEASE);
+    async_wake();
+    pthread_join(L.async.thread, NULL);
+    async_drain(batch);
+
+    close(L.async.wake_fd);
+    free(L.async.records);
+    free(batch);
+    L.async.records = NULL;
+    batch = NULL;
+    return 0;
+  }
+
+  memset(&L.async, 0, sizeof(L.async));
+  if (!(L.async.records = calloc(ASYNC_SLOTS, sizeof(Record))) ||
+      !(batch = malloc(ASYNC_BATCH_SIZE)) ||
+      (L.async.wake_fd = eventfd(0, EFD_CLOEXEC)) == -1) {
+    free(L.async.records);
+    free(batch);
+    batch = NULL;
+    return -1;
+  }
+  for (unsigned long i = 0; i < ASYNC_SLOTS; i++) { L.async.records[i].seq = i; }
+  L.async.pid = getpid();
+
+  /* The writer must not take the signals of the process */
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  if (pthread_create(&L.async.thread, NULL, async_writer, batch)) {
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    close(L.async.wake_fd);
+    free(L.async.records);
+    free(batch);
+    batch = NULL;
+    return -1;
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+  __atomic_store_n(&L.async.enabled, true, __ATOMIC_RELEASE);
+  return 0;
+}
+
+
+void log_flush(void) {
+  if (!async_enter()) { return; }
+  async_wait();
+  async_leave();
+}
+
+
+void log_set_raw(bool enable) {
+  L.raw = enable;
+}
+
+
+static void raw_log(int level, const char *file, int line,
+                    const char *fmt, va_list ap) {
+  char buf[ASYNC_MESSAGE_SIZE + 256];
+  int len;
+
+#ifdef LOG_USE_COLOR
+  len = snprintf(buf, sizeof(buf), "%s%-5s\x1b[0m \x1b[90m%s:%d:\x1b[0m ",
+                 level_colors[level], level_strings[level], file, line);
+#else
+  len = snprintf(buf, sizeof(buf), "%-5s %s:%d: ", level_strings[level], file, line);
+#endif
+  if (len > (int)sizeof(buf) - 1) { len = sizeof(buf) - 1; }
+  len += vsnprintf(buf + len, sizeof(buf) - len, fmt, ap);
+  if (len > (int)sizeof(buf) - 1) { len = sizeof(buf) - 1; }
+  buf[len++] = '\n';
+  write_all(buf, len);
+}
+
+
 void log_log(int level, const char *file, int line, const char *fmt, ...) {
   log_Event ev = {
     .fmt   = fmt,
@@ -145,6 +758,34 @@ void log_log(int level, const char *file, int line, const char *fmt, ...) {
     .level = level,
   };
 
+  if (L.raw) {
+    if (!L.quiet && level >= L.level) {
+      va_list ap;
+
+      va_start(ap, fmt);
+      raw_log(level, file, line, fmt, ap);
+      va_end(ap);
+    }
+    return;
+  }
+
+  /* Fatal messages are written before the process goes away, after the
+   * pending ones. A full ring falls back to synchronous writes. */
+  if (async_enter()) {
+    bool pushed = false;
+
+    if (level < LOG_FATAL) {
+      va_list ap;
+
+      va_start(ap, fmt);
+      pushed = async_push(level, file, line, fmt, ap);
+      va_end(ap);
+    }
+    if (!pushed) { async_wait(); }
+    async_leave();
+    if (pushed) { return; }
+  }
+
   lock();
 
   if (!L.quiet && level >= L.level) {
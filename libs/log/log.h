@@ -30,12 +30,28 @@ typedef void (*log_LockFn)(bool lock, void *udata);
 
 enum { LOG_TRACE, LOG_DEBUG, LOG_INFO, LOG_WARN, LOG_ERROR, LOG_FATAL };
 
-#define log_trace(...) log_log(LOG_TRACE, __FILE__, __LINE__, __VA_ARGS__)
-#define log_debug(...) log_log(LOG_DEBUG, __FILE__, __LINE__, __VA_ARGS__)
-#define log_info(...)  log_log(LOG_INFO,  __FILE__, __LINE__, __VA_ARGS__)
-#define log_warn(...)  log_log(LOG_WARN,  __FILE__, __LINE__, __VA_ARGS__)
-#define log_error(...) log_log(LOG_ERROR, __FILE__, __LINE__, __VA_ARGS__)
-#define log_fatal(...) log_log(LOG_FATAL, __FILE__, __LINE__, __VA_ARGS__)
+/* Calls below LOG_LEVEL_MIN are compiled out, with their arguments */
+#ifndef LOG_LEVEL_MIN
+#define LOG_LEVEL_MIN LOG_TRACE
+#endif
+
+/* Lowest level written anywhere, the arguments of lower calls are not
+ * evaluated */
+extern int log_threshold;
+
+#define log_at(level, ...) \
+  do { \
+    if ((level) >= LOG_LEVEL_MIN && (level) >= log_threshold) { \
+      log_log(level, __FILE__, __LINE__, __VA_ARGS__); \
+    } \
+  } while (0)
+
+#define log_trace(...) log_at(LOG_TRACE, __VA_ARGS__)
+#define log_debug(...) log_at(LOG_DEBUG, __VA_ARGS__)
+#define log_info(...)  log_at(LOG_INFO,  __VA_ARGS__)
+#define log_warn(...)  log_at(LOG_WARN,  __VA_ARGS__)
+#define log_error(...) log_at(LOG_ERROR, __VA_ARGS__)
+#define log_fatal(...) log_at(LOG_FATAL, __VA_ARGS__)
 
 const char* log_level_string(int level);
 void log_set_lock(log_LockFn fn, void *udata);
@@ -44,6 +60,23 @@ void log_set_quiet(bool enable);
 int log_add_callback(log_LogFn fn, void *udata, int level);
 int log_add_fp(FILE *fp, int level);
 
+/* In async mode, callers copy the arguments of their message into a lock-free
+ * ring, and a writer thread formats and writes them in batches. The format
+ * must outlive the call (a string literal, as with the macros above), and a
+ * message whose arguments do not fit in a slot is formatted by the caller.
+ * Disabling it waits for the callers still pushing and writes the pending
+ * messages. A child process (fork, clone) must disable it, the writer thread
+ * is not there. */
+int log_set_async(bool enable);
+/* Waits until the pending messages are written */
+void log_flush(void);
+
+/* In raw mode, messages are formatted on the stack and written to stderr with
+ * a single write(2), without time, locks, stdio or callbacks. A child cloned
+ * from a multithreaded process must use it, the locks that other threads held
+ * (stdio, time zone, malloc) stay locked in the child. */
+void log_set_raw(bool enable);
+
 void log_log(int level, const char *file, int line, const char *fmt, ...);
 
 #endif
@@ -1,8 +1,19 @@
 #include <limits.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <stdlib.h>
 #include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/file.h>
+#include <errno.h>
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
 
 #include "log.h"
 #include "cgroupsv2.h"
@@ -10,115 +21,625 @@
 // This struct is used to store cgroups settings.
 struct cgroups_setting {
     char name[CGROUPS_CONTROL_FIELD_SIZE];
-    char value[CGROUPS_CONTROL_FIELD_SIZE];
+    // Large enough for a device number followed by a value
+    char value[CGROUPS_CONTROL_FIELD_SIZE * 2];
 };
 
-// cgroups settings are written to the cgroups v2 filesystem as follows:
-// - create a directory for the new cgroup
-// - settings files are created automatically
-// - write the settings to the corresponding files
-int cgroupsv2_init(const char *hostname, pid_t pid) {
-    struct cgroups_setting procs_setting = {
-        .name = CGROUPS_CGROUP_PROCS,
-    };
-    struct cgroups_setting memory_setting = {
-        .name = "memory.max",
-        .value = CGROUPS_MEMORY_MAX,
-    };
-    struct cgroups_setting cpu_setting = {
-        .name = "cpu.weight",
-        .value = CGROUPS_CPU_WEIGHT,
-    };
-    struct cgroups_setting pids_max_setting = {
-        .name = "pids.max",
-        .value = CGROUPS_PIDS_MAX,
-    };
-    char cgroup_dir[PATH_MAX] = {0};
+// Writes a value to a control file of the cgroup directory
+static int cgroupsv2_write(int cgroup_fd, const char *name, const char *value) {
+    int fd = 0;
 
-    // The "cgroup.procs" setting is used to add a process to a cgroup.
-    // It is prepared here with the pid of the calling process, so that it can be
-    // added to the cgroup later.
-    snprintf(procs_setting.value, CGROUPS_CONTROL_FIELD_SIZE, "%d", pid);
+    log_debug("opening %s...", name);
+    if ((fd = openat(cgroup_fd, name, O_WRONLY | O_CLOEXEC)) == -1) {
+        log_error("failed to open %s: %m", name);
+        return -1;
+    }
 
-    // Cgroups let us limit resources allocated to a process to prevent it from
-    // dying services to the rest of the system. The cgroups must be created
-    // before the process enters a cgroups namespace. The following settings are
-    // applied:
-    // - memory.limit_in_bytes: 1GB (process memory limit)
-    // - cpu.shares: 256 (a quarter of the CPU time)
-    // - pids.max: 64 (max number of processes)
-    // - cgroup.procs: 0 (the calling process is added to the cgroup)
-    struct cgroups_setting *cgroups_setting_list[] = {
-        &memory_setting,
-        &cpu_setting,
-        &pids_max_setting,
-        &procs_setting,
-        NULL
-    };
+    log_debug("writing %s to setting", value);
+    if (write(fd, value, strlen(value)) == -1) {
+        log_error("failed to write %s: %m", name);
+        close(fd);
+        return -1;
+    }
 
-    log_debug("setting cgroups...");
+    log_debug("closing %s...", name);
+    if (close(fd)) {
+        log_error("failed to close %s: %m", name);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Enables a controller for the cgroups of barco (children of the root cgroup)
+static int cgroupsv2_enable(const char *controller) {
+    int fd = -1;
 
-    // Create the cgroup directory.
-    if (snprintf(cgroup_dir, sizeof(cgroup_dir), "/sys/fs/cgroup/%s", hostname) == -1) {
-        log_error("failed to setup path: %m");
+    log_debug("enabling %s controller...", controller);
+    if ((fd = open(CGROUPS_SUBTREE_CONTROL, O_WRONLY | O_CLOEXEC)) == -1 ||
+        dprintf(fd, "+%s", controller) < 0) {
+        log_error("failed to enable %s controller: %m", controller);
+        if (fd >= 0)
+            close(fd);
         return -1;
     }
 
+    return close(fd);
+}
+
+// Places the cgroup on its cpus and memory nodes. A partition gives the
+// cgroup its cpus exclusively, but is refused by the kernel when the cpus are
+// needed elsewhere: the container then only runs on them without owning them.
+static int cgroupsv2_set_cpuset(int cgroup_fd, const cgroupsv2_config *config) {
+    log_info("setting cpuset.cpus to %s and cpuset.mems to %s...", config->cpus,
+             config->mems);
+    if (cgroupsv2_write(cgroup_fd, "cpuset.mems", config->mems) ||
+        cgroupsv2_write(cgroup_fd, "cpuset.cpus", config->cpus))
+        return -1;
+
+    if (config->cpus_exclusive &&
+        cgroupsv2_write(cgroup_fd, "cpuset.cpus.partition", "root"))
+        log_warn("cpus %s are not exclusive", config->cpus);
+
+    return 0;
+}
+
+// Undoes the placement of a cgroup of the pool, the cpuset controller being
+// enabled for the cgroups of barco once any container was placed. Partitions
+// are turned back into members before the cpus are released.
+static int cgroupsv2_reset_cpuset(int cgroup_fd) {
+    if (faccessat(cgroup_fd, "cpuset.cpus", F_OK, 0))
+        return 0;
+
+    return cgroupsv2_write(cgroup_fd, "cpuset.cpus.partition", "member") ||
+        cgroupsv2_write(cgroup_fd, "cpuset.cpus", "\n") ||
+        cgroupsv2_write(cgroup_fd, "cpuset.mems", "\n") ? -1 : 0;
+}
+
+int cgroupsv2_parse_io(cgroupsv2_config *config, const char *file, const char *arg) {
+    cgroupsv2_io *io = &config->io[config->io_count];
+    const char *value = strchr(arg, ' ');
+    char *end = NULL;
+
+    if (config->io_count == CGROUPS_IO_MAX) {
+        log_error("too many %s settings", file);
+        return -1;
+    }
+
+    io->file = file;
+    io->path[0] = '\0';
+
+    // The default weight applies to the devices without their own
+    if (!value && !strcmp(file, "io.weight")) {
+        if (strtoul(arg, &end, 10) < 1 || *end) {
+            log_error("invalid %s %s", file, arg);
+            return -1;
+        }
+        snprintf(io->value, sizeof(io->value), "%s", arg);
+        config->io_count++;
+        return 0;
+    }
+
+    if (!value || !value[1]) {
+        log_error("invalid %s %s, a path and a value are expected", file, arg);
+        return -1;
+    }
+    if (value - arg >= (long)sizeof(io->path)) {
+        log_error("invalid %s path %s", file, arg);
+        return -1;
+    }
+    memcpy(io->path, arg, value - arg);
+    io->path[value - arg] = '\0';
+    value++;
+
+    if (!strcmp(file, "io.latency")) {
+        if (strtoul(value, &end, 10) < 1 || *end) {
+            log_error("invalid %s target %s", file, value);
+            return -1;
+        }
+        snprintf(io->value, sizeof(io->value), "target=%s", value);
+    } else {
+        snprintf(io->value, sizeof(io->value), "%s", value);
+    }
+    config->io_count++;
+
+    return 0;
+}
+
+// Resolves a path to the number of its whole disk: io settings of
+// partitions are refused by the kernel. Paths on file systems without a
+// block device (tmpfs, overlayfs, btrfs subvolumes...) have no disk.
+static int cgroupsv2_device(const char *path, unsigned int *major, unsigned int *minor) {
+    char sys_path[PATH_MAX] = {0};
+    char disk_path[PATH_MAX] = {0};
+    char dev[CGROUPS_CONTROL_FIELD_SIZE] = {0};
+    struct stat st = {0};
+    FILE *fp = NULL;
+
+    if (stat(path, &st)) {
+        log_error("failed to stat %s: %m", path);
+        return -1;
+    }
+
+    *major = major(S_ISBLK(st.st_mode) ? st.st_rdev : st.st_dev);
+    *minor = minor(S_ISBLK(st.st_mode) ? st.st_rdev : st.st_dev);
+    if (!*major) {
+        log_error("%s is not on a block device", path);
+        return -1;
+    }
+
+    // /sys/dev/block/MAJ:MIN of a partition is a directory of its disk
+    snprintf(sys_path, sizeof(sys_path), "/sys/dev/block/%u:%u/partition", *major, *minor);
+    if (access(sys_path, F_OK))
+        return 0;
+
+    snprintf(sys_path, sizeof(sys_path), "/sys/dev/block/%u:%u/../dev", *major, *minor);
+    if (!realpath(sys_path, disk_path) || !(fp = fopen(disk_path, "re")) ||
+        !fgets(dev, sizeof(dev), fp) || sscanf(dev, "%u:%u", major, minor) != 2) {
+        log_error("failed to find the disk of %s: %m", path);
+        if (fp)
+            fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+
+    return 0;
+}
+
+// Lists the settings written when a cgroup is created: the default limits of
+// barco, the memory settings, and the block I/O settings. Crossing
+// memory.high throttles the container and reclaims its memory, well before
+// it would be killed at memory.max. io.latency needs a kernel built with
+// CONFIG_BLK_CGROUP_IOLATENCY, io.weight a scheduler or io.cost supporting
+// weights: the settings are not optional, their failure is an error.
+// Returns the number of settings or -1.
+static int cgroupsv2_settings(const cgroupsv2_config *config,
+                              struct cgroups_setting settings[CGROUPS_SETTINGS_MAX]) {
+    const struct {
+        const char *name;
+        const char *value;
+    } memory[] = {
+        {"memory.max", config->memory_max ? config->memory_max : CGROUPS_MEMORY_MAX},
+        {"cpu.weight", CGROUPS_CPU_WEIGHT},
+        {"pids.max", CGROUPS_PIDS_MAX},
+        {"memory.high", config->memory_high},
+        {"memory.swap.max", config->memory_swap_max},
+        {"memory.zswap.max", config->memory_zswap_max},
+        {"memory.oom.group", config->memory_oom_group ? "1" : NULL},
+    };
+    int count = 0;
+
+    for (size_t i = 0; i < sizeof(memory) / sizeof(memory[0]); i++) {
+        if (!memory[i].value)
+            continue;
+        snprintf(settings[count].name, sizeof(settings[count].name), "%s", memory[i].name);
+        snprintf(settings[count].value, sizeof(settings[count].value), "%s", memory[i].value);
+        count++;
+    }
+
+    for (int i = 0; i < config->io_count; i++) {
+        const cgroupsv2_io *io = &config->io[i];
+        unsigned int major = 0;
+        unsigned int minor = 0;
+
+        snprintf(settings[count].name, sizeof(settings[count].name), "%s", io->file);
+        if (!io->path[0]) {
+            snprintf(settings[count].value, sizeof(settings[count].value), "default %s",
+                     io->value);
+        } else {
+            if (cgroupsv2_device(io->path, &major, &minor))
+                return -1;
+            snprintf(settings[count].value, sizeof(settings[count].value), "%u:%u %s",
+                     major, minor, io->value);
+        }
+        count++;
+    }
+
+    return count;
+}
+
+// Idle cgroups can only be used by containers with the same settings
+static uint64_t cgroupsv2_hash(const struct cgroups_setting *settings, int count) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (int i = 0; i < count; i++) {
+        const char *fields[] = {settings[i].name, settings[i].value};
+
+        for (int j = 0; j < 2; j++) {
+            for (const char *c = fields[j]; ; c++) {
+                hash ^= (unsigned char)*c;
+                hash *= 0x100000001b3ULL;
+                if (!*c)
+                    break;
+            }
+        }
+    }
+
+    return hash;
+}
+
+// Creates a cgroup and writes its settings one by one, returns an fd of the
+// cgroup directory
+static int cgroupsv2_create(const char *name, const struct cgroups_setting *settings,
+                            int count) {
+    char cgroup_dir[PATH_MAX] = {0};
+    int cgroup_fd = -1;
+
+    snprintf(cgroup_dir, sizeof(cgroup_dir), "/sys/fs/cgroup/%s", name);
+
     log_debug("creating %s...", cgroup_dir);
     if (mkdir(cgroup_dir, S_IRUSR | S_IWUSR | S_IXUSR)) {
         log_error("failed to mkdir %s: %m", cgroup_dir);
         return -1;
     }
 
+    // The settings files are opened relative to the directory
+    if ((cgroup_fd = open(cgroup_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1) {
+        log_error("failed to open %s: %m", cgroup_dir);
+        rmdir(cgroup_dir);
+        return -1;
+    }
+
     // Loop through and write settings to the corresponding files in the cgroup
     // directory.
-    for (struct cgroups_setting **setting = cgroups_setting_list; *setting; setting++) {
-        char setting_path[PATH_MAX] = {0};
-        int fd = 0;
-
-        log_info("setting %s to %s...", (*setting)->name, (*setting)->value);
-        if (snprintf(setting_path, sizeof(setting_path), "%s/%s", cgroup_dir, (*setting)->name) == -1) {
-            log_error("failed to setup path: %m");
+    for (int i = 0; i < count; i++) {
+        log_info("setting %s to %s...", settings[i].name, settings[i].value);
+        if (cgroupsv2_write(cgroup_fd, settings[i].name, settings[i].value)) {
+            close(cgroup_fd);
+            rmdir(cgroup_dir);
             return -1;
         }
+    }
 
-        log_debug("opening %s...", setting_path);
-        if ((fd = open(setting_path, O_WRONLY)) == -1) {
-            log_error("failed to open %s: %m", setting_path);
-            return -1;
-        }
+    return cgroup_fd;
+}
 
-        log_debug("writing %s to setting", (*setting)->value);
-        if (write(fd, (*setting)->value, strlen((*setting)->value)) == -1) {
-            log_error("failed to write %s: %m", setting_path);
-            close(fd);
-            return -1;
+// Returns whether the cgroup has processes, cgroups of the pool must not
+static bool cgroupsv2_populated(int cgroup_fd) {
+    char buffer[CGROUPS_CONTROL_FIELD_SIZE] = {0};
+    const char *populated = NULL;
+    int fd = openat(cgroup_fd, "cgroup.events", O_RDONLY | O_CLOEXEC);
+    ssize_t len = fd >= 0 ? read(fd, buffer, sizeof(buffer) - 1) : -1;
+
+    if (fd >= 0)
+        close(fd);
+    if (len <= 0)
+        return true;
+
+    populated = strstr(buffer, "populated ");
+    return !populated || populated[strlen("populated ")] != '0';
+}
+
+// Calls fn for each idle cgroup of the pool of hash, until it returns true
+static void cgroupsv2_pool_each(uint64_t hash, bool (*fn)(int dir_fd, const char *name,
+                                                          void *arg), void *arg) {
+    char prefix[CGROUPS_CONTROL_FIELD_SIZE] = {0};
+    struct dirent *entry = NULL;
+    DIR *dir = opendir("/sys/fs/cgroup");
+
+    if (!dir) {
+        log_error("failed to open /sys/fs/cgroup: %m");
+        return;
+    }
+
+    snprintf(prefix, sizeof(prefix), CGROUPS_POOL_PREFIX "%016" PRIx64 "-", hash);
+    while ((entry = readdir(dir))) {
+        if (entry->d_type == DT_DIR && !strncmp(entry->d_name, prefix, strlen(prefix)) &&
+            fn(dirfd(dir), entry->d_name, arg))
+            break;
+    }
+
+    closedir(dir);
+}
+
+static bool cgroupsv2_pool_count(int dir_fd, const char *name, void *arg) {
+    (void)dir_fd;
+    (void)name;
+    (*(int *)arg)++;
+    return false;
+}
+
+struct cgroupsv2_claim {
+    char *name;
+    size_t size;
+    int cgroup_fd;
+};
+
+// Locks an idle cgroup with flock() on its directory. The lock follows the
+// fd of the cgroup kept by barco while the container runs, and is released
+// even if barco dies. A cgroup with processes left is not idle. The cpuset is
+// not part of the hash, and a barco that died never released its placement:
+// it is reset here too, the container sets its own afterwards.
+static bool cgroupsv2_pool_claim(int dir_fd, const char *name, void *arg) {
+    struct cgroupsv2_claim *claim = arg;
+    int fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (fd == -1)
+        return false;
+    if (flock(fd, LOCK_EX | LOCK_NB) || cgroupsv2_populated(fd) ||
+        cgroupsv2_reset_cpuset(fd)) {
+        close(fd);
+        return false;
+    }
+
+    log_debug("claimed idle cgroup %s", name);
+    snprintf(claim->name, claim->size, "%s", name);
+    claim->cgroup_fd = fd;
+    return true;
+}
+
+// Names a new idle cgroup of the pool, unique between the barco processes
+static void cgroupsv2_pool_name(char *name, size_t size, uint64_t hash) {
+    static unsigned long seq = 0;
+
+    snprintf(name, size, CGROUPS_POOL_PREFIX "%016" PRIx64 "-%d-%lu", hash, getpid(),
+             __atomic_fetch_add(&seq, 1, __ATOMIC_RELAXED));
+}
+
+#ifdef HAVE_LIBURING
+// Creates the cgroups with io_uring: each cgroup is a chain of linked
+// operations (mkdir, then open, write and close of each setting through a
+// direct descriptor), and the chains of all the cgroups are submitted at once
+// and run concurrently. Needs Linux 5.15. Returns the number of cgroups
+// created, failed ones are removed.
+static int cgroupsv2_create_uring(char (*names)[HOST_NAME_MAX + 1], int count,
+                                  const struct cgroups_setting *settings,
+                                  int settings_count) {
+    int ops = 1 + 3 * settings_count;
+    char (*paths)[PATH_MAX] = NULL;
+    bool *failed = NULL;
+    struct io_uring ring;
+    int created = 0;
+    int err = 0;
+
+    if (count > CGROUPS_URING_ENTRIES / ops)
+        count = CGROUPS_URING_ENTRIES / ops;
+
+    if ((err = io_uring_queue_init(count * ops, &ring, 0))) {
+        errno = -err;
+        log_debug("io_uring not available: %m");
+        return 0;
+    }
+    if ((err = io_uring_register_files_sparse(&ring, count))) {
+        errno = -err;
+        log_debug("io_uring direct descriptors not available: %m");
+        io_uring_queue_exit(&ring);
+        return 0;
+    }
+
+    paths = calloc(count * (settings_count + 1), sizeof(*paths));
+    failed = calloc(count, sizeof(*failed));
+    if (!paths || !failed) {
+        log_error("failed to allocate cgroups batch: %m");
+        goto exit;
+    }
+
+    for (int i = 0; i < count; i++) {
+        char (*dir)[PATH_MAX] = &paths[i * (settings_count + 1)];
+        struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+
+        snprintf(*dir, PATH_MAX, "/sys/fs/cgroup/%s", names[i]);
+        io_uring_prep_mkdirat(sqe, AT_FDCWD, *dir, S_IRUSR | S_IWUSR | S_IXUSR);
+        io_uring_sqe_set_data64(sqe, i);
+        if (settings_count)
+            sqe->flags |= IOSQE_IO_LINK;
+
+        for (int j = 0; j < settings_count; j++) {
+            char *path = dir[j + 1];
+
+            snprintf(path, PATH_MAX, "%s/%s", *dir, settings[j].name);
+            sqe = io_uring_get_sqe(&ring);
+            io_uring_prep_openat_direct(sqe, AT_FDCWD, path, O_WRONLY | O_CLOEXEC, 0, i);
+            io_uring_sqe_set_data64(sqe, i);
+            sqe->flags |= IOSQE_IO_LINK;
+
+            sqe = io_uring_get_sqe(&ring);
+            io_uring_prep_write(sqe, i, settings[j].value, strlen(settings[j].value), 0);
+            io_uring_sqe_set_data64(sqe, i);
+            sqe->flags |= IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+
+            sqe = io_uring_get_sqe(&ring);
+            io_uring_prep_close_direct(sqe, i);
+            io_uring_sqe_set_data64(sqe, i);
+            if (j < settings_count - 1)
+                sqe->flags |= IOSQE_IO_LINK;
         }
+    }
 
-        log_debug("closing %s...", setting_path);
-        if (close(fd)) {
-            log_error("failed to close %s: %m", setting_path);
-            return -1;
+    log_debug("submitting %d cgroups to io_uring...", count);
+    if ((err = io_uring_submit_and_wait(&ring, count * ops)) < 0) {
+        errno = -err;
+        log_error("failed to submit cgroups batch: %m");
+        goto exit;
+    }
+
+    // A failed operation cancels the rest of its chain
+    for (int i = 0; i < count * ops; i++) {
+        struct io_uring_cqe *cqe = NULL;
+
+        if ((err = io_uring_wait_cqe(&ring, &cqe))) {
+            errno = -err;
+            log_error("failed to complete cgroups batch: %m");
+            goto exit;
+        }
+        if (cqe->res < 0 && cqe->res != -ECANCELED) {
+            errno = -cqe->res;
+            log_debug("failed to set up cgroup %s: %m", names[cqe->user_data]);
         }
+        if (cqe->res < 0)
+            failed[cqe->user_data] = true;
+        io_uring_cqe_seen(&ring, cqe);
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (failed[i])
+            rmdir(paths[i * (settings_count + 1)]);
+        else
+            created++;
+    }
+
+exit:
+    free(paths);
+    free(failed);
+    io_uring_queue_exit(&ring);
+    return created;
+}
+#endif
+
+int cgroupsv2_pool_fill(const cgroupsv2_config *config) {
+    struct cgroups_setting settings[CGROUPS_SETTINGS_MAX] = {0};
+    char (*names)[HOST_NAME_MAX + 1] = NULL;
+    int settings_count = 0;
+    int created = 0;
+    int missing = 0;
+    uint64_t hash = 0;
+
+    if ((settings_count = cgroupsv2_settings(config, settings)) == -1)
+        return -1;
+    hash = cgroupsv2_hash(settings, settings_count);
+
+    cgroupsv2_pool_each(hash, cgroupsv2_pool_count, &missing);
+    missing = config->pool_size - missing;
+    if (missing <= 0)
+        return 0;
+
+    log_info("creating %d idle cgroups...", missing);
+    if ((config->cpus[0] && cgroupsv2_enable("cpuset")) ||
+        (config->io_count && cgroupsv2_enable("io")))
+        return -1;
+
+    if (!(names = calloc(missing, sizeof(*names)))) {
+        log_error("failed to allocate cgroups names: %m");
+        return -1;
+    }
+    for (int i = 0; i < missing; i++)
+        cgroupsv2_pool_name(names[i], sizeof(names[i]), hash);
+
+#ifdef HAVE_LIBURING
+    while (created < missing) {
+        int batch = cgroupsv2_create_uring(names + created, missing - created,
+                                           settings, settings_count);
+        if (batch <= 0)
+            break;
+        created += batch;
+    }
+#endif
+
+    // Without io_uring, or for what it failed to create
+    for (int i = created; i < missing; i++) {
+        int fd = cgroupsv2_create(names[i], settings, settings_count);
+
+        if (fd == -1)
+            break;
+        close(fd);
+        created++;
+    }
+    free(names);
+
+    return created == missing ? 0 : -1;
+}
+
+// cgroups settings are written to the cgroups v2 filesystem as follows:
+// - create a directory for the new cgroup
+// - settings files are created automatically
+// - write the settings to the corresponding files
+//
+// The cgroup is set up before the container exists, so that the container
+// can be cloned directly into it (see container_init).
+//
+// With a pool, an idle cgroup with the same settings is claimed instead:
+// mkdir and the settings writes are then replaced by a flock().
+int cgroupsv2_init(const char *hostname, const cgroupsv2_config *config, char *name,
+                   size_t size) {
+    struct cgroups_setting settings[CGROUPS_SETTINGS_MAX] = {0};
+    struct cgroupsv2_claim claim = {.name = name, .size = size, .cgroup_fd = -1};
+    int settings_count = 0;
+    int cgroup_fd = -1;
+
+    // Cgroups let us limit resources allocated to a process to prevent it from
+    // dying services to the rest of the system. The cgroups must be created
+    // before the process enters a cgroups namespace. The following settings are
+    // applied by default:
+    // - memory.max: 1GB (process memory limit)
+    // - cpu.weight: 256 (a quarter of the CPU time)
+    // - pids.max: 64 (max number of processes)
+    log_debug("setting cgroups...");
+
+    if ((config->cpus[0] && cgroupsv2_enable("cpuset")) ||
+        (config->io_count && cgroupsv2_enable("io")))
+        return -1;
+
+    if ((settings_count = cgroupsv2_settings(config, settings)) == -1)
+        return -1;
+
+    snprintf(name, size, "%s", hostname);
+    if (config->pool_size > 0)
+        cgroupsv2_pool_each(cgroupsv2_hash(settings, settings_count),
+                            cgroupsv2_pool_claim, &claim);
+
+    if ((cgroup_fd = claim.cgroup_fd) == -1 &&
+        (cgroup_fd = cgroupsv2_create(name, settings, settings_count)) == -1)
+        return -1;
+
+    // The cgroup is removed, or released to the pool, before the fd that
+    // holds its lock is closed
+    if (config->cpus[0] && cgroupsv2_set_cpuset(cgroup_fd, config)) {
+        cgroupsv2_free(name);
+        close(cgroup_fd);
+        return -1;
     }
 
     log_debug("cgroups set");
-    return 0;
+    return cgroup_fd;
+}
+
+// The "cgroup.procs" setting is used to add a process to a cgroup.
+// This is only needed when the container could not be cloned into the cgroup.
+int cgroupsv2_attach(int cgroup_fd, pid_t pid) {
+    char pid_value[CGROUPS_CONTROL_FIELD_SIZE] = {0};
+
+    snprintf(pid_value, sizeof(pid_value), "%d", pid);
+    log_info("setting %s to %s...", CGROUPS_CGROUP_PROCS, pid_value);
+
+    return cgroupsv2_write(cgroup_fd, CGROUPS_CGROUP_PROCS, pid_value);
+}
+
+// Leaves a cgroup of the pool idle, it is unlocked when barco closes its fd.
+// The placement of the container is undone. Counters (e.g. memory.events) keep the values of the previous containers.
+static int cgroupsv2_pool_release(const char *name) {
+    char cgroup_dir[PATH_MAX] = {0};
+    int cgroup_fd = -1;
+    bool idle = false;
+
+    snprintf(cgroup_dir, sizeof(cgroup_dir), "/sys/fs/cgroup/%s", name);
+    if ((cgroup_fd = open(cgroup_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+        return -1;
+
+    idle = !cgroupsv2_populated(cgroup_fd) && !cgroupsv2_reset_cpuset(cgroup_fd);
+    close(cgroup_fd);
+
+    return idle ? 0 : -1;
 }
 
 // Clean up the cgroups for the process. Since barco write the PID of its child
 // process to the cgroup.procs file, all that is needed is to remove the cgroups
-// directory after the child process is exited.
-int cgroupsv2_free(const char *hostname) {
+// directory after the child process is exited. Cgroups of the pool are kept.
+int cgroupsv2_free(const char *name) {
     char dir[PATH_MAX] = {0};
 
     log_debug("freeing cgroups...");
 
-    if (snprintf(dir, sizeof(dir), "/sys/fs/cgroup/%s", hostname) == -1) {
+    if (snprintf(dir, sizeof(dir), "/sys/fs/cgroup/%s", name) == -1) {
         log_error("failed to setup paths: %m");
         return -1;
     }
 
+    if (!strncmp(name, CGROUPS_POOL_PREFIX, strlen(CGROUPS_POOL_PREFIX)) &&
+        !cgroupsv2_pool_release(name)) {
+        log_debug("cgroup %s back to the pool", name);
+        return 0;
+    }
+
     log_debug("removing %s...", dir);
     if (rmdir(dir)) {
         log_error("failed to rmdir %s: %m", dir);
@@ -1,84 +1,649 @@
 #define _GNU_SOURCE
 #include <sched.h>
+#include <linux/sched.h>
 #include <unistd.h>
+#include <stdint.h>
 #include <string.h>
 #include <signal.h>
-#include <sys/wait.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include <limits.h>
 
 #include "log.h"
 #include "mount.h"
 #include "user.h"
 #include "sec.h"
+#include "sec_learn.h"
+#include "cgroupsv2.h"
+#include "profile.h"
+#include "net.h"
+#include "exec.h"
+#include "ns.h"
 #include "container.h"
 
+// Parked containers receive their launch message in this buffer, which is
+// private to each container after clone().
+static char container_launch_msg[CONTAINER_LAUNCH_MSG_MAX];
+
+// Reports why the container failed to start, in a single message. barco
+// sees EOF instead when execve succeeds.
+static void container_report(int fd, const char *step, int error) {
+    container_error msg = {.error = error};
+
+    snprintf(msg.step, sizeof(msg.step), "%s", step);
+    if (send(fd, &msg, sizeof(msg), MSG_NOSIGNAL) != sizeof(msg))
+        log_debug("failed to report error to barco: %m");
+}
+
+// Sets the hostname and attaches the root filesystem
+static int container_set_root(container_config *config, const char **step) {
+    // A joined uts namespace keeps the hostname of the group
+    *step = "hostname";
+    profile_begin(PROFILE_CHILD_HOSTNAME);
+    if (config->ns_fds[NS_UTS] < 0 &&
+        sethostname(config->hostname, strlen(config->hostname))) {
+        log_error("failed to set hostname %s: %m", config->hostname);
+        return -1;
+    }
+    profile_end(PROFILE_CHILD_HOSTNAME);
+
+    *step = "mount";
+    profile_begin(PROFILE_CHILD_MOUNT);
+    if (mount_set(&config->mount))
+        return -1;
+    profile_end(PROFILE_CHILD_MOUNT);
+
+    return 0;
+}
+
+// The user namespace of the container is created without clone: the shared
+// namespaces are owned by the user namespace of barco, and the mounts without
+// a mount tree need the capabilities of barco. The container tells barco
+// once its user namespace exists, so that barco writes its mappings.
+static int container_unshare(container_config *config, const char **step) {
+    int unshared = 0;
+
+    *step = "namespaces";
+    if (ns_join(config->ns_fds) || container_set_root(config, step))
+        return -1;
+
+    *step = "user namespace";
+    log_debug("setting user namespace...");
+    unshared = unshare(CLONE_NEWUSER);
+    if (write(config->fd, &unshared, sizeof(unshared)) != sizeof(unshared)) {
+        log_error("failed to write socket %d: %m", config->fd);
+        return -1;
+    }
+
+    return 0;
+}
+
 // This is the function that will be called by clone() to start the container.
 // The order of the operations is of important as, for example,
 // mounts cannot be changed without specific capabilities,
 // unshare cannot be called after syscalls are limited, etc...
+//
+// The container is usually cloned in its user namespace, and waits for a
+// single release message of barco, sent once barco wrote its mappings and
+// set up its network. It then sets itself up without barco. Either execve
+// closes the socket (close-on-exec), or the container reports its error on
+// it (see container_error).
 int container_start(void *arg) {
     container_config *config = arg;
+    char *launch_argv[CONTAINER_LAUNCH_ARGS_MAX + 1] = {0};
+    char *launch_envp[CONTAINER_LAUNCH_ARGS_MAX + 1] = {0};
+    char **argv = config->argv;
+    char **envp = NULL;
+    const char *step = "setup";
+    sigset_t mask;
+    int release = -1;
+
+    // barco may block the signals it handles through a signalfd, the
+    // command must not inherit that
+    sigemptyset(&mask);
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+
+    // The log writer thread of barco is not in the container. The container
+    // may be cloned from any thread of barco, with the locks of the others
+    // taken: up to execve, it logs with write(2) and does not allocate.
+    log_set_async(false);
+    log_set_raw(true);
 
     log_debug("starting container");
-    log_debug("setting hostname, mounts, user namespace, capabilities and syscalls...");
+    if (!config->userns_cloned && container_unshare(config, &step))
+        goto error;
 
-    if (sethostname(config->hostname, strlen(config->hostname)) ||
-        mount_set(config->mnt) || user_namespace_init(config->uid, config->fd) ||
-        sec_set_caps() || sec_set_seccomp()) {
-        log_debug("failed to set properties");
-        close(config->fd);
+    // EOF means that barco gave up on the container, there is no one to
+    // report to
+    log_debug("waiting for barco...");
+    if (read(config->fd, &release, sizeof(release)) != sizeof(release)) {
+        log_debug("container not released: %m");
         return -1;
     }
 
-    log_debug("closing container socket...");
-    if (close(config->fd)) {
-        log_error("failed to close container socket: %m");
-        return -1;
+    log_debug("setting hostname, mounts, user, capabilities and syscalls...");
+    if (config->userns_cloned && container_set_root(config, &step))
+        goto error;
+
+    step = "user";
+    profile_begin(PROFILE_CHILD_USERNS);
+    if (user_namespace_set_user(config->uid))
+        goto error;
+    profile_end(PROFILE_CHILD_USERNS);
+
+    step = "capabilities";
+    profile_begin(PROFILE_CHILD_CAPS);
+    if (sec_set_caps())
+        goto error;
+    profile_end(PROFILE_CHILD_CAPS);
+
+    // seccomp does not let the command change its memory policy
+    step = "mempolicy";
+    if (cpuset_set_mempolicy(config->cpuset.mempolicy, config->mems))
+        goto error;
+
+    step = "seccomp";
+    profile_begin(PROFILE_CHILD_SECCOMP);
+    if (config->seccomp_learn ? sec_learn_set_filter(config->fd) :
+        !config->seccomp_disabled && sec_set_seccomp())
+        goto error;
+    profile_end(PROFILE_CHILD_SECCOMP);
+
+    // A parked container is ready to exec, it only misses what to run
+    if (config->parked) {
+        ssize_t len = 0;
+
+        log_debug("waiting for launch message...");
+        if ((len = read(config->fd, container_launch_msg,
+                        sizeof(container_launch_msg))) <= 0) {
+            log_debug("no launch message received: %m");
+            return -1;
+        }
+
+        step = "launch";
+        if (container_launch_parse(container_launch_msg, len, launch_argv,
+                                   launch_envp))
+            goto error;
+        argv = launch_argv;
+        envp = launch_envp;
     }
 
-    log_debug("executing command '%s %s' from directory '%s' in container...",
-              config->cmd, config->argv[ARGV_ARG_INDEX], config->mnt);
+    // When profiling, the socket also reports the phases above. It is
+    // close-on-exec, so barco sees EOF as soon as execve succeeds.
+    profile_begin(PROFILE_CHILD_EXECVE);
+    if (profile_enabled() && profile_send(config->fd))
+        return -1;
+
+    log_debug("executing command '%s %s' in container...",
+              argv[ARGV_CMD_INDEX], argv[ARGV_ARG_INDEX]);
     log_info("### BARCONTAINER STARTING - type 'exit' to quit ###");
+
+    // The log of barco is done, what follows is the output of the command
+    step = "output";
+    for (int i = 0; i < OUTPUT_STREAMS; i++) {
+        if (config->output_fds[i] >= 0 &&
+            dup2(config->output_fds[i], i == OUTPUT_STDOUT ? STDOUT_FILENO : STDERR_FILENO) == -1) {
+            log_error("failed to redirect output: %m");
+            goto error;
+        }
+    }
+
     // argv must be NULL terminated
-    if (execve(config->cmd, config->argv, NULL)) {
-        log_error("failed to execve '%s %s': %m", config->cmd, config->argv[ARGV_ARG_INDEX]);
-        return -1;
+    step = "execve";
+    execve(argv[ARGV_CMD_INDEX], argv, envp);
+    log_error("failed to execve '%s %s': %m", argv[ARGV_CMD_INDEX], argv[ARGV_ARG_INDEX]);
+
+error:
+    container_report(config->fd, step, errno);
+    close(config->fd);
+    return -1;
+}
+
+bool container_report_error(const char *name, const void *msg, size_t len) {
+    container_error error = {0};
+
+    if (len != sizeof(error))
+        return false;
+
+    memcpy(&error, msg, sizeof(error));
+    error.step[sizeof(error.step) - 1] = '\0';
+    log_error("container %s failed to start: %s: %s", name, error.step,
+              error.error ? strerror(error.error) : "unknown error");
+    return true;
+}
+
+// Set once clone3 with CLONE_INTO_CGROUP turned out to be unsupported, so that
+// the next containers go straight to clone(). Supervisor workers share it, it
+// is only accessed atomically.
+static bool container_clone3_unsupported;
+
+// clone3 works like fork(): the child runs on a copy of the stack of the
+// caller, so there is no stack to allocate. The child only sets itself up and
+// execs or exits.
+static pid_t container_clone3(container *container, int flags) {
+    struct clone_args args = {
+        .flags = flags | CLONE_PIDFD | CLONE_INTO_CGROUP,
+        .pidfd = (uint64_t)(uintptr_t)&container->pidfd,
+        .exit_signal = SIGCHLD,
+        .cgroup = (uint64_t)container->cgroup_fd,
+    };
+    pid_t pid = syscall(SYS_clone3, &args, sizeof(args));
+
+    if (!pid)
+        _exit(container_start(&container->config));
+
+    return pid;
+}
+
+// Allocates a stack for clone() with a guard page below it, so that a stack
+// overflow faults instead of silently corrupting memory
+static char *container_stack_alloc(void) {
+    long page_size = sysconf(_SC_PAGESIZE);
+    char *stack = mmap(NULL, CONTAINER_STACK_SIZE + page_size,
+                       PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+
+    if (stack == MAP_FAILED)
+        return NULL;
+
+    if (mprotect(stack, page_size, PROT_NONE)) {
+        munmap(stack, CONTAINER_STACK_SIZE + page_size);
+        return NULL;
     }
-    log_debug("container started...");
 
-    return 0;
+    return stack;
 }
 
 // Creates container (process) with different properties than its parent
 // e.g. mount to different dir, different hostname, etc...
 // All these requirements are specified by the flags we pass to clone()
-int container_init(container_config *config, char *stack) {
-    int container_pid = 0;
+//
+// clone3 is used when available: the container is created directly in its
+// cgroup (CLONE_INTO_CGROUP), so it never runs unconstrained, and barco gets a
+// pidfd for it (CLONE_PIDFD). Older kernels fall back to clone() followed by
+// a write of the pid to cgroup.procs.
+int container_init(container *container) {
+    long page_size = sysconf(_SC_PAGESIZE);
     // The flags specify what the cloned process can do.
     // These allow some control overrmounts, pids, IPC data structures, network
     // devices and hostname.
     int flags = CLONE_NEWNS | CLONE_NEWCGROUP | CLONE_NEWPID | CLONE_NEWIPC |
         CLONE_NEWNET | CLONE_NEWUTS;
 
+    // The joined namespaces are not created (see ns_join)
+    for (int i = 0; i < NS_TYPES; i++) {
+        if (container->config.ns_fds[i] >= 0)
+            flags &= ~ns_flag(i);
+    }
+    if (container->config.userns_cloned)
+        flags |= CLONE_NEWUSER;
+
+    if (!__atomic_load_n(&container_clone3_unsupported, __ATOMIC_RELAXED)) {
+        log_debug("cloning process into cgroup...");
+        if ((container->pid = container_clone3(container, flags)) != -1)
+            return 0;
+
+        // ENOSYS: no clone3 (< 5.3), E2BIG: no CLONE_INTO_CGROUP (< 5.7).
+        // Anything else (e.g. EINVAL for the cgroup of this container) is an
+        // error of this container only.
+        if (errno != ENOSYS && errno != E2BIG) {
+            log_error("failed to clone3: %m");
+            return -1;
+        }
+
+        log_debug("clone3 not supported, falling back to clone: %m");
+        __atomic_store_n(&container_clone3_unsupported, true, __ATOMIC_RELAXED);
+    }
+
+    // Initialize a stack for the container
+    log_debug("initializing container stack...");
+    profile_begin(PROFILE_STACK);
+    if (!(container->stack = container_stack_alloc())) {
+        log_error("failed to initialize container stack: %m");
+        return -1;
+    }
+    profile_end(PROFILE_STACK);
+
     // SIGCHLD lets us wait on the child process.
+    // Stacks on most architectures grow downwards, the top of the stack is
+    // past the guard page and CONTAINER_STACK_SIZE.
     log_debug("cloning process...");
-    if ((container_pid =
-        clone(container_start, stack, flags | SIGCHLD, config)) == -1) {
+    if ((container->pid = clone(container_start,
+                                container->stack + page_size + CONTAINER_STACK_SIZE,
+                                flags | SIGCHLD, &container->config)) == -1) {
         log_error("failed to clone: %m");
-        return 1;
+        return -1;
+    }
+
+    // pidfd_open needs Linux 5.3, barco can do without a pidfd
+    container->pidfd = syscall(SYS_pidfd_open, container->pid, 0);
+
+    return cgroupsv2_attach(container->cgroup_fd, container->pid);
+}
+
+// Waits for a container that creates its user namespace itself (see
+// container_unshare). unshared is its unshare status, not 0 when user
+// namespaces are not available.
+static int container_wait_unshare(container *container, int *unshared) {
+    char msg[sizeof(container_error)] = {0};
+    ssize_t len = 0;
+
+    log_debug("waiting for user namespace of %s...", container->name);
+    if ((len = recv(container->fd, msg, sizeof(msg), 0)) == sizeof(*unshared)) {
+        memcpy(unshared, msg, sizeof(*unshared));
+        return 0;
+    }
+
+    if (len == -1)
+        log_error("failed to wait for container %s: %m", container->name);
+    else if (!container_report_error(container->name, msg, len))
+        log_error("container %s exited during setup", container->name);
+    return -1;
+}
+
+// Picks the cpus and memory nodes of the container for its cgroup
+static int container_place(container *container, cgroupsv2_config *cgroups) {
+    cpuset_placement placement = {0};
+
+    log_debug("placing container %s on %u cpus...", container->name,
+              container->config.cpuset.cpus);
+    if (cpuset_place(container->name, &container->config.cpuset, &placement))
+        return -1;
+    container->cpuset = true;
+    container->config.mems = placement.mems;
+
+    if (cpuset_format(&placement.cpus, cgroups->cpus, sizeof(cgroups->cpus)) ||
+        cpuset_format_nodes(placement.mems, cgroups->mems, sizeof(cgroups->mems))) {
+        log_error("failed to format cpuset of %s", container->name);
+        return -1;
+    }
+    cgroups->cpus_exclusive = container->config.cpuset.exclusive;
+
+    return 0;
+}
+
+// Runs the launch sequence of barco for a container:
+// - a socket pair to synchronize with the container
+// - cpus and memory nodes of the container, when requested
+// - cgroups limits for the container
+// - the root filesystem as a detached mount tree
+// - clone3() into the cgroup, or clone() and attach (container_init)
+// - uid / gid mappings of the user namespace of the container
+int container_create(container *container, const container_config *config) {
+    cgroupsv2_config cgroups = {0};
+    int sockets[2] = {-1, -1};
+    bool idmap_owned = false;
+    int idmap_fd = -1;
+    int unshared = 0;
+    int err = 0;
+
+    container->config = *config;
+    container->pid = -1;
+    container->pidfd = -1;
+    container->fd = -1;
+    container->cgroup_fd = -1;
+    container->stack = NULL;
+    container->cgroup = false;
+    container->cpuset = false;
+    container->registered = false;
+    container->uids.count = 0;
+    container->output.fd = -1;
+    for (int i = 0; i < OUTPUT_STREAMS; i++) {
+        container->output.pipes[i] = -1;
+        container->config.output_fds[i] = -1;
+    }
+    for (int i = 0; i < NS_TYPES; i++)
+        container->config.ns_fds[i] = -1;
+    snprintf(container->name, sizeof(container->name), "%s", config->hostname);
+    snprintf(container->cgroup_name, sizeof(container->cgroup_name), "%s", config->hostname);
+    container->config.hostname = container->name;
+
+    // Initialize a socket pair to communicate with the container
+    log_debug("initializing socket pair...");
+    profile_begin(PROFILE_SOCKETPAIR);
+    if (socketpair(AF_LOCAL, SOCK_SEQPACKET, 0, sockets)) {
+        log_error("failed to initialialize socket pair: %m");
+        return -1;
+    }
+    container->fd = sockets[0];
+    container->config.fd = sockets[1];
+
+    // Both ends are close-on-exec: the container end is closed by a successful
+    // execve, which is how barco notices the container started when profiling.
+    log_debug("setting socket flags...");
+    if (fcntl(sockets[0], F_SETFD, FD_CLOEXEC) ||
+        fcntl(sockets[1], F_SETFD, FD_CLOEXEC)) {
+        log_error("failed to socket fcntl: %m");
+        close(sockets[1]);
+        return -1;
+    }
+    profile_end(PROFILE_SOCKETPAIR);
+
+    // Prepare cgroups for the process, before it exists
+    log_debug("initializing cgroups...");
+    profile_begin(PROFILE_CGROUPS);
+    if (config->cgroups)
+        cgroups = *config->cgroups;
+    if (config->cpuset.cpus && container_place(container, &cgroups)) {
+        log_error("failed to place container");
+        close(sockets[1]);
+        return -1;
+    }
+
+    // A failed cgroupsv2_init cleans up after itself, and the cgroup of the
+    // name may belong to someone else when mkdir fails
+    if ((container->cgroup_fd = cgroupsv2_init(container->name, &cgroups,
+                                                 container->cgroup_name,
+                                                 sizeof(container->cgroup_name))) == -1) {
+        log_error("failed to initialize cgroups");
+        close(sockets[1]);
+        return -1;
+    }
+    container->cgroup = true;
+    profile_end(PROFILE_CGROUPS);
+
+    // The uids are known before the root filesystem is idmapped with them
+    if (user_range_alloc(&container->uids)) {
+        log_error("failed to allocate uids");
+        close(sockets[1]);
+        return -1;
+    }
+
+    // The container inherits the fds of the namespaces it joins
+    if (config->ns.join && ns_open(config->ns.join, container->config.ns_fds)) {
+        log_error("failed to open namespaces %s", config->ns.join);
+        close(sockets[1]);
+        return -1;
+    }
+
+    // The output pipes are created before the clone, the container inherits
+    // its ends
+    if (config->output && config->output->dir) {
+        log_debug("initializing output...");
+        if (output_init(&container->output, config->output, container->name,
+                        container->config.output_fds)) {
+            log_error("failed to initialize output");
+            ns_close(container->config.ns_fds);
+            close(sockets[1]);
+            return -1;
+        }
+    }
+
+    // Build the root filesystem as a detached mount tree that the container
+    // inherits. On failure the container mounts it itself.
+    log_debug("preparing root filesystem...");
+    profile_begin(PROFILE_MOUNT_PREPARE);
+    idmap_fd = user_namespace_idmap(&container->uids, &idmap_owned);
+    container->config.mount.tree_fd = mount_prepare(&config->mount, idmap_fd);
+    if (idmap_owned && idmap_fd >= 0)
+        close(idmap_fd);
+    profile_end(PROFILE_MOUNT_PREPARE);
+
+    // The user namespace is created by clone, unless the container needs the
+    // capabilities of barco to join namespaces or to mount its root
+    container->config.userns_cloned = !config->ns.join &&
+        container->config.mount.tree_fd >= 0;
+
+    // Initialize the container (calls clone3() or clone() internally).
+    log_debug("initializing container %s...", container->name);
+    profile_begin(PROFILE_CLONE);
+    err = container_init(container);
+    profile_end(PROFILE_CLONE);
+
+    // The container holds its own copy of its end of the socket pair and of
+    // the mount tree. Barco closes its copies, so that reads see EOF once the
+    // container execs or exits.
+    close(sockets[1]);
+    if (container->config.mount.tree_fd >= 0)
+        close(container->config.mount.tree_fd);
+    for (int i = 0; i < OUTPUT_STREAMS; i++) {
+        if (container->config.output_fds[i] >= 0)
+            close(container->config.output_fds[i]);
+        container->config.output_fds[i] = -1;
+    }
+    ns_close(container->config.ns_fds);
+    if (err)
+        return -1;
+
+    // The uids stay taken as long as the container runs, barco or not
+    user_range_own(&container->uids, container->pid);
+
+    // A container that creates its user namespace itself tells barco first
+    profile_begin(PROFILE_USERNS_MAPPINGS);
+    if (!container->config.userns_cloned && container_wait_unshare(container, &unshared))
+        return -1;
+
+    // Barco configures the user namespace for the container
+    log_debug("configuring user namespace...");
+    if (!unshared && user_namespace_prepare_mappings(container->pid, &container->uids)) {
+        log_error("failed to configure user namespace of %s", container->name);
+        return -1;
+    }
+    profile_end(PROFILE_USERNS_MAPPINGS);
+
+    // The container waits for its release, so its network is ready before
+    // it runs anything
+    if (config->net.mode != NET_MODE_NONE) {
+        log_debug("configuring network...");
+        profile_begin(PROFILE_NET);
+        if (net_setup(&config->net, container->pid))
+            return -1;
+        profile_end(PROFILE_NET);
     }
 
-    return container_pid;
+    // The namespaces are complete, the network included. They are pinned
+    // while the container waits, it may exit as soon as it is released.
+    if (config->ns.pin && ns_pin(config->ns.pin, container->pid)) {
+        log_error("failed to pin namespaces as %s", config->ns.pin);
+        return -1;
+    }
+
+    // A single message lets the container run, it does not wait for barco
+    // anymore
+    log_debug("releasing container %s...", container->name);
+    if (send(container->fd, &(int){0}, sizeof(int), MSG_NOSIGNAL) != sizeof(int)) {
+        log_error("failed to release container %s: %m", container->name);
+        if (config->ns.pin)
+            ns_unpin(config->ns.pin);
+        return -1;
+    }
+
+    // The container runs without it, only exec needs it
+    container->registered = !exec_register(container);
+
+    return 0;
+}
+
+void container_destroy(container *container) {
+    log_debug("freeing container %s...", container->name);
+
+    if (container->registered) {
+        exec_unregister(container);
+        container->registered = false;
+    }
+
+    log_debug("freeing stack...");
+    if (container->stack) {
+        munmap(container->stack, CONTAINER_STACK_SIZE + sysconf(_SC_PAGESIZE));
+        container->stack = NULL;
+    }
+
+    log_debug("freeing sockets...");
+    if (container->fd >= 0) {
+        close(container->fd);
+        container->fd = -1;
+    }
+    if (container->pidfd >= 0) {
+        close(container->pidfd);
+        container->pidfd = -1;
+    }
+
+    // A cgroup of the pool stays claimed until its fd is closed
+    if (container->cgroup) {
+        log_debug("freeing cgroups...");
+        cgroupsv2_free(container->cgroup_name);
+        container->cgroup = false;
+    }
+    if (container->cgroup_fd >= 0) {
+        close(container->cgroup_fd);
+        container->cgroup_fd = -1;
+    }
+
+    if (container->cpuset) {
+        cpuset_release(container->name);
+        container->cpuset = false;
+    }
+
+    output_free(&container->output);
+    user_range_free(&container->uids);
 }
 
-int container_wait(int container_pid) {
-    int container_status = 0;
+int container_launch(container *container, const char *msg, size_t len) {
+    log_debug("launching container %s...", container->name);
+    if (send(container->fd, msg, len, MSG_NOSIGNAL) != (ssize_t)len) {
+        log_error("failed to send launch message to %s: %m", container->name);
+        return -1;
+    }
+
+    return 0;
+}
 
-    log_debug("waiting for container_pid %d...", container_pid);
-    waitpid(container_pid, &container_status, 0);
-    log_debug("container_pid %d exited", container_pid);
+int container_launch_parse(char *msg, size_t len, char **argv, char **envp) {
+    uint32_t counts[2] = {0};
+    char **lists[2] = {argv, envp};
+    size_t offset = sizeof(counts);
 
-    return WEXITSTATUS(container_status);
+    if (len < sizeof(counts)) {
+        log_error("launch message too short");
+        return -1;
+    }
+    memcpy(counts, msg, sizeof(counts));
+
+    if (!counts[0] || counts[0] > CONTAINER_LAUNCH_ARGS_MAX ||
+        counts[1] > CONTAINER_LAUNCH_ARGS_MAX) {
+        log_error("invalid launch message (argc %u, envc %u)", counts[0], counts[1]);
+        return -1;
+    }
+
+    // Every string must be NUL terminated within the message
+    for (int list = 0; list < 2; list++) {
+        for (uint32_t i = 0; i < counts[list]; i++) {
+            char *end = offset < len ? memchr(msg + offset, '\0', len - offset) : NULL;
+
+            if (!end) {
+                log_error("truncated launch message");
+                return -1;
+            }
+            lists[list][i] = msg + offset;
+            offset = end - msg + 1;
+        }
+        lists[list][counts[list]] = NULL;
+    }
+
+    return 0;
 }
 
 void container_stop(int container_pid) {
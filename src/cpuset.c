@@ -0,0 +1,492 @@
+#define _GNU_SOURCE
+#include <linux/mempolicy.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "log.h"
+#include "cpuset.h"
+
+#define CPUSET_SYSFS_CPU    "/sys/devices/system/cpu"
+#define CPUSET_SYSFS_NODE   "/sys/devices/system/node"
+
+// Topology of the host, read once from sysfs
+static struct {
+    bool loaded;
+    cpuset_mask online;
+    // Highest online cpu + 1
+    unsigned int cpus_count;
+    // NUMA node of each cpu
+    int node[CPUSET_CPUS_MAX];
+    // First SMT sibling of each cpu, which identifies its core
+    int core[CPUSET_CPUS_MAX];
+    // Position of each cpu among its SMT siblings
+    int thread[CPUSET_CPUS_MAX];
+} T;
+
+// A container placed by a barco process. Slots of barco processes that
+// are gone are reclaimed by the next placement.
+struct cpuset_allocation {
+    pid_t pid;
+    bool exclusive;
+    char name[HOST_NAME_MAX + 1];
+    cpuset_mask cpus;
+};
+
+static bool cpuset_isset(const cpuset_mask *mask, unsigned int cpu) {
+    return (mask->bits[cpu / 64] >> (cpu % 64)) & 1;
+}
+
+static void cpuset_set(cpuset_mask *mask, unsigned int cpu) {
+    mask->bits[cpu / 64] |= 1ULL << (cpu % 64);
+}
+
+int cpuset_parse(const char *list, cpuset_mask *mask) {
+    const char *p = list;
+
+    memset(mask, 0, sizeof(*mask));
+    while (*p && *p != '\n') {
+        char *end = NULL;
+        unsigned long first = strtoul(p, &end, 10);
+        unsigned long last = first;
+
+        if (end == p)
+            return -1;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtoul(p, &end, 10);
+            if (end == p)
+                return -1;
+        }
+        if (first > last || last >= CPUSET_CPUS_MAX)
+            return -1;
+
+        for (unsigned long cpu = first; cpu <= last; cpu++)
+            cpuset_set(mask, cpu);
+
+        p = *end == ',' ? end + 1 : end;
+    }
+
+    return 0;
+}
+
+static int cpuset_format_bits(const uint64_t *bits, unsigned int count,
+                              char *list, size_t size) {
+    size_t len = 0;
+
+    list[0] = '\0';
+    for (unsigned int i = 0; i < count; i++) {
+        unsigned int last = i;
+        int written = 0;
+
+        if (!((bits[i / 64] >> (i % 64)) & 1))
+            continue;
+
+        while (last + 1 < count && ((bits[(last + 1) / 64] >> ((last + 1) % 64)) & 1))
+            last++;
+
+        if (last == i)
+            written = snprintf(list + len, size - len, "%s%u", len ? "," : "", i);
+        else
+            written = snprintf(list + len, size - len, "%s%u-%u", len ? "," : "", i, last);
+        if (written < 0 || (size_t)written >= size - len)
+            return -1;
+
+        len += written;
+        i = last;
+    }
+
+    return 0;
+}
+
+int cpuset_format(const cpuset_mask *mask, char *list, size_t size) {
+    return cpuset_format_bits(mask->bits, CPUSET_CPUS_MAX, list, size);
+}
+
+int cpuset_format_nodes(uint64_t nodes, char *list, size_t size) {
+    return cpuset_format_bits(&nodes, CPUSET_NODES_MAX, list, size);
+}
+
+static int cpuset_read(const char *path, char *buf, size_t size) {
+    ssize_t len = 0;
+    int fd = -1;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+        return -1;
+
+    len = read(fd, buf, size - 1);
+    close(fd);
+    if (len < 0)
+        return -1;
+    buf[len] = '\0';
+
+    return 0;
+}
+
+// Reads the online cpus, their SMT siblings and their NUMA nodes. Hosts
+// without NUMA (no node directory) are a single node 0.
+static int cpuset_topology(void) {
+    char path[PATH_MAX] = {0};
+    char list[CPUSET_LIST_SIZE] = {0};
+    cpuset_mask mask = {0};
+
+    if (T.loaded)
+        return 0;
+
+    log_debug("reading cpu topology...");
+    if (cpuset_read(CPUSET_SYSFS_CPU "/online", list, sizeof(list)) ||
+        cpuset_parse(list, &T.online)) {
+        log_error("failed to read online cpus: %m");
+        return -1;
+    }
+
+    for (unsigned int cpu = 0; cpu < CPUSET_CPUS_MAX; cpu++) {
+        if (!cpuset_isset(&T.online, cpu))
+            continue;
+
+        T.cpus_count = cpu + 1;
+        T.core[cpu] = cpu;
+        T.thread[cpu] = 0;
+
+        snprintf(path, sizeof(path), CPUSET_SYSFS_CPU "/cpu%u/topology/thread_siblings_list", cpu);
+        if (cpuset_read(path, list, sizeof(list)) || cpuset_parse(list, &mask))
+            continue;
+
+        for (unsigned int sibling = 0; sibling < cpu; sibling++) {
+            if (!cpuset_isset(&mask, sibling))
+                continue;
+            if (!T.thread[cpu])
+                T.core[cpu] = sibling;
+            T.thread[cpu]++;
+        }
+    }
+
+    for (int node = 0; node < CPUSET_NODES_MAX; node++) {
+        snprintf(path, sizeof(path), CPUSET_SYSFS_NODE "/node%d/cpulist", node);
+        if (cpuset_read(path, list, sizeof(list)) || cpuset_parse(list, &mask))
+            continue;
+
+        for (unsigned int cpu = 0; cpu < T.cpus_count; cpu++) {
+            if (cpuset_isset(&mask, cpu))
+                T.node[cpu] = node;
+        }
+    }
+
+    T.loaded = true;
+    return 0;
+}
+
+// Maps the allocations of the host, locked against the other barco processes
+// until cpuset_unlock. The lock is released by the kernel if barco dies.
+static struct cpuset_allocation *cpuset_lock(int *fd) {
+    size_t size = CPUSET_ALLOCATIONS_MAX * sizeof(struct cpuset_allocation);
+    struct cpuset_allocation *allocations = NULL;
+    struct stat st = {0};
+
+    if (mkdir(CPUSET_STATE_DIR, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) &&
+        errno != EEXIST) {
+        log_error("failed to create %s: %m", CPUSET_STATE_DIR);
+        return NULL;
+    }
+
+    if ((*fd = open(CPUSET_STATE_PATH, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR)) == -1 ||
+        flock(*fd, LOCK_EX) || fstat(*fd, &st) ||
+        ((size_t)st.st_size < size && ftruncate(*fd, size)) ||
+        (allocations = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                            *fd, 0)) == MAP_FAILED) {
+        log_error("failed to open %s: %m", CPUSET_STATE_PATH);
+        if (*fd >= 0)
+            close(*fd);
+        return NULL;
+    }
+
+    for (int i = 0; i < CPUSET_ALLOCATIONS_MAX; i++) {
+        if (allocations[i].pid && kill(allocations[i].pid, 0) && errno == ESRCH) {
+            log_debug("reclaiming cpus of %s", allocations[i].name);
+            memset(&allocations[i], 0, sizeof(allocations[i]));
+        }
+    }
+
+    return allocations;
+}
+
+static void cpuset_unlock(struct cpuset_allocation *allocations, int fd) {
+    munmap(allocations, CPUSET_ALLOCATIONS_MAX * sizeof(*allocations));
+    close(fd);
+}
+
+// Computes the number of containers on each cpu, -1 for the cpus of
+// exclusive containers
+static void cpuset_loads(const struct cpuset_allocation *allocations, int *loads) {
+    memset(loads, 0, CPUSET_CPUS_MAX * sizeof(*loads));
+    for (int i = 0; i < CPUSET_ALLOCATIONS_MAX; i++) {
+        if (!allocations[i].pid)
+            continue;
+
+        for (unsigned int cpu = 0; cpu < T.cpus_count; cpu++) {
+            if (!cpuset_isset(&allocations[i].cpus, cpu))
+                continue;
+            loads[cpu] = allocations[i].exclusive ? -1 : (loads[cpu] >= 0 ? loads[cpu] + 1 : -1);
+        }
+    }
+}
+
+// Takes whole free cores of node (any node if -1) until count cpus are
+// taken. Returns the number of cpus taken.
+static unsigned int cpuset_take_cores(const int *loads, int node,
+                                      unsigned int count, cpuset_mask *mask) {
+    unsigned int taken = 0;
+
+    memset(mask, 0, sizeof(*mask));
+    for (unsigned int core = 0; core < T.cpus_count && taken < count; core++) {
+        unsigned int siblings = 0;
+        bool idle = true;
+
+        if (!cpuset_isset(&T.online, core) || T.core[core] != (int)core ||
+            (node >= 0 && T.node[core] != node))
+            continue;
+
+        for (unsigned int cpu = core; cpu < T.cpus_count && idle; cpu++) {
+            if (cpuset_isset(&T.online, cpu) && T.core[cpu] == (int)core)
+                idle = loads[cpu] == 0;
+        }
+        if (!idle)
+            continue;
+
+        for (unsigned int cpu = core; cpu < T.cpus_count; cpu++) {
+            if (cpuset_isset(&T.online, cpu) && T.core[cpu] == (int)core) {
+                cpuset_set(mask, cpu);
+                siblings++;
+            }
+        }
+        taken += siblings;
+    }
+
+    return taken;
+}
+
+// Takes the least loaded cpus of node (any node if -1), using the first
+// thread of every core before their siblings. Returns the number of cpus
+// taken.
+static unsigned int cpuset_take_shared(const int *loads, int node,
+                                       unsigned int count, cpuset_mask *mask) {
+    unsigned int taken = 0;
+
+    memset(mask, 0, sizeof(*mask));
+    for (; taken < count; taken++) {
+        int best = -1;
+
+        for (unsigned int cpu = 0; cpu < T.cpus_count; cpu++) {
+            if (!cpuset_isset(&T.online, cpu) || cpuset_isset(mask, cpu) ||
+                loads[cpu] < 0 || (node >= 0 && T.node[cpu] != node))
+                continue;
+
+            if (best < 0 || loads[cpu] < loads[best] ||
+                (loads[cpu] == loads[best] && T.thread[cpu] < T.thread[best]))
+                best = cpu;
+        }
+        if (best < 0)
+            break;
+
+        cpuset_set(mask, best);
+    }
+
+    return taken;
+}
+
+// Exclusive containers go to the node with the fewest free cores that fit
+// them (keeping the large free areas for the large containers), shared ones
+// to the least loaded node that can hold them.
+static int cpuset_choose(const int *loads, const cpuset_request *request,
+                         cpuset_mask *mask) {
+    unsigned int best_taken = 0;
+    uint64_t best_load = 0;
+    int best = -1;
+
+    if (request->node >= 0) {
+        unsigned int taken = request->exclusive ?
+            cpuset_take_cores(loads, request->node, request->cpus, mask) :
+            cpuset_take_shared(loads, request->node, request->cpus, mask);
+
+        if (taken < request->cpus) {
+            log_error("not enough %scpus on node %d", request->exclusive ? "free " : "",
+                      request->node);
+            return -1;
+        }
+        return 0;
+    }
+
+    for (int node = 0; node < CPUSET_NODES_MAX; node++) {
+        unsigned int taken = 0;
+        uint64_t load = 0;
+
+        if (request->exclusive) {
+            taken = cpuset_take_cores(loads, node, UINT_MAX, mask);
+            if (taken >= request->cpus && (best < 0 || taken < best_taken)) {
+                best = node;
+                best_taken = taken;
+            }
+            continue;
+        }
+
+        taken = cpuset_take_shared(loads, node, UINT_MAX, mask);
+        for (unsigned int cpu = 0; cpu < T.cpus_count; cpu++) {
+            if (cpuset_isset(mask, cpu))
+                load += loads[cpu];
+        }
+        // Compares load / taken without dividing
+        if (taken >= request->cpus &&
+            (best < 0 || load * best_taken < best_load * taken)) {
+            best = node;
+            best_taken = taken;
+            best_load = load;
+        }
+    }
+
+    if (best < 0)
+        log_warn("no NUMA node can hold %u cpus, spreading over nodes", request->cpus);
+
+    if ((request->exclusive ?
+         cpuset_take_cores(loads, best, request->cpus, mask) :
+         cpuset_take_shared(loads, best, request->cpus, mask)) < request->cpus) {
+        log_error("not enough %scpus for %u cpus", request->exclusive ? "free " : "",
+                  request->cpus);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void cpuset_remove(struct cpuset_allocation *allocations, const char *name) {
+    pid_t pid = getpid();
+
+    for (int i = 0; i < CPUSET_ALLOCATIONS_MAX; i++) {
+        if (allocations[i].pid == pid && !strcmp(allocations[i].name, name))
+            memset(&allocations[i], 0, sizeof(allocations[i]));
+    }
+}
+
+int cpuset_place(const char *name, const cpuset_request *request,
+                 cpuset_placement *placement) {
+    struct cpuset_allocation *allocations = NULL;
+    struct cpuset_allocation *slot = NULL;
+    int loads[CPUSET_CPUS_MAX] = {0};
+    int result = -1;
+    int fd = -1;
+
+    if (cpuset_topology() || !(allocations = cpuset_lock(&fd)))
+        return -1;
+
+    cpuset_remove(allocations, name);
+    for (int i = 0; i < CPUSET_ALLOCATIONS_MAX && !slot; i++) {
+        if (!allocations[i].pid)
+            slot = &allocations[i];
+    }
+    if (!slot) {
+        log_error("too many containers placed on the host");
+        goto exit;
+    }
+
+    cpuset_loads(allocations, loads);
+    memset(placement, 0, sizeof(*placement));
+    if (cpuset_choose(loads, request, &placement->cpus))
+        goto exit;
+
+    for (unsigned int cpu = 0; cpu < T.cpus_count; cpu++) {
+        if (cpuset_isset(&placement->cpus, cpu))
+            placement->mems |= 1ULL << T.node[cpu];
+    }
+
+    slot->pid = getpid();
+    slot->exclusive = request->exclusive;
+    snprintf(slot->name, sizeof(slot->name), "%s", name);
+    slot->cpus = placement->cpus;
+    result = 0;
+
+exit:
+    cpuset_unlock(allocations, fd);
+    return result;
+}
+
+int cpuset_release(const char *name) {
+    struct cpuset_allocation *allocations = NULL;
+    int fd = -1;
+
+    log_debug("releasing cpus of %s...", name);
+    if (!(allocations = cpuset_lock(&fd)))
+        return -1;
+
+    cpuset_remove(allocations, name);
+    cpuset_unlock(allocations, fd);
+
+    return 0;
+}
+
+int cpuset_parse_mempolicy(const char *name, cpuset_mempolicy *mempolicy) {
+    static const struct {
+        const char *name;
+        cpuset_mempolicy mempolicy;
+    } mempolicies[] = {
+        {"bind", CPUSET_MEMPOLICY_BIND},
+        {"preferred", CPUSET_MEMPOLICY_PREFERRED},
+        {"interleave", CPUSET_MEMPOLICY_INTERLEAVE},
+        {"local", CPUSET_MEMPOLICY_LOCAL},
+    };
+
+    for (size_t i = 0; i < sizeof(mempolicies) / sizeof(*mempolicies); i++) {
+        if (!strcmp(name, mempolicies[i].name)) {
+            *mempolicy = mempolicies[i].mempolicy;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+// The memory policy is set in the container before seccomp, which blocks
+// set_mempolicy. It is inherited across execve.
+int cpuset_set_mempolicy(cpuset_mempolicy mempolicy, uint64_t mems) {
+    unsigned long nodemask[CPUSET_NODES_MAX / (8 * sizeof(unsigned long))] = {0};
+    int mode = MPOL_DEFAULT;
+
+    switch (mempolicy) {
+    case CPUSET_MEMPOLICY_NONE:
+        return 0;
+    case CPUSET_MEMPOLICY_BIND:
+        mode = MPOL_BIND;
+        break;
+    case CPUSET_MEMPOLICY_PREFERRED:
+        mode = MPOL_PREFERRED;
+        mems &= -mems;
+        break;
+    case CPUSET_MEMPOLICY_INTERLEAVE:
+        mode = MPOL_INTERLEAVE;
+        break;
+    case CPUSET_MEMPOLICY_LOCAL:
+        mode = MPOL_LOCAL;
+        mems = 0;
+        break;
+    }
+
+    for (int node = 0; node < CPUSET_NODES_MAX; node++) {
+        if ((mems >> node) & 1)
+            nodemask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+    }
+
+    log_debug("setting memory policy %d...", mode);
+    if (syscall(SYS_set_mempolicy, mode, mems ? nodemask : NULL,
+                mems ? CPUSET_NODES_MAX + 1 : 0)) {
+        log_error("failed to set memory policy: %m");
+        return -1;
+    }
+
+    return 0;
+}
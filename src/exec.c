@@ -0,0 +1,286 @@
+#define _GNU_SOURCE
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include "log.h"
+#include "user.h"
+#include "sec.h"
+#include "cgroupsv2.h"
+#include "exec.h"
+
+// Namespaces of the containers besides their user namespace. They belong to
+// the user namespace of the container, or to the one of barco when the
+// container joined pinned namespaces (see container_unshare).
+#define EXEC_NAMESPACES (CLONE_NEWNS | CLONE_NEWCGROUP | CLONE_NEWPID | \
+                         CLONE_NEWIPC | CLONE_NEWNET | CLONE_NEWUTS)
+
+// Namespaces joined one by one when setns does not take a pidfd (before Linux
+// 5.8), the user namespace last
+static const struct {
+    int type;
+    const char *name;
+} exec_namespaces[] = {
+    {CLONE_NEWCGROUP, "cgroup"},
+    {CLONE_NEWIPC, "ipc"},
+    {CLONE_NEWUTS, "uts"},
+    {CLONE_NEWNET, "net"},
+    {CLONE_NEWPID, "pid"},
+    {CLONE_NEWNS, "mnt"},
+    {CLONE_NEWUSER, "user"},
+};
+
+// State of a running container, one line of
+// "<pid> <uid> <cgroup> <seccomp> [<profile>]" where seccomp is "default",
+// "learn", "none" or "profile" followed by the absolute path of the profile
+typedef struct {
+    pid_t pid;
+    uid_t uid;
+    char cgroup[HOST_NAME_MAX + 1];
+    char seccomp[16];
+    char profile[PATH_MAX];
+} exec_state;
+
+static int exec_state_path(const char *name, char *path, size_t size) {
+    if (snprintf(path, size, "%s/%s.pid", EXEC_STATE_DIR, name) >= (int)size) {
+        log_error("state path of %s too long", name);
+        return -1;
+    }
+
+    return 0;
+}
+
+// The state is written to a temporary file and renamed, so that exec never
+// reads half of it. The profile is recorded by its absolute path, exec runs
+// from anywhere.
+int exec_register(const container *container) {
+    const container_config *config = &container->config;
+    char profile[PATH_MAX] = {0};
+    char path[PATH_MAX] = {0};
+    char tmp[PATH_MAX + 16] = {0};
+    int fd = -1;
+
+    if (exec_state_path(container->name, path, sizeof(path)))
+        return -1;
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid());
+
+    if (config->seccomp_profile && !config->seccomp_learn && !config->seccomp_disabled &&
+        !realpath(config->seccomp_profile, profile)) {
+        log_warn("failed to resolve %s: %m", config->seccomp_profile);
+        return -1;
+    }
+
+    log_debug("writing state %s...", path);
+    if ((mkdir(EXEC_STATE_DIR, 0755) && errno != EEXIST) ||
+        (fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) == -1 ||
+        dprintf(fd, "%d %u %s %s%s%s\n", container->pid, config->uid,
+                container->cgroup_name,
+                config->seccomp_learn ? "learn" : config->seccomp_disabled ? "none" :
+                profile[0] ? "profile" : "default",
+                profile[0] ? " " : "", profile) < 0 ||
+        close(fd) || rename(tmp, path)) {
+        log_warn("failed to write state %s: %m", path);
+        if (fd >= 0)
+            unlink(tmp);
+        return -1;
+    }
+
+    return 0;
+}
+
+void exec_unregister(const container *container) {
+    char path[PATH_MAX] = {0};
+
+    if (!exec_state_path(container->name, path, sizeof(path)) && unlink(path) &&
+        errno != ENOENT)
+        log_warn("failed to remove state %s: %m", path);
+}
+
+static int exec_read_state(const char *name, exec_state *state) {
+    char path[PATH_MAX] = {0};
+    char format[64] = {0};
+    FILE *file = NULL;
+    int count = 0;
+    bool profile = false;
+
+    if (exec_state_path(name, path, sizeof(path)))
+        return -1;
+
+    if (!(file = fopen(path, "re"))) {
+        log_error("container %s is not running: %m", name);
+        return -1;
+    }
+    snprintf(format, sizeof(format), "%%d %%u %%%zus %%%zus", sizeof(state->cgroup) - 1,
+             sizeof(state->seccomp) - 1);
+    count = fscanf(file, format, &state->pid, &state->uid, state->cgroup, state->seccomp);
+    if (count == 4 && (profile = !strcmp(state->seccomp, "profile"))) {
+        snprintf(format, sizeof(format), " %%%zu[^\n]", sizeof(state->profile) - 1);
+        count += fscanf(file, format, state->profile);
+    }
+    fclose(file);
+
+    if (count != (profile ? 5 : 4) || state->pid <= 0 ||
+        (!profile && strcmp(state->seccomp, "default") && strcmp(state->seccomp, "learn") &&
+         strcmp(state->seccomp, "none"))) {
+        log_error("invalid state %s", path);
+        return -1;
+    }
+
+    return 0;
+}
+
+// The pid of the state may have been recycled if barco did not remove the
+// state (e.g. killed), the process must be in the cgroup of the container
+static int exec_check_cgroup(pid_t pid, const char *cgroup) {
+    char path[PATH_MAX] = {0};
+    char line[PATH_MAX + 8] = {0};
+    char expected[PATH_MAX + 8] = {0};
+    FILE *file = NULL;
+    bool found = false;
+
+    snprintf(path, sizeof(path), "/proc/%d/cgroup", pid);
+    snprintf(expected, sizeof(expected), "0::/%s\n", cgroup);
+    if (!(file = fopen(path, "re"))) {
+        log_error("failed to open %s: %m", path);
+        return -1;
+    }
+    while (!found && fgets(line, sizeof(line), file))
+        found = !strcmp(line, expected);
+    fclose(file);
+
+    if (!found) {
+        log_error("process %d is not in cgroup %s", pid, cgroup);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Joins the namespaces of the container. The user namespace comes last:
+// barco has the capabilities of its own user namespace over all of them,
+// which it loses once in the user namespace of the container. setns with a
+// pidfd joins several namespaces at once.
+static int exec_join(int pidfd, pid_t pid) {
+    char path[PATH_MAX] = {0};
+    int fd = -1;
+
+    if (pidfd >= 0) {
+        if (!setns(pidfd, EXEC_NAMESPACES) && !setns(pidfd, CLONE_NEWUSER))
+            return 0;
+        if (errno != EINVAL) {
+            log_error("failed to join namespaces of %d: %m", pid);
+            return -1;
+        }
+        log_debug("setns does not take pidfds, joining namespaces one by one...");
+    }
+
+    for (size_t i = 0; i < sizeof(exec_namespaces) / sizeof(*exec_namespaces); i++) {
+        snprintf(path, sizeof(path), "/proc/%d/ns/%s", pid, exec_namespaces[i].name);
+        if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1 ||
+            setns(fd, exec_namespaces[i].type)) {
+            log_error("failed to join %s: %m", path);
+            if (fd >= 0)
+                close(fd);
+            return -1;
+        }
+        close(fd);
+    }
+
+    return 0;
+}
+
+// Same steps as container_start once the namespaces exist. The filter of a
+// container in learn mode reports to its barco, the command runs unfiltered
+// as with --no-seccomp.
+static void exec_child(const exec_config *config, uid_t uid, bool seccomp) {
+    if (user_namespace_set_user(uid) || sec_set_caps() || (seccomp && sec_set_seccomp()))
+        _exit(127);
+
+    log_debug("executing command '%s' in container %s...", config->argv[0], config->name);
+    execve(config->argv[0], config->argv, NULL);
+    log_error("failed to execve '%s': %m", config->argv[0]);
+    _exit(127);
+}
+
+int exec_run(const exec_config *config) {
+    exec_state state = {0};
+    char cgroup_dir[PATH_MAX] = {0};
+    bool filter = true;
+    int cgroup_fd = -1;
+    int pidfd = -1;
+    int status = 0;
+    int result = -1;
+    pid_t pid = -1;
+    uid_t uid = 0;
+
+    if (exec_read_state(config->name, &state))
+        return -1;
+    pid = state.pid;
+    uid = config->uid != (uid_t)-1 ? config->uid : state.uid;
+
+    // The filter is the one of the container, most likely cached already
+    if (!strcmp(state.seccomp, "learn")) {
+        log_warn("container %s learns its syscalls, the ones of the command are not filtered "
+                 "nor learned", config->name);
+        filter = false;
+    } else if (!strcmp(state.seccomp, "none")) {
+        filter = false;
+    } else if (sec_seccomp_prepare(state.profile[0] ? state.profile : NULL)) {
+        log_error("failed to prepare seccomp filter");
+        return -1;
+    }
+
+    // The pidfd pins the process, the check below cannot race with a pid
+    // being recycled
+    if ((pidfd = syscall(SYS_pidfd_open, pid, 0)) == -1 && errno != ENOSYS) {
+        log_error("container %s is not running: %m", config->name);
+        return -1;
+    }
+    if (exec_check_cgroup(pid, state.cgroup))
+        goto exit;
+
+    // barco joins the cgroup first, while its path is the one of the host,
+    // the command inherits it
+    log_debug("joining cgroup %s...", state.cgroup);
+    snprintf(cgroup_dir, sizeof(cgroup_dir), "/sys/fs/cgroup/%s", state.cgroup);
+    if ((cgroup_fd = open(cgroup_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1 ||
+        cgroupsv2_attach(cgroup_fd, getpid())) {
+        log_error("failed to join cgroup %s: %m", state.cgroup);
+        goto exit;
+    }
+
+    // Joining the mount namespace also moves to the root of the container
+    log_debug("joining namespaces of container %s...", config->name);
+    if (exec_join(pidfd, pid))
+        goto exit;
+
+    // Only the children of barco are in the pid namespace
+    if ((pid = fork()) == -1) {
+        log_error("failed to fork: %m");
+        goto exit;
+    }
+    if (!pid)
+        exec_child(config, uid, filter);
+
+    if (waitpid(pid, &status, 0) == -1) {
+        log_error("failed to wait for command: %m");
+        goto exit;
+    }
+    result = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    log_debug("command exited with %d", result);
+
+exit:
+    if (cgroup_fd >= 0)
+        close(cgroup_fd);
+    if (pidfd >= 0)
+        close(pidfd);
+    return result;
+}
@@ -0,0 +1,378 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "log.h"
+#include "json.h"
+
+// Recursive descent parser state
+struct json_parser {
+    const char *p;
+    const char *end;
+    int line;
+};
+
+static int json_parse_value(struct json_parser *parser, json_value *value,
+                            int depth);
+
+static void json_skip_space(struct json_parser *parser) {
+    while (parser->p < parser->end) {
+        if (*parser->p == '\n')
+            parser->line++;
+        else if (*parser->p != ' ' && *parser->p != '\t' && *parser->p != '\r')
+            break;
+        parser->p++;
+    }
+}
+
+static int json_error(struct json_parser *parser, const char *what) {
+    log_error("invalid JSON at line %d: %s", parser->line, what);
+    return -1;
+}
+
+// Appends the UTF-8 encoding of a code point
+static size_t json_utf8(char *out, unsigned int cp) {
+    if (cp < 0x80) {
+        out[0] = cp;
+        return 1;
+    }
+    if (cp < 0x800) {
+        out[0] = 0xc0 | (cp >> 6);
+        out[1] = 0x80 | (cp & 0x3f);
+        return 2;
+    }
+    if (cp < 0x10000) {
+        out[0] = 0xe0 | (cp >> 12);
+        out[1] = 0x80 | ((cp >> 6) & 0x3f);
+        out[2] = 0x80 | (cp & 0x3f);
+        return 3;
+    }
+    out[0] = 0xf0 | (cp >> 18);
+    out[1] = 0x80 | ((cp >> 12) & 0x3f);
+    out[2] = 0x80 | ((cp >> 6) & 0x3f);
+    out[3] = 0x80 | (cp & 0x3f);
+    return 4;
+}
+
+static int json_hex4(struct json_parser *parser, unsigned int *cp) {
+    char hex[5] = {0};
+
+    if (parser->end - parser->p < 4)
+        return json_error(parser, "truncated \\u escape");
+
+    // strtoul alone would take signs, spaces and 0x
+    memcpy(hex, parser->p, 4);
+    for (int i = 0; i < 4; i++) {
+        if (!isxdigit((unsigned char)hex[i]))
+            return json_error(parser, "invalid \\u escape");
+    }
+    *cp = strtoul(hex, NULL, 16);
+    parser->p += 4;
+
+    return 0;
+}
+
+// Parses a string, the opening quote being the current character. The
+// decoded string is never longer than its escaped form.
+static int json_parse_string(struct json_parser *parser, char **out) {
+    const char *start = ++parser->p;
+    char *string = NULL;
+    size_t len = 0;
+
+    while (parser->p < parser->end && *parser->p != '"') {
+        if (*parser->p == '\\')
+            parser->p++;
+        parser->p++;
+    }
+    if (parser->p >= parser->end)
+        return json_error(parser, "unterminated string");
+
+    if (!(string = malloc(parser->p - start + 1))) {
+        log_error("failed to allocate JSON string: %m");
+        return -1;
+    }
+
+    for (parser->p = start; *parser->p != '"';) {
+        char c = *parser->p++;
+        unsigned int cp = 0;
+
+        if (c != '\\') {
+            string[len++] = c;
+            continue;
+        }
+
+        switch ((c = *parser->p++)) {
+        case '"': case '\\': case '/': string[len++] = c; break;
+        case 'b': string[len++] = '\b'; break;
+        case 'f': string[len++] = '\f'; break;
+        case 'n': string[len++] = '\n'; break;
+        case 'r': string[len++] = '\r'; break;
+        case 't': string[len++] = '\t'; break;
+        case 'u':
+            if (json_hex4(parser, &cp)) {
+                free(string);
+                return -1;
+            }
+            // A surrogate pair takes 12 escaped characters for 4 bytes
+            if (cp >= 0xd800 && cp < 0xdc00 && parser->end - parser->p >= 6 &&
+                parser->p[0] == '\\' && parser->p[1] == 'u') {
+                unsigned int low = 0;
+
+                parser->p += 2;
+                if (json_hex4(parser, &low)) {
+                    free(string);
+                    return -1;
+                }
+                if (low < 0xdc00 || low >= 0xe000) {
+                    free(string);
+                    return json_error(parser, "invalid surrogate pair");
+                }
+                cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+            }
+            len += json_utf8(string + len, cp);
+            break;
+        default:
+            free(string);
+            return json_error(parser, "invalid escape");
+        }
+    }
+    parser->p++;
+    string[len] = '\0';
+    *out = string;
+
+    return 0;
+}
+
+static int json_parse_number(struct json_parser *parser, json_value *value) {
+    const char *start = parser->p;
+
+    while (parser->p < parser->end && strchr("+-0123456789.eE", *parser->p))
+        parser->p++;
+
+    value->type = JSON_NUMBER;
+    if (!(value->string = strndup(start, parser->p - start))) {
+        log_error("failed to allocate JSON number: %m");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int json_parse_literal(struct json_parser *parser, json_value *value) {
+    static const struct {
+        const char *text;
+        json_type type;
+        bool boolean;
+    } literals[] = {
+        {"true", JSON_BOOL, true},
+        {"false", JSON_BOOL, false},
+        {"null", JSON_NULL, false},
+    };
+
+    for (size_t i = 0; i < sizeof(literals) / sizeof(*literals); i++) {
+        size_t len = strlen(literals[i].text);
+
+        if ((size_t)(parser->end - parser->p) >= len &&
+            !memcmp(parser->p, literals[i].text, len)) {
+            parser->p += len;
+            value->type = literals[i].type;
+            value->boolean = literals[i].boolean;
+            return 0;
+        }
+    }
+
+    return json_error(parser, "unexpected character");
+}
+
+// Parses the items of an array or the members of an object
+static int json_parse_items(struct json_parser *parser, json_value *value,
+                            int depth) {
+    bool object = value->type == JSON_OBJECT;
+    char close = object ? '}' : ']';
+
+    parser->p++;
+    json_skip_space(parser);
+    if (parser->p < parser->end && *parser->p == close) {
+        parser->p++;
+        return 0;
+    }
+
+    for (;;) {
+        json_value *items = NULL;
+        json_value *item = NULL;
+
+        if (!(items = realloc(value->items, (value->count + 1) * sizeof(*items)))) {
+            log_error("failed to allocate JSON value: %m");
+            return -1;
+        }
+        value->items = items;
+        item = &items[value->count++];
+        memset(item, 0, sizeof(*item));
+
+        json_skip_space(parser);
+        if (object) {
+            if (parser->p >= parser->end || *parser->p != '"')
+                return json_error(parser, "expected member name");
+            if (json_parse_string(parser, &item->key))
+                return -1;
+
+            json_skip_space(parser);
+            if (parser->p >= parser->end || *parser->p != ':')
+                return json_error(parser, "expected ':'");
+            parser->p++;
+        }
+
+        if (json_parse_value(parser, item, depth + 1))
+            return -1;
+
+        json_skip_space(parser);
+        if (parser->p < parser->end && *parser->p == ',') {
+            parser->p++;
+            continue;
+        }
+        if (parser->p < parser->end && *parser->p == close) {
+            parser->p++;
+            return 0;
+        }
+
+        return json_error(parser, object ? "expected ',' or '}'" : "expected ',' or ']'");
+    }
+}
+
+// depth is the number of arrays and objects around the value
+static int json_parse_value(struct json_parser *parser, json_value *value,
+                            int depth) {
+    json_skip_space(parser);
+    if (parser->p >= parser->end)
+        return json_error(parser, "unexpected end");
+
+    if ((*parser->p == '{' || *parser->p == '[') && depth >= JSON_DEPTH_MAX)
+        return json_error(parser, "too deeply nested");
+
+    switch (*parser->p) {
+    case '{':
+        value->type = JSON_OBJECT;
+        return json_parse_items(parser, value, depth);
+    case '[':
+        value->type = JSON_ARRAY;
+        return json_parse_items(parser, value, depth);
+    case '"':
+        value->type = JSON_STRING;
+        return json_parse_string(parser, &value->string);
+    case '-': case '0': case '1': case '2': case '3': case '4':
+    case '5': case '6': case '7': case '8': case '9':
+        return json_parse_number(parser, value);
+    default:
+        return json_parse_literal(parser, value);
+    }
+}
+
+json_value *json_parse(const char *text, size_t len) {
+    struct json_parser parser = {.p = text, .end = text + len, .line = 1};
+    json_value *value = calloc(1, sizeof(*value));
+
+    if (!value) {
+        log_error("failed to allocate JSON value: %m");
+        return NULL;
+    }
+
+    if (json_parse_value(&parser, value, 0)) {
+        json_free(value);
+        return NULL;
+    }
+
+    json_skip_space(&parser);
+    if (parser.p != parser.end) {
+        json_error(&parser, "trailing characters");
+        json_free(value);
+        return NULL;
+    }
+
+    return value;
+}
+
+json_value *json_load(const char *path) {
+    json_value *value = NULL;
+    struct stat st = {0};
+    char *text = NULL;
+    int fd = -1;
+
+    log_debug("loading %s...", path);
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1 || fstat(fd, &st)) {
+        log_error("failed to open %s: %m", path);
+        goto exit;
+    }
+
+    if (!(text = malloc(st.st_size + 1))) {
+        log_error("failed to allocate %s: %m", path);
+        goto exit;
+    }
+
+    if (read(fd, text, st.st_size) != st.st_size) {
+        log_error("failed to read %s: %m", path);
+        goto exit;
+    }
+
+    if (!(value = json_parse(text, st.st_size)))
+        log_error("failed to parse %s", path);
+
+exit:
+    if (fd >= 0)
+        close(fd);
+    free(text);
+    return value;
+}
+
+static void json_free_items(json_value *value) {
+    for (size_t i = 0; i < value->count; i++)
+        json_free_items(&value->items[i]);
+
+    free(value->items);
+    free(value->key);
+    free(value->string);
+}
+
+void json_free(json_value *value) {
+    if (!value)
+        return;
+
+    json_free_items(value);
+    free(value);
+}
+
+const json_value *json_get(const json_value *object, const char *key) {
+    if (!object || object->type != JSON_OBJECT)
+        return NULL;
+
+    for (size_t i = 0; i < object->count; i++) {
+        if (!strcmp(object->items[i].key, key))
+            return &object->items[i];
+    }
+
+    return NULL;
+}
+
+const char *json_get_string(const json_value *object, const char *key) {
+    const json_value *value = json_get(object, key);
+
+    return value && value->type == JSON_STRING ? value->string : NULL;
+}
+
+int json_uint64(const json_value *value, uint64_t *out) {
+    char *end = NULL;
+
+    if (!value || value->type != JSON_NUMBER || value->string[0] == '-')
+        return -1;
+
+    errno = 0;
+    *out = strtoull(value->string, &end, 10);
+    if (errno || *end)
+        return -1;
+
+    return 0;
+}
@@ -2,8 +2,6 @@
 #include <libgen.h>
 #include <stdlib.h>
 #include <unistd.h>
-#include <sys/socket.h>
-#include <fcntl.h>
 #include <string.h>
 
 #include <argtable3.h>
@@ -11,7 +9,19 @@
 #include "version.h"
 #include "log.h"
 #include "container.h"
-#include "cgroupsv2.h"
+#include "profile.h"
+#include "pool.h"
+#include "sec.h"
+#include "sec_learn.h"
+#include "stats.h"
+#include "memwatch.h"
+#include "supervisor.h"
+#include "monitor.h"
+#include "net.h"
+#include "output.h"
+#include "store.h"
+#include "exec.h"
+#include "ns.h"
 #include "user.h"
 
 enum {
@@ -23,33 +33,215 @@ enum {
 struct arg_lit *help, *version;
 struct arg_int *uid;
 struct arg_str *mnt;
+struct arg_str *layer;
+struct arg_str *image;
+struct arg_str *ref;
+struct arg_str *store;
+struct arg_str *import;
+struct arg_str *tar;
+struct arg_str *upper;
+struct arg_str *work;
 struct arg_str *cmd;
 struct arg_str *arg;
+struct arg_str *host;
 struct arg_lit *vrb;
+struct arg_lit *prof;
+struct arg_lit *log_async;
+struct arg_int *pool_size;
+struct arg_int *pool_refill;
+struct arg_str *pool_sock;
+struct arg_str *scmp_profile;
+struct arg_str *scmp_learn;
+struct arg_lit *scmp_off;
+struct arg_int *cpus;
+struct arg_lit *cpus_excl;
+struct arg_int *numa_node;
+struct arg_str *mempolicy;
+struct arg_str *stats_sock;
+struct arg_str *stats_fmt;
+struct arg_int *stats_interval;
+struct arg_str *io_max;
+struct arg_str *io_weight;
+struct arg_str *io_latency;
+struct arg_str *mem_max;
+struct arg_str *mem_high;
+struct arg_str *mem_swap;
+struct arg_str *mem_zswap;
+struct arg_lit *mem_oom_group;
+struct arg_lit *mem_events;
+struct arg_str *mem_action;
+struct arg_str *manifest;
+struct arg_int *workers;
+struct arg_int *timeout;
+struct arg_int *stop_grace;
+struct arg_int *cgroup_pool;
+struct arg_str *net;
+struct arg_str *net_bridge;
+struct arg_str *net_parent;
+struct arg_str *net_address;
+struct arg_str *net_gateway;
+struct arg_int *net_mtu;
+struct arg_str *net_rate;
+struct arg_str *output_dir;
+struct arg_str *output_max_size;
+struct arg_int *output_max_age;
+struct arg_int *output_keep;
+struct arg_lit *output_framed;
+struct arg_lit *output_echo;
+struct arg_str *ns_pin_name;
+struct arg_str *ns_join_name;
+struct arg_str *ns_unpin_name;
+struct arg_str *uid_pool;
+struct arg_int *uid_extents;
 struct arg_end *end;
 
+// barco exec: runs a command in a running container, joining its namespaces
+// and cgroup instead of creating a new container
+static int main_exec(int argc, char **argv, const char *progname) {
+    struct arg_lit *exec_help = arg_litn(NULL, "help", 0, 1, "display this help and exit");
+    struct arg_str *exec_name = arg_strn("n", "hostname", "<s>", 1, 1, "name of the running container");
+    struct arg_int *exec_uid = arg_intn("u", "uid", "<n>", 0, 1, "uid and gid of the command (default: the ones of the container)");
+    struct arg_lit *exec_vrb = arg_litn("v", "verbosity", 0, 1, "verbose output");
+    struct arg_str *exec_cmd = arg_strn(NULL, NULL, "<cmd>", 1, CONTAINER_LAUNCH_ARGS_MAX, "command to run and its arguments, after --");
+    struct arg_end *exec_end = arg_end(ARGTABLE_ARG_MAX);
+    void *argtable[] = {exec_help, exec_name, exec_uid, exec_vrb, exec_cmd, exec_end};
+    char *cmd_argv[CONTAINER_LAUNCH_ARGS_MAX + 1] = {0};
+    exec_config config = {.uid = (uid_t)-1, .argv = cmd_argv};
+    int exitcode = 1;
+    int nerrors = arg_parse(argc, argv, argtable);
+
+    if (exec_help->count > 0) {
+        printf("Usage: %s exec", progname);
+        arg_print_syntax(stdout, argtable, "\n");
+        arg_print_glossary(stdout, argtable, "  %-25s %s\n");
+        exitcode = 0;
+        goto exit;
+    }
+
+    if (nerrors > 0) {
+        arg_print_errors(stdout, exec_end, progname);
+        printf("Try '%s exec --help' for more information.\n", progname);
+        goto exit;
+    }
+
+    log_set_level(exec_vrb->count > 0 ? LOG_TRACE : LOG_INFO);
+
+    config.name = exec_name->sval[0];
+    if (exec_uid->count > 0)
+        config.uid = exec_uid->ival[0];
+    for (int i = 0; i < exec_cmd->count; i++)
+        cmd_argv[i] = (char *)exec_cmd->sval[i];
+
+    exitcode = exec_run(&config);
+    if (exitcode < 0) {
+        log_fatal("failed to run command in container %s", config.name);
+        exitcode = 1;
+    }
+
+exit:
+    arg_freetable(argtable, sizeof(argtable) / sizeof(argtable[0]));
+    return exitcode;
+}
+
 int main(int argc, char **argv) {
-    // used for container stack
-    char *stack = NULL;
     // used for container config
     container_config config = {0};
-    // used for container pid
-    int container_pid = 0;
-    // socket pair used for communication between barco and container
-    int sockets[2] = {-1, -1};
+    // used for the container (pid, socket, stack, cgroups)
+    container container = {.pid = -1, .pidfd = -1, .fd = -1, .cgroup_fd = -1,
+                           .output = {.fd = -1, .pipes = {-1, -1}}};
+    // used to export the metrics of the container
+    stats_exporter stats = {.listen_fd = -1, .wake_fd = -1};
+    stats_format format = STATS_FORMAT_PROMETHEUS;
+    // used to report the memory events of the container
+    memwatch watch = {0};
+    // used to supervise the containers until they exit
+    monitor mon = {.epoll_fd = -1, .signal_fd = -1};
+    int status = 0;
+    // used to stop the container, what is left of it after learning syscalls
+    unsigned int timeout_ms = 0;
+    // used for the cgroup settings given on the command line
+    static cgroupsv2_config cgroups = {0};
+    // used for the layers of the image of --ref
+    static store_layers layers = {0};
+    // used for the host uids of the containers
+    user_pool_config uids = {.extents = 1};
+    // used for the logs of the output of the containers
+    static output_config output = {.keep = OUTPUT_KEEP};
+    // barco only imports an image or unpins namespaces, no container is run
+    bool import_only = false;
     int exitcode = 0;
     int nerrors = 0;
     const char *progname = basename(argv[0]);
 
+    if (argc > 1 && !strcmp(argv[1], "exec"))
+        return main_exec(argc - 1, argv + 1, progname);
+
     // the global arg_xxx structs are initialised within the argtable
     void *argtable[] = {
         help    = arg_litn(NULL, "help", 0, 1, "display this help and exit"),
         version = arg_litn(NULL, "version", 0, 1, "display version info and exit"),
-        uid     = arg_intn("u", "uid", "<n>", 1, 1, "uid and gid of the user in the container"),
-        mnt     = arg_strn("m", "mnt", "<s>", 1, 1, "directory to mount as root in the container"),
-        cmd     = arg_strn("c", "cmd", "<s>", 1, 1, "command to run in the container"),
+        uid     = arg_intn("u", "uid", "<n>", 0, 1, "uid and gid of the user in the container (required to run a container)"),
+        mnt     = arg_strn("m", "mnt", "<s>", 0, 1, "directory to mount as root in the container"),
+        layer   = arg_strn("l", "layer", "<s>", 0, MOUNT_LAYERS_MAX, "read-only layer of the root (repeatable, bottom first) instead of --mnt"),
+        image   = arg_strn("i", "image", "<file>", 0, 1, "EROFS or SquashFS image file to mount read-only as root instead of --mnt"),
+        ref     = arg_strn("r", "ref", "<s>", 0, 1, "image of the store to use as root instead of --mnt (see --import)"),
+        store   = arg_strn(NULL, "store", "<dir>", 0, 1, "directory of the image store (default: " STORE_ROOT ")"),
+        import  = arg_strn(NULL, "import", "<s>", 0, 1, "import the layers of --tar into the store as the image <s>"),
+        tar     = arg_strn(NULL, "tar", "<file>", 0, MOUNT_LAYERS_MAX, "layer of --import, a tar file, plain or compressed (repeatable, bottom first)"),
+        upper   = arg_strn(NULL, "upper", "<s>", 0, 1, "writable overlayfs upper directory for --layer"),
+        work    = arg_strn(NULL, "work", "<s>", 0, 1, "overlayfs work directory for --layer (same file system as --upper)"),
+        cmd     = arg_strn("c", "cmd", "<s>", 0, 1, "command to run in the container (required without --pool)"),
         arg     = arg_strn("a", "arg", "<s>", 0, 1, "argument to pass to the command"),
+        host    = arg_strn("n", "hostname", "<s>", 0, 1, "hostname and cgroup name of the container (default: barcontainer)"),
         vrb     = arg_litn("v", "verbosity", 0, 1, "verbose output"),
+        prof    = arg_litn(NULL, "profile-startup", 0, 1, "print a JSON line with the duration of each startup phase"),
+        log_async = arg_litn(NULL, "log-async", 0, 1, "write the logs from a background thread"),
+        pool_size   = arg_intn(NULL, "pool", "<n>", 0, 1, "keep <n> containers parked and launch them on request"),
+        pool_refill = arg_intn(NULL, "pool-refill", "<n>", 0, 1, "park at most <n> containers per second (default: no limit)"),
+        pool_sock   = arg_strn(NULL, "pool-socket", "<s>", 0, 1, "unix socket receiving the launch requests of the pool"),
+        scmp_profile = arg_strn(NULL, "seccomp-profile", "<file>", 0, 1, "Docker/OCI JSON seccomp profile (default: built-in deny list)"),
+        scmp_learn   = arg_strn(NULL, "seccomp-learn", "<file>", 0, 1, "run without seccomp filtering and write the syscalls of the container as a profile"),
+        scmp_off     = arg_litn(NULL, "no-seccomp", 0, 1, "run without seccomp filter, e.g. to measure its cost"),
+        cpus         = arg_intn(NULL, "cpus", "<n>", 0, 1, "place the container on <n> cpus of a single NUMA node when possible"),
+        cpus_excl    = arg_litn(NULL, "cpus-exclusive", 0, 1, "do not share the cpus (whole cores) of --cpus with other containers"),
+        numa_node    = arg_intn(NULL, "numa-node", "<n>", 0, 1, "NUMA node of the cpus of --cpus (default: best fit)"),
+        mempolicy    = arg_strn(NULL, "mempolicy", "<s>", 0, 1, "memory policy on the nodes of --cpus: bind, preferred, interleave or local"),
+        stats_sock     = arg_strn(NULL, "stats", "<s>", 0, 1, "unix socket serving the cgroup metrics of the container"),
+        stats_fmt      = arg_strn(NULL, "stats-format", "<s>", 0, 1, "format of --stats: prometheus (default) or json"),
+        stats_interval = arg_intn(NULL, "stats-interval", "<ms>", 0, 1, "sampling interval of --stats (default: 1000)"),
+        io_max     = arg_strn(NULL, "io-max", "<s>", 0, CGROUPS_IO_MAX, "\"<path> rbps=<n> wbps=<n> riops=<n> wiops=<n>\" limits of the disk of <path> (repeatable)"),
+        io_weight  = arg_strn(NULL, "io-weight", "<s>", 0, CGROUPS_IO_MAX, "\"<n>\" default or \"<path> <n>\" I/O weight of the disk of <path> (repeatable)"),
+        io_latency = arg_strn(NULL, "io-latency", "<s>", 0, CGROUPS_IO_MAX, "\"<path> <us>\" I/O latency target of the disk of <path> (repeatable)"),
+        mem_max       = arg_strn(NULL, "memory-max", "<s>", 0, 1, "memory.max of the container, killed above it (default: " CGROUPS_MEMORY_MAX ")"),
+        mem_high      = arg_strn(NULL, "memory-high", "<s>", 0, 1, "memory.high of the container, throttled above it"),
+        mem_swap      = arg_strn(NULL, "memory-swap-max", "<s>", 0, 1, "memory.swap.max of the container"),
+        mem_zswap     = arg_strn(NULL, "memory-zswap-max", "<s>", 0, 1, "memory.zswap.max of the container"),
+        mem_oom_group = arg_litn(NULL, "memory-oom-group", 0, 1, "kill the whole container on OOM instead of one of its processes"),
+        mem_events    = arg_litn(NULL, "memory-events", 0, 1, "report the high, max, oom and oom_kill events of the container"),
+        mem_action    = arg_strn(NULL, "memory-action", "<cmd>", 0, 1, "run <cmd> with sh -c on each memory event (implies --memory-events)"),
+        manifest      = arg_strn(NULL, "manifest", "<file>", 0, 1, "run the containers of a JSON manifest, the options are their defaults"),
+        workers       = arg_intn(NULL, "workers", "<n>", 0, 1, "threads creating the containers of --manifest or extracting the layers of --import (default: number of cpus)"),
+        timeout       = arg_intn(NULL, "timeout", "<ms>", 0, 1, "stop the containers after <ms> (default: no timeout)"),
+        stop_grace    = arg_intn(NULL, "stop-grace", "<ms>", 0, 1, "delay between SIGTERM and SIGKILL when stopping a container (default: 10000)"),
+        cgroup_pool   = arg_intn(NULL, "cgroup-pool", "<n>", 0, 1, "keep <n> idle cgroups with the settings of the containers, recycled between them"),
+        net           = arg_strn(NULL, "net", "<s>", 0, 1, "network of the container: none (default), loopback, veth, macvlan or ipvlan"),
+        net_bridge    = arg_strn(NULL, "net-bridge", "<s>", 0, 1, "bridge of the host end of --net veth"),
+        net_parent    = arg_strn(NULL, "net-parent", "<s>", 0, 1, "host interface of --net macvlan and ipvlan"),
+        net_address   = arg_strn(NULL, "net-address", "<s>", 0, 1, "address of the container with its prefix, e.g. 10.0.0.2/24"),
+        net_gateway   = arg_strn(NULL, "net-gateway", "<s>", 0, 1, "default route of the container"),
+        net_mtu       = arg_intn(NULL, "net-mtu", "<n>", 0, 1, "MTU of the interface of the container"),
+        net_rate      = arg_strn(NULL, "net-rate", "<s>", 0, 1, "rate limit of the container in bytes per second, k, m or g suffix (both ways with veth)"),
+        output_dir      = arg_strn(NULL, "output-dir", "<dir>", 0, 1, "write the stdout and stderr of the containers to <dir>/<name>.log"),
+        output_max_size = arg_strn(NULL, "output-max-size", "<s>", 0, 1, "rotate the logs above <s> bytes, k, m or g suffix (default: no limit)"),
+        output_max_age  = arg_intn(NULL, "output-max-age", "<s>", 0, 1, "rotate the logs every <s> seconds (default: no limit)"),
+        output_keep     = arg_intn(NULL, "output-keep", "<n>", 0, 1, "number of rotated logs kept (default: 5)"),
+        output_framed   = arg_litn(NULL, "output-framed", 0, 1, "precede each chunk of output with a line '<time> <stream> <length>'"),
+        output_echo     = arg_litn(NULL, "output-echo", 0, 1, "also pass the output to stdout and stderr when they are pipes"),
+        ns_pin_name     = arg_strn(NULL, "ns-pin", "<s>", 0, 1, "keep the net, ipc and uts namespaces of the container as <s>, after it exits too"),
+        ns_join_name    = arg_strn(NULL, "ns-join", "<s>", 0, 1, "join the namespaces pinned as <s> instead of creating net, ipc and uts ones"),
+        ns_unpin_name   = arg_strn(NULL, "ns-unpin", "<s>", 0, 1, "release the namespaces pinned as <s>"),
+        uid_pool        = arg_strn(NULL, "uid-pool", "<s>", 0, 1, "give each container its own host uids from <start>:<slots>:<size>, shared by the barco processes of the host"),
+        uid_extents     = arg_intn(NULL, "uid-extents", "<n>", 0, 1, "ranges of --uid-pool per container, mapped one after the other (default: 1)"),
         end     = arg_end(ARGTABLE_ARG_MAX),
     };
 
@@ -60,6 +252,7 @@ int main(int argc, char **argv) {
         printf("Usage: %s", progname);
         arg_print_syntax(stdout, argtable, "\n");
         arg_print_glossary(stdout, argtable, "  %-25s %s\n");
+        printf("\nRun '%s exec --help' to run a command in a running container.\n", progname);
         goto exit;
     }
 
@@ -83,97 +276,554 @@ int main(int argc, char **argv) {
     else
         log_set_level(LOG_INFO);
 
-    config.cmd = cmd->sval[0];
-    config.argv[ARGV_CMD_INDEX] = strdup(config.cmd);
-    config.mnt = mnt->sval[0];
-    config.hostname = "barcontainer";
+    // The logs are written in the background, they are all written on exit
+    if (log_async->count > 0 && log_set_async(true))
+        log_warn("failed to start the log writer, logs are synchronous");
+
+    // barco can be run to import an image or to unpin namespaces only
+    import_only = (import->count > 0 || ns_unpin_name->count > 0) &&
+        !cmd->count && !pool_size->count && !manifest->count;
+
+    if ((import->count > 0) != (tar->count > 0)) {
+        printf("%s: --import and --tar go together\n", progname);
+        exitcode = 1;
+        goto exit;
+    }
+
+    if (!uid->count && !import_only) {
+        printf("%s: missing option -u|--uid=<n>\n", progname);
+        printf("Try '%s --help' for more information.\n", progname);
+        exitcode = 1;
+        goto exit;
+    }
+
+    if (!cmd->count && !pool_size->count && !manifest->count && !import_only) {
+        printf("%s: missing option -c|--cmd=<s>\n", progname);
+        printf("Try '%s --help' for more information.\n", progname);
+        exitcode = 1;
+        goto exit;
+    }
+
+    if (pool_size->count > 0 && pool_size->ival[0] <= 0) {
+        printf("%s: --pool must be positive\n", progname);
+        exitcode = 1;
+        goto exit;
+    }
+
+    config.cmd = cmd->count > 0 ? cmd->sval[0] : NULL;
+    config.argv[ARGV_CMD_INDEX] = config.cmd ? strdup(config.cmd) : NULL;
+    if (mnt->count + (layer->count > 0) + image->count + ref->count > 1 ||
+        (!mnt->count && !layer->count && !image->count && !ref->count &&
+         !manifest->count && !import_only)) {
+        printf("%s: either -m|--mnt, -l|--layer, -i|--image or -r|--ref is required\n", progname);
+        exitcode = 1;
+        goto exit;
+    }
+
+    if ((upper->count > 0) != (work->count > 0) ||
+        (upper->count > 0 && !layer->count && !ref->count)) {
+        printf("%s: --upper and --work go together, with --layer or --ref\n", progname);
+        exitcode = 1;
+        goto exit;
+    }
+
+    // Every syscall of the container waits for barco, which must be free to
+    // answer (and the timings would be meaningless). barco does not relay the
+    // output meanwhile, the container would block on its full pipes.
+    if (scmp_learn->count > 0 &&
+        (pool_size->count > 0 || prof->count > 0 || scmp_profile->count > 0 ||
+         output_dir->count > 0)) {
+        printf("%s: --seccomp-learn goes without --pool, --profile-startup, --seccomp-profile and --output-dir\n", progname);
+        exitcode = 1;
+        goto exit;
+    }
+
+    if (scmp_off->count > 0 && (scmp_profile->count > 0 || scmp_learn->count > 0)) {
+        printf("%s: --no-seccomp goes without --seccomp-profile and --seccomp-learn\n", progname);
+        exitcode = 1;
+        goto exit;
+    }
+
+    if (!cpus->count && (cpus_excl->count || numa_node->count || mempolicy->count)) {
+        printf("%s: --cpus-exclusive, --numa-node and --mempolicy need --cpus\n", progname);
+        exitcode = 1;
+        goto exit;
+    }
+
+    if (cpus->count > 0 && (cpus->ival[0] <= 0 || cpus->ival[0] > CPUSET_CPUS_MAX)) {
+        printf("%s: --cpus must be between 1 and %d\n", progname, CPUSET_CPUS_MAX);
+        exitcode = 1;
+        goto exit;
+    }
+
+    if (mempolicy->count > 0 &&
+        cpuset_parse_mempolicy(mempolicy->sval[0], &config.cpuset.mempolicy)) {
+        printf("%s: unknown memory policy %s\n", progname, mempolicy->sval[0]);
+        exitcode = 1;
+        goto exit;
+    }
+
+    if (numa_node->count > 0 &&
+        (numa_node->ival[0] < 0 || numa_node->ival[0] >= CPUSET_NODES_MAX)) {
+        printf("%s: --numa-node must be between 0 and %d\n", progname, CPUSET_NODES_MAX - 1);
+        exitcode = 1;
+        goto exit;
+    }
+
+    if (stats_sock->count > 0 && pool_size->count > 0) {
+        printf("%s: --stats goes without --pool\n", progname);
+        exitcode = 1;
+        goto exit;
+    }
+
+    if (manifest->count > 0 &&
+        (pool_size->count > 0 || prof->count > 0 || scmp_learn->count > 0)) {
+        printf("%s: --manifest goes without --pool, --profile-startup and --seccomp-learn\n", progname);
+        exitcode = 1;
+        goto exit;
+    }
+
+    if (workers->count > 0 &&
+        (workers->ival[0] <= 0 || workers->ival[0] > SUPERVISOR_WORKERS_MAX)) {
+        printf("%s: --workers must be between 1 and %d\n", progname, SUPERVISOR_WORKERS_MAX);
+        exitcode = 1;
+        goto exit;
+    }
+
+    if ((timeout->count > 0 && timeout->ival[0] <= 0) ||
+        (stop_grace->count > 0 && stop_grace->ival[0] < 0)) {
+        printf("%s: --timeout must be positive and --stop-grace not negative\n", progname);
+        exitcode = 1;
+        goto exit;
+    }
+
+    if (cgroup_pool->count > 0 && cgroup_pool->ival[0] <= 0) {
+        printf("%s: --cgroup-pool must be positive\n", progname);
+        exitcode = 1;
+        goto exit;
+    }
+
+    if ((mem_events->count > 0 || mem_action->count > 0) && pool_size->count > 0) {
+        printf("%s: --memory-events and --memory-action go without --pool\n", progname);
+        exitcode = 1;
+        goto exit;
+    }
+
+    if (net->count > 0 && net_parse_mode(net->sval[0], &config.net.mode)) {
+        printf("%s: unknown network mode %s\n", progname, net->sval[0]);
+        exitcode = 1;
+        goto exit;
+    }
+
+    if ((config.net.mode == NET_MODE_MACVLAN || config.net.mode == NET_MODE_IPVLAN) !=
+        (net_parent->count > 0)) {
+        printf("%s: --net-parent goes with --net macvlan and ipvlan\n", progname);
+        exitcode = 1;
+        goto exit;
+    }
+
+    if (config.net.mode < NET_MODE_VETH &&
+        (net_bridge->count || net_address->count || net_gateway->count ||
+         net_mtu->count || net_rate->count)) {
+        printf("%s: the --net-* options need --net veth, macvlan or ipvlan\n", progname);
+        exitcode = 1;
+        goto exit;
+    }
+
+    // The parked containers would all get the same address
+    if (net_address->count > 0 && pool_size->count > 0) {
+        printf("%s: --net-address goes without --pool\n", progname);
+        exitcode = 1;
+        goto exit;
+    }
+
+    if (net_mtu->count > 0 && (net_mtu->ival[0] < 68 || net_mtu->ival[0] > 65535)) {
+        printf("%s: --net-mtu must be between 68 and 65535\n", progname);
+        exitcode = 1;
+        goto exit;
+    }
+
+    if (net_rate->count > 0 && net_parse_rate(net_rate->sval[0], &config.net.rate)) {
+        printf("%s: invalid rate %s\n", progname, net_rate->sval[0]);
+        exitcode = 1;
+        goto exit;
+    }
+
+    if (uid_extents->count > 0 && !uid_pool->count) {
+        printf("%s: --uid-extents needs --uid-pool\n", progname);
+        exitcode = 1;
+        goto exit;
+    }
+
+    if (uid_pool->count > 0 && user_pool_parse(uid_pool->sval[0], &uids)) {
+        exitcode = 1;
+        goto exit;
+    }
+
+    if (uid_extents->count > 0) {
+        uids.extents = uid_extents->ival[0];
+        if (uids.extents <= 0 || uids.extents > USER_RANGE_EXTENTS_MAX ||
+            uids.extents > uids.slots) {
+            printf("%s: --uid-extents must be between 1 and %d, and at most the slots of the pool\n",
+                   progname, USER_RANGE_EXTENTS_MAX);
+            exitcode = 1;
+            goto exit;
+        }
+    }
+
+    // The parked containers would all be pinned under the same name, and the
+    // manifest creates its containers in parallel
+    if (ns_pin_name->count > 0 && (pool_size->count > 0 || manifest->count > 0)) {
+        printf("%s: --ns-pin goes without --pool and --manifest\n", progname);
+        exitcode = 1;
+        goto exit;
+    }
+
+    // The joined network is the one configured for the pinned namespaces
+    if (ns_join_name->count > 0 &&
+        (config.net.mode != NET_MODE_NONE || ns_pin_name->count > 0)) {
+        printf("%s: --ns-join goes without --net and --ns-pin\n", progname);
+        exitcode = 1;
+        goto exit;
+    }
+
+    if (!output_dir->count &&
+        (output_max_size->count || output_max_age->count || output_keep->count ||
+         output_framed->count || output_echo->count)) {
+        printf("%s: the --output-* options need --output-dir\n", progname);
+        exitcode = 1;
+        goto exit;
+    }
+
+    // The output of the parked containers is not monitored
+    if (output_dir->count > 0 && pool_size->count > 0) {
+        printf("%s: --output-dir goes without --pool\n", progname);
+        exitcode = 1;
+        goto exit;
+    }
+
+    if (output_max_size->count > 0 &&
+        output_parse_size(output_max_size->sval[0], &output.max_size)) {
+        printf("%s: invalid size %s\n", progname, output_max_size->sval[0]);
+        exitcode = 1;
+        goto exit;
+    }
+
+    if ((output_max_age->count > 0 && output_max_age->ival[0] <= 0) ||
+        (output_keep->count > 0 && output_keep->ival[0] < 0)) {
+        printf("%s: --output-max-age must be positive and --output-keep not negative\n", progname);
+        exitcode = 1;
+        goto exit;
+    }
+
+    if (stats_fmt->count > 0 && stats_parse_format(stats_fmt->sval[0], &format)) {
+        printf("%s: unknown stats format %s\n", progname, stats_fmt->sval[0]);
+        exitcode = 1;
+        goto exit;
+    }
+
+    if (stats_interval->count > 0 && stats_interval->ival[0] <= 0) {
+        printf("%s: --stats-interval must be positive\n", progname);
+        exitcode = 1;
+        goto exit;
+    }
+
+    for (int i = 0; i < io_max->count; i++) {
+        if (cgroupsv2_parse_io(&cgroups, "io.max", io_max->sval[i])) {
+            exitcode = 1;
+            goto exit;
+        }
+    }
+    for (int i = 0; i < io_weight->count; i++) {
+        if (cgroupsv2_parse_io(&cgroups, "io.weight", io_weight->sval[i])) {
+            exitcode = 1;
+            goto exit;
+        }
+    }
+    for (int i = 0; i < io_latency->count; i++) {
+        if (cgroupsv2_parse_io(&cgroups, "io.latency", io_latency->sval[i])) {
+            exitcode = 1;
+            goto exit;
+        }
+    }
+    cgroups.memory_max = mem_max->count > 0 ? mem_max->sval[0] : NULL;
+    cgroups.memory_high = mem_high->count > 0 ? mem_high->sval[0] : NULL;
+    cgroups.memory_swap_max = mem_swap->count > 0 ? mem_swap->sval[0] : NULL;
+    cgroups.memory_zswap_max = mem_zswap->count > 0 ? mem_zswap->sval[0] : NULL;
+    cgroups.memory_oom_group = mem_oom_group->count > 0;
+    cgroups.pool_size = cgroup_pool->count > 0 ? cgroup_pool->ival[0] : 0;
+    config.cgroups = &cgroups;
+
+    output.dir = output_dir->count > 0 ? output_dir->sval[0] : NULL;
+    output.max_age = output_max_age->count > 0 ? output_max_age->ival[0] : 0;
+    output.keep = output_keep->count > 0 ? output_keep->ival[0] : OUTPUT_KEEP;
+    output.framed = output_framed->count > 0;
+    output.echo = output_echo->count > 0;
+    config.output = &output;
+
+    config.ns.pin = ns_pin_name->count > 0 ? ns_pin_name->sval[0] : NULL;
+    config.ns.join = ns_join_name->count > 0 ? ns_join_name->sval[0] : NULL;
+
+    config.cpuset.cpus = cpus->count > 0 ? cpus->ival[0] : 0;
+    config.cpuset.exclusive = cpus_excl->count > 0;
+    config.cpuset.node = numa_node->count > 0 ? numa_node->ival[0] : -1;
+
+    config.mount.mnt = mnt->count > 0 ? mnt->sval[0] : NULL;
+    config.mount.image = image->count > 0 ? image->sval[0] : NULL;
+    for (int i = 0; i < layer->count; i++)
+        config.mount.layers[i] = layer->sval[i];
+    config.mount.layers_count = layer->count;
+    config.mount.upper = upper->count > 0 ? upper->sval[0] : NULL;
+    config.mount.work = work->count > 0 ? work->sval[0] : NULL;
+    config.mount.tree_fd = -1;
+    config.hostname = host->count > 0 ? host->sval[0] : "barcontainer";
     if (arg->count > 0)
         config.argv[ARGV_ARG_INDEX] = strdup(arg->sval[0]);
+    config.seccomp_learn = scmp_learn->count > 0;
+    config.seccomp_disabled = scmp_off->count > 0;
+    config.seccomp_profile = scmp_profile->count > 0 ? scmp_profile->sval[0] : NULL;
+    config.net.bridge = net_bridge->count > 0 ? net_bridge->sval[0] : NULL;
+    config.net.parent = net_parent->count > 0 ? net_parent->sval[0] : NULL;
+    config.net.address = net_address->count > 0 ? net_address->sval[0] : NULL;
+    config.net.gateway = net_gateway->count > 0 ? net_gateway->sval[0] : NULL;
+    config.net.mtu = net_mtu->count > 0 ? net_mtu->ival[0] : 0;
+
+    profile_enable(prof->count > 0);
 
     // check if barco is running as root
     if (geteuid() != 0) {
         log_warn("barco should be running as root");
     }
 
-    // Initialize a socket pair to communicate with the container
-    log_info("initializing socket pair...");
-    if (socketpair(AF_LOCAL, SOCK_SEQPACKET, 0, sockets)) {
-        log_fatal("failed to initialialize socket pair: %m");
+    // The layers are extracted before anything else, the image is ready for
+    // --ref
+    if (import->count > 0 &&
+        store_import(store->count > 0 ? store->sval[0] : STORE_ROOT, import->sval[0],
+                     tar->sval, tar->count,
+                     workers->count > 0 ? workers->ival[0] : sysconf(_SC_NPROCESSORS_ONLN))) {
+        log_fatal("failed to import image %s", import->sval[0]);
         exitcode = 1;
         goto exit;
     }
 
-    log_info("setting socket flags...");
-    if (fcntl(sockets[0], F_SETFD, FD_CLOEXEC)) {
-        log_fatal("failed to socket fcntl: %m");
+    if (ns_unpin_name->count > 0 && ns_unpin(ns_unpin_name->sval[0])) {
+        log_fatal("failed to unpin namespaces %s", ns_unpin_name->sval[0]);
         exitcode = 1;
-        goto cleanup;
+        goto exit;
+    }
+    if (import_only)
+        goto exit;
+
+    if (ref->count > 0) {
+        if (store_resolve(store->count > 0 ? store->sval[0] : STORE_ROOT, ref->sval[0],
+                          &layers)) {
+            log_fatal("failed to resolve image %s", ref->sval[0]);
+            exitcode = 1;
+            goto exit;
+        }
+        for (int i = 0; i < layers.count; i++)
+            config.mount.layers[i] = layers.paths[i];
+        config.mount.layers_count = layers.count;
     }
-    config.fd = sockets[1];
 
-    // Initialize a stack for the container
-    log_info("initializing container stack...");
-    if (!(stack = malloc(CONTAINER_STACK_SIZE))) {
-        log_fatal("failed to initialize container stack: %m");
+    // The seccomp filter is compiled once, all the containers load it as is
+    log_info("preparing seccomp filter...");
+    if (config.seccomp_learn) {
+        log_info("seccomp learn mode, syscalls are not filtered");
+    } else if (config.seccomp_disabled) {
+        log_warn("seccomp disabled, syscalls are not filtered");
+    } else if (scmp_profile->count > 0) {
+        // A custom profile is never silently replaced by the default one
+        if (sec_seccomp_prepare(scmp_profile->sval[0])) {
+            log_fatal("failed to prepare seccomp profile %s", scmp_profile->sval[0]);
+            exitcode = 1;
+            goto exit;
+        }
+    } else if (sec_seccomp_prepare(NULL)) {
+        log_warn("failed to prepare seccomp filter, containers will compile it");
+    }
+
+    // Every container takes its uids from the pool, the state is mapped once
+    if (uid_pool->count > 0 && user_pool_init(&uids)) {
+        log_fatal("failed to initialize uid pool");
         exitcode = 1;
-        goto cleanup;
+        goto exit;
+    }
+
+    // Idle cgroups are created before any container, so that launches only
+    // rename them
+    if (cgroups.pool_size > 0 && cgroupsv2_pool_fill(&cgroups))
+        log_warn("failed to fill the cgroup pool, containers will create their cgroup");
+
+    // Pool mode: containers are parked and launched on request
+    if (pool_size->count > 0) {
+        container_pool pool = {0};
+
+        if (!pool_sock->count) {
+            log_fatal("--pool requires --pool-socket");
+            exitcode = 1;
+            goto exit;
+        }
+
+        log_info("initializing pool of %d containers...", pool_size->ival[0]);
+        if (pool_init(&pool, &config, pool_size->ival[0],
+                      pool_refill->count > 0 ? pool_refill->ival[0] : 0) ||
+            pool_serve(&pool, pool_sock->sval[0])) {
+            log_fatal("failed to run pool");
+            exitcode = 1;
+        }
+
+        log_info("freeing pool...");
+        pool_free(&pool);
+        goto exit;
     }
 
-    // Initialize the container (calls clone() internally).
+    // Manifest mode: the containers are created in parallel and supervised
+    // until they all exit
+    if (manifest->count > 0) {
+        supervisor sup = {0};
+        long cpus_count = sysconf(_SC_NPROCESSORS_ONLN);
+
+        // Signals are blocked before the workers are started
+        if (supervisor_load(&sup, manifest->sval[0], &config,
+                            timeout->count > 0 ? timeout->ival[0] : 0) ||
+            monitor_init(&mon, sup.count,
+                         stop_grace->count > 0 ? stop_grace->ival[0] : MONITOR_GRACE_MS) ||
+            supervisor_start(&sup, workers->count > 0 ? workers->ival[0]
+                                                      : cpus_count > 0 ? cpus_count : 1)) {
+            log_fatal("failed to run manifest %s", manifest->sval[0]);
+            exitcode = 1;
+            goto manifest_cleanup;
+        }
+
+        if (stats_sock->count > 0 &&
+            stats_init(&stats, stats_sock->sval[0], format,
+                       stats_interval->count > 0 ? stats_interval->ival[0] : 1000)) {
+            log_fatal("failed to export stats");
+            exitcode = 1;
+            goto manifest_cleanup;
+        }
+        if ((mem_events->count > 0 || mem_action->count > 0) &&
+            memwatch_init(&watch, mem_action->count > 0 ? mem_action->sval[0] : NULL)) {
+            log_fatal("failed to watch memory events");
+            exitcode = 1;
+            goto manifest_cleanup;
+        }
+        for (int i = 0; i < sup.count; i++) {
+            const char *name = sup.entries[i].name;
+            int cgroup_fd = sup.entries[i].container.cgroup_fd;
+
+            if ((stats_sock->count > 0 && stats_add(&stats, name, cgroup_fd)) ||
+                ((mem_events->count > 0 || mem_action->count > 0) &&
+                 memwatch_add(&watch, name, cgroup_fd))) {
+                exitcode = 1;
+                goto manifest_cleanup;
+            }
+        }
+        if ((stats_sock->count > 0 && stats_start(&stats)) ||
+            ((mem_events->count > 0 || mem_action->count > 0) && memwatch_start(&watch))) {
+            exitcode = 1;
+            goto manifest_cleanup;
+        }
+
+        for (int i = 0; i < sup.count; i++) {
+            if (monitor_add(&mon, &sup.entries[i].container, sup.entries[i].timeout_ms)) {
+                exitcode = 1;
+                goto manifest_cleanup;
+            }
+        }
+        exitcode = monitor_run(&mon) ? 1 : 0;
+
+manifest_cleanup:
+        log_info("freeing containers...");
+        stats_free(&stats);
+        memwatch_free(&watch);
+        monitor_free(&mon);
+        supervisor_free(&sup);
+        goto exit;
+    }
+
+    // Initialize the container: socket pair, stack, clone, cgroups and user
+    // namespace (the container is a child process of barco)
     log_info("initializing container...");
-    // Stacks on most architectures grow downwards.
-    // CONTAINER_STACK_SIZE gives us a pointer just below the end.
-    if ((container_pid = container_init(&config, stack + CONTAINER_STACK_SIZE)) == -1) {
-        log_fatal("failed to container_init");
+    timeout_ms = timeout->count > 0 ? timeout->ival[0] : 0;
+    if (monitor_init(&mon, 1, stop_grace->count > 0 ? stop_grace->ival[0] : MONITOR_GRACE_MS)) {
+        log_fatal("failed to initialize monitor");
+        exitcode = 1;
+        goto cleanup;
+    }
+    if (container_create(&container, &config)) {
+        log_fatal("failed to initialize container, stopping container...");
         exitcode = 1;
         goto cleanup;
     }
 
-    // Prepare cgroups for the process (the container is a child process of barco)
-    log_info("initializing cgroups...");
-    if (cgroupsv2_init(config.hostname, container_pid)) {
-        log_fatal("failed to initialize cgroups");
+    // Collect the phases timed by the container and report the breakdown
+    if (profile_enabled()) {
+        if (profile_recv(container.fd)) {
+            log_error("failed to profile startup");
+        } else {
+            profile_write_json(stderr);
+        }
+    }
+
+    // Sample the cgroup of the container while it runs
+    if (stats_sock->count > 0 &&
+        (stats_init(&stats, stats_sock->sval[0], format,
+                    stats_interval->count > 0 ? stats_interval->ival[0] : 1000) ||
+         stats_add(&stats, container.name, container.cgroup_fd) ||
+         stats_start(&stats))) {
+        log_fatal("failed to export stats");
         exitcode = 1;
         goto cleanup;
     }
 
-    // Barco configures the user namespace for the container
-    log_info("configuring user namespace...");
-    if (user_namespace_prepare_mappings(container_pid, sockets[0])) {
+    // Report the memory events of the container while it runs
+    if ((mem_events->count > 0 || mem_action->count > 0) &&
+        (memwatch_init(&watch, mem_action->count > 0 ? mem_action->sval[0] : NULL) ||
+         memwatch_add(&watch, container.name, container.cgroup_fd) ||
+         memwatch_start(&watch))) {
+        log_fatal("failed to watch memory events");
         exitcode = 1;
-        log_fatal("failed to user_namespace_set_user, stopping container...");
         goto cleanup;
     }
 
-    // Wait for the container to exit
+    // Answer the syscalls of the container until it exits, or it is stopped
+    if (config.seccomp_learn) {
+        int notify_fd = sec_learn_recv(container.fd);
+
+        if (notify_fd < 0 ||
+            sec_learn_run(notify_fd, container.pidfd, mon.signal_fd, &timeout_ms,
+                          scmp_learn->sval[0])) {
+            log_error("failed to learn the syscalls of the container");
+            exitcode = 1;
+        }
+        if (notify_fd >= 0)
+            close(notify_fd);
+    }
+
+    // Supervise the container until it exits and its cgroup is empty
     log_info("waiting for container to exit...");
-    exitcode |= container_wait(container_pid);
+    if (monitor_add(&mon, &container, timeout_ms) || (status = monitor_run(&mon)) < 0)
+        exitcode = 1;
+    else
+        exitcode |= status;
     log_debug("container exited...");
 
 cleanup:
     // Clear resources (cgroups, stack, sockets)
     log_info("freeing resources...");
-
-    log_debug("freeing stack...");
-    if (stack) {
-        free(stack);
-        stack = NULL;
-    }
-
-    log_debug("freeing sockets...");
-    if (sockets[0] >= 0) {
-        close(sockets[0]);
-        sockets[0] = -1;
-    }
-    if (sockets[1] >= 0) {
-        close(sockets[1]);
-        sockets[1] = -1;
-    }
-
-    log_debug("freeing cgroups...");
-    cgroupsv2_free(config.hostname);
+    // A reaped container has a pid of -1, its pid may belong to another
+    // process already
+    if (exitcode && container.pid > 0)
+        container_stop(container.pid);
+    stats_free(&stats);
+    memwatch_free(&watch);
+    monitor_free(&mon);
+    container_destroy(&container);
 
 exit:
+    log_set_async(false);
     arg_freetable(argtable, sizeof(argtable) / sizeof(argtable[0]));
     if (config.argv[ARGV_CMD_INDEX])
         free(config.argv[ARGV_CMD_INDEX]);
@@ -0,0 +1,347 @@
+#define _GNU_SOURCE
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <sys/wait.h>
+#include <spawn.h>
+#include <signal.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+
+#include "log.h"
+#include "memwatch.h"
+
+extern char **environ;
+
+// Keys of the counters in memory.events, in the order of memwatch_event
+static const char *memwatch_keys[MEMWATCH_EVENTS_MAX] = {
+    "high",
+    "max",
+    "oom",
+    "oom_kill",
+    "oom_group_kill",
+};
+
+// Reads the counters of memory.events. Counters missing from older kernels
+// stay at 0.
+static int memwatch_read(int fd, uint64_t counts[MEMWATCH_EVENTS_MAX]) {
+    char buffer[MEMWATCH_READ_SIZE] = {0};
+    char *saveptr = NULL;
+    ssize_t len = 0;
+
+    if ((len = pread(fd, buffer, sizeof(buffer) - 1, 0)) == -1)
+        return -1;
+    buffer[len] = '\0';
+
+    for (char *line = strtok_r(buffer, "\n", &saveptr); line;
+         line = strtok_r(NULL, "\n", &saveptr)) {
+        char key[32] = {0};
+        uint64_t value = 0;
+
+        if (sscanf(line, "%31s %" SCNu64, key, &value) != 2)
+            continue;
+        for (int i = 0; i < MEMWATCH_EVENTS_MAX; i++) {
+            if (!strcmp(key, memwatch_keys[i]))
+                counts[i] = value;
+        }
+    }
+
+    return 0;
+}
+
+// Runs the action with the event in its environment:
+// - BARCO_CONTAINER: name of the container
+// - BARCO_MEMORY_EVENT: key of the counter in memory.events
+// - BARCO_MEMORY_EVENTS: new events since the last report
+// The thread waits for the action, events happening meanwhile are reported
+// together afterwards.
+static void memwatch_run_action(const memwatch *watch, const memwatch_report *report) {
+    char container_env[HOST_NAME_MAX + 32] = {0};
+    char event_env[64] = {0};
+    char count_env[64] = {0};
+    char *argv[] = {"sh", "-c", (char *)watch->action, NULL};
+    char **envp = NULL;
+    size_t environ_count = 0;
+    posix_spawnattr_t attr;
+    sigset_t mask;
+    pid_t pid = -1;
+    int err = 0;
+
+    while (environ[environ_count])
+        environ_count++;
+    if (!(envp = calloc(environ_count + 4, sizeof(*envp)))) {
+        log_error("failed to allocate memory action: %m");
+        return;
+    }
+
+    snprintf(container_env, sizeof(container_env), "BARCO_CONTAINER=%s", report->name);
+    snprintf(event_env, sizeof(event_env), "BARCO_MEMORY_EVENT=%s",
+             memwatch_keys[report->event]);
+    snprintf(count_env, sizeof(count_env), "BARCO_MEMORY_EVENTS=%" PRIu64, report->count);
+    memcpy(envp, environ, environ_count * sizeof(*envp));
+    envp[environ_count] = container_env;
+    envp[environ_count + 1] = event_env;
+    envp[environ_count + 2] = count_env;
+
+    // barco blocks the signals it handles through a signalfd (see
+    // monitor_init), the action must not inherit that
+    sigemptyset(&mask);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+
+    log_debug("running memory action of %s...", report->name);
+    if ((err = posix_spawn(&pid, "/bin/sh", NULL, &attr, argv, envp))) {
+        errno = err;
+        log_error("failed to run memory action: %m");
+    } else if (waitpid(pid, NULL, 0) == -1 && errno != ECHILD) {
+        log_error("failed to wait for memory action: %m");
+    }
+
+    posix_spawnattr_destroy(&attr);
+    free(envp);
+}
+
+// Reports the counters of the source that increased since the last read, and
+// queues their actions for the thread. Called with the lock held.
+static void memwatch_check(memwatch *watch, memwatch_source *source) {
+    uint64_t counts[MEMWATCH_EVENTS_MAX] = {0};
+
+    if (memwatch_read(source->fd, counts)) {
+        log_error("failed to read memory.events of %s: %m", source->name);
+        return;
+    }
+
+    for (int i = 0; i < MEMWATCH_EVENTS_MAX; i++) {
+        uint64_t count = counts[i] - source->counts[i];
+
+        if (counts[i] <= source->counts[i])
+            continue;
+        source->counts[i] = counts[i];
+
+        // Throttling is expected, kills are not
+        if (i == MEMWATCH_HIGH)
+            log_info("%s: memory %s event (%" PRIu64 " new, %" PRIu64 " total)",
+                     source->name, memwatch_keys[i], count, counts[i]);
+        else
+            log_warn("%s: memory %s event (%" PRIu64 " new, %" PRIu64 " total)",
+                     source->name, memwatch_keys[i], count, counts[i]);
+
+        if (!watch->action)
+            continue;
+        if (watch->pending_count == MEMWATCH_PENDING_MAX) {
+            log_warn("%s: too many memory events, skipping action", source->name);
+            continue;
+        }
+        memwatch_report *report = &watch->pending[watch->pending_count++];
+        snprintf(report->name, sizeof(report->name), "%s", source->name);
+        report->event = i;
+        report->count = count;
+    }
+}
+
+// Runs the actions of the pending events, without the lock
+static void memwatch_run_pending(memwatch *watch) {
+    memwatch_report reports[MEMWATCH_PENDING_MAX];
+    int count = 0;
+
+    pthread_mutex_lock(&watch->lock);
+    count = watch->pending_count;
+    memcpy(reports, watch->pending, count * sizeof(*reports));
+    watch->pending_count = 0;
+    pthread_mutex_unlock(&watch->lock);
+
+    for (int i = 0; i < count; i++)
+        memwatch_run_action(watch, &reports[i]);
+}
+
+static void *memwatch_thread(void *arg) {
+    memwatch *watch = arg;
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    for (;;) {
+        struct pollfd fds[2] = {
+            {.fd = watch->wake_fd, .events = POLLIN},
+            {.fd = watch->inotify_fd, .events = POLLIN},
+        };
+        ssize_t len = 0;
+        uint64_t count = 0;
+        bool stopping = false;
+
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            log_error("failed to poll memory events: %m");
+            break;
+        }
+
+        // Woken up for the events of removed containers, or to stop once
+        // they are handled
+        if (fds[0].revents & POLLIN) {
+            (void)!read(watch->wake_fd, &count, sizeof(count));
+            pthread_mutex_lock(&watch->lock);
+            stopping = watch->stopping;
+            pthread_mutex_unlock(&watch->lock);
+
+            memwatch_run_pending(watch);
+            if (stopping)
+                break;
+            continue;
+        }
+
+        if ((len = read(watch->inotify_fd, buffer, sizeof(buffer))) == -1) {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            log_error("failed to read memory events: %m");
+            break;
+        }
+
+        // A modification of memory.events means at least one counter changed
+        pthread_mutex_lock(&watch->lock);
+        for (char *ptr = buffer; ptr < buffer + len;) {
+            const struct inotify_event *event = (const struct inotify_event *)ptr;
+
+            for (int i = 0; i < watch->sources_count; i++) {
+                if (watch->sources[i].wd == event->wd)
+                    memwatch_check(watch, &watch->sources[i]);
+            }
+            ptr += sizeof(*event) + event->len;
+        }
+        pthread_mutex_unlock(&watch->lock);
+
+        memwatch_run_pending(watch);
+    }
+
+    return NULL;
+}
+
+int memwatch_init(memwatch *watch, const char *action) {
+    memset(watch, 0, sizeof(*watch));
+    watch->action = action;
+    watch->inotify_fd = -1;
+    watch->wake_fd = -1;
+    pthread_mutex_init(&watch->lock, NULL);
+    watch->initialized = true;
+
+    log_debug("watching memory events...");
+    if ((watch->wake_fd = eventfd(0, EFD_CLOEXEC)) == -1) {
+        log_error("failed to create eventfd: %m");
+        return -1;
+    }
+
+    if ((watch->inotify_fd = inotify_init1(IN_CLOEXEC)) == -1) {
+        log_error("failed to initialize inotify: %m");
+        return -1;
+    }
+
+    return 0;
+}
+
+// memory.events is watched through its fd, as the cgroup is only known by
+// the fd of its directory.
+int memwatch_add(memwatch *watch, const char *name, int cgroup_fd) {
+    memwatch_source *source = NULL;
+    char path[PATH_MAX] = {0};
+
+    pthread_mutex_lock(&watch->lock);
+    if (watch->sources_count == MEMWATCH_SOURCES_MAX) {
+        pthread_mutex_unlock(&watch->lock);
+        log_error("too many containers to watch");
+        return -1;
+    }
+
+    source = &watch->sources[watch->sources_count];
+    memset(source, 0, sizeof(*source));
+    snprintf(source->name, sizeof(source->name), "%s", name);
+    if ((source->fd = openat(cgroup_fd, "memory.events", O_RDONLY | O_CLOEXEC)) == -1) {
+        pthread_mutex_unlock(&watch->lock);
+        log_error("failed to open memory.events of %s: %m", name);
+        return -1;
+    }
+
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", source->fd);
+    if ((source->wd = inotify_add_watch(watch->inotify_fd, path, IN_MODIFY)) == -1 ||
+        memwatch_read(source->fd, source->counts)) {
+        pthread_mutex_unlock(&watch->lock);
+        log_error("failed to watch memory.events of %s: %m", name);
+        close(source->fd);
+        return -1;
+    }
+    watch->sources_count++;
+    pthread_mutex_unlock(&watch->lock);
+
+    return 0;
+}
+
+void memwatch_remove(memwatch *watch, const char *name) {
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&watch->lock);
+    for (int i = 0; i < watch->sources_count; i++) {
+        if (strcmp(watch->sources[i].name, name))
+            continue;
+
+        // The last events of a container that exited are still reported,
+        // their actions are run by the thread
+        memwatch_check(watch, &watch->sources[i]);
+        if (watch->pending_count && write(watch->wake_fd, &one, sizeof(one)) != sizeof(one))
+            log_warn("failed to wake memory events thread: %m");
+        inotify_rm_watch(watch->inotify_fd, watch->sources[i].wd);
+        close(watch->sources[i].fd);
+        watch->sources[i] = watch->sources[--watch->sources_count];
+        break;
+    }
+    pthread_mutex_unlock(&watch->lock);
+}
+
+int memwatch_start(memwatch *watch) {
+    int err = 0;
+
+    log_debug("starting memory events thread...");
+    if ((err = pthread_create(&watch->thread, NULL, memwatch_thread, watch))) {
+        errno = err;
+        log_error("failed to start memory events thread: %m");
+        return -1;
+    }
+    watch->started = true;
+
+    return 0;
+}
+
+void memwatch_free(memwatch *watch) {
+    if (!watch->initialized)
+        return;
+
+    // The actions of the last events are run before the thread stops
+    while (watch->sources_count)
+        memwatch_remove(watch, watch->sources[0].name);
+
+    if (watch->started) {
+        uint64_t one = 1;
+
+        log_debug("stopping memory events thread...");
+        pthread_mutex_lock(&watch->lock);
+        watch->stopping = true;
+        pthread_mutex_unlock(&watch->lock);
+        if (write(watch->wake_fd, &one, sizeof(one)) == sizeof(one))
+            pthread_join(watch->thread, NULL);
+        watch->started = false;
+    }
+
+    if (watch->inotify_fd >= 0) {
+        close(watch->inotify_fd);
+        watch->inotify_fd = -1;
+    }
+    if (watch->wake_fd >= 0) {
+        close(watch->wake_fd);
+        watch->wake_fd = -1;
+    }
+
+    pthread_mutex_destroy(&watch->lock);
+    watch->initialized = false;
+}
@@ -0,0 +1,385 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include "log.h"
+#include "monitor.h"
+
+// What an epoll event is about, stored with the index of the entry
+typedef enum {
+    MONITOR_PIDFD,
+    MONITOR_SOCKET,
+    MONITOR_CGROUP_EVENTS,
+    MONITOR_STDOUT,
+    MONITOR_STDERR,
+    MONITOR_KINDS,
+} monitor_kind;
+
+// Data of the events of the signalfd
+#define MONITOR_SIGNAL UINT64_MAX
+
+static uint64_t monitor_now_ms(void) {
+    struct timespec ts = {0};
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void monitor_signals(sigset_t *mask) {
+    sigemptyset(mask);
+    sigaddset(mask, SIGCHLD);
+    sigaddset(mask, SIGINT);
+    sigaddset(mask, SIGTERM);
+}
+
+static int monitor_watch(monitor *mon, int fd, uint32_t events, int index,
+                         monitor_kind kind) {
+    struct epoll_event event = {
+        .events = events,
+        .data.u64 = (uint64_t)index * MONITOR_KINDS + kind,
+    };
+
+    return epoll_ctl(mon->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+}
+
+// Reads whether the cgroup still has processes. Reading also acknowledges
+// the change, so that the next one is notified.
+static void monitor_read_events(monitor_entry *entry) {
+    char buffer[256] = {0};
+    const char *populated = NULL;
+    ssize_t len = 0;
+
+    if ((len = pread(entry->events_fd, buffer, sizeof(buffer) - 1, 0)) == -1) {
+        log_error("failed to read cgroup.events of %s: %m", entry->container->name);
+        entry->populated = false;
+        return;
+    }
+    buffer[len] = '\0';
+
+    populated = strstr(buffer, "populated ");
+    entry->populated = populated && populated[strlen("populated ")] == '1';
+}
+
+// Sends a signal through the pidfd when there is one, so that a recycled
+// pid is never signaled
+static int monitor_signal(const monitor_entry *entry, int signal) {
+    const container *container = entry->container;
+
+    if (container->pidfd >= 0)
+        return syscall(SYS_pidfd_send_signal, container->pidfd, signal, NULL, 0);
+    return kill(container->pid, signal);
+}
+
+// Kills every process of the cgroup (cgroup.kill, Linux 5.14), or the init
+// of the container, which takes down its pid namespace
+static void monitor_kill(monitor_entry *entry) {
+    int fd = openat(entry->container->cgroup_fd, "cgroup.kill", O_WRONLY | O_CLOEXEC);
+
+    log_info("killing container %s...", entry->container->name);
+    entry->kill_at = 0;
+    if (fd >= 0 && write(fd, "1", 1) == 1) {
+        close(fd);
+        return;
+    }
+    if (fd >= 0)
+        close(fd);
+
+    if (!entry->exited && monitor_signal(entry, SIGKILL) && errno != ESRCH)
+        log_error("failed to kill container %s: %m", entry->container->name);
+}
+
+// Asks the container to stop, it is killed after the grace delay. The init
+// of a pid namespace only gets the signals it handles.
+static void monitor_stop(monitor *mon, monitor_entry *entry) {
+    entry->stop_at = 0;
+    if (entry->exited || entry->kill_at)
+        return;
+
+    log_info("stopping container %s...", entry->container->name);
+    if (monitor_signal(entry, SIGTERM) && errno != ESRCH)
+        log_error("failed to stop container %s: %m", entry->container->name);
+    entry->kill_at = monitor_now_ms() + mon->grace_ms;
+}
+
+static void monitor_reap(monitor *mon, monitor_entry *entry) {
+    int status = 0;
+
+    if (entry->exited || waitpid(entry->container->pid, &status, WNOHANG) <= 0)
+        return;
+
+    entry->exited = true;
+    entry->status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    entry->container->pid = -1;
+    entry->stop_at = 0;
+    log_info("container %s exited with %d", entry->container->name, entry->status);
+
+    if (entry->container->pidfd >= 0)
+        epoll_ctl(mon->epoll_fd, EPOLL_CTL_DEL, entry->container->pidfd, NULL);
+
+    // Processes left in the cgroup get the grace delay to go away
+    if (entry->populated)
+        entry->kill_at = monitor_now_ms() + mon->grace_ms;
+}
+
+static void monitor_handle_signal(monitor *mon) {
+    struct signalfd_siginfo info = {0};
+
+    if (read(mon->signal_fd, &info, sizeof(info)) != sizeof(info))
+        return;
+
+    // Containers without pidfd are only noticed through SIGCHLD
+    if (info.ssi_signo == SIGCHLD) {
+        for (int i = 0; i < mon->count; i++) {
+            if (mon->entries[i].container->pidfd < 0)
+                monitor_reap(mon, &mon->entries[i]);
+        }
+        return;
+    }
+
+    // A second signal does not wait for the grace delay
+    if (mon->stopping) {
+        log_info("received signal %d again, killing containers...", info.ssi_signo);
+        for (int i = 0; i < mon->count; i++) {
+            if (!mon->entries[i].exited || mon->entries[i].populated)
+                monitor_kill(&mon->entries[i]);
+        }
+        return;
+    }
+
+    log_info("received signal %d, stopping containers...", info.ssi_signo);
+    mon->stopping = true;
+    for (int i = 0; i < mon->count; i++)
+        monitor_stop(mon, &mon->entries[i]);
+}
+
+// Relays the output of the container to its log, the pipe is closed once
+// every process of the container closed its end
+static void monitor_relay(monitor *mon, monitor_entry *entry, output_stream stream,
+                          uint32_t events) {
+    output *out = &entry->container->output;
+    int status = output_relay(out, stream, events & (EPOLLHUP | EPOLLERR));
+
+    if (status == 0)
+        return;
+    if (status == -1)
+        log_error("failed to relay output of %s, dropping it", entry->container->name);
+
+    epoll_ctl(mon->epoll_fd, EPOLL_CTL_DEL, out->pipes[stream], NULL);
+    close(out->pipes[stream]);
+    out->pipes[stream] = -1;
+}
+
+static void monitor_handle(monitor *mon, const struct epoll_event *event) {
+    monitor_entry *entry = &mon->entries[event->data.u64 / MONITOR_KINDS];
+    char buffer[64] = {0};
+    ssize_t len = 0;
+
+    switch (event->data.u64 % MONITOR_KINDS) {
+    case MONITOR_PIDFD:
+        monitor_reap(mon, entry);
+        break;
+
+    case MONITOR_SOCKET:
+        // Both ends are close-on-exec, EOF means execve (or exit). A
+        // container that fails to start says why first.
+        if ((len = recv(entry->container->fd, buffer, sizeof(buffer), MSG_DONTWAIT)) > 0) {
+            container_report_error(entry->container->name, buffer, len);
+            break;
+        }
+        epoll_ctl(mon->epoll_fd, EPOLL_CTL_DEL, entry->container->fd, NULL);
+        entry->started = true;
+        log_debug("container %s started", entry->container->name);
+        break;
+
+    case MONITOR_CGROUP_EVENTS:
+        monitor_read_events(entry);
+        log_debug("cgroup of %s is %spopulated", entry->container->name,
+                  entry->populated ? "" : "not ");
+        if (!entry->populated)
+            entry->kill_at = 0;
+        break;
+
+    case MONITOR_STDOUT:
+        monitor_relay(mon, entry, OUTPUT_STDOUT, event->events);
+        break;
+
+    case MONITOR_STDERR:
+        monitor_relay(mon, entry, OUTPUT_STDERR, event->events);
+        break;
+    }
+}
+
+// Handles the deadlines that passed, returns the delay until the next one
+// (-1 for none)
+static int monitor_deadlines(monitor *mon) {
+    uint64_t now = monitor_now_ms();
+    uint64_t next = 0;
+
+    for (int i = 0; i < mon->count; i++) {
+        monitor_entry *entry = &mon->entries[i];
+
+        if (entry->stop_at && entry->stop_at <= now) {
+            log_info("container %s timed out", entry->container->name);
+            monitor_stop(mon, entry);
+        }
+        if (entry->kill_at && entry->kill_at <= now)
+            monitor_kill(entry);
+
+        if (entry->stop_at && (!next || entry->stop_at < next))
+            next = entry->stop_at;
+        if (entry->kill_at && (!next || entry->kill_at < next))
+            next = entry->kill_at;
+    }
+
+    return next ? (int)(next - now) : -1;
+}
+
+// The output of a container is relayed until its last byte, its pipes are
+// closed once its processes are gone
+static bool monitor_done(const monitor *mon) {
+    for (int i = 0; i < mon->count; i++) {
+        const output *out = &mon->entries[i].container->output;
+
+        if (!mon->entries[i].exited || mon->entries[i].populated ||
+            out->pipes[OUTPUT_STDOUT] >= 0 || out->pipes[OUTPUT_STDERR] >= 0)
+            return false;
+    }
+
+    return true;
+}
+
+int monitor_init(monitor *mon, int size, unsigned int grace_ms) {
+    sigset_t mask;
+
+    memset(mon, 0, sizeof(*mon));
+    mon->epoll_fd = -1;
+    mon->signal_fd = -1;
+    mon->grace_ms = grace_ms;
+    mon->size = size;
+
+    if (!(mon->entries = calloc(size, sizeof(*mon->entries)))) {
+        log_error("failed to allocate monitor: %m");
+        return -1;
+    }
+
+    monitor_signals(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    if ((mon->signal_fd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK)) == -1 ||
+        (mon->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        log_error("failed to setup monitor: %m");
+        return -1;
+    }
+
+    if (epoll_ctl(mon->epoll_fd, EPOLL_CTL_ADD, mon->signal_fd,
+                  &(struct epoll_event){.events = EPOLLIN, .data.u64 = MONITOR_SIGNAL})) {
+        log_error("failed to watch signals: %m");
+        return -1;
+    }
+
+    return 0;
+}
+
+int monitor_add(monitor *mon, container *container, unsigned int timeout_ms) {
+    monitor_entry *entry = NULL;
+    int index = mon->count;
+
+    if (mon->count == mon->size) {
+        log_error("too many containers to monitor");
+        return -1;
+    }
+
+    entry = &mon->entries[index];
+    memset(entry, 0, sizeof(*entry));
+    entry->container = container;
+    entry->stop_at = timeout_ms ? monitor_now_ms() + timeout_ms : 0;
+
+    log_debug("monitoring container %s...", container->name);
+    if ((entry->events_fd = openat(container->cgroup_fd, "cgroup.events",
+                                   O_RDONLY | O_CLOEXEC)) >= 0) {
+        monitor_read_events(entry);
+        if (monitor_watch(mon, entry->events_fd, EPOLLPRI, index, MONITOR_CGROUP_EVENTS)) {
+            log_error("failed to watch cgroup.events of %s: %m", container->name);
+            close(entry->events_fd);
+            return -1;
+        }
+    }
+
+    if ((container->pidfd >= 0 &&
+         monitor_watch(mon, container->pidfd, EPOLLIN, index, MONITOR_PIDFD)) ||
+        (container->fd >= 0 &&
+         monitor_watch(mon, container->fd, EPOLLIN | EPOLLRDHUP, index, MONITOR_SOCKET)) ||
+        (container->output.pipes[OUTPUT_STDOUT] >= 0 &&
+         monitor_watch(mon, container->output.pipes[OUTPUT_STDOUT], EPOLLIN, index,
+                       MONITOR_STDOUT)) ||
+        (container->output.pipes[OUTPUT_STDERR] >= 0 &&
+         monitor_watch(mon, container->output.pipes[OUTPUT_STDERR], EPOLLIN, index,
+                       MONITOR_STDERR))) {
+        log_error("failed to monitor container %s: %m", container->name);
+        if (entry->events_fd >= 0)
+            close(entry->events_fd);
+        return -1;
+    }
+    mon->count++;
+
+    // The container may have exited before being monitored
+    monitor_reap(mon, entry);
+
+    return 0;
+}
+
+int monitor_run(monitor *mon) {
+    struct epoll_event events[MONITOR_EVENTS_MAX];
+    int exitcode = 0;
+
+    log_debug("monitoring %d containers...", mon->count);
+    while (!monitor_done(mon)) {
+        int count = epoll_wait(mon->epoll_fd, events, MONITOR_EVENTS_MAX,
+                               monitor_deadlines(mon));
+
+        if (count == -1) {
+            if (errno == EINTR)
+                continue;
+            log_error("failed to wait for events: %m");
+            return -1;
+        }
+
+        for (int i = 0; i < count; i++) {
+            if (events[i].data.u64 == MONITOR_SIGNAL)
+                monitor_handle_signal(mon);
+            else
+                monitor_handle(mon, &events[i]);
+        }
+    }
+
+    // The first failure is reported, like a single container
+    for (int i = 0; i < mon->count && !exitcode; i++)
+        exitcode = mon->entries[i].status;
+
+    return exitcode;
+}
+
+void monitor_free(monitor *mon) {
+    for (int i = 0; i < mon->count; i++) {
+        if (mon->entries[i].events_fd >= 0)
+            close(mon->entries[i].events_fd);
+    }
+    if (mon->epoll_fd >= 0)
+        close(mon->epoll_fd);
+    if (mon->signal_fd >= 0)
+        close(mon->signal_fd);
+
+    free(mon->entries);
+    mon->entries = NULL;
+    mon->count = 0;
+}
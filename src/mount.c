@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <sys/syscall.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -5,6 +6,17 @@
 #include <string.h>
 #include <libgen.h>
 #include <limits.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <dirent.h>
+#include <endian.h>
+#include <errno.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/loop.h>
 
 #include "log.h"
 #include "mount.h"
@@ -19,13 +31,429 @@ static long pivot_root(const char *new_root, const char *put_old) {
     return syscall(SYS_pivot_root, new_root, put_old);
 }
 
-// Restricts access to resources the process has in its own mount namespace:
+// Writes the lowerdir list of overlayfs to buf. overlayfs lists lower layers
+// from the top one to the bottom one, the configuration from the bottom one.
+static int mount_overlay_lowerdir(const mount_config *config, char *buf,
+                                  size_t size) {
+    size_t len = 0;
+
+    for (int i = config->layers_count - 1; i >= 0 && len < size; i--)
+        len += snprintf(buf + len, size - len, "%s%s", config->layers[i],
+                        i ? ":" : "");
+
+    if (len >= size) {
+        log_error("too many layers, overlayfs options exceed %zu bytes", size);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Returns the directory to bind mount, or NULL if the layers need an overlay.
+// A single read-only layer needs no overlay.
+static const char *mount_source(const mount_config *config) {
+    if (config->layers_count == 1 && !config->upper)
+        return config->layers[0];
+
+    return config->mnt;
+}
+
+// The layers are shared by the containers and the store, a single layer
+// bind mounted as root must be as read-only as the overlay of several
+static bool mount_source_readonly(const mount_config *config) {
+    return config->layers_count == 1 && !config->upper;
+}
+
+// Assembles the layers with overlayfs on target.
+//
+// The lower layers are only read, so any number of containers can share them
+// and the page cache of their files. MS_NOATIME avoids writing access times
+// back for every file the containers read.
+static int mount_overlay(const mount_config *config, const char *target) {
+    char lowerdir[MOUNT_OPTIONS_SIZE] = {0};
+    char options[MOUNT_OPTIONS_SIZE] = {0};
+    unsigned long flags = config->upper ? MS_NOATIME : MS_NOATIME | MS_RDONLY;
+    int len = 0;
+
+    if (mount_overlay_lowerdir(config, lowerdir, sizeof(lowerdir)))
+        return -1;
+
+    if (config->upper)
+        len = snprintf(options, sizeof(options), "lowerdir=%s,upperdir=%s,workdir=%s",
+                       lowerdir, config->upper, config->work);
+    else
+        len = snprintf(options, sizeof(options), "lowerdir=%s", lowerdir);
+
+    if (len >= (int)sizeof(options)) {
+        log_error("too many layers, overlayfs options exceed %zu bytes",
+                  sizeof(options));
+        return -1;
+    }
+
+    log_debug("overlay mount with %s...", options);
+    if (mount("overlay", target, "overlay", flags, options)) {
+        log_error("failed to mount overlay on %s: %m", target);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Creates a detached overlayfs mount of the layers with the new mount API.
+static int mount_overlay_tree(const mount_config *config) {
+    char lowerdir[MOUNT_OPTIONS_SIZE] = {0};
+    unsigned int attrs = config->upper ?
+        MOUNT_ATTR_NOATIME : MOUNT_ATTR_NOATIME | MOUNT_ATTR_RDONLY;
+    int fs_fd = -1;
+    int tree_fd = -1;
+
+    if (mount_overlay_lowerdir(config, lowerdir, sizeof(lowerdir)))
+        return -1;
+
+    log_debug("creating overlay with lowerdir %s...", lowerdir);
+    if ((fs_fd = fsopen("overlay", FSOPEN_CLOEXEC)) == -1) {
+        log_debug("failed to fsopen overlay: %m");
+        return -1;
+    }
+
+    if (fsconfig(fs_fd, FSCONFIG_SET_STRING, "lowerdir", lowerdir, 0) ||
+        (config->upper &&
+         (fsconfig(fs_fd, FSCONFIG_SET_STRING, "upperdir", config->upper, 0) ||
+          fsconfig(fs_fd, FSCONFIG_SET_STRING, "workdir", config->work, 0))) ||
+        fsconfig(fs_fd, FSCONFIG_CMD_CREATE, NULL, NULL, 0) ||
+        (tree_fd = fsmount(fs_fd, FSMOUNT_CLOEXEC, attrs)) == -1) {
+        log_error("failed to create overlay: %m");
+        close(fs_fd);
+        return -1;
+    }
+
+    close(fs_fd);
+    return tree_fd;
+}
+
+// Magic numbers of the image file systems, in their superblocks
+#define MOUNT_EROFS_MAGIC       0xE0F5E1E2
+#define MOUNT_EROFS_OFFSET      1024
+#define MOUNT_SQUASHFS_MAGIC    0x73717368
+
+// Returns the file system of the image, NULL if it is not supported
+static const char *mount_image_type(int fd) {
+    uint32_t magic = 0;
+
+    if (pread(fd, &magic, sizeof(magic), MOUNT_EROFS_OFFSET) == sizeof(magic) &&
+        le32toh(magic) == MOUNT_EROFS_MAGIC)
+        return "erofs";
+    if (pread(fd, &magic, sizeof(magic), 0) == sizeof(magic) &&
+        le32toh(magic) == MOUNT_SQUASHFS_MAGIC)
+        return "squashfs";
+
+    return NULL;
+}
+
+// Returns true if the loop device is attached read-only to the file st
+static bool mount_loop_matches(int loop_fd, const struct stat *st) {
+    struct loop_info64 info = {0};
+
+    if (ioctl(loop_fd, LOOP_GET_STATUS64, &info))
+        return false;
+
+    return info.lo_device == st->st_dev && info.lo_inode == st->st_ino &&
+        (info.lo_flags & LO_FLAGS_READ_ONLY);
+}
+
+// Finds a loop device already attached to the image, by this or another
+// barco process. The open fd keeps the device from being cleared.
+static int mount_loop_find(const char *path, const struct stat *st, char *dev,
+                           size_t size) {
+    DIR *dir = opendir("/sys/block");
+    struct dirent *entry = NULL;
+    int loop_fd = -1;
+
+    if (!dir)
+        return -1;
+
+    while (loop_fd == -1 && (entry = readdir(dir))) {
+        char file[PATH_MAX] = {0};
+        char backing[PATH_MAX] = {0};
+        ssize_t len = 0;
+        int fd = -1;
+
+        if (strncmp(entry->d_name, "loop", strlen("loop")))
+            continue;
+
+        snprintf(file, sizeof(file), "/sys/block/%s/loop/backing_file", entry->d_name);
+        if ((fd = open(file, O_RDONLY | O_CLOEXEC)) == -1)
+            continue;
+        len = read(fd, backing, sizeof(backing) - 1);
+        close(fd);
+        if (len <= 0)
+            continue;
+        backing[strcspn(backing, "\n")] = '\0';
+        if (strcmp(backing, path))
+            continue;
+
+        snprintf(dev, size, "/dev/%s", entry->d_name);
+        if ((loop_fd = open(dev, O_RDONLY | O_CLOEXEC)) >= 0 &&
+            !mount_loop_matches(loop_fd, st)) {
+            close(loop_fd);
+            loop_fd = -1;
+        }
+    }
+
+    closedir(dir);
+    return loop_fd;
+}
+
+// Attaches the image to a free loop device (LOOP_CONFIGURE, Linux 5.8, or
+// LOOP_SET_FD before). The device is:
+// - read-only
+// - cleared when the last mount goes away (autoclear)
+// - reading the image with direct I/O, so its blocks are only cached once,
+// by the file system of the image
+//
+// The device keeps its own open file of the image, which must not be the one
+// holding the lock of the image.
+static int mount_loop_attach(const char *path, char *dev, size_t size) {
+    struct loop_config loop = {
+        .info.lo_flags = LO_FLAGS_READ_ONLY | LO_FLAGS_AUTOCLEAR | LO_FLAGS_DIRECT_IO,
+    };
+    int image_fd = open(path, O_RDONLY | O_CLOEXEC);
+    int ctl_fd = open("/dev/loop-control", O_RDWR | O_CLOEXEC);
+    int loop_fd = -1;
+
+    if (image_fd == -1 || ctl_fd == -1) {
+        log_error("failed to open %s or /dev/loop-control: %m", path);
+        goto exit;
+    }
+    loop.fd = image_fd;
+    snprintf((char *)loop.info.lo_file_name, LO_NAME_SIZE, "%s", path);
+
+    for (int i = 0; i < MOUNT_LOOP_RETRIES; i++) {
+        int index = ioctl(ctl_fd, LOOP_CTL_GET_FREE);
+
+        if (index < 0)
+            break;
+
+        snprintf(dev, size, "/dev/loop%d", index);
+        if ((loop_fd = open(dev, O_RDONLY | O_CLOEXEC)) == -1)
+            break;
+
+        if (!ioctl(loop_fd, LOOP_CONFIGURE, &loop))
+            break;
+        if (errno == EINVAL &&
+            !ioctl(loop_fd, LOOP_SET_FD, image_fd)) {
+            if (ioctl(loop_fd, LOOP_SET_STATUS64, &loop.info) ||
+                ioctl(loop_fd, LOOP_SET_DIRECT_IO, 1))
+                log_debug("failed to configure %s: %m", dev);
+            break;
+        }
+
+        // Another process took the device in between
+        close(loop_fd);
+        loop_fd = -1;
+        if (errno != EBUSY)
+            break;
+    }
+
+    if (loop_fd == -1)
+        log_error("failed to attach %s to a loop device: %m", path);
+
+exit:
+    if (image_fd >= 0)
+        close(image_fd);
+    if (ctl_fd >= 0)
+        close(ctl_fd);
+    return loop_fd;
+}
+
+// Returns an fd of the loop device of the image, and the device and the file
+// system to mount. The image is locked while looking for its device, so that
+// all the containers of an image share one device, one superblock and thus
+// one page cache.
+static int mount_image_loop(const char *image, char *dev, size_t size,
+                            const char **type) {
+    char path[PATH_MAX] = {0};
+    struct stat st = {0};
+    int image_fd = -1;
+    int loop_fd = -1;
+
+    if ((image_fd = open(image, O_RDONLY | O_CLOEXEC)) == -1 ||
+        fstat(image_fd, &st) || !realpath(image, path)) {
+        log_error("failed to open image %s: %m", image);
+        goto exit;
+    }
+
+    if (!(*type = mount_image_type(image_fd))) {
+        log_error("%s is neither an EROFS nor a SquashFS image", image);
+        goto exit;
+    }
+
+    if (flock(image_fd, LOCK_EX)) {
+        log_error("failed to lock image %s: %m", image);
+        goto exit;
+    }
+
+    if ((loop_fd = mount_loop_find(path, &st, dev, size)) == -1)
+        loop_fd = mount_loop_attach(path, dev, size);
+    else
+        log_debug("image %s is attached to %s", image, dev);
+
+exit:
+    if (image_fd >= 0)
+        close(image_fd);
+    return loop_fd;
+}
+
+// Creates a detached mount of the image with the new mount API.
+static int mount_image_tree(const mount_config *config) {
+    char dev[PATH_MAX] = {0};
+    const char *type = NULL;
+    int loop_fd = -1;
+    int fs_fd = -1;
+    int tree_fd = -1;
+
+    if ((loop_fd = mount_image_loop(config->image, dev, sizeof(dev), &type)) == -1)
+        return -1;
+
+    log_debug("creating %s mount of %s...", type, dev);
+    if ((fs_fd = fsopen(type, FSOPEN_CLOEXEC)) == -1) {
+        log_debug("failed to fsopen %s: %m", type);
+        close(loop_fd);
+        return -1;
+    }
+
+    if (fsconfig(fs_fd, FSCONFIG_SET_STRING, "source", dev, 0) ||
+        fsconfig(fs_fd, FSCONFIG_SET_FLAG, "ro", NULL, 0) ||
+        fsconfig(fs_fd, FSCONFIG_CMD_CREATE, NULL, NULL, 0) ||
+        (tree_fd = fsmount(fs_fd, FSMOUNT_CLOEXEC,
+                           MOUNT_ATTR_RDONLY | MOUNT_ATTR_NOATIME)) == -1)
+        log_error("failed to mount image %s: %m", config->image);
+
+    close(fs_fd);
+    close(loop_fd);
+    return tree_fd;
+}
+
+// Mounts the image on target.
+static int mount_image(const mount_config *config, const char *target) {
+    char dev[PATH_MAX] = {0};
+    const char *type = NULL;
+    int loop_fd = -1;
+    int err = 0;
+
+    if ((loop_fd = mount_image_loop(config->image, dev, sizeof(dev), &type)) == -1)
+        return -1;
+
+    log_debug("%s mount of %s...", type, dev);
+    if ((err = mount(dev, target, type, MS_RDONLY | MS_NOATIME, NULL)))
+        log_error("failed to mount image %s on %s: %m", config->image, target);
+
+    close(loop_fd);
+    return err;
+}
+
+// The root filesystem is built by barco as a detached mount tree, before the
+// container is cloned:
+// - a recursive clone of the directory (open_tree), or a new overlay or
+// image mount (fsopen / fsconfig / fsmount)
+// - idmapped with the mappings of the containers (mount_setattr), so files
+// owned by root on the host are owned by root in the container and the root
+// filesystem never needs to be chowned
+//
+// The container inherits the fd and attaches the tree with move_mount, with no
+// temporary directory in the host /tmp.
+int mount_prepare(const mount_config *config, int userns_fd) {
+    const char *mnt = mount_source(config);
+    struct mount_attr attr = {
+        .attr_set = MOUNT_ATTR_IDMAP,
+        .userns_fd = userns_fd,
+    };
+    struct mount_attr readonly = {
+        .attr_set = MOUNT_ATTR_RDONLY | MOUNT_ATTR_NOATIME,
+    };
+    int tree_fd = -1;
+
+    log_debug("preparing mount tree...");
+    if (config->image) {
+        if ((tree_fd = mount_image_tree(config)) == -1)
+            return -1;
+    } else if (mnt) {
+        if ((tree_fd = open_tree(AT_FDCWD, mnt,
+                                 OPEN_TREE_CLONE | OPEN_TREE_CLOEXEC | AT_RECURSIVE)) == -1) {
+            log_debug("failed to open_tree %s: %m", mnt);
+            return -1;
+        }
+        if (mount_source_readonly(config) &&
+            mount_setattr(tree_fd, "", AT_EMPTY_PATH | AT_RECURSIVE, &readonly,
+                          sizeof(readonly))) {
+            log_error("failed to make %s read-only: %m", mnt);
+            close(tree_fd);
+            return -1;
+        }
+    } else if ((tree_fd = mount_overlay_tree(config)) == -1) {
+        return -1;
+    }
+
+    // Not every file system supports idmapped mounts, the tree is still
+    // usable without, files owned by root on the host are then read-only
+    if (userns_fd >= 0 &&
+        mount_setattr(tree_fd, "", AT_EMPTY_PATH | AT_RECURSIVE, &attr, sizeof(attr)))
+        log_warn("failed to idmap the root filesystem: %m");
+
+    log_debug("mount tree prepared");
+    return tree_fd;
+}
+
+// Attaches the mount tree prepared by barco as the new root:
+// - move_mount stacks the tree on top of /
+// - pivot_root(".", ".") from the tree swaps it with the old root, which ends
+// up stacked on top of the new root
+// - umount the old root
+static int mount_set_tree(int tree_fd) {
+    log_debug("attaching mount tree...");
+    if (move_mount(tree_fd, "", AT_FDCWD, "/", MOVE_MOUNT_F_EMPTY_PATH)) {
+        log_error("failed to move mount tree: %m");
+        return -1;
+    }
+
+    if (fchdir(tree_fd)) {
+        log_error("failed to chdir to mount tree: %m");
+        return -1;
+    }
+
+    log_debug("pivot root...");
+    if (pivot_root(".", ".")) {
+        log_error("failed to pivot root: %m");
+        return -1;
+    }
+
+    log_debug("unmounting old root...");
+    if (umount2(".", MNT_DETACH)) {
+        log_error("failed to umount old root: %m");
+        return -1;
+    }
+
+    if (chdir("/")) {
+        log_error("failed to chdir to /: %m");
+        return -1;
+    }
+
+    close(tree_fd);
+    log_debug("mount set");
+    return 0;
+}
+
+// Restricts access to resources the process has in its own mount namespace.
+// The tree prepared by mount_prepare is used when there is one, otherwise:
 // - Create a temporary directory and one inside of it
-// - Bind mount of the user argument onto the temporary directory
+// - Bind mount of the user argument onto the temporary directory, or mount
+// the overlay of the layers or the image on it
 // - pivot_root makes the bind mount the new root and mounts the old root onto
 // the inner temporary directory
 // - umount the old root and remove the inner temporary directory.
-int mount_set(const char *mnt) {
+int mount_set(const mount_config *config) {
+    const char *mnt = mount_source(config);
+
     log_debug("setting mount...");
 
     // MS_PRIVATE makes the bind mount invisible outside of the namespace
@@ -48,6 +476,9 @@ int mount_set(const char *mnt) {
     }
     log_debug("remounted");
 
+    if (config->tree_fd >= 0)
+        return mount_set_tree(config->tree_fd);
+
     log_debug("creating temporary directory and...");
     char mount_dir[] = "/tmp/barco.XXXXXX";
     // The mkdtemp() function generates a uniquely named temporary directory
@@ -66,9 +497,23 @@ int mount_set(const char *mnt) {
     // mount, which is essentially a mirror of the original directory, and the
     // MS_PRIVATE flag ensures this specific bind mount also remains
     // isolated within the current namespace.
-    log_debug("bind mount...");
-    if (mount(mnt, mount_dir, NULL, MS_BIND | MS_PRIVATE, NULL)) {
-        log_error("failed to bind mount on %s: %m", mnt);
+    if (config->image) {
+        if (mount_image(config, mount_dir))
+            return -1;
+    } else if (mnt) {
+        log_debug("bind mount...");
+        if (mount(mnt, mount_dir, NULL, MS_BIND | MS_PRIVATE, NULL)) {
+            log_error("failed to bind mount on %s: %m", mnt);
+            return -1;
+        }
+        // The flags of a bind mount are only changed by a remount
+        if (mount_source_readonly(config) &&
+            mount(NULL, mount_dir, NULL,
+                  MS_REMOUNT | MS_BIND | MS_RDONLY | MS_NOATIME, NULL)) {
+            log_error("failed to make %s read-only: %m", mnt);
+            return -1;
+        }
+    } else if (mount_overlay(config, mount_dir)) {
         return -1;
     }
 
@@ -0,0 +1,462 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sched.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/if_link.h>
+#include <linux/veth.h>
+#include <linux/pkt_sched.h>
+
+#include "log.h"
+#include "net.h"
+
+// A netlink request being built
+typedef struct {
+    struct nlmsghdr *hdr;
+    char buffer[NET_MSG_SIZE] __attribute__((aligned(NLMSG_ALIGNTO)));
+} net_msg;
+
+// An address with its prefix length
+typedef struct {
+    int family;
+    unsigned char bytes[16];
+    size_t len;
+    unsigned int prefix;
+} net_addr;
+
+int net_parse_mode(const char *name, net_mode *mode) {
+    static const char *names[] = {
+        [NET_MODE_NONE] = "none",
+        [NET_MODE_LOOPBACK] = "loopback",
+        [NET_MODE_VETH] = "veth",
+        [NET_MODE_MACVLAN] = "macvlan",
+        [NET_MODE_IPVLAN] = "ipvlan",
+    };
+
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (!strcmp(name, names[i])) {
+            *mode = i;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+int net_parse_rate(const char *text, uint64_t *rate) {
+    char *end = NULL;
+    uint64_t unit = 1;
+
+    errno = 0;
+    *rate = strtoull(text, &end, 10);
+    if (end == text || errno)
+        return -1;
+
+    switch (*end) {
+    case 'g': case 'G': unit *= 1024; // fallthrough
+    case 'm': case 'M': unit *= 1024; // fallthrough
+    case 'k': case 'K': unit *= 1024; end++; break;
+    }
+    if (*end || !*rate || *rate > UINT64_MAX / unit / NET_RATE_LATENCY_MS)
+        return -1;
+    *rate *= unit;
+
+    return 0;
+}
+
+// Parses an address, with a prefix if prefix is true
+static int net_parse_addr(const char *text, bool prefix, net_addr *addr) {
+    char host[INET6_ADDRSTRLEN] = {0};
+    const char *slash = strchr(text, '/');
+    size_t len = slash ? (size_t)(slash - text) : strlen(text);
+    char *end = NULL;
+
+    if (len >= sizeof(host) || (prefix && !slash) || (!prefix && slash))
+        goto invalid;
+    memcpy(host, text, len);
+
+    addr->family = strchr(host, ':') ? AF_INET6 : AF_INET;
+    addr->len = addr->family == AF_INET6 ? 16 : 4;
+    if (inet_pton(addr->family, host, addr->bytes) != 1)
+        goto invalid;
+
+    addr->prefix = addr->len * 8;
+    if (slash) {
+        addr->prefix = strtoul(slash + 1, &end, 10);
+        if (!slash[1] || *end || addr->prefix > addr->len * 8)
+            goto invalid;
+    }
+
+    return 0;
+
+invalid:
+    log_error("invalid address %s", text);
+    return -1;
+}
+
+static struct nlmsghdr *net_msg_init(net_msg *msg, uint16_t type, uint16_t flags,
+                                     const void *header, size_t len) {
+    memset(msg->buffer, 0, NLMSG_SPACE(len));
+    msg->hdr = (struct nlmsghdr *)msg->buffer;
+    msg->hdr->nlmsg_len = NLMSG_LENGTH(len);
+    msg->hdr->nlmsg_type = type;
+    msg->hdr->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | flags;
+    memcpy(NLMSG_DATA(msg->hdr), header, len);
+
+    return msg->hdr;
+}
+
+// Appends raw data to the request (e.g. the ifinfomsg of a veth peer)
+static void *net_msg_put(net_msg *msg, const void *data, size_t len) {
+    size_t offset = NLMSG_ALIGN(msg->hdr->nlmsg_len);
+    char *ptr = msg->buffer + offset;
+
+    // The requests of barco are far smaller than a page
+    if (offset + RTA_ALIGN(len) > sizeof(msg->buffer)) {
+        log_error("netlink request too large");
+        abort();
+    }
+
+    memset(ptr, 0, RTA_ALIGN(len));
+    if (data)
+        memcpy(ptr, data, len);
+    msg->hdr->nlmsg_len = offset + RTA_ALIGN(len);
+
+    return ptr;
+}
+
+static struct rtattr *net_attr(net_msg *msg, uint16_t type, const void *data, size_t len) {
+    struct rtattr *attr = net_msg_put(msg, NULL, RTA_LENGTH(len));
+
+    attr->rta_type = type;
+    attr->rta_len = RTA_LENGTH(len);
+    if (data)
+        memcpy(RTA_DATA(attr), data, len);
+
+    return attr;
+}
+
+static void net_attr_u32(net_msg *msg, uint16_t type, uint32_t value) {
+    net_attr(msg, type, &value, sizeof(value));
+}
+
+static void net_attr_string(net_msg *msg, uint16_t type, const char *value) {
+    net_attr(msg, type, value, strlen(value) + 1);
+}
+
+// Nested attributes are closed by net_nest_end
+static struct rtattr *net_nest(net_msg *msg, uint16_t type) {
+    return net_attr(msg, type, NULL, 0);
+}
+
+static void net_nest_end(net_msg *msg, struct rtattr *nest) {
+    nest->rta_len = msg->buffer + msg->hdr->nlmsg_len - (char *)nest;
+}
+
+// Sends the request and waits for its acknowledgement
+static int net_send(int fd, net_msg *msg, const char *what) {
+    static uint32_t seq = 0;
+    char reply[NET_MSG_SIZE] __attribute__((aligned(NLMSG_ALIGNTO)));
+    struct nlmsghdr *hdr = (struct nlmsghdr *)reply;
+    ssize_t len = 0;
+
+    msg->hdr->nlmsg_seq = __atomic_add_fetch(&seq, 1, __ATOMIC_RELAXED);
+    if (send(fd, msg->hdr, msg->hdr->nlmsg_len, 0) == -1 ||
+        (len = recv(fd, reply, sizeof(reply), 0)) == -1) {
+        log_error("failed to %s: %m", what);
+        return -1;
+    }
+
+    if (!NLMSG_OK(hdr, (size_t)len) || hdr->nlmsg_type != NLMSG_ERROR) {
+        log_error("failed to %s: unexpected netlink reply", what);
+        return -1;
+    }
+    if (((struct nlmsgerr *)NLMSG_DATA(hdr))->error) {
+        errno = -((struct nlmsgerr *)NLMSG_DATA(hdr))->error;
+        log_error("failed to %s: %m", what);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int net_link_up(int fd, int index, unsigned int mtu) {
+    struct ifinfomsg ifi = {
+        .ifi_family = AF_UNSPEC,
+        .ifi_index = index,
+        .ifi_flags = IFF_UP,
+        .ifi_change = IFF_UP,
+    };
+    net_msg msg;
+
+    net_msg_init(&msg, RTM_NEWLINK, 0, &ifi, sizeof(ifi));
+    if (mtu)
+        net_attr_u32(&msg, IFLA_MTU, mtu);
+
+    return net_send(fd, &msg, "set link up");
+}
+
+// Creates a veth pair, the container end is created in the namespace of pid
+static int net_create_veth(int fd, const net_config *config, const char *host_name,
+                           pid_t pid) {
+    struct ifinfomsg ifi = {.ifi_family = AF_UNSPEC};
+    struct rtattr *linkinfo = NULL;
+    struct rtattr *data = NULL;
+    struct rtattr *peer = NULL;
+    net_msg msg;
+
+    net_msg_init(&msg, RTM_NEWLINK, NLM_F_CREATE | NLM_F_EXCL, &ifi, sizeof(ifi));
+    net_attr_string(&msg, IFLA_IFNAME, host_name);
+    if (config->mtu)
+        net_attr_u32(&msg, IFLA_MTU, config->mtu);
+    if (config->bridge) {
+        unsigned int bridge = if_nametoindex(config->bridge);
+
+        if (!bridge) {
+            log_error("failed to find bridge %s: %m", config->bridge);
+            return -1;
+        }
+        net_attr_u32(&msg, IFLA_MASTER, bridge);
+    }
+
+    linkinfo = net_nest(&msg, IFLA_LINKINFO);
+    net_attr_string(&msg, IFLA_INFO_KIND, "veth");
+    data = net_nest(&msg, IFLA_INFO_DATA);
+    peer = net_nest(&msg, VETH_INFO_PEER);
+    net_msg_put(&msg, &ifi, sizeof(ifi));
+    net_attr_string(&msg, IFLA_IFNAME, NET_IFNAME);
+    net_attr_u32(&msg, IFLA_NET_NS_PID, pid);
+    if (config->mtu)
+        net_attr_u32(&msg, IFLA_MTU, config->mtu);
+    net_nest_end(&msg, peer);
+    net_nest_end(&msg, data);
+    net_nest_end(&msg, linkinfo);
+
+    return net_send(fd, &msg, "create veth pair");
+}
+
+// Creates a macvlan or an ipvlan of the parent directly in the namespace of pid
+static int net_create_vlan(int fd, const net_config *config, pid_t pid) {
+    struct ifinfomsg ifi = {.ifi_family = AF_UNSPEC};
+    unsigned int parent = if_nametoindex(config->parent);
+    struct rtattr *linkinfo = NULL;
+    struct rtattr *data = NULL;
+    net_msg msg;
+
+    if (!parent) {
+        log_error("failed to find interface %s: %m", config->parent);
+        return -1;
+    }
+
+    net_msg_init(&msg, RTM_NEWLINK, NLM_F_CREATE | NLM_F_EXCL, &ifi, sizeof(ifi));
+    net_attr_string(&msg, IFLA_IFNAME, NET_IFNAME);
+    net_attr_u32(&msg, IFLA_LINK, parent);
+    net_attr_u32(&msg, IFLA_NET_NS_PID, pid);
+    if (config->mtu)
+        net_attr_u32(&msg, IFLA_MTU, config->mtu);
+
+    linkinfo = net_nest(&msg, IFLA_LINKINFO);
+    if (config->mode == NET_MODE_MACVLAN) {
+        net_attr_string(&msg, IFLA_INFO_KIND, "macvlan");
+        data = net_nest(&msg, IFLA_INFO_DATA);
+        net_attr_u32(&msg, IFLA_MACVLAN_MODE, MACVLAN_MODE_BRIDGE);
+    } else {
+        uint16_t mode = IPVLAN_MODE_L2;
+
+        net_attr_string(&msg, IFLA_INFO_KIND, "ipvlan");
+        data = net_nest(&msg, IFLA_INFO_DATA);
+        net_attr(&msg, IFLA_IPVLAN_MODE, &mode, sizeof(mode));
+    }
+    net_nest_end(&msg, data);
+    net_nest_end(&msg, linkinfo);
+
+    return net_send(fd, &msg, config->mode == NET_MODE_MACVLAN ? "create macvlan"
+                                                               : "create ipvlan");
+}
+
+static int net_add_address(int fd, int index, const char *address) {
+    struct ifaddrmsg ifa = {.ifa_scope = RT_SCOPE_UNIVERSE, .ifa_index = index};
+    net_addr addr = {0};
+    net_msg msg;
+
+    if (net_parse_addr(address, true, &addr))
+        return -1;
+    ifa.ifa_family = addr.family;
+    ifa.ifa_prefixlen = addr.prefix;
+
+    net_msg_init(&msg, RTM_NEWADDR, NLM_F_CREATE | NLM_F_EXCL, &ifa, sizeof(ifa));
+    net_attr(&msg, IFA_LOCAL, addr.bytes, addr.len);
+    net_attr(&msg, IFA_ADDRESS, addr.bytes, addr.len);
+
+    return net_send(fd, &msg, "add address");
+}
+
+static int net_add_default_route(int fd, int index, const char *gateway) {
+    struct rtmsg rtm = {
+        .rtm_table = RT_TABLE_MAIN,
+        .rtm_protocol = RTPROT_BOOT,
+        .rtm_scope = RT_SCOPE_UNIVERSE,
+        .rtm_type = RTN_UNICAST,
+    };
+    net_addr addr = {0};
+    net_msg msg;
+
+    if (net_parse_addr(gateway, false, &addr))
+        return -1;
+    rtm.rtm_family = addr.family;
+
+    net_msg_init(&msg, RTM_NEWROUTE, NLM_F_CREATE | NLM_F_EXCL, &rtm, sizeof(rtm));
+    net_attr(&msg, RTA_GATEWAY, addr.bytes, addr.len);
+    net_attr_u32(&msg, RTA_OIF, index);
+
+    return net_send(fd, &msg, "add default route");
+}
+
+// Limits the egress rate of the interface with a token bucket filter. The
+// bucket holds 10ms of traffic (at least 32KB, for TSO segments), and
+// packets wait for NET_RATE_LATENCY_MS at most.
+static int net_set_rate(int fd, int index, uint64_t rate) {
+    struct tcmsg tcm = {
+        .tcm_family = AF_UNSPEC,
+        .tcm_ifindex = index,
+        .tcm_handle = TC_H_MAKE(1U << 16, 0),
+        .tcm_parent = TC_H_ROOT,
+    };
+    struct tc_tbf_qopt qopt = {0};
+    uint64_t burst = rate / 100 > 32 * 1024 ? rate / 100 : 32 * 1024;
+    uint64_t limit = rate * NET_RATE_LATENCY_MS / 1000 + burst;
+    struct rtattr *options = NULL;
+    net_msg msg;
+
+    qopt.rate.rate = rate > UINT32_MAX ? UINT32_MAX : rate;
+    qopt.rate.linklayer = TC_LINKLAYER_ETHERNET;
+    qopt.limit = limit > UINT32_MAX ? UINT32_MAX : limit;
+
+    net_msg_init(&msg, RTM_NEWQDISC, NLM_F_CREATE | NLM_F_EXCL, &tcm, sizeof(tcm));
+    net_attr_string(&msg, TCA_KIND, "tbf");
+    options = net_nest(&msg, TCA_OPTIONS);
+    net_attr(&msg, TCA_TBF_PARMS, &qopt, sizeof(qopt));
+    net_attr_u32(&msg, TCA_TBF_BURST, burst > UINT32_MAX ? UINT32_MAX : burst);
+    if (rate > UINT32_MAX)
+        net_attr(&msg, TCA_TBF_RATE64, &rate, sizeof(rate));
+    net_nest_end(&msg, options);
+
+    return net_send(fd, &msg, "set rate limit");
+}
+
+static int net_socket(void) {
+    int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+
+    if (fd == -1)
+        log_error("failed to open netlink socket: %m");
+    return fd;
+}
+
+// Opens a netlink socket in the network namespace of pid, and finds the
+// indexes of its interfaces. A socket stays in the namespace it was created
+// in, so the thread only enters the namespace for that.
+static int net_socket_in(pid_t pid, int *lo_index, int *index) {
+    char path[PATH_MAX] = {0};
+    int host_fd = -1;
+    int ns_fd = -1;
+    int fd = -1;
+
+    snprintf(path, sizeof(path), "/proc/%d/ns/net", pid);
+    if ((host_fd = open("/proc/thread-self/ns/net", O_RDONLY | O_CLOEXEC)) == -1 ||
+        (ns_fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+        log_error("failed to open network namespaces: %m");
+        goto exit;
+    }
+
+    if (setns(ns_fd, CLONE_NEWNET)) {
+        log_error("failed to enter network namespace of %d: %m", pid);
+        goto exit;
+    }
+
+    fd = net_socket();
+    *lo_index = if_nametoindex("lo");
+    *index = if_nametoindex(NET_IFNAME);
+
+    // barco must not stay in the namespace of the container
+    if (setns(host_fd, CLONE_NEWNET)) {
+        log_fatal("failed to leave network namespace of %d: %m", pid);
+        abort();
+    }
+
+exit:
+    if (host_fd >= 0)
+        close(host_fd);
+    if (ns_fd >= 0)
+        close(ns_fd);
+    return fd;
+}
+
+int net_setup(const net_config *config, pid_t pid) {
+    char host_name[IF_NAMESIZE] = {0};
+    int host_fd = -1;
+    int fd = -1;
+    int lo_index = 0;
+    int index = 0;
+    int err = -1;
+
+    log_debug("setting up network of %d...", pid);
+
+    // Interfaces are created from the host, the peer directly in the
+    // namespace of the container
+    if (config->mode >= NET_MODE_VETH) {
+        if ((host_fd = net_socket()) == -1)
+            return -1;
+
+        snprintf(host_name, sizeof(host_name), "bv%d", pid);
+        if ((config->mode == NET_MODE_VETH
+             ? net_create_veth(host_fd, config, host_name, pid)
+             : net_create_vlan(host_fd, config, pid)))
+            goto exit;
+    }
+
+    if ((fd = net_socket_in(pid, &lo_index, &index)) == -1)
+        goto exit;
+
+    if (net_link_up(fd, lo_index, 0))
+        goto exit;
+
+    if (config->mode >= NET_MODE_VETH) {
+        if (!index) {
+            log_error("failed to find %s in the container", NET_IFNAME);
+            goto exit;
+        }
+
+        if ((config->address && net_add_address(fd, index, config->address)) ||
+            net_link_up(fd, index, 0) ||
+            (config->gateway && net_add_default_route(fd, index, config->gateway)) ||
+            (config->rate && net_set_rate(fd, index, config->rate)))
+            goto exit;
+    }
+
+    // The host end of the veth pair shapes the traffic to the container
+    if (config->mode == NET_MODE_VETH &&
+        (net_link_up(host_fd, if_nametoindex(host_name), 0) ||
+         (config->rate && net_set_rate(host_fd, if_nametoindex(host_name), config->rate))))
+        goto exit;
+
+    log_debug("network of %d set up", pid);
+    err = 0;
+
+exit:
+    // The interfaces go away with the namespace of the container
+    if (fd >= 0)
+        close(fd);
+    if (host_fd >= 0)
+        close(host_fd);
+    return err;
+}
@@ -0,0 +1,155 @@
+#define _GNU_SOURCE
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+
+#include "log.h"
+#include "exec.h"
+#include "ns.h"
+
+static const struct {
+    int flag;
+    const char *name;
+} ns_types[NS_TYPES] = {
+    [NS_NET] = {CLONE_NEWNET, "net"},
+    [NS_IPC] = {CLONE_NEWIPC, "ipc"},
+    [NS_UTS] = {CLONE_NEWUTS, "uts"},
+};
+
+int ns_flag(ns_type type) {
+    return ns_types[type].flag;
+}
+
+static int ns_path(const char *name, const char *type, char *path, size_t size) {
+    if (!*name || strchr(name, '/') || !strcmp(name, ".") || !strcmp(name, "..")) {
+        log_error("invalid namespace name %s", name);
+        return -1;
+    }
+    if (snprintf(path, size, type ? "%s/%s/%s" : "%s/%s", NS_PIN_DIR, name, type) >=
+        (int)size) {
+        log_error("namespace path of %s too long", name);
+        return -1;
+    }
+
+    return 0;
+}
+
+// The namespaces are pinned by bind mounts of their nsfs files, which hold
+// them like an open fd would, but outlive barco.
+int ns_pin(const char *name, pid_t pid) {
+    char source[PATH_MAX] = {0};
+    char target[PATH_MAX] = {0};
+    int fd = -1;
+
+    if (ns_path(name, NULL, target, sizeof(target)))
+        return -1;
+
+    log_debug("pinning namespaces of %d as %s...", pid, name);
+    if ((mkdir(EXEC_STATE_DIR, 0755) && errno != EEXIST) ||
+        (mkdir(NS_PIN_DIR, 0755) && errno != EEXIST) || mkdir(target, 0755)) {
+        log_error("failed to create %s: %m", target);
+        return -1;
+    }
+
+    for (int i = 0; i < NS_TYPES; i++) {
+        snprintf(source, sizeof(source), "/proc/%d/ns/%s", pid, ns_types[i].name);
+        if (ns_path(name, ns_types[i].name, target, sizeof(target)))
+            goto error;
+
+        // A bind mount needs an existing file as its target
+        if ((fd = open(target, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0444)) == -1) {
+            log_error("failed to create %s: %m", target);
+            goto error;
+        }
+        close(fd);
+
+        if (mount(source, target, NULL, MS_BIND, NULL)) {
+            log_error("failed to pin %s on %s: %m", source, target);
+            goto error;
+        }
+    }
+
+    return 0;
+
+error:
+    ns_unpin(name);
+    return -1;
+}
+
+int ns_unpin(const char *name) {
+    char path[PATH_MAX] = {0};
+    int result = 0;
+
+    log_debug("unpinning namespaces %s...", name);
+    for (int i = 0; i < NS_TYPES; i++) {
+        if (ns_path(name, ns_types[i].name, path, sizeof(path)))
+            return -1;
+
+        // MNT_DETACH, as the joined containers may still be setting up
+        if (umount2(path, MNT_DETACH) && errno != EINVAL && errno != ENOENT) {
+            log_error("failed to unmount %s: %m", path);
+            result = -1;
+        }
+        if (unlink(path) && errno != ENOENT) {
+            log_error("failed to remove %s: %m", path);
+            result = -1;
+        }
+    }
+
+    if (ns_path(name, NULL, path, sizeof(path)) || (rmdir(path) && errno != ENOENT)) {
+        log_error("failed to remove %s: %m", path);
+        result = -1;
+    }
+
+    return result;
+}
+
+int ns_open(const char *name, int fds[NS_TYPES]) {
+    char path[PATH_MAX] = {0};
+
+    for (int i = 0; i < NS_TYPES; i++)
+        fds[i] = -1;
+
+    for (int i = 0; i < NS_TYPES; i++) {
+        if (ns_path(name, ns_types[i].name, path, sizeof(path)))
+            goto error;
+
+        // A file left by a pin that failed is not a namespace, setns tells
+        if ((fds[i] = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+            log_error("failed to open namespace %s: %m", path);
+            goto error;
+        }
+    }
+
+    return 0;
+
+error:
+    ns_close(fds);
+    return -1;
+}
+
+int ns_join(const int fds[NS_TYPES]) {
+    for (int i = 0; i < NS_TYPES; i++) {
+        if (fds[i] >= 0 && setns(fds[i], ns_types[i].flag)) {
+            log_error("failed to join %s namespace: %m", ns_types[i].name);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void ns_close(int fds[NS_TYPES]) {
+    for (int i = 0; i < NS_TYPES; i++) {
+        if (fds[i] >= 0) {
+            close(fds[i]);
+            fds[i] = -1;
+        }
+    }
+}
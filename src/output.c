@@ -0,0 +1,211 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+#include "log.h"
+#include "output.h"
+
+static const char *output_stream_names[OUTPUT_STREAMS] = {
+    [OUTPUT_STDOUT] = "stdout",
+    [OUTPUT_STDERR] = "stderr",
+};
+
+int output_parse_size(const char *text, uint64_t *size) {
+    char *end = NULL;
+    uint64_t unit = 1;
+
+    errno = 0;
+    *size = strtoull(text, &end, 10);
+    if (end == text || errno)
+        return -1;
+
+    switch (*end) {
+    case 'g': case 'G': unit *= 1024; // fallthrough
+    case 'm': case 'M': unit *= 1024; // fallthrough
+    case 'k': case 'K': unit *= 1024; end++; break;
+    }
+    if (*end || !*size || *size > UINT64_MAX / unit)
+        return -1;
+    *size *= unit;
+
+    return 0;
+}
+
+// splice does not write to O_APPEND files, the log is written at explicit
+// offsets instead
+static int output_open(output *out) {
+    struct stat st = {0};
+
+    if ((out->fd = open(out->path, O_WRONLY | O_CREAT | O_CLOEXEC, 0640)) == -1 ||
+        fstat(out->fd, &st)) {
+        log_error("failed to open log %s: %m", out->path);
+        return -1;
+    }
+
+    out->size = st.st_size;
+    out->opened = time(NULL);
+    return 0;
+}
+
+// Moves <name>.log to <name>.log.1, <name>.log.1 to <name>.log.2, ... the
+// oldest one is overwritten
+static int output_rotate(output *out) {
+    char from[PATH_MAX + 16] = {0};
+    char to[PATH_MAX + 16] = {0};
+
+    log_debug("rotating log %s...", out->path);
+    for (int i = out->config->keep - 1; i >= 0; i--) {
+        snprintf(from, sizeof(from), i ? "%s.%d" : "%s", out->path, i);
+        snprintf(to, sizeof(to), "%s.%d", out->path, i + 1);
+        if (rename(from, to) && errno != ENOENT)
+            log_warn("failed to rotate %s: %m", from);
+    }
+    close(out->fd);
+    if (output_open(out))
+        return -1;
+
+    if (!out->config->keep) {
+        if (ftruncate(out->fd, 0))
+            log_warn("failed to truncate %s: %m", out->path);
+        else
+            out->size = 0;
+    }
+    return 0;
+}
+
+// Writes the frame header of a chunk
+static int output_frame(output *out, output_stream stream, size_t len) {
+    char header[128] = {0};
+    struct timespec ts = {0};
+    struct tm tm = {0};
+    int count = 0;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    gmtime_r(&ts.tv_sec, &tm);
+    count = strftime(header, sizeof(header), "%Y-%m-%dT%H:%M:%S", &tm);
+    count += snprintf(header + count, sizeof(header) - count, ".%09ldZ %s %zu\n",
+                      ts.tv_nsec, output_stream_names[stream], len);
+
+    if (pwrite(out->fd, header, count, out->size) != count) {
+        log_error("failed to write log %s: %m", out->path);
+        return -1;
+    }
+    out->size += count;
+
+    return 0;
+}
+
+int output_init(output *out, const output_config *config, const char *name,
+                int child_fds[OUTPUT_STREAMS]) {
+    int fds[2] = {-1, -1};
+
+    memset(out, 0, sizeof(*out));
+    out->config = config;
+    out->fd = -1;
+    for (int i = 0; i < OUTPUT_STREAMS; i++) {
+        out->pipes[i] = -1;
+        child_fds[i] = -1;
+    }
+
+    if (snprintf(out->path, sizeof(out->path), "%s/%s.log", config->dir, name) >=
+        (int)sizeof(out->path)) {
+        log_error("log path of %s too long", name);
+        return -1;
+    }
+    if (output_open(out))
+        return -1;
+
+    // Both ends are close-on-exec, the container gets its ends as its stdout
+    // and stderr with dup2 (see container_start)
+    for (int i = 0; i < OUTPUT_STREAMS; i++) {
+        if (pipe2(fds, O_CLOEXEC | O_NONBLOCK)) {
+            log_error("failed to create pipe: %m");
+            for (int j = 0; j < i; j++) {
+                close(child_fds[j]);
+                child_fds[j] = -1;
+            }
+            return -1;
+        }
+        out->pipes[i] = fds[0];
+        child_fds[i] = fds[1];
+
+        // The container end must block, like a terminal or a file would
+        if (fcntl(fds[1], F_SETFL, 0))
+            log_warn("failed to make pipe of %s blocking: %m", name);
+        if (fcntl(fds[0], F_SETPIPE_SZ, OUTPUT_PIPE_SIZE) == -1)
+            log_debug("failed to resize pipe of %s: %m", name);
+    }
+
+    return 0;
+}
+
+int output_relay(output *out, output_stream stream, bool hangup) {
+    int pipe_fd = out->pipes[stream];
+    int echo_fd = stream == OUTPUT_STDOUT ? STDOUT_FILENO : STDERR_FILENO;
+    size_t relayed = 0;
+
+    while (relayed < OUTPUT_RELAY_MAX) {
+        int available = 0;
+        size_t len = 0;
+
+        // Without writers, an empty pipe is closed for good
+        if (ioctl(pipe_fd, FIONREAD, &available) || available <= 0)
+            return hangup ? 1 : 0;
+        len = available;
+
+        if ((out->config->max_size && out->size >= out->config->max_size) ||
+            (out->config->max_age && time(NULL) - out->opened >= out->config->max_age)) {
+            if (output_rotate(out))
+                return -1;
+        }
+        // The rest goes to the next log
+        if (out->config->max_size && len > out->config->max_size - out->size)
+            len = out->config->max_size - out->size;
+
+        // tee duplicates the pages of the pipe, the echo is dropped when
+        // barco's pipe is full rather than slowing the container down
+        if (out->config->echo)
+            tee(pipe_fd, echo_fd, len, SPLICE_F_NONBLOCK);
+
+        if (out->config->framed && output_frame(out, stream, len))
+            return -1;
+
+        // The whole chunk is moved, the frame tells its length
+        while (len > 0) {
+            loff_t offset = out->size;
+            ssize_t moved = splice(pipe_fd, NULL, out->fd, &offset, len,
+                                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+            if (moved <= 0) {
+                if (moved == -1 && errno == EINTR)
+                    continue;
+                log_error("failed to write log %s: %m", out->path);
+                return -1;
+            }
+            len -= moved;
+            relayed += moved;
+            out->size += moved;
+        }
+    }
+
+    return 0;
+}
+
+void output_free(output *out) {
+    for (int i = 0; i < OUTPUT_STREAMS; i++) {
+        if (out->pipes[i] >= 0) {
+            close(out->pipes[i]);
+            out->pipes[i] = -1;
+        }
+    }
+    if (out->fd >= 0) {
+        close(out->fd);
+        out->fd = -1;
+    }
+}
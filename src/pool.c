@@ -0,0 +1,367 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/signalfd.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "log.h"
+#include "container.h"
+#include "pool.h"
+
+// Signals handled by pool_serve through a signalfd. They are blocked before
+// the refill thread starts so that the thread inherits the mask, and the
+// containers reset it in container_start.
+static void pool_signals(sigset_t *mask) {
+    sigemptyset(mask);
+    sigaddset(mask, SIGCHLD);
+    sigaddset(mask, SIGINT);
+    sigaddset(mask, SIGTERM);
+}
+
+// Moves a container into a slot. The hostname of the configuration points
+// into the container itself, so it has to follow the copy.
+static void pool_move(container *dst, const container *src) {
+    *dst = *src;
+    dst->config.hostname = dst->name;
+}
+
+// Kills a container that never got launched and releases it
+static void pool_discard(container *container) {
+    if (container->pid > 0) {
+        container_stop(container->pid);
+        waitpid(container->pid, NULL, 0);
+    }
+    container_destroy(container);
+}
+
+// Waits for the refill delay, or until the pool is stopped
+static void pool_wait_locked(container_pool *pool, long delay_ms) {
+    struct timespec deadline = {0};
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += delay_ms / 1000;
+    deadline.tv_nsec += (delay_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    while (!pool->stop &&
+           pthread_cond_timedwait(&pool->cond, &pool->lock, &deadline) != ETIMEDOUT)
+        ;
+}
+
+// Creates a parked container, called without the lock held
+static int pool_create(container_pool *pool, container *container,
+                       unsigned long seq) {
+    container_config config = pool->config;
+    char name[HOST_NAME_MAX + 1] = {0};
+
+    // The pid of barco is part of the name so that several pools can run
+    snprintf(name, sizeof(name), "%s-%d-%lu", pool->config.hostname, getpid(), seq);
+    config.hostname = name;
+    config.parked = true;
+
+    if (container_create(container, &config)) {
+        log_error("failed to create parked container %s", name);
+        pool_discard(container);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Keeps the pool filled up to its size. Creating containers is the slow part,
+// so it is done without the lock: launches only contend on the list itself.
+static void *pool_refill(void *arg) {
+    container_pool *pool = arg;
+
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->stop) {
+        container entry = {0};
+        unsigned long seq = 0;
+        int failed = 0;
+
+        if (pool->parked_count >= pool->size) {
+            pthread_cond_wait(&pool->cond, &pool->lock);
+            continue;
+        }
+
+        seq = pool->seq++;
+        pthread_mutex_unlock(&pool->lock);
+        failed = pool_create(pool, &entry, seq);
+        pthread_mutex_lock(&pool->lock);
+
+        if (failed) {
+            pool_wait_locked(pool, POOL_RETRY_DELAY_MS);
+            continue;
+        }
+
+        if (pool->stop || pool->parked_count >= pool->size) {
+            pthread_mutex_unlock(&pool->lock);
+            pool_discard(&entry);
+            pthread_mutex_lock(&pool->lock);
+            continue;
+        }
+
+        pool_move(&pool->parked[pool->parked_count++], &entry);
+        log_debug("parked container %s (%d/%d)", entry.name,
+                  pool->parked_count, pool->size);
+
+        if (pool->refill_rate > 0)
+            pool_wait_locked(pool, 1000 / pool->refill_rate);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+int pool_init(container_pool *pool, const container_config *config, int size,
+              int refill_rate) {
+    sigset_t mask;
+    int err = 0;
+
+    log_debug("initializing pool of %d containers...", size);
+    memset(pool, 0, sizeof(*pool));
+    pool->config = *config;
+    pool->size = size;
+    pool->refill_rate = refill_rate;
+
+    if (!(pool->parked = calloc(size, sizeof(*pool->parked)))) {
+        log_error("failed to allocate pool: %m");
+        return -1;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+
+    pool_signals(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    if ((err = pthread_create(&pool->refill, NULL, pool_refill, pool))) {
+        log_error("failed to start refill thread: %s", strerror(err));
+        free(pool->parked);
+        pool->parked = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+pid_t pool_launch(container_pool *pool, const char *msg, size_t len) {
+    container entry = {0};
+    container *launched = NULL;
+
+    // Room is made first, a launched container must always be tracked so
+    // that pool_reap and pool_free release it
+    if (!(launched = realloc(pool->launched,
+                             (pool->launched_count + 1) * sizeof(*launched)))) {
+        log_error("failed to allocate launched containers: %m");
+        return -1;
+    }
+    pool->launched = launched;
+
+    for (;;) {
+        bool parked = false;
+        unsigned long seq = 0;
+
+        pthread_mutex_lock(&pool->lock);
+        if ((parked = pool->parked_count > 0))
+            pool_move(&entry, &pool->parked[--pool->parked_count]);
+        else
+            seq = pool->seq++;
+        pthread_cond_signal(&pool->cond);
+        pthread_mutex_unlock(&pool->lock);
+
+        // An empty pool means a cold start, the burst outran the refill
+        if (!parked) {
+            log_warn("pool is empty, creating a container...");
+            if (pool_create(pool, &entry, seq))
+                return -1;
+        }
+
+        if (!container_launch(&entry, msg, len))
+            break;
+
+        // The parked container died, try the next one
+        pool_discard(&entry);
+    }
+
+    pool_move(&pool->launched[pool->launched_count++], &entry);
+
+    log_info("launched container %s (pid %d)", entry.name, entry.pid);
+    return entry.pid;
+}
+
+// Reaps the container if it exited. Returns true if it did, its pid is then
+// reset as it may be reused by any process from now on.
+static bool pool_reaped(container *container) {
+    if (container->pid <= 0 || waitpid(container->pid, NULL, WNOHANG) <= 0)
+        return false;
+
+    container->pid = -1;
+    container_destroy(container);
+    return true;
+}
+
+void pool_reap(container_pool *pool) {
+    for (int i = 0; i < pool->launched_count; i++) {
+        if (!pool_reaped(&pool->launched[i]))
+            continue;
+
+        log_info("container %s exited", pool->launched[i].name);
+        pool_move(&pool->launched[i], &pool->launched[--pool->launched_count]);
+        i--;
+    }
+
+    // A parked container should not exit, drop it so that it gets replaced
+    pthread_mutex_lock(&pool->lock);
+    for (int i = 0; i < pool->parked_count; i++) {
+        if (!pool_reaped(&pool->parked[i]))
+            continue;
+
+        log_warn("parked container %s exited", pool->parked[i].name);
+        pool_move(&pool->parked[i], &pool->parked[--pool->parked_count]);
+        pthread_cond_signal(&pool->cond);
+        i--;
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Handles one launch request of a client. Returns -1 when the client is gone.
+static int pool_serve_client(container_pool *pool, int fd) {
+    static char msg[CONTAINER_LAUNCH_MSG_MAX];
+    static char copy[CONTAINER_LAUNCH_MSG_MAX];
+    char *argv[CONTAINER_LAUNCH_ARGS_MAX + 1] = {0};
+    char *envp[CONTAINER_LAUNCH_ARGS_MAX + 1] = {0};
+    ssize_t len = 0;
+    int pid = -1;
+
+    if ((len = recv(fd, msg, sizeof(msg), 0)) <= 0)
+        return -1;
+
+    // Messages are checked here so that a bad request does not burn a
+    // parked container
+    memcpy(copy, msg, len);
+    if (!container_launch_parse(copy, len, argv, envp))
+        pid = pool_launch(pool, msg, len);
+
+    if (send(fd, &pid, sizeof(pid), MSG_NOSIGNAL) != sizeof(pid))
+        return -1;
+
+    return 0;
+}
+
+int pool_serve(container_pool *pool, const char *path) {
+    struct pollfd fds[2 + POOL_CLIENTS_MAX] = {0};
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    sigset_t mask;
+    int nfds = 2;
+    int result = -1;
+
+    log_debug("serving launch requests on %s...", path);
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        log_error("socket path %s too long", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    pool_signals(&mask);
+    if ((fds[0].fd = signalfd(-1, &mask, SFD_CLOEXEC)) == -1) {
+        log_error("failed to setup signals: %m");
+        return -1;
+    }
+    fds[0].events = POLLIN;
+
+    unlink(path);
+    if ((fds[1].fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) == -1 ||
+        bind(fds[1].fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+        listen(fds[1].fd, POOL_CLIENTS_MAX)) {
+        log_error("failed to listen on %s: %m", path);
+        goto exit;
+    }
+    fds[1].events = POLLIN;
+
+    log_info("pool ready on %s", path);
+    for (;;) {
+        if (poll(fds, nfds, -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            log_error("failed to poll: %m");
+            goto exit;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            struct signalfd_siginfo info = {0};
+
+            if (read(fds[0].fd, &info, sizeof(info)) != sizeof(info)) {
+                log_error("failed to read signal: %m");
+                goto exit;
+            }
+
+            if (info.ssi_signo != SIGCHLD) {
+                log_info("received signal %d, stopping pool...", info.ssi_signo);
+                break;
+            }
+
+            pool_reap(pool);
+        }
+
+        if ((fds[1].revents & POLLIN) && nfds < (int)(sizeof(fds) / sizeof(*fds))) {
+            int fd = accept4(fds[1].fd, NULL, NULL, SOCK_CLOEXEC);
+
+            if (fd >= 0)
+                fds[nfds++] = (struct pollfd){.fd = fd, .events = POLLIN};
+        }
+
+        for (int i = 2; i < nfds; i++) {
+            if (!fds[i].revents || !pool_serve_client(pool, fds[i].fd))
+                continue;
+
+            close(fds[i].fd);
+            fds[i--] = fds[--nfds];
+        }
+    }
+    result = 0;
+
+exit:
+    for (int i = 0; i < nfds; i++) {
+        if (fds[i].fd > 0)
+            close(fds[i].fd);
+    }
+    unlink(path);
+
+    return result;
+}
+
+void pool_free(container_pool *pool) {
+    log_debug("freeing pool...");
+    if (!pool->parked)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    pthread_join(pool->refill, NULL);
+
+    for (int i = 0; i < pool->parked_count; i++)
+        pool_discard(&pool->parked[i]);
+    for (int i = 0; i < pool->launched_count; i++)
+        pool_discard(&pool->launched[i]);
+
+    free(pool->parked);
+    free(pool->launched);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->cond);
+    pool->parked = NULL;
+    pool->launched = NULL;
+}
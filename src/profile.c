@@ -0,0 +1,114 @@
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "profile.h"
+
+// Names used as JSON keys, indexed by profile_phase
+static const char *profile_phase_names[PROFILE_PHASE_MAX] = {
+    [PROFILE_SOCKETPAIR]        = "socketpair",
+    [PROFILE_CGROUPS]           = "cgroups",
+    [PROFILE_MOUNT_PREPARE]     = "mount_prepare",
+    [PROFILE_STACK]             = "stack",
+    [PROFILE_CLONE]             = "clone",
+    [PROFILE_USERNS_MAPPINGS]   = "userns_mappings",
+    [PROFILE_NET]               = "net",
+    [PROFILE_CHILD_HOSTNAME]    = "child_hostname",
+    [PROFILE_CHILD_MOUNT]       = "child_mount",
+    [PROFILE_CHILD_USERNS]      = "child_userns",
+    [PROFILE_CHILD_CAPS]        = "child_caps",
+    [PROFILE_CHILD_SECCOMP]     = "child_seccomp",
+    [PROFILE_CHILD_EXECVE]      = "child_execve",
+};
+
+// The recorded spans. The container gets its own copy with clone(), fills in
+// the CHILD phases and sends them back with profile_send().
+static struct {
+    bool enabled;
+    profile_span spans[PROFILE_PHASE_MAX];
+} P;
+
+static uint64_t profile_now(void) {
+    struct timespec ts = {0};
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+const char *profile_phase_name(profile_phase phase) {
+    return profile_phase_names[phase];
+}
+
+void profile_enable(bool enable) {
+    P.enabled = enable;
+}
+
+bool profile_enabled(void) {
+    return P.enabled;
+}
+
+void profile_begin(profile_phase phase) {
+    PROFILE_PROBE(phase__begin, phase);
+    if (P.enabled)
+        P.spans[phase].begin_ns = profile_now();
+}
+
+void profile_end(profile_phase phase) {
+    if (P.enabled)
+        P.spans[phase].end_ns = profile_now();
+    PROFILE_PROBE(phase__end, phase);
+}
+
+int profile_send(int fd) {
+    log_debug("sending startup profile...");
+    if (write(fd, P.spans, sizeof(P.spans)) != sizeof(P.spans)) {
+        log_error("failed to send startup profile: %m");
+        return -1;
+    }
+
+    return 0;
+}
+
+int profile_recv(int fd) {
+    profile_span spans[PROFILE_PHASE_MAX] = {0};
+    int eof = 0;
+
+    log_debug("receiving startup profile...");
+    if (read(fd, spans, sizeof(spans)) != sizeof(spans)) {
+        log_error("failed to receive startup profile: %m");
+        return -1;
+    }
+
+    // Only the phases timed by the container are taken from the message
+    for (int phase = PROFILE_CHILD_HOSTNAME; phase < PROFILE_PHASE_MAX; phase++)
+        P.spans[phase] = spans[phase];
+
+    log_debug("waiting for container execve...");
+    if (read(fd, &eof, sizeof(eof)) == -1) {
+        log_error("failed to wait for container execve: %m");
+        return -1;
+    }
+    P.spans[PROFILE_CHILD_EXECVE].end_ns = profile_now();
+
+    return 0;
+}
+
+int profile_write_json(FILE *fp) {
+    const profile_span *first = &P.spans[PROFILE_SOCKETPAIR];
+    const profile_span *last = &P.spans[PROFILE_CHILD_EXECVE];
+
+    fprintf(fp, "{\"event\":\"startup\",\"total_ns\":%llu,\"phases\":{",
+            (unsigned long long)(last->end_ns - first->begin_ns));
+    for (int phase = 0; phase < PROFILE_PHASE_MAX; phase++) {
+        const profile_span *span = &P.spans[phase];
+
+        fprintf(fp, "%s\"%s\":{\"begin_ns\":%llu,\"end_ns\":%llu,\"ns\":%llu}",
+                phase ? "," : "", profile_phase_names[phase],
+                (unsigned long long)span->begin_ns,
+                (unsigned long long)span->end_ns,
+                (unsigned long long)(span->end_ns - span->begin_ns));
+    }
+    fprintf(fp, "}}\n");
+
+    return fflush(fp) ? -1 : 0;
+}
@@ -1,12 +1,26 @@
+#define _GNU_SOURCE
 #include <sys/capability.h>
 #include <sys/prctl.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
 #include <seccomp.h>
 #include <sys/stat.h>
 #include <linux/sched.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
 
 #include "log.h"
 #include "sec.h"
+#include "sec_profile.h"
 
 // Capabilities are used to finely define the privileges of a process.
 // The process' own inheritable set and bounding set of capabilities
@@ -50,15 +64,15 @@
 //
 // Notice: in some edge cases, some capabilities might not be respected because
 // they are not namespaced (e.g. when writing to parts of procfs)
+static cap_value_t drop_caps[] = {
+    CAP_AUDIT_CONTROL,   CAP_AUDIT_READ,   CAP_AUDIT_WRITE, CAP_BLOCK_SUSPEND,
+    CAP_DAC_READ_SEARCH, CAP_FSETID,       CAP_IPC_LOCK,    CAP_MAC_ADMIN,
+    CAP_MAC_OVERRIDE,    CAP_MKNOD,        CAP_SETFCAP,     CAP_SYSLOG,
+    CAP_SYS_ADMIN,       CAP_SYS_BOOT,     CAP_SYS_MODULE,  CAP_SYS_NICE,
+    CAP_SYS_RAWIO,       CAP_SYS_RESOURCE, CAP_SYS_TIME,    CAP_WAKE_ALARM};
+
 int sec_set_caps(void) {
     log_debug("setting capabilities...");
-    int drop_caps[] = {
-        CAP_AUDIT_CONTROL,   CAP_AUDIT_READ,   CAP_AUDIT_WRITE, CAP_BLOCK_SUSPEND,
-        CAP_DAC_READ_SEARCH, CAP_FSETID,       CAP_IPC_LOCK,    CAP_MAC_ADMIN,
-        CAP_MAC_OVERRIDE,    CAP_MKNOD,        CAP_SETFCAP,     CAP_SYSLOG,
-        CAP_SYS_ADMIN,       CAP_SYS_BOOT,     CAP_SYS_MODULE,  CAP_SYS_NICE,
-        CAP_SYS_RAWIO,       CAP_SYS_RESOURCE, CAP_SYS_TIME,    CAP_WAKE_ALARM};
-
     int num_caps = sizeof(drop_caps) / sizeof(*drop_caps);
     log_debug("dropping bounding capabilities...");
     for (int i = 0; i < num_caps; i++) {
@@ -68,27 +82,49 @@ int sec_set_caps(void) {
         }
     }
 
+    // capget / capset rather than libcap, which allocates: the container may
+    // be cloned with the malloc locks of other threads taken
     log_debug("dropping inheritable capabilities...");
-    cap_t caps = NULL;
-    if (!(caps = cap_get_proc()) ||
-        cap_set_flag(caps, CAP_INHERITABLE, num_caps, drop_caps, CAP_CLEAR) ||
-        cap_set_proc(caps)) {
-        log_error("failed to run cap functions: %m");
-        if (caps) {
-            log_debug("freeing caps...");
-            cap_free(caps);
-        }
-
+    struct __user_cap_header_struct header = {.version = _LINUX_CAPABILITY_VERSION_3};
+    struct __user_cap_data_struct data[_LINUX_CAPABILITY_U32S_3] = {0};
+    if (syscall(SYS_capget, &header, data)) {
+        log_error("failed to get capabilities: %m");
+        return 1;
+    }
+    for (int i = 0; i < num_caps; i++)
+        data[CAP_TO_INDEX(drop_caps[i])].inheritable &= ~CAP_TO_MASK(drop_caps[i]);
+    if (syscall(SYS_capset, &header, data)) {
+        log_error("failed to set capabilities: %m");
         return 1;
     }
-
-    log_debug("freeing caps...");
-    cap_free(caps);
     log_debug("capabilities set");
 
     return 0;
 }
 
+bool sec_cap_kept(const char *name) {
+    cap_value_t cap = 0;
+
+    if (cap_from_name(name, &cap))
+        return false;
+
+    for (size_t i = 0; i < sizeof(drop_caps) / sizeof(*drop_caps); i++) {
+        if (drop_caps[i] == cap)
+            return false;
+    }
+
+    return true;
+}
+
+// A rule denying a syscall, with at most one argument comparison.
+#define SEC_RULE(name) { .syscall = SCMP_SYS(name), .action = SEC_SCMP_FAIL }
+#define SEC_RULE_ARG(name, index, cmp, a, b) { \
+    .syscall = SCMP_SYS(name), \
+    .action = SEC_SCMP_FAIL, \
+    .arg_cnt = 1, \
+    .args = {{ .arg = (index), .op = (cmp), .datum_a = (a), .datum_b = (b) }}, \
+}
+
 // Blocks sensitive system calls based on Docker's default seccomp profile
 // and other obsolete or dangerous system calls.
 // The syscalls disallowed by the default Docker policy but permitted by this
@@ -103,72 +139,371 @@ int sec_set_caps(void) {
 // - newer versions or aliases of other syscalls
 //
 // New Linux syscalls are added to the kernel over time, so this list
-// should be updated periodically.
+// should be updated periodically. Any change to the rules changes the hash of
+// the profile, so cached filters are never stale.
+static const sec_profile_rule sec_rules[] = {
+    // Calls that allow creating new setuid / setgid executables.
+    // The contained process could created a setuid binary that can be used
+    // by an user to get root in absence of user namespaces.
+    SEC_RULE_ARG(chmod, 1, SCMP_CMP_MASKED_EQ, S_ISUID, S_ISUID),
+    SEC_RULE_ARG(chmod, 1, SCMP_CMP_MASKED_EQ, S_ISGID, S_ISGID),
+    SEC_RULE_ARG(fchmod, 1, SCMP_CMP_MASKED_EQ, S_ISUID, S_ISUID),
+    SEC_RULE_ARG(fchmod, 1, SCMP_CMP_MASKED_EQ, S_ISGID, S_ISGID),
+    SEC_RULE_ARG(fchmodat, 2, SCMP_CMP_MASKED_EQ, S_ISUID, S_ISUID),
+    SEC_RULE_ARG(fchmodat, 2, SCMP_CMP_MASKED_EQ, S_ISGID, S_ISGID),
+
+    // Calls that allow contained processes to start new user namespaces
+    // and possibly allow processes to gain new capabilities.
+    SEC_RULE_ARG(unshare, 0, SCMP_CMP_MASKED_EQ, CLONE_NEWUSER, CLONE_NEWUSER),
+    SEC_RULE_ARG(clone, 0, SCMP_CMP_MASKED_EQ, CLONE_NEWUSER, CLONE_NEWUSER),
+
+    // Allows contained processes to write to the controlling terminal
+    SEC_RULE_ARG(ioctl, 1, SCMP_CMP_MASKED_EQ, TIOCSTI, TIOCSTI),
+
+    // The kernel keyring system is not namespaced
+    SEC_RULE(keyctl),
+    SEC_RULE(add_key),
+    SEC_RULE(request_key),
+
+    // Before Linux 4.8, ptrace breaks seccomp
+    SEC_RULE(ptrace),
+
+    // Calls that let processes assign NUMA nodes. These could be used to deny
+    // service to other NUMA-aware application on the host.
+    SEC_RULE(mbind),
+    SEC_RULE(migrate_pages),
+    SEC_RULE(move_pages),
+    SEC_RULE(set_mempolicy),
+
+    // Alows userspace to handle page faults It can be used to pause execution
+    // in the kernel by triggering page faults in system calls, a mechanism
+    // often used in kernel exploits.
+    SEC_RULE(userfaultfd),
+
+    // This call could leak a lot of information on the host.
+    // It can theoretically be used to discover kernel addresses and
+    // uninitialized memory.
+    SEC_RULE(perf_event_open),
+};
+
+// The default profile of barco: a deny list of the rules above
+static const sec_profile sec_default_profile = {
+    .default_action = SCMP_ACT_ALLOW,
+    .rules = sec_rules,
+    .rules_count = sizeof(sec_rules) / sizeof(*sec_rules),
+};
+
+// Compiled filter, shared by all the containers of barco (see
+// sec_seccomp_prepare). Each container gets its own copy with clone().
+static struct {
+    struct sock_filter *filter;
+    unsigned short len;
+    // Flags of seccomp(SECCOMP_SET_MODE_FILTER), not part of the program
+    unsigned int flags;
+} S;
+
+// Creates the libseccomp context of a profile.
+//
+// libseccomp checks the syscalls one after the other by default, so the
+// cost of a syscall grows with the number of rules of an allow-list (~400
+// syscalls for Docker's). The filter is compiled into a binary tree instead
+// (libseccomp >= 2.5), which takes a few comparisons for any syscall. The
+// priorities order the checks of the hottest syscalls first when the tree is
+// not available.
+static scmp_filter_ctx sec_seccomp_build(const sec_profile *profile) {
+    scmp_filter_ctx ctx = NULL;
+
+    if (!(ctx = seccomp_init(profile->default_action)))
+        return NULL;
+
+    for (size_t i = 0; i < profile->rules_count; i++) {
+        const sec_profile_rule *rule = &profile->rules[i];
+
+        if (seccomp_rule_add_array(ctx, rule->action, rule->syscall,
+                                   rule->arg_cnt, rule->args))
+            goto error;
+    }
+
+    for (size_t i = 0; i < profile->priorities_count; i++) {
+        uint8_t priority = i < UINT8_MAX ? UINT8_MAX - i : 1;
+
+        if (seccomp_syscall_priority(ctx, profile->priorities[i], priority))
+            goto error;
+    }
+
+    if (seccomp_attr_set(ctx, SCMP_FLTATR_CTL_OPTIMIZE, 2))
+        log_debug("binary tree seccomp filters are not supported");
+
+    // Processes are forced into the SSB mitigation by seccomp, which slows
+    // down their memory accesses (it is only needed against untrusted code
+    // running in the same process, e.g. JIT sandboxes)
+    if (profile->spec_allow && seccomp_attr_set(ctx, SCMP_FLTATR_CTL_SSB, 1))
+        goto error;
+
+    // Prevents setuid and setcap'd binaries from being executed
+    // with additional privileges. This has some security benefits, but due to
+    // weird side-effects, the ping command will not work in a process for
+    // an unprivileged user.
+    if (seccomp_attr_set(ctx, SCMP_FLTATR_CTL_NNP, 0))
+        goto error;
+
+    return ctx;
+
+error:
+    seccomp_release(ctx);
+    return NULL;
+}
+
+// FNV-1a, used to key the cache by the content of the profile
+static uint64_t sec_hash(uint64_t hash, const void *data, size_t len) {
+    const unsigned char *bytes = data;
+
+    for (size_t i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+// The cache key covers everything the compiled filter depends on: the rules,
+// the architecture and the version of libseccomp that compiled it.
+static uint64_t sec_profile_hash(const sec_profile *profile) {
+    const struct scmp_version *version = seccomp_version();
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    hash = sec_hash(hash, version, sizeof(*version));
+    hash = sec_hash(hash, &profile->default_action, sizeof(profile->default_action));
+    hash = sec_hash(hash, &profile->spec_allow, sizeof(profile->spec_allow));
+    for (size_t i = 0; i < profile->rules_count; i++) {
+        const sec_profile_rule *rule = &profile->rules[i];
+
+        hash = sec_hash(hash, &rule->syscall, sizeof(rule->syscall));
+        hash = sec_hash(hash, &rule->action, sizeof(rule->action));
+        hash = sec_hash(hash, &rule->arg_cnt, sizeof(rule->arg_cnt));
+        for (unsigned int j = 0; j < rule->arg_cnt; j++) {
+            const struct scmp_arg_cmp *arg = &rule->args[j];
+
+            hash = sec_hash(hash, &arg->arg, sizeof(arg->arg));
+            hash = sec_hash(hash, &arg->op, sizeof(arg->op));
+            hash = sec_hash(hash, &arg->datum_a, sizeof(arg->datum_a));
+            hash = sec_hash(hash, &arg->datum_b, sizeof(arg->datum_b));
+        }
+    }
+    hash = sec_hash(hash, profile->priorities,
+                    profile->priorities_count * sizeof(*profile->priorities));
+
+    return hash;
+}
+
+// Reads a whole BPF program from fd into S
+static int sec_filter_read(int fd) {
+    struct stat st = {0};
+
+    if (fstat(fd, &st) || !st.st_size ||
+        st.st_size % sizeof(struct sock_filter) ||
+        st.st_size / sizeof(struct sock_filter) > BPF_MAXINSNS) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (!(S.filter = malloc(st.st_size)))
+        return -1;
+
+    if (pread(fd, S.filter, st.st_size, 0) != st.st_size) {
+        free(S.filter);
+        S.filter = NULL;
+        errno = EIO;
+        return -1;
+    }
+    S.len = st.st_size / sizeof(struct sock_filter);
+
+    return 0;
+}
+
+// Compiles the profile with libseccomp and exports the BPF program to S
+static int sec_filter_compile(const sec_profile *profile) {
+    scmp_filter_ctx ctx = NULL;
+    int fd = -1;
+    int result = -1;
+
+    log_debug("compiling seccomp filter...");
+    if (!(ctx = sec_seccomp_build(profile)) ||
+        (fd = memfd_create("barco-seccomp", MFD_CLOEXEC)) == -1 ||
+        seccomp_export_bpf(ctx, fd) || sec_filter_read(fd)) {
+        log_error("failed to compile seccomp filter: %m");
+        goto exit;
+    }
+    result = 0;
+
+exit:
+    if (fd >= 0)
+        close(fd);
+    if (ctx)
+        seccomp_release(ctx);
+    return result;
+}
+
+// The cached filter is installed in every container, so the cache is only
+// used when nobody but root can have written it: the directory and the file
+// must be owned by root and writable by nobody else.
+static bool sec_cache_trusted(int fd, const char *path) {
+    struct stat st = {0};
+
+    if (fstat(fd, &st)) {
+        log_warn("failed to stat %s: %m", path);
+        return false;
+    }
+
+    if (st.st_uid != 0 || (st.st_mode & (S_IWGRP | S_IWOTH)) ||
+        !(S_ISDIR(st.st_mode) || S_ISREG(st.st_mode))) {
+        log_warn("ignoring seccomp cache %s, not owned by root or writable by others", path);
+        return false;
+    }
+
+    return true;
+}
+
+// Opens the cache directory, creating it if needed. Returns -1 if it cannot
+// be trusted.
+static int sec_cache_open(void) {
+    int dir_fd = -1;
+
+    if (mkdir(SEC_CACHE_DIR, S_IRWXU) && errno != EEXIST) {
+        log_warn("failed to create %s: %m", SEC_CACHE_DIR);
+        return -1;
+    }
+
+    if ((dir_fd = open(SEC_CACHE_DIR, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) == -1) {
+        log_warn("failed to open %s: %m", SEC_CACHE_DIR);
+        return -1;
+    }
+
+    if (!sec_cache_trusted(dir_fd, SEC_CACHE_DIR)) {
+        close(dir_fd);
+        return -1;
+    }
+
+    return dir_fd;
+}
+
+// Reads S from the file name of the cache, returns -1 if it is missing,
+// untrusted or invalid
+static int sec_filter_load(int dir_fd, const char *name, const char *path) {
+    int fd = -1;
+    int err = 0;
+
+    if ((fd = openat(dir_fd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC)) == -1)
+        return -1;
+
+    if (!sec_cache_trusted(fd, path)) {
+        close(fd);
+        return -1;
+    }
+
+    err = sec_filter_read(fd);
+    close(fd);
+    if (err) {
+        log_warn("ignoring invalid seccomp cache %s: %m", path);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Writes S to the file name of the cache. The file is renamed into place so
+// that concurrent barco processes never read a partial filter.
+static void sec_filter_store(int dir_fd, const char *name, const char *path) {
+    char tmp[PATH_MAX] = {0};
+    size_t size = S.len * sizeof(struct sock_filter);
+    int fd = -1;
+
+    snprintf(tmp, sizeof(tmp), "%s.%d", name, getpid());
+    if ((fd = openat(dir_fd, tmp, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+                     S_IRUSR | S_IWUSR)) == -1 ||
+        write(fd, S.filter, size) != (ssize_t)size || close(fd) ||
+        renameat(dir_fd, tmp, dir_fd, name)) {
+        log_warn("failed to cache seccomp filter in %s: %m", path);
+        if (fd >= 0)
+            unlinkat(dir_fd, tmp, 0);
+    }
+}
+
+// Compiles the seccomp filter once, before any container is created. The BPF
+// program is cached on disk, keyed by the hash of the profile and the
+// architecture, so libseccomp only runs when the profile changes.
+int sec_seccomp_prepare(const char *profile_path) {
+    sec_profile loaded = {0};
+    const sec_profile *profile = &sec_default_profile;
+    char name[NAME_MAX + 1] = {0};
+    char path[PATH_MAX] = {0};
+    int result = -1;
+    int dir_fd = -1;
+
+    if (S.filter)
+        return 0;
+
+    if (profile_path) {
+        if (sec_profile_load(&loaded, profile_path))
+            return -1;
+        profile = &loaded;
+    }
+
+    // Not part of the BPF program, so it is passed to seccomp(2) when loading
+    S.flags = profile->spec_allow ? SECCOMP_FILTER_FLAG_SPEC_ALLOW : 0;
+
+    snprintf(name, sizeof(name), "seccomp-%08x-%016llx.bpf", seccomp_arch_native(),
+             (unsigned long long)sec_profile_hash(profile));
+    snprintf(path, sizeof(path), "%s/%s", SEC_CACHE_DIR, name);
+
+    // Without a trusted cache, the filter is compiled every time
+    log_debug("loading seccomp filter from %s...", path);
+    if ((dir_fd = sec_cache_open()) >= 0 && !sec_filter_load(dir_fd, name, path)) {
+        log_debug("seccomp filter loaded (%u instructions)", S.len);
+        result = 0;
+        goto exit;
+    }
+
+    if (sec_filter_compile(profile))
+        goto exit;
+
+    log_debug("seccomp filter compiled (%u instructions)", S.len);
+    if (dir_fd >= 0)
+        sec_filter_store(dir_fd, name, path);
+    result = 0;
+
+exit:
+    if (dir_fd >= 0)
+        close(dir_fd);
+    sec_profile_free(&loaded);
+    return result;
+}
+
+// Applies the seccomp profile to the calling process. The filter compiled by
+// sec_seccomp_prepare is loaded directly with seccomp(2), libseccomp is only
+// used to build the default profile when there is none.
 int sec_set_seccomp(void) {
     scmp_filter_ctx ctx = NULL;
 
     log_debug("setting syscalls...");
-    if (!(ctx = seccomp_init(SCMP_ACT_ALLOW)) ||
-        // Calls that allow creating new setuid / setgid executables.
-        // The contained process could created a setuid binary that can be used
-        // by an user to get root in absence of user namespaces.
-        seccomp_rule_add(ctx, SEC_SCMP_FAIL, SCMP_SYS(chmod), 1,
-                         SCMP_A1(SCMP_CMP_MASKED_EQ, S_ISUID, S_ISUID)) ||
-        seccomp_rule_add(ctx, SEC_SCMP_FAIL, SCMP_SYS(chmod), 1,
-                         SCMP_A1(SCMP_CMP_MASKED_EQ, S_ISGID, S_ISGID)) ||
-        seccomp_rule_add(ctx, SEC_SCMP_FAIL, SCMP_SYS(fchmod), 1,
-                         SCMP_A1(SCMP_CMP_MASKED_EQ, S_ISUID, S_ISUID)) ||
-        seccomp_rule_add(ctx, SEC_SCMP_FAIL, SCMP_SYS(fchmod), 1,
-                         SCMP_A1(SCMP_CMP_MASKED_EQ, S_ISGID, S_ISGID)) ||
-        seccomp_rule_add(ctx, SEC_SCMP_FAIL, SCMP_SYS(fchmodat), 1,
-                         SCMP_A2(SCMP_CMP_MASKED_EQ, S_ISUID, S_ISUID)) ||
-        seccomp_rule_add(ctx, SEC_SCMP_FAIL, SCMP_SYS(fchmodat), 1,
-                         SCMP_A2(SCMP_CMP_MASKED_EQ, S_ISGID, S_ISGID)) ||
-
-        // Calls that allow contained processes to start new user namespaces
-        // and possibly allow processes to gain new capabilities.
-        seccomp_rule_add(
-            ctx, SEC_SCMP_FAIL, SCMP_SYS(unshare), 1,
-            SCMP_A0(SCMP_CMP_MASKED_EQ, CLONE_NEWUSER, CLONE_NEWUSER)) ||
-        seccomp_rule_add(
-            ctx, SEC_SCMP_FAIL, SCMP_SYS(clone), 1,
-            SCMP_A0(SCMP_CMP_MASKED_EQ, CLONE_NEWUSER, CLONE_NEWUSER)) ||
-
-        // Allows contained processes to write to the controlling terminal
-        seccomp_rule_add(ctx, SEC_SCMP_FAIL, SCMP_SYS(ioctl), 1,
-                         SCMP_A1(SCMP_CMP_MASKED_EQ, TIOCSTI, TIOCSTI)) ||
-
-        // The kernel keyring system is not namespaced
-        seccomp_rule_add(ctx, SEC_SCMP_FAIL, SCMP_SYS(keyctl), 0) ||
-        seccomp_rule_add(ctx, SEC_SCMP_FAIL, SCMP_SYS(add_key), 0) ||
-        seccomp_rule_add(ctx, SEC_SCMP_FAIL, SCMP_SYS(request_key), 0) ||
-
-        // Before Linux 4.8, ptrace breaks seccomp
-        seccomp_rule_add(ctx, SEC_SCMP_FAIL, SCMP_SYS(ptrace), 0) ||
-
-        // Calls that let processes assign NUMA nodes. These could be used to deny
-        // service to other NUMA-aware application on the host.
-        seccomp_rule_add(ctx, SEC_SCMP_FAIL, SCMP_SYS(mbind), 0) ||
-        seccomp_rule_add(ctx, SEC_SCMP_FAIL, SCMP_SYS(migrate_pages), 0) ||
-        seccomp_rule_add(ctx, SEC_SCMP_FAIL, SCMP_SYS(move_pages), 0) ||
-        seccomp_rule_add(ctx, SEC_SCMP_FAIL, SCMP_SYS(set_mempolicy), 0) ||
-
-        // Alows userspace to handle page faults It can be used to pause execution
-        // in the kernel by triggering page faults in system calls, a mechanism
-        // often used in kernel exploits.
-        seccomp_rule_add(ctx, SEC_SCMP_FAIL, SCMP_SYS(userfaultfd), 0) ||
-
-        // This call could leak a lot of information on the host.
-        // It can theoretically be used to discover kernel addresses and
-        // uninitialized memory.
-        seccomp_rule_add(ctx, SEC_SCMP_FAIL, SCMP_SYS(perf_event_open), 0) ||
-
-        // Prevents setuid and setcap'd binaries from being executed
-        // with additional privileges. This has some security benefits, but due to
-        // weird side-effects, the ping command will not work in a process for
-        // an unprivileged user.
-        seccomp_attr_set(ctx, SCMP_FLTATR_CTL_NNP, 0) || seccomp_load(ctx)) {
 
+    // The filter prepared by barco is loaded without libseccomp
+    if (S.filter) {
+        struct sock_fprog prog = {
+            .len = S.len,
+            .filter = S.filter,
+        };
+
+        if (syscall(SYS_seccomp, SECCOMP_SET_MODE_FILTER, S.flags, &prog)) {
+            log_error("failed to set syscalls: %m");
+            return 1;
+        }
+
+        log_debug("syscalls set");
+        return 0;
+    }
+
+    if (!(ctx = sec_seccomp_build(&sec_default_profile)) || seccomp_load(ctx)) {
         log_error("failed to set syscalls: %m");
 
         // Apply restrictions to the process and release the context.
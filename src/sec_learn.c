@@ -0,0 +1,340 @@
+#define _GNU_SOURCE
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+#include <seccomp.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+
+#include "log.h"
+#include "sec_profile.h"
+#include "sec_learn.h"
+
+// Offset of the low 32 bits of the first syscall argument
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define SEC_LEARN_ARG0_LOW offsetof(struct seccomp_data, args[0])
+#else
+#define SEC_LEARN_ARG0_LOW (offsetof(struct seccomp_data, args[0]) + sizeof(uint32_t))
+#endif
+
+// Calls and argument values of a syscall. An argument that took more than
+// SEC_LEARN_VALUES_MAX values has values_count set to SEC_LEARN_VALUES_MAX + 1.
+struct sec_learn_syscall {
+    uint64_t count;
+    uint64_t values[SEC_PROFILE_ARGS_MAX][SEC_LEARN_VALUES_MAX];
+    unsigned int values_count[SEC_PROFILE_ARGS_MAX];
+};
+
+// A syscall of the profile, sorted by number of calls
+struct sec_learn_entry {
+    int nr;
+    uint64_t count;
+    char *name;
+};
+
+// The learn filter reports every syscall to barco, except the sendmsg on the
+// socket pair that hands the notification fd over: nobody would answer it.
+// Syscalls of other architectures (e.g. i386 on x86_64) are not allowed by
+// the profiles of barco, so they kill the container as they would then.
+int sec_learn_set_filter(int fd) {
+    struct sock_filter filter[] = {
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, arch)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, seccomp_arch_native(), 1, 0),
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_KILL_PROCESS),
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, nr)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, __NR_sendmsg, 0, 3),
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SEC_LEARN_ARG0_LOW),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, fd, 0, 1),
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW),
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_USER_NOTIF),
+    };
+    struct sock_fprog prog = {
+        .len = sizeof(filter) / sizeof(*filter),
+        .filter = filter,
+    };
+    char control[CMSG_SPACE(sizeof(int))] = {0};
+    char byte = 0;
+    struct iovec iov = {.iov_base = &byte, .iov_len = sizeof(byte)};
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    int notify_fd = -1;
+
+    log_debug("setting seccomp learn filter...");
+
+    // Nothing may run between the two calls: any other syscall would wait
+    // for an answer from barco, which does not have the fd yet
+    if ((notify_fd = syscall(SYS_seccomp, SECCOMP_SET_MODE_FILTER,
+                             SECCOMP_FILTER_FLAG_NEW_LISTENER, &prog)) == -1) {
+        log_error("failed to set seccomp learn filter: %m");
+        return -1;
+    }
+
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &notify_fd, sizeof(int));
+    if (sendmsg(fd, &msg, MSG_NOSIGNAL) != sizeof(byte)) {
+        log_error("failed to send seccomp notification fd: %m");
+        close(notify_fd);
+        return -1;
+    }
+
+    close(notify_fd);
+    log_debug("seccomp learn filter set");
+
+    return 0;
+}
+
+int sec_learn_recv(int fd) {
+    char control[CMSG_SPACE(sizeof(int))] = {0};
+    char byte = 0;
+    struct iovec iov = {.iov_base = &byte, .iov_len = sizeof(byte)};
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    struct cmsghdr *cmsg = NULL;
+    int notify_fd = -1;
+
+    log_debug("receiving seccomp notification fd...");
+    if (recvmsg(fd, &msg, MSG_CMSG_CLOEXEC) != sizeof(byte) ||
+        !(cmsg = CMSG_FIRSTHDR(&msg)) || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(int))) {
+        log_error("failed to receive seccomp notification fd: %m");
+        return -1;
+    }
+    memcpy(&notify_fd, CMSG_DATA(cmsg), sizeof(int));
+
+    return notify_fd;
+}
+
+static void sec_learn_record(struct sec_learn_syscall *syscalls,
+                             const struct seccomp_notif *req) {
+    struct sec_learn_syscall *record = NULL;
+
+    // e.g. x32 syscalls, which have a flag in their number
+    if (req->data.nr < 0 || req->data.nr >= SEC_LEARN_SYSCALLS_MAX)
+        return;
+
+    record = &syscalls[req->data.nr];
+    record->count++;
+    for (int i = 0; i < SEC_PROFILE_ARGS_MAX; i++) {
+        unsigned int *count = &record->values_count[i];
+        unsigned int j = 0;
+
+        if (*count > SEC_LEARN_VALUES_MAX)
+            continue;
+
+        for (j = 0; j < *count && record->values[i][j] != req->data.args[i]; j++)
+            ;
+        if (j < *count)
+            continue;
+
+        if (*count < SEC_LEARN_VALUES_MAX)
+            record->values[i][*count] = req->data.args[i];
+        (*count)++;
+    }
+}
+
+static int sec_learn_compare(const void *a, const void *b) {
+    const struct sec_learn_entry *first = a;
+    const struct sec_learn_entry *second = b;
+
+    if (first->count != second->count)
+        return first->count < second->count ? 1 : -1;
+
+    return first->nr - second->nr;
+}
+
+// Describes the number of calls and the arguments that took few values. The
+// arguments are not turned into rules: values seen while learning (e.g.
+// flags) are not the only valid ones.
+static void sec_learn_write_comment(FILE *fp, const struct sec_learn_syscall *record) {
+    fprintf(fp, "%llu calls", (unsigned long long)record->count);
+    for (int i = 0; i < SEC_PROFILE_ARGS_MAX; i++) {
+        if (record->values_count[i] > SEC_LEARN_VALUES_MAX)
+            continue;
+
+        fprintf(fp, "; arg%d in {", i);
+        for (unsigned int j = 0; j < record->values_count[i]; j++)
+            fprintf(fp, "%s%#llx", j ? ", " : "", (unsigned long long)record->values[i][j]);
+        fprintf(fp, "}");
+    }
+}
+
+static int sec_learn_write(const char *path, const struct sec_learn_syscall *syscalls) {
+    struct sec_learn_entry *entries = NULL;
+    size_t count = 0;
+    FILE *fp = NULL;
+    int result = -1;
+
+    if (!(entries = calloc(SEC_LEARN_SYSCALLS_MAX, sizeof(*entries)))) {
+        log_error("failed to allocate seccomp profile: %m");
+        return -1;
+    }
+
+    for (int nr = 0; nr < SEC_LEARN_SYSCALLS_MAX; nr++) {
+        if (!syscalls[nr].count)
+            continue;
+
+        if (!(entries[count].name = seccomp_syscall_resolve_num_arch(SCMP_ARCH_NATIVE, nr))) {
+            log_warn("ignoring unknown syscall %d", nr);
+            continue;
+        }
+        entries[count].nr = nr;
+        entries[count].count = syscalls[nr].count;
+        count++;
+    }
+    qsort(entries, count, sizeof(*entries), sec_learn_compare);
+
+    log_info("writing seccomp profile of %zu syscalls to %s...", count, path);
+    if (!(fp = fopen(path, "w"))) {
+        log_error("failed to open %s: %m", path);
+        goto exit;
+    }
+
+    fprintf(fp, "{\n  \"defaultAction\": \"SCMP_ACT_ERRNO\",\n"
+                "  \"defaultErrnoRet\": 1,\n  \"syscalls\": [\n");
+    for (size_t i = 0; i < count; i++) {
+        fprintf(fp, "    {\"names\": [\"%s\"], \"action\": \"SCMP_ACT_ALLOW\", \"comment\": \"",
+                entries[i].name);
+        sec_learn_write_comment(fp, &syscalls[entries[i].nr]);
+        fprintf(fp, "\"}%s\n", i + 1 < count ? "," : "");
+    }
+    fprintf(fp, "  ],\n  \"priorities\": [");
+    for (size_t i = 0; i < count; i++)
+        fprintf(fp, "%s\"%s\"", i ? ", " : "", entries[i].name);
+    fprintf(fp, "]\n}\n");
+
+    if (fclose(fp)) {
+        log_error("failed to write %s: %m", path);
+        goto exit;
+    }
+    result = 0;
+
+exit:
+    for (size_t i = 0; i < count; i++)
+        free(entries[i].name);
+    free(entries);
+    return result;
+}
+
+// The container runs in its own pid namespace, so all its processes are gone
+// when its init exits. Without pidfd, the notification fd hangs up once the
+// last process using the filter exits.
+static uint64_t sec_learn_now_ms(void) {
+    struct timespec ts = {0};
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Returns true if the signal stops learning. SIGINT and SIGTERM are raised
+// again for the monitor, which stops the container. SIGCHLD only matters
+// without pidfd, the container may have exited.
+static bool sec_learn_signal(int signal_fd, int pidfd) {
+    struct signalfd_siginfo info = {0};
+
+    if (read(signal_fd, &info, sizeof(info)) != sizeof(info))
+        return false;
+    if (info.ssi_signo == SIGCHLD)
+        return pidfd < 0;
+
+    log_info("received signal %d, stopping learning...", info.ssi_signo);
+    raise(info.ssi_signo);
+    return true;
+}
+
+int sec_learn_run(int notify_fd, int pidfd, int signal_fd, unsigned int *timeout_ms,
+                  const char *path) {
+    struct pollfd fds[] = {
+        {.fd = notify_fd, .events = POLLIN},
+        {.fd = signal_fd, .events = POLLIN},
+        {.fd = pidfd, .events = POLLIN},
+    };
+    uint64_t started = sec_learn_now_ms();
+    uint64_t deadline = *timeout_ms ? started + *timeout_ms : 0;
+    struct sec_learn_syscall *syscalls = NULL;
+    struct seccomp_notif_resp *resp = NULL;
+    struct seccomp_notif *req = NULL;
+    int result = -1;
+
+    if (!(syscalls = calloc(SEC_LEARN_SYSCALLS_MAX, sizeof(*syscalls))) ||
+        seccomp_notify_alloc(&req, &resp)) {
+        log_error("failed to allocate seccomp notifications: %m");
+        goto exit;
+    }
+
+    log_info("learning syscalls of the container...");
+    for (;;) {
+        uint64_t now = sec_learn_now_ms();
+        int wait = -1;
+
+        if (deadline) {
+            if (now >= deadline) {
+                log_info("timeout, stopping learning...");
+                break;
+            }
+            wait = deadline - now;
+        }
+
+        if (poll(fds, pidfd >= 0 ? 3 : 2, wait) == -1) {
+            if (errno == EINTR)
+                continue;
+            log_error("failed to poll seccomp notifications: %m");
+            goto exit;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            // Fails when the caller was killed in the meantime
+            if (seccomp_notify_receive(notify_fd, req))
+                continue;
+
+            sec_learn_record(syscalls, req);
+
+            memset(resp, 0, sizeof(*resp));
+            resp->id = req->id;
+            resp->flags = SECCOMP_USER_NOTIF_FLAG_CONTINUE;
+            if (seccomp_notify_respond(notify_fd, resp))
+                log_debug("failed to answer seccomp notification");
+            continue;
+        }
+
+        if ((fds[0].revents & (POLLHUP | POLLERR)) || (fds[2].revents & POLLIN) ||
+            ((fds[1].revents & POLLIN) && sec_learn_signal(signal_fd, pidfd)))
+            break;
+    }
+
+    // What is left of the timeout goes to the monitor, which stops the
+    // container at once if it is over
+    if (*timeout_ms) {
+        uint64_t elapsed = sec_learn_now_ms() - started;
+
+        *timeout_ms = elapsed < *timeout_ms ? *timeout_ms - elapsed : 1;
+    }
+
+    result = sec_learn_write(path, syscalls);
+
+exit:
+    if (req)
+        seccomp_notify_free(req, resp);
+    free(syscalls);
+    return result;
+}
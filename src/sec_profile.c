@@ -0,0 +1,357 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "log.h"
+#include "json.h"
+#include "sec.h"
+#include "sec_profile.h"
+
+// Name of the native architecture in the "arches" conditions of Docker
+#if defined(__x86_64__)
+#define SEC_PROFILE_ARCH "amd64"
+#elif defined(__i386__)
+#define SEC_PROFILE_ARCH "x86"
+#elif defined(__aarch64__)
+#define SEC_PROFILE_ARCH "arm64"
+#elif defined(__arm__)
+#define SEC_PROFILE_ARCH "arm"
+#elif defined(__powerpc64__)
+#define SEC_PROFILE_ARCH "ppc64le"
+#elif defined(__s390x__)
+#define SEC_PROFILE_ARCH "s390x"
+#elif defined(__riscv) && __riscv_xlen == 64
+#define SEC_PROFILE_ARCH "riscv64"
+#else
+#define SEC_PROFILE_ARCH ""
+#endif
+
+// Rules being loaded, before they are handed to the profile
+struct sec_profile_rules {
+    sec_profile_rule *rules;
+    size_t count;
+};
+
+// Converts a Docker action, the errno (or tracer message) being errno_ret
+static int sec_profile_action(const char *name, const json_value *errno_ret,
+                              uint32_t *action) {
+    uint64_t ret = 1;
+
+    if (errno_ret && (json_uint64(errno_ret, &ret) || ret > 0xffff)) {
+        log_error("invalid errnoRet for %s", name);
+        return -1;
+    }
+
+    if (!strcmp(name, "SCMP_ACT_ALLOW"))
+        *action = SCMP_ACT_ALLOW;
+    else if (!strcmp(name, "SCMP_ACT_ERRNO"))
+        *action = SCMP_ACT_ERRNO(ret);
+    else if (!strcmp(name, "SCMP_ACT_KILL") || !strcmp(name, "SCMP_ACT_KILL_THREAD"))
+        *action = SCMP_ACT_KILL_THREAD;
+    else if (!strcmp(name, "SCMP_ACT_KILL_PROCESS"))
+        *action = SCMP_ACT_KILL_PROCESS;
+    else if (!strcmp(name, "SCMP_ACT_TRAP"))
+        *action = SCMP_ACT_TRAP;
+    else if (!strcmp(name, "SCMP_ACT_TRACE"))
+        *action = SCMP_ACT_TRACE(ret);
+    else if (!strcmp(name, "SCMP_ACT_LOG"))
+        *action = SCMP_ACT_LOG;
+    else {
+        log_error("unsupported seccomp action %s", name);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int sec_profile_op(const char *name, enum scmp_compare *op) {
+    static const struct {
+        const char *name;
+        enum scmp_compare op;
+    } ops[] = {
+        {"SCMP_CMP_NE", SCMP_CMP_NE},
+        {"SCMP_CMP_LT", SCMP_CMP_LT},
+        {"SCMP_CMP_LE", SCMP_CMP_LE},
+        {"SCMP_CMP_EQ", SCMP_CMP_EQ},
+        {"SCMP_CMP_GE", SCMP_CMP_GE},
+        {"SCMP_CMP_GT", SCMP_CMP_GT},
+        {"SCMP_CMP_MASKED_EQ", SCMP_CMP_MASKED_EQ},
+    };
+
+    for (size_t i = 0; i < sizeof(ops) / sizeof(*ops); i++) {
+        if (name && !strcmp(name, ops[i].name)) {
+            *op = ops[i].op;
+            return 0;
+        }
+    }
+
+    log_error("unsupported seccomp operator %s", name ? name : "(none)");
+    return -1;
+}
+
+// Returns true if one of the strings of the array is name
+static bool sec_profile_contains(const json_value *array, const char *name) {
+    for (size_t i = 0; array && array->type == JSON_ARRAY && i < array->count; i++) {
+        if (array->items[i].type == JSON_STRING && !strcmp(array->items[i].string, name))
+            return true;
+    }
+
+    return false;
+}
+
+// Counts the capabilities of the array kept in the containers
+static size_t sec_profile_caps_kept(const json_value *caps) {
+    size_t kept = 0;
+
+    for (size_t i = 0; caps && caps->type == JSON_ARRAY && i < caps->count; i++) {
+        if (caps->items[i].type == JSON_STRING && sec_cap_kept(caps->items[i].string))
+            kept++;
+    }
+
+    return kept;
+}
+
+// Evaluates the "includes" and "excludes" conditions of an entry against the
+// native architecture and the capabilities kept by barco. Kernel versions
+// are not checked: a missing syscall is not an error.
+static bool sec_profile_applies(const json_value *entry) {
+    const json_value *includes = json_get(entry, "includes");
+    const json_value *excludes = json_get(entry, "excludes");
+    const json_value *arches = NULL;
+    const json_value *caps = NULL;
+
+    if ((arches = json_get(includes, "arches")) && arches->count &&
+        !sec_profile_contains(arches, SEC_PROFILE_ARCH))
+        return false;
+    if ((caps = json_get(includes, "caps")) && caps->type == JSON_ARRAY &&
+        sec_profile_caps_kept(caps) != caps->count)
+        return false;
+
+    if ((arches = json_get(excludes, "arches")) &&
+        sec_profile_contains(arches, SEC_PROFILE_ARCH))
+        return false;
+    if ((caps = json_get(excludes, "caps")) && sec_profile_caps_kept(caps))
+        return false;
+
+    return true;
+}
+
+// Parses the argument comparisons of an entry. libseccomp only accepts one
+// comparison per argument in a rule, so like runc, the comparisons are turned
+// into one rule each (a logical or) when an argument is compared twice.
+static int sec_profile_args(const json_value *entry, struct scmp_arg_cmp *args,
+                            unsigned int *count, bool *split) {
+    const json_value *array = json_get(entry, "args");
+    unsigned int seen = 0;
+
+    *count = 0;
+    *split = false;
+    if (!array || array->type == JSON_NULL)
+        return 0;
+
+    if (array->type != JSON_ARRAY || array->count > SEC_PROFILE_ARGS_MAX) {
+        log_error("invalid seccomp args");
+        return -1;
+    }
+
+    for (size_t i = 0; i < array->count; i++) {
+        const json_value *arg = &array->items[i];
+        const json_value *value_two = json_get(arg, "valueTwo");
+        uint64_t index = 0;
+
+        args[i].datum_b = 0;
+        if (json_uint64(json_get(arg, "index"), &index) || index >= SEC_PROFILE_ARGS_MAX ||
+            json_uint64(json_get(arg, "value"), &args[i].datum_a) ||
+            (value_two && json_uint64(value_two, &args[i].datum_b)) ||
+            sec_profile_op(json_get_string(arg, "op"), &args[i].op)) {
+            log_error("invalid seccomp arg %zu", i);
+            return -1;
+        }
+        args[i].arg = index;
+
+        if (seen & (1U << index))
+            *split = true;
+        seen |= 1U << index;
+    }
+    *count = array->count;
+
+    return 0;
+}
+
+static int sec_profile_add(struct sec_profile_rules *rules, int syscall,
+                           uint32_t action, const struct scmp_arg_cmp *args,
+                           unsigned int arg_cnt) {
+    sec_profile_rule *resized = NULL;
+    sec_profile_rule *rule = NULL;
+
+    if (!(resized = realloc(rules->rules, (rules->count + 1) * sizeof(*resized)))) {
+        log_error("failed to allocate seccomp rule: %m");
+        return -1;
+    }
+    rules->rules = resized;
+
+    rule = &resized[rules->count++];
+    memset(rule, 0, sizeof(*rule));
+    rule->syscall = syscall;
+    rule->action = action;
+    rule->arg_cnt = arg_cnt;
+    memcpy(rule->args, args, arg_cnt * sizeof(*args));
+
+    return 0;
+}
+
+// Adds the rules of a "syscalls" entry
+static int sec_profile_entry(struct sec_profile_rules *rules,
+                             const json_value *entry, uint32_t default_action) {
+    struct scmp_arg_cmp args[SEC_PROFILE_ARGS_MAX] = {0};
+    const json_value *names = json_get(entry, "names");
+    const char *action_name = json_get_string(entry, "action");
+    const char *name = json_get_string(entry, "name");
+    unsigned int arg_cnt = 0;
+    uint32_t action = 0;
+    bool split = false;
+
+    if (!action_name || (!name && (!names || names->type != JSON_ARRAY))) {
+        log_error("invalid seccomp syscalls entry");
+        return -1;
+    }
+
+    if (!sec_profile_applies(entry))
+        return 0;
+
+    if (sec_profile_action(action_name, json_get(entry, "errnoRet"), &action) ||
+        sec_profile_args(entry, args, &arg_cnt, &split))
+        return -1;
+
+    // libseccomp refuses rules doing what the default action does
+    if (action == default_action)
+        return 0;
+
+    for (size_t i = 0; i < (name ? 1 : names->count); i++) {
+        const char *syscall_name = name ? name : names->items[i].string;
+        int syscall = 0;
+
+        if (!syscall_name) {
+            log_error("invalid seccomp syscall name");
+            return -1;
+        }
+
+        if ((syscall = seccomp_syscall_resolve_name(syscall_name)) == __NR_SCMP_ERROR) {
+            log_debug("ignoring unknown syscall %s", syscall_name);
+            continue;
+        }
+
+        if (!split) {
+            if (sec_profile_add(rules, syscall, action, args, arg_cnt))
+                return -1;
+            continue;
+        }
+
+        for (unsigned int j = 0; j < arg_cnt; j++) {
+            if (sec_profile_add(rules, syscall, action, &args[j], 1))
+                return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int sec_profile_priorities(sec_profile *profile, const json_value *array) {
+    int *priorities = NULL;
+    size_t count = 0;
+
+    if (!array)
+        return 0;
+
+    if (array->type != JSON_ARRAY ||
+        !(priorities = calloc(array->count ? array->count : 1, sizeof(*priorities)))) {
+        log_error("invalid seccomp priorities");
+        return -1;
+    }
+
+    for (size_t i = 0; i < array->count; i++) {
+        int syscall = __NR_SCMP_ERROR;
+
+        if (array->items[i].type != JSON_STRING ||
+            (syscall = seccomp_syscall_resolve_name(array->items[i].string)) == __NR_SCMP_ERROR) {
+            log_debug("ignoring priority of unknown syscall");
+            continue;
+        }
+        priorities[count++] = syscall;
+    }
+
+    profile->priorities = priorities;
+    profile->priorities_count = count;
+
+    return 0;
+}
+
+int sec_profile_load(sec_profile *profile, const char *path) {
+    struct sec_profile_rules rules = {0};
+    const json_value *syscalls = NULL;
+    const json_value *flags = NULL;
+    const char *default_action = NULL;
+    json_value *root = NULL;
+    int result = -1;
+
+    memset(profile, 0, sizeof(*profile));
+    profile->allocated = true;
+
+    log_debug("loading seccomp profile %s...", path);
+    if (!(root = json_load(path)))
+        goto exit;
+
+    if (!(default_action = json_get_string(root, "defaultAction"))) {
+        log_error("missing defaultAction in %s", path);
+        goto exit;
+    }
+    if (sec_profile_action(default_action, json_get(root, "defaultErrnoRet"),
+                           &profile->default_action))
+        goto exit;
+
+    flags = json_get(root, "flags");
+    for (size_t i = 0; flags && flags->type == JSON_ARRAY && i < flags->count; i++) {
+        const char *flag = flags->items[i].string;
+
+        if (flag && !strcmp(flag, "SECCOMP_FILTER_FLAG_SPEC_ALLOW"))
+            profile->spec_allow = true;
+        else if (flag && !strcmp(flag, "SECCOMP_FILTER_FLAG_LOG"))
+            log_warn("ignoring seccomp flag %s", flag);
+        else {
+            log_error("unsupported seccomp flag %s", flag ? flag : "(none)");
+            goto exit;
+        }
+    }
+
+    syscalls = json_get(root, "syscalls");
+    for (size_t i = 0; syscalls && syscalls->type == JSON_ARRAY && i < syscalls->count; i++) {
+        if (sec_profile_entry(&rules, &syscalls->items[i], profile->default_action)) {
+            log_error("invalid syscalls entry %zu in %s", i, path);
+            goto exit;
+        }
+    }
+
+    if (sec_profile_priorities(profile, json_get(root, "priorities")))
+        goto exit;
+
+    log_debug("seccomp profile loaded (%zu rules)", rules.count);
+    result = 0;
+
+exit:
+    profile->rules = rules.rules;
+    profile->rules_count = rules.count;
+    if (result)
+        sec_profile_free(profile);
+    json_free(root);
+    return result;
+}
+
+void sec_profile_free(sec_profile *profile) {
+    if (!profile->allocated)
+        return;
+
+    free((void *)profile->rules);
+    free((void *)profile->priorities);
+    memset(profile, 0, sizeof(*profile));
+}
@@ -0,0 +1,520 @@
+#define _GNU_SOURCE
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+
+#include "log.h"
+#include "stats.h"
+
+typedef enum {
+    // A single value, e.g. memory.current
+    STATS_SINGLE,
+    // "key value" lines, e.g. cpu.stat
+    STATS_KEYED,
+    // "label key=value..." lines, e.g. io.stat or cpu.pressure
+    STATS_NESTED,
+} stats_file_type;
+
+// The files sampled in each cgroup. Files of controllers that are not
+// enabled do not exist and are skipped.
+static const struct stats_file {
+    const char *name;
+    // Name of the metric in the Prometheus format
+    const char *metric;
+    stats_file_type type;
+    // Name of the label of the first column of nested files
+    const char *label;
+} stats_files[STATS_FILES_MAX] = {
+    {"cpu.stat", "cpu", STATS_KEYED, NULL},
+    {"memory.current", "memory_current_bytes", STATS_SINGLE, NULL},
+    {"memory.stat", "memory", STATS_KEYED, NULL},
+    {"io.stat", "io", STATS_NESTED, "device"},
+    {"pids.current", "pids_current", STATS_SINGLE, NULL},
+    {"cpu.pressure", "cpu_pressure", STATS_NESTED, "type"},
+    {"memory.pressure", "memory_pressure", STATS_NESTED, "type"},
+    {"io.pressure", "io_pressure", STATS_NESTED, "type"},
+};
+
+static uint64_t stats_now_ms(void) {
+    struct timespec ts = {0};
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Appends to the sample buffer, which grows as needed
+static int stats_append(stats_exporter *stats, const char *fmt, ...) {
+    for (;;) {
+        size_t available = stats->size - stats->len;
+        va_list args;
+        int len = 0;
+
+        va_start(args, fmt);
+        len = vsnprintf(stats->buffer + stats->len, available, fmt, args);
+        va_end(args);
+        if (len < 0)
+            return -1;
+
+        if ((size_t)len < available) {
+            stats->len += len;
+            return 0;
+        }
+
+        char *buffer = realloc(stats->buffer, stats->size * 2 + len);
+        if (!buffer) {
+            log_error("failed to allocate stats: %m");
+            return -1;
+        }
+        stats->buffer = buffer;
+        stats->size = stats->size * 2 + len;
+    }
+}
+
+// Values of cgroup files are numbers, the rest (e.g. "max") is not exported
+static bool stats_is_number(const char *value) {
+    char *end = NULL;
+
+    if (!*value)
+        return false;
+    strtod(value, &end);
+
+    return !*end;
+}
+
+// Writes one value of a file. Keys of cgroup files are made of [a-z0-9_],
+// they are valid in Prometheus metric names as is.
+static int stats_emit(stats_exporter *stats, const stats_source *source,
+                      const struct stats_file *file, const char *label,
+                      const char *key, const char *value, bool *first) {
+    if (!stats_is_number(value))
+        return 0;
+
+    if (stats->format == STATS_FORMAT_JSON) {
+        int result = stats_append(stats, "%s\"%s%s%s%s%s\":%s", *first ? "" : ",",
+                                  file->name, label ? "." : "", label ? label : "",
+                                  key ? "." : "", key ? key : "", value);
+
+        *first = false;
+        return result;
+    }
+
+    if (!label)
+        return stats_append(stats, "barco_%s%s%s{container=\"%s\"} %s\n", file->metric,
+                            key ? "_" : "", key ? key : "", source->name, value);
+
+    return stats_append(stats, "barco_%s%s%s{container=\"%s\",%s=\"%s\"} %s\n",
+                        file->metric, key ? "_" : "", key ? key : "", source->name,
+                        file->label, label, value);
+}
+
+// Parses the content of a file and writes its values
+static int stats_parse(stats_exporter *stats, const stats_source *source,
+                       const struct stats_file *file, char *content, bool *first) {
+    char *line_save = NULL;
+
+    for (char *line = strtok_r(content, "\n", &line_save); line;
+         line = strtok_r(NULL, "\n", &line_save)) {
+        char *save = NULL;
+        char *first_field = strtok_r(line, " ", &save);
+
+        if (!first_field)
+            continue;
+
+        switch (file->type) {
+        case STATS_SINGLE:
+            if (stats_emit(stats, source, file, NULL, NULL, first_field, first))
+                return -1;
+            break;
+        case STATS_KEYED: {
+            char *value = strtok_r(NULL, " ", &save);
+
+            if (value && stats_emit(stats, source, file, NULL, first_field, value, first))
+                return -1;
+            break;
+        }
+        case STATS_NESTED:
+            for (char *pair = strtok_r(NULL, " ", &save); pair;
+                 pair = strtok_r(NULL, " ", &save)) {
+                char *value = strchr(pair, '=');
+
+                if (!value)
+                    continue;
+                *value++ = '\0';
+                if (stats_emit(stats, source, file, first_field, pair, value, first))
+                    return -1;
+            }
+            break;
+        }
+    }
+
+    return 0;
+}
+
+// Reads the files of the containers with pread (no open/close per sample)
+// and renders them in the sample buffer
+static int stats_sample(stats_exporter *stats) {
+    char content[STATS_READ_SIZE];
+    struct timespec ts = {0};
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    stats->len = 0;
+    if (stats_append(stats, "%s", ""))
+        return -1;
+
+    pthread_mutex_lock(&stats->lock);
+    for (int i = 0; i < stats->sources_count; i++) {
+        const stats_source *source = &stats->sources[i];
+        bool first = true;
+
+        if (stats->format == STATS_FORMAT_JSON &&
+            stats_append(stats, "{\"timestamp_ns\":%llu,\"container\":\"%s\",\"metrics\":{",
+                         (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec,
+                         source->name))
+            goto error;
+
+        for (int j = 0; j < STATS_FILES_MAX; j++) {
+            ssize_t len = 0;
+
+            if (source->fds[j] < 0)
+                continue;
+
+            if ((len = pread(source->fds[j], content, sizeof(content) - 1, 0)) < 0) {
+                log_debug("failed to read %s of %s: %m", stats_files[j].name, source->name);
+                continue;
+            }
+            content[len] = '\0';
+
+            if (stats_parse(stats, source, &stats_files[j], content, &first))
+                goto error;
+        }
+
+        if (stats->format == STATS_FORMAT_JSON && stats_append(stats, "}}\n"))
+            goto error;
+    }
+    pthread_mutex_unlock(&stats->lock);
+
+    return 0;
+
+error:
+    pthread_mutex_unlock(&stats->lock);
+    return -1;
+}
+
+static void stats_drop(stats_exporter *stats, int index) {
+    close(stats->clients[index].fd);
+    free(stats->clients[index].pending);
+    stats->clients[index] = stats->clients[--stats->clients_count];
+}
+
+// Sends what the socket takes without blocking, the rest is kept for when
+// the client reads
+static int stats_send(stats_client *client, const char *data, size_t len) {
+    char *pending = NULL;
+
+    if (!client->pending) {
+        ssize_t sent = send(client->fd, data, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+
+        if (sent == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+            return -1;
+        sent = sent > 0 ? sent : 0;
+        data += sent;
+        len -= sent;
+        if (!len)
+            return 0;
+    }
+
+    if (!(pending = realloc(client->pending, client->len + len))) {
+        log_error("failed to allocate stats: %m");
+        return -1;
+    }
+    memcpy(pending + client->len, data, len);
+    client->pending = pending;
+    client->len += len;
+
+    return 0;
+}
+
+// Sends more of what is pending, once the client can take it
+static int stats_flush(stats_client *client) {
+    ssize_t sent = send(client->fd, client->pending + client->sent,
+                        client->len - client->sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+
+    if (sent == -1)
+        return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+
+    client->sent += sent;
+    if (client->sent == client->len) {
+        free(client->pending);
+        client->pending = NULL;
+        client->len = 0;
+        client->sent = 0;
+    }
+
+    return 0;
+}
+
+// Answers a request of a Prometheus client with the last sample. Requests
+// starting with GET are answered with an HTTP response, so the socket can be
+// scraped through an HTTP proxy or with curl --unix-socket.
+static int stats_answer(stats_exporter *stats, stats_client *client) {
+    static const char header[] =
+        "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n\r\n";
+    char request[512] = {0};
+    ssize_t len = recv(client->fd, request, sizeof(request) - 1, MSG_DONTWAIT);
+
+    if (len <= 0)
+        return -1;
+
+    client->answered = true;
+    if (!strncmp(request, "GET ", 4) && stats_send(client, header, sizeof(header) - 1))
+        return -1;
+
+    return stats_send(client, stats->buffer, stats->len);
+}
+
+// Handles the events of a client, returns -1 once it is to be dropped
+static int stats_handle(stats_exporter *stats, stats_client *client, short revents) {
+    if ((revents & POLLERR) || ((revents & POLLOUT) && stats_flush(client)))
+        return -1;
+
+    // JSON clients have nothing to say and are dropped on EOF
+    if (stats->format == STATS_FORMAT_JSON) {
+        if ((revents & (POLLIN | POLLHUP)) &&
+            recv(client->fd, (char[64]){0}, 64, MSG_DONTWAIT) <= 0)
+            return -1;
+        return 0;
+    }
+
+    if (!client->answered && (revents & (POLLIN | POLLHUP)) &&
+        stats_answer(stats, client))
+        return -1;
+
+    // The connection is closed once the whole answer is sent
+    return client->answered && !client->pending ? -1 : 0;
+}
+
+static void *stats_run(void *arg) {
+    stats_exporter *stats = arg;
+    struct pollfd fds[2 + STATS_CLIENTS_MAX] = {0};
+    uint64_t next = stats_now_ms();
+
+    for (;;) {
+        uint64_t now = stats_now_ms();
+        int nfds = 2;
+
+        if (now >= next) {
+            if (stats_sample(stats))
+                log_error("failed to sample cgroups");
+
+            // JSON clients get every sample, a client still behind on the
+            // previous one is disconnected, so that it never slows the
+            // sampling down
+            for (int i = 0; stats->format == STATS_FORMAT_JSON && i < stats->clients_count;) {
+                if (stats->clients[i].pending ||
+                    stats_send(&stats->clients[i], stats->buffer, stats->len))
+                    stats_drop(stats, i);
+                else
+                    i++;
+            }
+
+            next += stats->interval_ms;
+            if (next <= now)
+                next = now + stats->interval_ms;
+        }
+
+        fds[0] = (struct pollfd){.fd = stats->wake_fd, .events = POLLIN};
+        fds[1] = (struct pollfd){.fd = stats->listen_fd, .events = POLLIN};
+        for (int i = 0; i < stats->clients_count; i++) {
+            const stats_client *client = &stats->clients[i];
+
+            fds[nfds++] = (struct pollfd){
+                .fd = client->fd,
+                .events = (client->answered ? 0 : POLLIN) | (client->pending ? POLLOUT : 0),
+            };
+        }
+
+        if (poll(fds, nfds, next - now) == -1) {
+            if (errno == EINTR)
+                continue;
+            log_error("failed to poll stats: %m");
+            break;
+        }
+
+        if (fds[0].revents & POLLIN)
+            break;
+
+        // Clients are handled from the last one, as handled ones are dropped
+        for (int i = nfds - 1; i >= 2; i--) {
+            if (fds[i].revents && stats_handle(stats, &stats->clients[i - 2], fds[i].revents))
+                stats_drop(stats, i - 2);
+        }
+
+        if (fds[1].revents & POLLIN) {
+            int fd = accept4(stats->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+
+            if (fd == -1) {
+                log_error("failed to accept stats client: %m");
+            } else if (stats->clients_count == STATS_CLIENTS_MAX) {
+                log_warn("too many stats clients");
+                close(fd);
+            } else {
+                stats->clients[stats->clients_count++] = (stats_client){.fd = fd};
+                if (stats->format == STATS_FORMAT_JSON &&
+                    stats_send(&stats->clients[stats->clients_count - 1], stats->buffer,
+                               stats->len))
+                    stats_drop(stats, stats->clients_count - 1);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+int stats_parse_format(const char *name, stats_format *format) {
+    if (!strcmp(name, "prometheus"))
+        *format = STATS_FORMAT_PROMETHEUS;
+    else if (!strcmp(name, "json"))
+        *format = STATS_FORMAT_JSON;
+    else
+        return -1;
+
+    return 0;
+}
+
+int stats_init(stats_exporter *stats, const char *path, stats_format format,
+               unsigned int interval_ms) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+
+    memset(stats, 0, sizeof(*stats));
+    stats->format = format;
+    stats->interval_ms = interval_ms;
+    stats->path = path;
+    stats->listen_fd = -1;
+    stats->wake_fd = -1;
+    pthread_mutex_init(&stats->lock, NULL);
+
+    log_debug("serving stats on %s...", path);
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        log_error("socket path %s too long", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    if ((stats->wake_fd = eventfd(0, EFD_CLOEXEC)) == -1) {
+        log_error("failed to create eventfd: %m");
+        return -1;
+    }
+
+    unlink(path);
+    if ((stats->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1 ||
+        bind(stats->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+        listen(stats->listen_fd, STATS_CLIENTS_MAX)) {
+        log_error("failed to listen on %s: %m", path);
+        return -1;
+    }
+
+    stats->size = STATS_READ_SIZE;
+    if (!(stats->buffer = malloc(stats->size))) {
+        log_error("failed to allocate stats: %m");
+        return -1;
+    }
+
+    return 0;
+}
+
+int stats_add(stats_exporter *stats, const char *name, int cgroup_fd) {
+    stats_source *source = NULL;
+
+    pthread_mutex_lock(&stats->lock);
+    if (stats->sources_count == STATS_SOURCES_MAX) {
+        pthread_mutex_unlock(&stats->lock);
+        log_error("too many containers to sample");
+        return -1;
+    }
+
+    source = &stats->sources[stats->sources_count++];
+    snprintf(source->name, sizeof(source->name), "%s", name);
+    for (int i = 0; i < STATS_FILES_MAX; i++) {
+        if ((source->fds[i] = openat(cgroup_fd, stats_files[i].name,
+                                     O_RDONLY | O_CLOEXEC)) == -1)
+            log_debug("not sampling %s of %s: %m", stats_files[i].name, name);
+    }
+    pthread_mutex_unlock(&stats->lock);
+
+    return 0;
+}
+
+void stats_remove(stats_exporter *stats, const char *name) {
+    pthread_mutex_lock(&stats->lock);
+    for (int i = 0; i < stats->sources_count; i++) {
+        if (strcmp(stats->sources[i].name, name))
+            continue;
+
+        for (int j = 0; j < STATS_FILES_MAX; j++) {
+            if (stats->sources[i].fds[j] >= 0)
+                close(stats->sources[i].fds[j]);
+        }
+        stats->sources[i] = stats->sources[--stats->sources_count];
+        break;
+    }
+    pthread_mutex_unlock(&stats->lock);
+}
+
+int stats_start(stats_exporter *stats) {
+    int err = 0;
+
+    log_debug("starting stats thread...");
+    if ((err = pthread_create(&stats->thread, NULL, stats_run, stats))) {
+        errno = err;
+        log_error("failed to start stats thread: %m");
+        return -1;
+    }
+    stats->started = true;
+
+    return 0;
+}
+
+void stats_free(stats_exporter *stats) {
+    // stats_init was not called
+    if (!stats->path)
+        return;
+
+    if (stats->started) {
+        uint64_t one = 1;
+
+        log_debug("stopping stats thread...");
+        if (write(stats->wake_fd, &one, sizeof(one)) == sizeof(one))
+            pthread_join(stats->thread, NULL);
+        stats->started = false;
+    }
+
+    while (stats->sources_count)
+        stats_remove(stats, stats->sources[0].name);
+    while (stats->clients_count)
+        stats_drop(stats, 0);
+
+    if (stats->listen_fd >= 0) {
+        close(stats->listen_fd);
+        unlink(stats->path);
+        stats->listen_fd = -1;
+    }
+    if (stats->wake_fd >= 0) {
+        close(stats->wake_fd);
+        stats->wake_fd = -1;
+    }
+
+    free(stats->buffer);
+    stats->buffer = NULL;
+    pthread_mutex_destroy(&stats->lock);
+    stats->path = NULL;
+}
@@ -0,0 +1,601 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/xattr.h>
+
+#ifdef HAVE_LIBARCHIVE
+#include <archive.h>
+#include <archive_entry.h>
+#endif
+
+#include "log.h"
+#include "sha256.h"
+#include "store.h"
+
+// A layer being imported
+typedef struct {
+    const char *tar;
+    char digest[STORE_DIGEST_HEX_SIZE];
+    int err;
+} store_layer;
+
+// The layers of an import, shared by the workers
+typedef struct {
+    const char *root;
+    store_layer *layers;
+    int count;
+    int next;
+} store_job;
+
+// Formats a path, fails instead of truncating it
+static int store_path(char *path, const char *format, ...) {
+    va_list args;
+    int len = 0;
+
+    va_start(args, format);
+    len = vsnprintf(path, PATH_MAX, format, args);
+    va_end(args);
+
+    if (len >= PATH_MAX) {
+        log_error("path too long in the store");
+        return -1;
+    }
+
+    return 0;
+}
+
+// Creates a directory and its missing parents
+static int store_mkdirs(const char *dir) {
+    char path[PATH_MAX] = {0};
+
+    if (store_path(path, "%s", dir))
+        return -1;
+
+    for (char *slash = path + 1; ; slash++) {
+        if (*slash && *slash != '/')
+            continue;
+
+        char c = *slash;
+        *slash = '\0';
+        if (mkdir(path, 0755) && errno != EEXIST) {
+            log_error("failed to create %s: %m", path);
+            return -1;
+        }
+        if (!(*slash = c))
+            break;
+    }
+
+    return 0;
+}
+
+static int store_remove_entry(const char *path, const struct stat *st, int flag,
+                              struct FTW *ftw) {
+    (void)st;
+    (void)flag;
+    (void)ftw;
+
+    if (remove(path))
+        log_warn("failed to remove %s: %m", path);
+    return 0;
+}
+
+// Removes a partially extracted layer
+static void store_remove(const char *dir) {
+    nftw(dir, store_remove_entry, 64, FTW_DEPTH | FTW_PHYS);
+}
+
+// Refs are file names of the refs directory
+static bool store_valid_ref(const char *ref) {
+    size_t len = strlen(ref);
+
+    if (!len || len >= STORE_REF_MAX || ref[0] == '.')
+        return false;
+    return strspn(ref, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                       "0123456789._:-") == len;
+}
+
+// Writes the digest in hexadecimal
+static void store_hash_end(sha256_ctx *ctx, char hex[STORE_DIGEST_HEX_SIZE]) {
+    unsigned char digest[SHA256_DIGEST_SIZE] = {0};
+
+    sha256_final(ctx, digest);
+    for (int i = 0; i < SHA256_DIGEST_SIZE; i++)
+        snprintf(hex + 2 * i, 3, "%02x", digest[i]);
+}
+
+static int store_hash_file(const char *path, char hex[STORE_DIGEST_HEX_SIZE]) {
+    char *buffer = malloc(STORE_BLOCK_SIZE);
+    sha256_ctx ctx;
+    int fd = -1;
+    ssize_t len = 0;
+    int err = -1;
+
+    if (!buffer || (fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+        log_error("failed to open layer %s: %m", path);
+        goto exit;
+    }
+
+    sha256_init(&ctx);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    while ((len = read(fd, buffer, STORE_BLOCK_SIZE)) > 0)
+        sha256_update(&ctx, buffer, len);
+    if (len == -1) {
+        log_error("failed to read layer %s: %m", path);
+        goto exit;
+    }
+
+    store_hash_end(&ctx, hex);
+    err = 0;
+
+exit:
+    if (fd >= 0)
+        close(fd);
+    free(buffer);
+    return err;
+}
+
+#ifdef HAVE_LIBARCHIVE
+// Returns the path of the entry in the layer, NULL for the layer itself
+static const char *store_entry_name(const char *name) {
+    while (*name == '/' || !strncmp(name, "./", 2))
+        name += *name == '/' ? 1 : 2;
+
+    return *name && strcmp(name, ".") ? name : NULL;
+}
+
+// Entries must stay in the layer, whatever barco extracts them with
+static bool store_entry_safe(const char *name) {
+    for (const char *c = name; c; c = strchr(c, '/')) {
+        c += *c == '/';
+        if (!strncmp(c, "..", 2) && (c[2] == '/' || !c[2]))
+            return false;
+    }
+
+    return true;
+}
+
+// Opens the directory path of the layer, relative to dir_fd, creating the
+// missing ones. No component is a symbolic link, an earlier entry of the layer
+// cannot redirect a later one out of it.
+static int store_open_dir(int dir_fd, const char *path) {
+    char components[PATH_MAX] = {0};
+    char *save = NULL;
+    int fd = dup(dir_fd);
+
+    snprintf(components, sizeof(components), "%s", path);
+    for (char *c = strtok_r(components, "/", &save); c && fd >= 0;
+         c = strtok_r(NULL, "/", &save)) {
+        int next = -1;
+
+        if (!strcmp(c, "."))
+            continue;
+        if (mkdirat(fd, c, 0755) && errno != EEXIST)
+            log_error("failed to create %s in layer: %m", path);
+        else if ((next = openat(fd, c, O_RDONLY | O_DIRECTORY | O_NOFOLLOW |
+                                O_CLOEXEC)) == -1)
+            log_error("failed to open %s in layer: %m", path);
+        close(fd);
+        fd = next;
+    }
+
+    return fd;
+}
+
+// Converts an OCI whiteout to the overlayfs one: .wh.<name> hides name of the
+// lower layers (a 0:0 character device), .wh..wh..opq hides all the lower
+// content of its directory (the opaque xattr). name is relative to the layer
+// dir_fd, the whiteouts do not go through libarchive and its checks.
+static int store_whiteout(int dir_fd, const char *name) {
+    char dir[PATH_MAX] = {0};
+    const char *base = strrchr(name, '/');
+    int fd = -1;
+    int err = -1;
+
+    snprintf(dir, sizeof(dir), "%.*s", base ? (int)(base - name) : 0, name);
+    base = base ? base + 1 : name;
+    if ((fd = store_open_dir(dir_fd, dir)) == -1)
+        return -1;
+
+    if (!strcmp(base, ".wh..wh..opq")) {
+        if (fsetxattr(fd, "trusted.overlay.opaque", "y", 1, 0))
+            log_error("failed to make %s opaque: %m", dir);
+        else
+            err = 0;
+    } else if (mknodat(fd, base + strlen(".wh."), S_IFCHR, makedev(0, 0))) {
+        log_error("failed to create whiteout %s: %m", name);
+    } else {
+        err = 0;
+    }
+
+    close(fd);
+    return err;
+}
+
+// Files can be shared with the identical files of other layers if nothing but
+// their content and their mode tell them apart
+static bool store_dedupable(struct archive_entry *entry) {
+    return archive_entry_filetype(entry) == AE_IFREG &&
+        !archive_entry_hardlink(entry) &&
+        archive_entry_size(entry) > 0 &&
+        !archive_entry_xattr_count(entry) &&
+        !archive_entry_sparse_count(entry) &&
+        !archive_entry_acl_count(entry, ARCHIVE_ENTRY_ACL_TYPE_ACCESS);
+}
+
+// Writes the data of the entry, and computes its digest if ctx is not NULL
+static int store_copy_data(struct archive *in, struct archive *out, sha256_ctx *ctx) {
+    const void *block = NULL;
+    size_t size = 0;
+    la_int64_t offset = 0;
+    int r = 0;
+
+    while ((r = archive_read_data_block(in, &block, &size, &offset)) == ARCHIVE_OK) {
+        if (archive_write_data_block(out, block, size, offset) < ARCHIVE_WARN) {
+            log_error("failed to write file: %s", archive_error_string(out));
+            return -1;
+        }
+        if (ctx)
+            sha256_update(ctx, block, size);
+    }
+
+    if (r != ARCHIVE_EOF) {
+        log_error("failed to read file: %s", archive_error_string(in));
+        return -1;
+    }
+
+    return 0;
+}
+
+// Replaces the file with a hard link of the identical file of the store, or
+// adds it to the store if it is the first one. The first file also gives its
+// modification time to the others.
+static void store_dedup(const char *root, const char *path, const char *key) {
+    char shared[PATH_MAX] = {0};
+    char tmp[PATH_MAX] = {0};
+
+    if (store_path(shared, "%s/files/%s", root, key) ||
+        store_path(tmp, "%s.dedup", path) ||
+        !link(path, shared))
+        return;
+
+    // EMLINK (too many links) keeps a copy
+    if (errno != EEXIST || link(shared, tmp)) {
+        log_debug("failed to share %s: %m", path);
+        return;
+    }
+    if (rename(tmp, path)) {
+        log_debug("failed to share %s: %m", path);
+        unlink(tmp);
+    }
+}
+
+// Extracts the layer tar to dir. libarchive detects the compression, the
+// paths are prefixed with dir and can neither go up (..) nor through a
+// symbolic link of the layer.
+static int store_extract(const char *root, const char *tar, const char *dir) {
+    struct archive *in = archive_read_new();
+    struct archive *out = archive_write_disk_new();
+    struct archive_entry *entry = NULL;
+    int flags = ARCHIVE_EXTRACT_PERM | ARCHIVE_EXTRACT_TIME | ARCHIVE_EXTRACT_OWNER |
+        ARCHIVE_EXTRACT_XATTR | ARCHIVE_EXTRACT_ACL | ARCHIVE_EXTRACT_FFLAGS |
+        ARCHIVE_EXTRACT_SECURE_NODOTDOT | ARCHIVE_EXTRACT_SECURE_SYMLINKS;
+    int dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    int err = -1;
+    int r = 0;
+
+    if (!in || !out) {
+        log_error("failed to allocate archive: %m");
+        goto exit;
+    }
+    if (dir_fd == -1) {
+        log_error("failed to open %s: %m", dir);
+        goto exit;
+    }
+
+    archive_read_support_filter_all(in);
+    archive_read_support_format_tar(in);
+    archive_write_disk_set_options(out, flags);
+    if (archive_read_open_filename(in, tar, STORE_BLOCK_SIZE) != ARCHIVE_OK) {
+        log_error("failed to open layer %s: %s", tar, archive_error_string(in));
+        goto exit;
+    }
+
+    while ((r = archive_read_next_header(in, &entry)) == ARCHIVE_OK) {
+        const char *name = store_entry_name(archive_entry_pathname(entry));
+        const char *hardlink = archive_entry_hardlink(entry);
+        char path[PATH_MAX] = {0};
+        char target[PATH_MAX] = {0};
+        char key[STORE_DIGEST_HEX_SIZE + 64] = {0};
+        bool dedup = store_dedupable(entry);
+        sha256_ctx ctx;
+
+        if (!name)
+            continue;
+        if (!store_entry_safe(name) || (hardlink && !store_entry_safe(hardlink))) {
+            log_error("entry %s leaves layer %s", name, tar);
+            goto exit;
+        }
+        if (store_path(path, "%s/%s", dir, name))
+            goto exit;
+
+        if (!strncmp(strrchr(path, '/') + 1, ".wh.", strlen(".wh."))) {
+            if (store_whiteout(dir_fd, name))
+                goto exit;
+            continue;
+        }
+
+        archive_entry_set_pathname(entry, path);
+        if (hardlink && (hardlink = store_entry_name(hardlink))) {
+            if (store_path(target, "%s/%s", dir, hardlink))
+                goto exit;
+            archive_entry_set_hardlink(entry, target);
+        }
+
+        if (archive_write_header(out, entry) < ARCHIVE_WARN) {
+            log_error("failed to extract %s: %s", name, archive_error_string(out));
+            goto exit;
+        }
+
+        sha256_init(&ctx);
+        if (archive_entry_size(entry) > 0 && store_copy_data(in, out, dedup ? &ctx : NULL))
+            goto exit;
+        if (archive_write_finish_entry(out) < ARCHIVE_WARN) {
+            log_error("failed to extract %s: %s", name, archive_error_string(out));
+            goto exit;
+        }
+
+        if (dedup) {
+            int len = 0;
+
+            store_hash_end(&ctx, key);
+            len = strlen(key);
+            snprintf(key + len, sizeof(key) - len, "-%o-%ld-%ld",
+                     (unsigned int)archive_entry_mode(entry),
+                     (long)archive_entry_uid(entry), (long)archive_entry_gid(entry));
+            store_dedup(root, path, key);
+        }
+    }
+
+    if (r != ARCHIVE_EOF) {
+        log_error("failed to read layer %s: %s", tar, archive_error_string(in));
+        goto exit;
+    }
+
+    // The modes and times of the directories are set last
+    if (archive_write_close(out) < ARCHIVE_WARN) {
+        log_error("failed to extract layer %s: %s", tar, archive_error_string(out));
+        goto exit;
+    }
+
+    err = 0;
+
+exit:
+    if (dir_fd >= 0)
+        close(dir_fd);
+    archive_read_free(in);
+    archive_write_free(out);
+    return err;
+}
+#else
+static int store_extract(const char *root, const char *tar, const char *dir) {
+    (void)root;
+    (void)dir;
+
+    log_error("failed to extract layer %s: barco is built without libarchive", tar);
+    return -1;
+}
+#endif
+
+// Extracts the layer unless it is already in the store. It is extracted to a
+// temporary directory, renamed once complete, so that a layer of the store is
+// always complete.
+static int store_import_layer(const char *root, store_layer *layer) {
+    char dir[PATH_MAX] = {0};
+    char tmp[PATH_MAX] = {0};
+
+    if (store_hash_file(layer->tar, layer->digest) ||
+        store_path(dir, "%s/layers/sha256/%s", root, layer->digest) ||
+        store_path(tmp, "%s/layers/sha256/.%s.%d.%d", root, layer->digest,
+                   getpid(), gettid()))
+        return -1;
+
+    if (!access(dir, F_OK)) {
+        log_info("layer %s is already in the store", layer->digest);
+        return 0;
+    }
+
+    log_info("extracting layer %s (%s)...", layer->tar, layer->digest);
+    if (mkdir(tmp, 0755)) {
+        log_error("failed to create %s: %m", tmp);
+        return -1;
+    }
+    if (store_extract(root, layer->tar, tmp)) {
+        store_remove(tmp);
+        return -1;
+    }
+
+    // The same layer may have been extracted meanwhile, by another worker or
+    // another barco
+    if (rename(tmp, dir)) {
+        if (errno != EEXIST && errno != ENOTEMPTY) {
+            log_error("failed to add layer %s: %m", layer->digest);
+            store_remove(tmp);
+            return -1;
+        }
+        store_remove(tmp);
+    }
+
+    log_info("layer %s extracted", layer->digest);
+    return 0;
+}
+
+static void *store_worker(void *arg) {
+    store_job *job = arg;
+    int index = 0;
+
+    while ((index = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->count)
+        job->layers[index].err = store_import_layer(job->root, &job->layers[index]);
+
+    return NULL;
+}
+
+// Writes the ref file, replaced at once so that readers never see a partial one
+static int store_write_ref(const char *root, const char *ref, const store_layer *layers,
+                           int count) {
+    char path[PATH_MAX] = {0};
+    char tmp[PATH_MAX] = {0};
+    FILE *fp = NULL;
+
+    if (store_path(path, "%s/refs/%s", root, ref) ||
+        store_path(tmp, "%s/refs/.%s.%d", root, ref, getpid()))
+        return -1;
+
+    if (!(fp = fopen(tmp, "we"))) {
+        log_error("failed to create %s: %m", tmp);
+        return -1;
+    }
+    for (int i = 0; i < count; i++)
+        fprintf(fp, "sha256:%s\n", layers[i].digest);
+
+    if (fflush(fp) || fsync(fileno(fp)) || fclose(fp)) {
+        log_error("failed to write %s: %m", tmp);
+        unlink(tmp);
+        return -1;
+    }
+    if (rename(tmp, path)) {
+        log_error("failed to write %s: %m", path);
+        unlink(tmp);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Layers are imported in parallel, one layer per worker: the decompression of
+// a layer (gzip) is sequential, the layers are not.
+int store_import(const char *root, const char *ref, const char **tars, int count,
+                 int workers) {
+    store_layer layers[MOUNT_LAYERS_MAX] = {0};
+    pthread_t threads[MOUNT_LAYERS_MAX];
+    store_job job = {.layers = layers, .count = count};
+    char path[PATH_MAX] = {0};
+    char *real = NULL;
+    int started = 0;
+    int err = -1;
+
+    if (!store_valid_ref(ref)) {
+        log_error("invalid image reference %s", ref);
+        return -1;
+    }
+    if (count <= 0 || count > MOUNT_LAYERS_MAX) {
+        log_error("an image has 1 to %d layers", MOUNT_LAYERS_MAX);
+        return -1;
+    }
+
+    // The paths of the store must have no symbolic links, which libarchive
+    // refuses to extract through
+    if (store_path(path, "%s/layers/sha256", root) || store_mkdirs(path) ||
+        store_path(path, "%s/files", root) || store_mkdirs(path) ||
+        store_path(path, "%s/refs", root) || store_mkdirs(path))
+        return -1;
+    if (!(real = realpath(root, NULL))) {
+        log_error("failed to resolve %s: %m", root);
+        return -1;
+    }
+    job.root = real;
+
+    for (int i = 0; i < count; i++)
+        layers[i].tar = tars[i];
+
+    log_info("importing %s (%d layers)...", ref, count);
+    for (; started < (workers < count ? workers : count) - 1; started++) {
+        if (pthread_create(&threads[started], NULL, store_worker, &job)) {
+            log_warn("failed to start worker: %m");
+            break;
+        }
+    }
+    store_worker(&job);
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    for (int i = 0; i < count; i++) {
+        if (layers[i].err) {
+            log_error("failed to import layer %s", layers[i].tar);
+            goto exit;
+        }
+    }
+
+    if (store_write_ref(real, ref, layers, count))
+        goto exit;
+
+    log_info("image %s imported", ref);
+    err = 0;
+
+exit:
+    free(real);
+    return err;
+}
+
+int store_resolve(const char *root, const char *ref, store_layers *layers) {
+    char path[PATH_MAX] = {0};
+    char line[STORE_DIGEST_HEX_SIZE + 16] = {0};
+    FILE *fp = NULL;
+    int err = -1;
+
+    layers->count = 0;
+    if (!store_valid_ref(ref)) {
+        log_error("invalid image reference %s", ref);
+        return -1;
+    }
+    if (store_path(path, "%s/refs/%s", root, ref))
+        return -1;
+    if (!(fp = fopen(path, "re"))) {
+        log_error("failed to find image %s: %m", ref);
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), fp)) {
+        const char *digest = line + strlen("sha256:");
+
+        line[strcspn(line, "\n")] = '\0';
+        if (strncmp(line, "sha256:", strlen("sha256:")) ||
+            strlen(digest) != STORE_DIGEST_HEX_SIZE - 1 ||
+            strspn(digest, "0123456789abcdef") != STORE_DIGEST_HEX_SIZE - 1) {
+            log_error("invalid layer %s in image %s", line, ref);
+            goto exit;
+        }
+        if (layers->count == MOUNT_LAYERS_MAX) {
+            log_error("image %s has more than %d layers", ref, MOUNT_LAYERS_MAX);
+            goto exit;
+        }
+
+        if (store_path(layers->paths[layers->count], "%s/layers/sha256/%s", root, digest))
+            goto exit;
+        if (access(layers->paths[layers->count], F_OK)) {
+            log_error("layer %s of image %s is missing: %m", digest, ref);
+            goto exit;
+        }
+        layers->count++;
+    }
+
+    if (!layers->count) {
+        log_error("image %s has no layers", ref);
+        goto exit;
+    }
+
+    err = 0;
+
+exit:
+    fclose(fp);
+    return err;
+}
@@ -0,0 +1,302 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/wait.h>
+
+#include "log.h"
+#include "supervisor.h"
+
+// Reads an unsigned member of the manifest, missing members keep the default
+static int supervisor_get_uint(const json_value *object, const char *key,
+                               uint64_t max, uint64_t *out) {
+    const json_value *value = json_get(object, key);
+
+    if (!value)
+        return 0;
+    if (json_uint64(value, out) || *out > max) {
+        log_error("invalid %s in manifest", key);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Reads a boolean member of the manifest, missing members keep the default
+static int supervisor_get_bool(const json_value *object, const char *key, bool *out) {
+    const json_value *value = json_get(object, key);
+
+    if (!value)
+        return 0;
+    if (value->type != JSON_BOOL) {
+        log_error("invalid %s in manifest", key);
+        return -1;
+    }
+    *out = value->boolean;
+
+    return 0;
+}
+
+// The name is a hostname and a directory in /sys/fs/cgroup
+static bool supervisor_valid_name(const char *name) {
+    size_t len = strlen(name);
+
+    return len && len <= HOST_NAME_MAX && !strchr(name, '/') &&
+        strcmp(name, ".") && strcmp(name, "..");
+}
+
+// Reads the root filesystem of a container, which replaces the one of the
+// command line as a whole
+static int supervisor_load_mount(supervisor_entry *entry, const json_value *object) {
+    const json_value *layers = json_get(object, "layers");
+    const char *mnt = json_get_string(object, "mnt");
+    const char *image = json_get_string(object, "image");
+
+    if (!mnt && !layers && !image)
+        return 0;
+    if ((mnt != NULL) + (layers != NULL) + (image != NULL) > 1) {
+        log_error("%s: either mnt, layers or image is expected", entry->name);
+        return -1;
+    }
+
+    memset(&entry->config.mount, 0, sizeof(entry->config.mount));
+    entry->config.mount.tree_fd = -1;
+    entry->config.mount.mnt = mnt;
+    entry->config.mount.image = image;
+    if (!layers)
+        return 0;
+
+    if (layers->type != JSON_ARRAY || !layers->count || layers->count > MOUNT_LAYERS_MAX) {
+        log_error("%s: layers must be an array of 1 to %d paths", entry->name,
+                  MOUNT_LAYERS_MAX);
+        return -1;
+    }
+    for (size_t i = 0; i < layers->count; i++) {
+        if (layers->items[i].type != JSON_STRING) {
+            log_error("%s: layers must be an array of paths", entry->name);
+            return -1;
+        }
+        entry->config.mount.layers[i] = layers->items[i].string;
+    }
+    entry->config.mount.layers_count = layers->count;
+    entry->config.mount.upper = json_get_string(object, "upper");
+    entry->config.mount.work = json_get_string(object, "work");
+    if (!entry->config.mount.upper != !entry->config.mount.work) {
+        log_error("%s: upper and work go together", entry->name);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int supervisor_load_entry(supervisor *sup, int index, const json_value *object,
+                                 const container_config *defaults,
+                                 unsigned int timeout_ms) {
+    supervisor_entry *entry = &sup->entries[index];
+    const char *name = json_get_string(object, "name");
+    uint64_t value = 0;
+
+    if (object->type != JSON_OBJECT) {
+        log_error("container %d of the manifest is not an object", index);
+        return -1;
+    }
+
+    // Unnamed containers are named like the containers of a pool, so that
+    // several barco processes can run the same manifest
+    if (name)
+        snprintf(entry->name, sizeof(entry->name), "%s", name);
+    else
+        snprintf(entry->name, sizeof(entry->name), "%s-%d-%d", defaults->hostname,
+                 getpid(), index);
+    if (!supervisor_valid_name(name ? name : entry->name)) {
+        log_error("invalid container name %s in manifest", name ? name : entry->name);
+        return -1;
+    }
+    for (int i = 0; i < index; i++) {
+        if (!strcmp(sup->entries[i].name, entry->name)) {
+            log_error("container %s is twice in the manifest", entry->name);
+            return -1;
+        }
+    }
+
+    entry->config = *defaults;
+    entry->config.hostname = entry->name;
+
+    if (json_get_string(object, "cmd")) {
+        entry->config.cmd = json_get_string(object, "cmd");
+        entry->config.argv[ARGV_CMD_INDEX] = (char *)entry->config.cmd;
+        entry->config.argv[ARGV_ARG_INDEX] = NULL;
+    }
+    if (json_get_string(object, "arg"))
+        entry->config.argv[ARGV_ARG_INDEX] = (char *)json_get_string(object, "arg");
+    if (!entry->config.cmd) {
+        log_error("%s: missing cmd", entry->name);
+        return -1;
+    }
+
+    value = entry->config.uid;
+    if (supervisor_get_uint(object, "uid", UINT32_MAX - 1, &value))
+        return -1;
+    entry->config.uid = value;
+
+    value = entry->config.cpuset.cpus;
+    if (supervisor_get_uint(object, "cpus", CPUSET_CPUS_MAX, &value) ||
+        supervisor_get_bool(object, "cpus_exclusive", &entry->config.cpuset.exclusive))
+        return -1;
+    entry->config.cpuset.cpus = value;
+
+    if (json_get(object, "numa_node")) {
+        if (supervisor_get_uint(object, "numa_node", CPUSET_NODES_MAX - 1, &value))
+            return -1;
+        entry->config.cpuset.node = value;
+    }
+
+    // Each container of a bridge needs its own address
+    if (json_get_string(object, "net") &&
+        net_parse_mode(json_get_string(object, "net"), &entry->config.net.mode)) {
+        log_error("%s: unknown network mode %s", entry->name, json_get_string(object, "net"));
+        return -1;
+    }
+    if (json_get_string(object, "address"))
+        entry->config.net.address = json_get_string(object, "address");
+    if (json_get_string(object, "gateway"))
+        entry->config.net.gateway = json_get_string(object, "gateway");
+    if (json_get_string(object, "ns_join"))
+        entry->config.ns.join = json_get_string(object, "ns_join");
+    if (entry->config.ns.join && entry->config.net.mode != NET_MODE_NONE) {
+        log_error("%s: a joined network is not configured", entry->name);
+        return -1;
+    }
+
+    value = timeout_ms;
+    if (supervisor_get_uint(object, "timeout_ms", UINT32_MAX, &value))
+        return -1;
+    entry->timeout_ms = value;
+
+    if (supervisor_load_mount(entry, object))
+        return -1;
+    if (!entry->config.mount.mnt && !entry->config.mount.layers_count &&
+        !entry->config.mount.image) {
+        log_error("%s: missing mnt, layers or image", entry->name);
+        return -1;
+    }
+
+    return 0;
+}
+
+int supervisor_load(supervisor *sup, const char *path, const container_config *defaults,
+                    unsigned int timeout_ms) {
+    const json_value *containers = NULL;
+
+    memset(sup, 0, sizeof(*sup));
+
+    log_debug("loading manifest %s...", path);
+    if (!(sup->manifest = json_load(path)))
+        return -1;
+
+    containers = json_get(sup->manifest, "containers");
+    if (!containers || containers->type != JSON_ARRAY || !containers->count ||
+        containers->count > SUPERVISOR_CONTAINERS_MAX) {
+        log_error("manifest %s must have 1 to %d containers", path,
+                  SUPERVISOR_CONTAINERS_MAX);
+        return -1;
+    }
+
+    if (!(sup->entries = calloc(containers->count, sizeof(*sup->entries)))) {
+        log_error("failed to allocate manifest: %m");
+        return -1;
+    }
+
+    for (size_t i = 0; i < containers->count; i++) {
+        if (supervisor_load_entry(sup, i, &containers->items[i], defaults, timeout_ms))
+            return -1;
+        sup->count++;
+    }
+
+    log_info("manifest %s has %d containers", path, sup->count);
+    return 0;
+}
+
+// Creates containers until there are none left. The launch sequence mostly
+// waits for the kernel (cgroup, mounts, clone), so the containers are created
+// in parallel.
+static void *supervisor_worker(void *arg) {
+    supervisor *sup = arg;
+    int index = 0;
+
+    while ((index = __atomic_fetch_add(&sup->next, 1, __ATOMIC_RELAXED)) < sup->count) {
+        supervisor_entry *entry = &sup->entries[index];
+
+        log_debug("creating container %s...", entry->name);
+        if (container_create(&entry->container, &entry->config)) {
+            log_error("failed to create container %s", entry->name);
+            if (entry->container.pid > 0) {
+                container_stop(entry->container.pid);
+                waitpid(entry->container.pid, NULL, 0);
+            }
+            container_destroy(&entry->container);
+            continue;
+        }
+        entry->created = true;
+    }
+
+    return NULL;
+}
+
+int supervisor_start(supervisor *sup, int workers) {
+    pthread_t threads[SUPERVISOR_WORKERS_MAX];
+    int started = 0;
+
+    if (workers > sup->count)
+        workers = sup->count;
+    if (workers > SUPERVISOR_WORKERS_MAX)
+        workers = SUPERVISOR_WORKERS_MAX;
+
+    log_info("creating %d containers with %d workers...", sup->count, workers);
+    sup->next = 0;
+    for (started = 0; started < workers; started++) {
+        int err = pthread_create(&threads[started], NULL, supervisor_worker, sup);
+
+        if (err) {
+            errno = err;
+            log_warn("failed to start worker: %m");
+            break;
+        }
+    }
+
+    // Without any worker the containers are created by this thread
+    if (!started)
+        supervisor_worker(sup);
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    for (int i = 0; i < sup->count; i++) {
+        if (!sup->entries[i].created)
+            return -1;
+    }
+
+    return 0;
+}
+
+void supervisor_free(supervisor *sup) {
+    for (int i = 0; i < sup->count; i++) {
+        supervisor_entry *entry = &sup->entries[i];
+
+        // Containers reaped by the monitor have no pid anymore
+        if (entry->created && entry->container.pid > 0) {
+            container_stop(entry->container.pid);
+            waitpid(entry->container.pid, NULL, 0);
+        }
+        if (entry->created)
+            container_destroy(&entry->container);
+    }
+
+    free(sup->entries);
+    sup->entries = NULL;
+    sup->count = 0;
+    json_free(sup->manifest);
+    sup->manifest = NULL;
+}
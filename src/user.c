@@ -1,43 +1,49 @@
 #define _GNU_SOURCE
 #include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <grp.h>
 #include <fcntl.h>
 #include <limits.h>
 #include <errno.h>
 #include <string.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "log.h"
 #include "user.h"
 
-// Lets the parent process know that the user namespace is started.
-// The parent calls user_namespace_set_user to update the uid_map / gid_map.
-// If successful, setgroups, setresgid, and setresuid are called in this
-// function by the child. setgroups and setresgid are necessary because of two
-// separate group mechanisms on Linux. The function assumes that every uid has a
-// corresponding gid, which is often the case.
-int user_namespace_init(uid_t uid, int fd) {
-    int unshared = unshare(CLONE_NEWUSER);
-    int result = 0;
+// Header of USER_POOL_PATH, followed by the pid owning each slot (0 for
+// none). Slots are taken with a compare-and-swap, so barco processes and
+// threads allocate ranges in parallel without a lock.
+typedef struct {
+    uint64_t start;
+    uint64_t size;
+    uint64_t slots;
+    uint32_t owners[];
+} user_pool_state;
 
-    log_debug("setting user namespace...");
+static int user_idmap_fixed = -1;
 
-    log_debug("writing to socket...");
-    if (write(fd, &unshared, sizeof(unshared)) != sizeof(unshared)) {
-        log_error("failed to write socket %d: %m", fd);
-        return -1;
-    }
-
-    log_debug("reading from socket...");
-    if (read(fd, &result, sizeof(result)) != sizeof(result)) {
-        log_error("failed to read from socket %d: %m", fd);
-        return -1;
-    }
-
-    if (result) {
-        return -1;
-    }
+static struct {
+    user_pool_config config;
+    // NULL without a pool
+    user_pool_state *state;
+    // Namespaces of the single extent ranges (see user_namespace_idmap)
+    int *idmap_fds;
+    int idmap_count;
+} U = {.idmap_fds = &user_idmap_fixed, .idmap_count = 1};
 
+// Switches to the uid and gid of the user in the user namespace of the
+// process. setgroups and setresgid are necessary because of two separate group
+// mechanisms on Linux. The function assumes that every uid has a
+// corresponding gid, which is often the case.
+int user_namespace_set_user(uid_t uid) {
     log_debug("switching to uid %d / gid %d...", uid, uid);
 
     log_debug("setting uid and gid mappings...");
@@ -59,83 +65,309 @@ int user_namespace_init(uid_t uid, int fd) {
         return -1;
     }
 
-    log_debug("user namespace set");
-
     return 0;
 }
 
-// Listens for the child process to request setting uid / gid, then updates the
-// uid_map / gid_map for the child process to use. uid_map and gid_map are a
-// Linux kernel mechanism for mapping uids and gids between the parent and child
-// parent. The parent process must be privileged to set the uid_map / gid_map.
-int user_namespace_prepare_mappings(pid_t pid, int fd) {
+// Formats the mappings of the range, one line per extent. The first number
+// is the starting uid / gid in the namespace of the child, the second number
+// is the starting uid / gid of the parent namespace, and the third number is
+// the number of uids / gids to map. With the fixed range, the child's uids
+// 0 to USER_NAMESPACE_UID_CHILD_RANGE_SIZE are the host uids from
+// USER_NAMESPACE_UID_CHILD_RANGE_START.
+//
+// This is the critical step that provides security isolation. It allows the
+// child process to run as root (UID 0) inside its own isolated user namespace,
+// while the kernel sees its operations as being performed by a non-privileged
+// user (e.g., UID 100000) on the host system. This ensures that the process
+// can't perform privileged operations on the host, even if it has full
+// administrative control within its own namespace. With a pool, each container
+// also gets host uids of its own, so containers are isolated from each other.
+static int user_namespace_format_map(const user_range *range, char *map, size_t size) {
+    int len = 0;
+
+    for (int i = 0; i < range->count; i++) {
+        len += snprintf(map + len, size - len, "%u %u %u\n",
+                        USER_NAMESPACE_UID_PARENT_RANGE_START + i * range->size,
+                        range->hosts[i], range->size);
+        if (len >= (int)size)
+            return -1;
+    }
+
+    return len;
+}
+
+// Writes the uid_map / gid_map of the process with the pid. The kernel takes
+// a map in a single write, all the lines at once.
+static int user_namespace_write_mappings(pid_t pid, const user_range *range) {
+    char map[USER_RANGE_EXTENTS_MAX * 3 * 12] = {0};
+    char dir[PATH_MAX] = {0};
     int map_fd = 0;
-    int unshared = -1;
+    int len = 0;
 
-    log_debug("updating uid_map / gid_map...");
-    log_debug("retrieving user namespaces status...");
-    if (read(fd, &unshared, sizeof(unshared)) != sizeof(unshared)) {
-        log_error("failed to retrieve status from socket %d: %m", fd);
+    if ((len = user_namespace_format_map(range, map, sizeof(map))) <= 0) {
+        log_error("invalid uid range");
         return -1;
     }
 
-    if (!unshared) {
-        char dir[PATH_MAX] = {0};
-
-        log_debug("user namespaces enabled");
-
-        log_debug("writing uid_map / gid_map...");
-        for (char **file = (char *[]){"uid_map", "gid_map", 0}; *file; file++) {
-            if (snprintf(dir, sizeof(dir), "/proc/%d/%s", pid, *file) >
-                (int)sizeof(dir)) {
-                log_error("failed to setup dir %s: %m", dir);
-                return -1;
-            }
-
-            log_debug("writing %s...", dir);
-            if ((map_fd = open(dir, O_WRONLY)) == -1) {
-                log_error("failed to open %s: %m", dir);
-                return -1;
-            }
-
-            log_debug("writing settings...");
-
-            // The first number is the starting uid / gid of the parent
-            // namespace, the second number is the starting uid / gid of the child
-            // namespace, and the third number is the number of uids / gids to map.
-            // This configuration tells the kernel that the parent uid / gid 0 is
-            // mapped to USER_NAMESPACE_UID_CHILD_RANGE_START uid of the child
-            //
-            // For the child process with PID <pid>, establish the following ID
-            // mapping: The child's UID range, starting at USER_NAMESPACE_UID_CHILD_RANGE_START
-            // and spanning for USER_NAMESPACE_UID_CHILD_RANGE_SIZE IDs, should be
-            // treated as the parent's UID range, starting at USER_NAMESPACE_UID_PARENT_RANGE_START.
-            //
-            // This is the critical step that provides security isolation. It allows the
-            // child process to run as root (UID 0) inside its own isolated user namespace,
-            // while the kernel sees its operations as being performed by a non-privileged
-            // user (e.g., UID 100000) on the host system. This ensures that the process
-            // can't perform privileged operations on the host, even if it has full
-            // administrative control within its own namespace.
-            if (dprintf(map_fd, "%d %d %d\n", USER_NAMESPACE_UID_PARENT_RANGE_START,
-                        USER_NAMESPACE_UID_CHILD_RANGE_START,
-                        USER_NAMESPACE_UID_CHILD_RANGE_SIZE) == -1) {
-                log_error("failed to write uid_map '%d': %m", map_fd);
-                close(map_fd);
-                return -1;
-            }
+    log_debug("writing uid_map / gid_map...");
+    for (char **file = (char *[]){"uid_map", "gid_map", 0}; *file; file++) {
+        if (snprintf(dir, sizeof(dir), "/proc/%d/%s", pid, *file) >
+            (int)sizeof(dir)) {
+            log_error("failed to setup dir %s: %m", dir);
+            return -1;
+        }
+
+        log_debug("writing %s...", dir);
+        if ((map_fd = open(dir, O_WRONLY | O_CLOEXEC)) == -1) {
+            log_error("failed to open %s: %m", dir);
+            return -1;
+        }
 
+        if (write(map_fd, map, len) != len) {
+            log_error("failed to write %s: %m", dir);
             close(map_fd);
+            return -1;
         }
 
-        log_debug("uid_map and gid_map updated");
+        close(map_fd);
+    }
+
+    return 0;
+}
+
+// Writes the uid_map / gid_map of the user namespace of the container, which
+// waits for them. uid_map and gid_map are a Linux kernel mechanism for mapping
+// uids and gids between the parent and child namespaces. The parent process
+// must be privileged to set the uid_map / gid_map.
+int user_namespace_prepare_mappings(pid_t pid, const user_range *range) {
+    log_debug("updating uid_map / gid_map...");
+    if (user_namespace_write_mappings(pid, range))
+        return -1;
+
+    log_debug("uid_map and gid_map updated");
+    return 0;
+}
+
+// Creates a user namespace with the mappings of the range. A helper process
+// is cloned in a new user namespace, gets the mappings, and the namespace is
+// kept alive by an fd after the helper exits.
+static int user_namespace_idmap_create(const user_range *range) {
+    int pipe_fds[2] = {-1, -1};
+    char path[PATH_MAX] = {0};
+    pid_t pid = 0;
+    int fd = -1;
+
+    log_debug("creating idmap user namespace...");
+    if (pipe2(pipe_fds, O_CLOEXEC)) {
+        log_error("failed to create pipe: %m");
+        return -1;
+    }
+
+    // Like fork(), but the child starts in a new user namespace. It waits
+    // until barco closes the pipe.
+    if ((pid = syscall(SYS_clone, CLONE_NEWUSER | SIGCHLD, NULL, NULL, NULL, NULL)) == -1) {
+        log_error("failed to clone idmap helper: %m");
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        return -1;
+    }
+
+    if (!pid) {
+        char c = 0;
+
+        close(pipe_fds[1]);
+        _exit(read(pipe_fds[0], &c, sizeof(c)) ? 1 : 0);
+    }
+
+    close(pipe_fds[0]);
+    snprintf(path, sizeof(path), "/proc/%d/ns/user", pid);
+    if (!user_namespace_write_mappings(pid, range) &&
+        (fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+        log_error("failed to open %s: %m", path);
+
+    close(pipe_fds[1]);
+    waitpid(pid, NULL, 0);
+
+    return fd;
+}
+
+// The namespaces of the ranges made of a single extent are created once and
+// shared by all the containers of the range, the fixed range first. The
+// others are rare enough to be created for each container.
+int user_namespace_idmap(const user_range *range, bool *owned) {
+    int *idmap_fd = NULL;
+    int cached = -1;
+    int fd = -1;
+
+    *owned = false;
+    if (range->count != 1 || range->slots[0] + 1 >= U.idmap_count) {
+        *owned = true;
+        return user_namespace_idmap_create(range);
+    }
+
+    idmap_fd = &U.idmap_fds[range->slots[0] + 1];
+    if ((cached = __atomic_load_n(idmap_fd, __ATOMIC_ACQUIRE)) >= 0)
+        return cached;
+
+    if ((fd = user_namespace_idmap_create(range)) == -1)
+        return -1;
+
+    // Several threads may race here, the first namespace stored wins
+    if (!__atomic_compare_exchange_n(idmap_fd, &cached, fd, false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        close(fd);
+        return cached;
     }
 
-    log_debug("updating socket...");
-    if (write(fd, &(int){0}, sizeof(int)) != sizeof(int)) {
-        log_error("failed to update socket %d: %m", fd);
+    return fd;
+}
+
+int user_pool_parse(const char *text, user_pool_config *config) {
+    unsigned long start = 0;
+    unsigned long size = 0;
+    int slots = 0;
+    int len = 0;
+
+    // The ranges end before 4294967295, which is (uid_t)-1
+    if (sscanf(text, "%lu:%d:%lu%n", &start, &slots, &size, &len) != 3 ||
+        text[len] || !start || !size || slots <= 0 || slots > USER_POOL_SLOTS_MAX ||
+        start + (unsigned long)slots * size >= UINT32_MAX) {
+        log_error("invalid uid pool %s, expected <start>:<slots>:<size>", text);
         return -1;
     }
 
+    config->start = start;
+    config->slots = slots;
+    config->size = size;
     return 0;
 }
+
+// The header is set by the first barco process, the others check that they
+// use the same pool. Each word is only ever changed from 0, no lock needed.
+static int user_pool_check(uint64_t *word, uint64_t value) {
+    uint64_t current = 0;
+
+    if (__atomic_compare_exchange_n(word, &current, value, false, __ATOMIC_ACQ_REL,
+                                    __ATOMIC_ACQUIRE) || current == value)
+        return 0;
+
+    log_error("%s is used by a pool with another configuration", USER_POOL_PATH);
+    return -1;
+}
+
+int user_pool_init(const user_pool_config *config) {
+    size_t size = sizeof(user_pool_state) + config->slots * sizeof(uint32_t);
+    struct stat st = {0};
+    void *state = MAP_FAILED;
+    int fd = -1;
+
+    log_debug("mapping uid pool %s...", USER_POOL_PATH);
+    if (mkdir(USER_STATE_DIR, 0755) && errno != EEXIST) {
+        log_error("failed to create %s: %m", USER_STATE_DIR);
+        return -1;
+    }
+
+    // Growing the file is harmless for the other processes, the header tells
+    // whether they use the same pool
+    if ((fd = open(USER_POOL_PATH, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR)) == -1 ||
+        fstat(fd, &st) || ((size_t)st.st_size < size && ftruncate(fd, size)) ||
+        (state = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        log_error("failed to map %s: %m", USER_POOL_PATH);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    close(fd);
+
+    U.config = *config;
+    U.state = state;
+    if (user_pool_check(&U.state->start, config->start) ||
+        user_pool_check(&U.state->size, config->size) ||
+        user_pool_check(&U.state->slots, config->slots))
+        return -1;
+
+    // The namespaces of the slots are created on first use
+    if (!(U.idmap_fds = malloc((config->slots + 1) * sizeof(int)))) {
+        log_error("failed to allocate idmap cache: %m");
+        return -1;
+    }
+    for (int i = 0; i <= config->slots; i++)
+        U.idmap_fds[i] = -1;
+    U.idmap_count = config->slots + 1;
+
+    return 0;
+}
+
+// A slot is stale when its owner is gone. The pid may have been reused, the
+// slot then stays taken until that process exits, which is safe.
+static bool user_slot_stale(uint32_t owner) {
+    return owner && kill(owner, 0) && errno == ESRCH;
+}
+
+// Takes a free slot, or a stale one when reclaim is set. The scan starts at a
+// different slot for each process and call, so that concurrent allocations
+// seldom compete for the same slots.
+static int user_slot_take(uint32_t owner, bool reclaim) {
+    static unsigned int next;
+    int slots = U.config.slots;
+    int first = (getpid() * 2654435761u + __atomic_fetch_add(&next, 1, __ATOMIC_RELAXED)) % slots;
+
+    for (int i = 0; i < slots; i++) {
+        int slot = (first + i) % slots;
+        uint32_t current = __atomic_load_n(&U.state->owners[slot], __ATOMIC_ACQUIRE);
+
+        if ((!current || (reclaim && user_slot_stale(current))) &&
+            __atomic_compare_exchange_n(&U.state->owners[slot], &current, owner, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return slot;
+    }
+
+    return -1;
+}
+
+int user_range_alloc(user_range *range) {
+    memset(range, 0, sizeof(*range));
+
+    if (!U.state) {
+        range->hosts[0] = USER_NAMESPACE_UID_CHILD_RANGE_START;
+        range->slots[0] = -1;
+        range->size = USER_NAMESPACE_UID_CHILD_RANGE_SIZE;
+        range->count = 1;
+        return 0;
+    }
+
+    range->size = U.config.size;
+    for (int i = 0; i < U.config.extents; i++) {
+        int slot = user_slot_take(getpid(), false);
+
+        // Checking the owners costs a syscall each, only done once the pool
+        // looks full
+        if (slot == -1 && (slot = user_slot_take(getpid(), true)) == -1) {
+            log_error("no uid range left in the pool");
+            user_range_free(range);
+            return -1;
+        }
+
+        range->slots[i] = slot;
+        range->hosts[i] = U.config.start + slot * U.config.size;
+        range->count++;
+    }
+
+    log_debug("allocated %d uid ranges from %u", range->count, range->hosts[0]);
+    return 0;
+}
+
+void user_range_own(const user_range *range, pid_t pid) {
+    for (int i = 0; i < range->count; i++) {
+        if (range->slots[i] >= 0)
+            __atomic_store_n(&U.state->owners[range->slots[i]], pid, __ATOMIC_RELEASE);
+    }
+}
+
+void user_range_free(user_range *range) {
+    for (int i = 0; i < range->count; i++) {
+        if (range->slots[i] >= 0)
+            __atomic_store_n(&U.state->owners[range->slots[i]], 0, __ATOMIC_RELEASE);
+    }
+    range->count = 0;
+}
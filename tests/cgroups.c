@@ -0,0 +1,40 @@
+#include <string.h>
+
+#include "log.h"
+#include "cgroupsv2.h"
+#include "check.h"
+
+// Tests of the io controller settings given to --cgroup
+
+static void test_cgroups_io(void) {
+    cgroupsv2_config config = {0};
+
+    CHECK(!cgroupsv2_parse_io(&config, "io.weight", "100"));
+    CHECK(config.io_count == 1 && !config.io[0].path[0] && !strcmp(config.io[0].value, "100"));
+    CHECK(!cgroupsv2_parse_io(&config, "io.max", "/dev/sda rbps=1048576 wiops=100"));
+    CHECK(config.io_count == 2 && !strcmp(config.io[1].path, "/dev/sda") &&
+          !strcmp(config.io[1].value, "rbps=1048576 wiops=100"));
+    CHECK(!cgroupsv2_parse_io(&config, "io.latency", "/dev/sda 500"));
+    CHECK(config.io_count == 3 && !strcmp(config.io[2].value, "target=500"));
+
+    CHECK(cgroupsv2_parse_io(&config, "io.weight", "0"));
+    CHECK(cgroupsv2_parse_io(&config, "io.weight", "10x"));
+    CHECK(cgroupsv2_parse_io(&config, "io.max", "/dev/sda"));
+    CHECK(cgroupsv2_parse_io(&config, "io.max", "/dev/sda "));
+    CHECK(cgroupsv2_parse_io(&config, "io.latency", "/dev/sda 0"));
+    CHECK(cgroupsv2_parse_io(&config, "io.latency", "/dev/sda abc"));
+    CHECK(config.io_count == 3);
+
+    while (config.io_count < CGROUPS_IO_MAX)
+        CHECK(!cgroupsv2_parse_io(&config, "io.weight", "100"));
+    CHECK(cgroupsv2_parse_io(&config, "io.weight", "100"));
+    CHECK(config.io_count == CGROUPS_IO_MAX);
+}
+
+int main(void) {
+    // The errors of the rejected inputs are expected
+    log_set_quiet(true);
+
+    test_cgroups_io();
+    return CHECK_RESULT();
+}
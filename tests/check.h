@@ -0,0 +1,23 @@
+#ifndef __CHECK_H__
+#define __CHECK_H__
+
+#include <stdio.h>
+
+// Checks of the tests: a failed check is reported and counted, the test goes
+// on and its main returns CHECK_RESULT().
+
+static int failures;
+
+#define CHECK(cond)                                                          \
+    do {                                                                     \
+        if (!(cond)) {                                                       \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, \
+                    #cond);                                                  \
+            failures++;                                                      \
+        }                                                                    \
+    } while (0)
+
+#define CHECK_RESULT()                                                       \
+    (failures ? (fprintf(stderr, "%d checks failed\n", failures), 1) : 0)
+
+#endif
@@ -0,0 +1,49 @@
+#include <stdbool.h>
+#include <string.h>
+
+#include "log.h"
+#include "cpuset.h"
+#include "check.h"
+
+// Tests of the cpu lists and memory policies given to --cpuset
+
+static bool cpuset_isset(const cpuset_mask *mask, unsigned int cpu) {
+    return (mask->bits[cpu / 64] >> (cpu % 64)) & 1;
+}
+
+static void test_cpuset(void) {
+    cpuset_mask mask = {0};
+    char list[CPUSET_LIST_SIZE] = {0};
+    cpuset_mempolicy mempolicy = CPUSET_MEMPOLICY_NONE;
+
+    CHECK(!cpuset_parse("0-3,8-11\n", &mask));
+    CHECK(cpuset_isset(&mask, 0) && cpuset_isset(&mask, 3) && !cpuset_isset(&mask, 4));
+    CHECK(cpuset_isset(&mask, 8) && cpuset_isset(&mask, 11) && !cpuset_isset(&mask, 12));
+    CHECK(!cpuset_format(&mask, list, sizeof(list)) && !strcmp(list, "0-3,8-11"));
+
+    CHECK(!cpuset_parse("5", &mask) && cpuset_isset(&mask, 5) && !cpuset_isset(&mask, 4));
+    CHECK(!cpuset_parse("", &mask) && !mask.bits[0]);
+    CHECK(!cpuset_parse("0-1023", &mask) && cpuset_isset(&mask, CPUSET_CPUS_MAX - 1));
+
+    // Reversed, out of range, negative and malformed ranges
+    CHECK(cpuset_parse("3-1", &mask));
+    CHECK(cpuset_parse("1024", &mask));
+    CHECK(cpuset_parse("0-1024", &mask));
+    CHECK(cpuset_parse("-1", &mask));
+    CHECK(cpuset_parse("1-", &mask));
+    CHECK(cpuset_parse("1,,2", &mask));
+    CHECK(cpuset_parse("a", &mask));
+    CHECK(cpuset_parse("1x", &mask));
+
+    CHECK(!cpuset_parse_mempolicy("interleave", &mempolicy) &&
+          mempolicy == CPUSET_MEMPOLICY_INTERLEAVE);
+    CHECK(cpuset_parse_mempolicy("nope", &mempolicy));
+}
+
+int main(void) {
+    // The errors of the rejected inputs are expected
+    log_set_quiet(true);
+
+    test_cpuset();
+    return CHECK_RESULT();
+}
@@ -0,0 +1,97 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "log.h"
+#include "json.h"
+#include "check.h"
+
+// Tests of the JSON parser used for the seccomp profiles
+
+// Returns true if text is rejected by the JSON parser
+static bool json_rejects(const char *text) {
+    json_value *value = json_parse(text, strlen(text));
+
+    json_free(value);
+    return !value;
+}
+
+// Returns true if depth balanced arrays around a number are rejected
+static bool json_nested(int depth) {
+    char text[2 * JSON_DEPTH_MAX + 8] = {0};
+
+    memset(text, '[', depth);
+    text[depth] = '1';
+    memset(text + depth + 1, ']', depth);
+    return json_rejects(text);
+}
+
+static void test_json(void) {
+    const char *text = "{\"a\": [1, \"x\\u00e9\", true, null], "
+                       "\"b\": {\"c\": 18446744073709551615}, "
+                       "\"d\": \"\\ud83d\\ude00\"}";
+    json_value *value = json_parse(text, strlen(text));
+    const json_value *a = json_get(value, "a");
+    uint64_t number = 0;
+
+    CHECK(value);
+    CHECK(a && a->type == JSON_ARRAY && a->count == 4);
+    CHECK(a && a->count == 4 && !strcmp(a->items[1].string, "x\xc3\xa9"));
+    CHECK(a && a->count == 4 && a->items[2].type == JSON_BOOL && a->items[2].boolean);
+    CHECK(a && a->count == 4 && a->items[3].type == JSON_NULL);
+    CHECK(!json_uint64(json_get(json_get(value, "b"), "c"), &number) &&
+          number == UINT64_MAX);
+    CHECK(json_get_string(value, "d") &&
+          !strcmp(json_get_string(value, "d"), "\xf0\x9f\x98\x80"));
+    CHECK(!json_get(value, "missing") && !json_get_string(value, "a"));
+    json_free(value);
+
+    // Unterminated strings, escapes ending the document
+    CHECK(json_rejects("\"abc"));
+    CHECK(json_rejects("\"abc\\"));
+    CHECK(json_rejects("\"abc\\\""));
+    CHECK(json_rejects("{\"abc"));
+    // Truncated and invalid \u escapes
+    CHECK(json_rejects("\"\\u"));
+    CHECK(json_rejects("\"\\u12"));
+    CHECK(json_rejects("\"\\u12\""));
+    CHECK(json_rejects("[\"\\u12\", \"abcd\"]"));
+    CHECK(json_rejects("\"\\u-123\""));
+    CHECK(json_rejects("\"\\u 123\""));
+    CHECK(json_rejects("\"\\u0x12\""));
+    CHECK(json_rejects("\"\\ud83d\\u0041\""));
+    CHECK(json_rejects("\"\\ud83d\\ude\""));
+    CHECK(json_rejects("\"\\q\""));
+    // Structure
+    CHECK(json_rejects(""));
+    CHECK(json_rejects("[1,"));
+    CHECK(json_rejects("[1 2]"));
+    CHECK(json_rejects("{\"a\" 1}"));
+    CHECK(json_rejects("{\"a\": 1,}"));
+    CHECK(json_rejects("{1: 2}"));
+    CHECK(json_rejects("[1] x"));
+    CHECK(json_rejects("tru"));
+
+    // The length is the end of the document, not the NUL
+    value = json_parse("\"abc\"", 3);
+    CHECK(!value);
+    json_free(value);
+
+    // Nesting is bounded, the parser is recursive
+    CHECK(!json_nested(JSON_DEPTH_MAX));
+    CHECK(json_nested(JSON_DEPTH_MAX + 1));
+
+    // Numbers are unsigned 64 bits integers
+    value = json_parse("[-1, 18446744073709551616, 1.5]", 31);
+    CHECK(value && value->count == 3);
+    for (size_t i = 0; value && i < value->count; i++)
+        CHECK(json_uint64(&value->items[i], &number));
+    json_free(value);
+}
+
+int main(void) {
+    // The errors of the rejected inputs are expected
+    log_set_quiet(true);
+
+    test_json();
+    return CHECK_RESULT();
+}
@@ -0,0 +1,71 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "log.h"
+#include "container.h"
+#include "check.h"
+
+// Tests of container_launch_parse, the launch message comes from the clients
+// of the pool socket.
+
+// Builds a launch message of argc + envc strings, the strings being given
+// back to back in strings (NUL separated) of length len
+static size_t launch_msg(char *msg, uint32_t argc, uint32_t envc,
+                         const char *strings, size_t len) {
+    uint32_t counts[2] = {argc, envc};
+
+    memcpy(msg, counts, sizeof(counts));
+    memcpy(msg + sizeof(counts), strings, len);
+    return sizeof(counts) + len;
+}
+
+static void test_launch(void) {
+    static char msg[CONTAINER_LAUNCH_MSG_MAX];
+    char *argv[CONTAINER_LAUNCH_ARGS_MAX + 1] = {0};
+    char *envp[CONTAINER_LAUNCH_ARGS_MAX + 1] = {0};
+    static const char strings[] = "/bin/echo\0hello\0HOME=/";
+    size_t len = 0;
+
+    len = launch_msg(msg, 2, 1, strings, sizeof(strings));
+    CHECK(!container_launch_parse(msg, len, argv, envp));
+    CHECK(argv[0] && !strcmp(argv[0], "/bin/echo"));
+    CHECK(argv[1] && !strcmp(argv[1], "hello"));
+    CHECK(!argv[2]);
+    CHECK(envp[0] && !strcmp(envp[0], "HOME=/"));
+    CHECK(!envp[1]);
+
+    // Shorter than the counts
+    CHECK(container_launch_parse(msg, sizeof(uint32_t), argv, envp));
+    // The command is required, argc and envc are bounded
+    len = launch_msg(msg, 0, 1, strings, sizeof(strings));
+    CHECK(container_launch_parse(msg, len, argv, envp));
+    len = launch_msg(msg, CONTAINER_LAUNCH_ARGS_MAX + 1, 0, strings, sizeof(strings));
+    CHECK(container_launch_parse(msg, len, argv, envp));
+    len = launch_msg(msg, 1, CONTAINER_LAUNCH_ARGS_MAX + 1, strings, sizeof(strings));
+    CHECK(container_launch_parse(msg, len, argv, envp));
+    len = launch_msg(msg, UINT32_MAX, UINT32_MAX, strings, sizeof(strings));
+    CHECK(container_launch_parse(msg, len, argv, envp));
+    // More strings than in the message, or the last one not terminated
+    len = launch_msg(msg, 2, 2, strings, sizeof(strings));
+    CHECK(container_launch_parse(msg, len, argv, envp));
+    len = launch_msg(msg, 2, 1, strings, sizeof(strings) - 1);
+    CHECK(container_launch_parse(msg, len, argv, envp));
+
+    // As many arguments as allowed
+    len = sizeof(uint32_t) * 2;
+    for (int i = 0; i < CONTAINER_LAUNCH_ARGS_MAX; i++) {
+        msg[len++] = 'a';
+        msg[len++] = '\0';
+    }
+    memcpy(msg, &(uint32_t[2]){CONTAINER_LAUNCH_ARGS_MAX, 0}, sizeof(uint32_t) * 2);
+    CHECK(!container_launch_parse(msg, len, argv, envp));
+    CHECK(!argv[CONTAINER_LAUNCH_ARGS_MAX] && !envp[0]);
+}
+
+int main(void) {
+    // The errors of the rejected inputs are expected
+    log_set_quiet(true);
+
+    test_launch();
+    return CHECK_RESULT();
+}
@@ -0,0 +1,29 @@
+#include <stdint.h>
+
+#include "log.h"
+#include "output.h"
+#include "check.h"
+
+// Tests of the sizes given to --output-max-size
+
+static void test_output_size(void) {
+    uint64_t size = 0;
+
+    CHECK(!output_parse_size("10", &size) && size == 10);
+    CHECK(!output_parse_size("10k", &size) && size == 10 * 1024);
+    CHECK(!output_parse_size("3G", &size) && size == 3ULL * 1024 * 1024 * 1024);
+    CHECK(output_parse_size("0", &size));
+    CHECK(output_parse_size("", &size));
+    CHECK(output_parse_size("k", &size));
+    CHECK(output_parse_size("10x", &size));
+    CHECK(output_parse_size("10kb", &size));
+    CHECK(output_parse_size("18446744073709551615k", &size));
+}
+
+int main(void) {
+    // The errors of the rejected inputs are expected
+    log_set_quiet(true);
+
+    test_output_size();
+    return CHECK_RESULT();
+}
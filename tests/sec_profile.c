@@ -0,0 +1,81 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "sec_profile.h"
+#include "check.h"
+
+// Tests of sec_profile_load, each profile is written to a temporary file
+
+// Writes text to a temporary file and loads it as a seccomp profile
+static int sec_profile_try(const char *text, sec_profile *profile) {
+    char path[] = "/tmp/barco-test-profile.XXXXXX";
+    int fd = mkstemp(path);
+    int result = -1;
+
+    if (fd == -1 || write(fd, text, strlen(text)) != (ssize_t)strlen(text)) {
+        perror("failed to write profile");
+        failures++;
+    } else {
+        result = sec_profile_load(profile, path);
+    }
+
+    if (fd >= 0) {
+        close(fd);
+        unlink(path);
+    }
+    return result;
+}
+
+static bool sec_profile_rejects(const char *text) {
+    sec_profile profile = {0};
+    int result = sec_profile_try(text, &profile);
+
+    sec_profile_free(&profile);
+    return result == -1;
+}
+
+static void test_sec_profile(void) {
+    sec_profile profile = {0};
+
+    CHECK(!sec_profile_try("{\"defaultAction\": \"SCMP_ACT_ERRNO\","
+                           " \"syscalls\": ["
+                           "  {\"names\": [\"read\", \"write\", \"no_such_syscall\"],"
+                           "   \"action\": \"SCMP_ACT_ALLOW\"},"
+                           "  {\"names\": [\"personality\"], \"action\": \"SCMP_ACT_ALLOW\","
+                           "   \"args\": [{\"index\": 0, \"value\": 8, \"op\": \"SCMP_CMP_EQ\"},"
+                           "              {\"index\": 0, \"value\": 0, \"op\": \"SCMP_CMP_EQ\"}]}],"
+                           " \"priorities\": [\"read\"]}", &profile));
+    // Unknown syscalls are ignored, an argument compared twice splits the rule
+    CHECK(profile.rules_count == 4);
+    CHECK(profile.priorities_count == 1);
+    sec_profile_free(&profile);
+
+    CHECK(sec_profile_rejects("{\"defaultAction\": \"SCMP_ACT_ERRNO\""));
+    CHECK(sec_profile_rejects("{\"syscalls\": []}"));
+    CHECK(sec_profile_rejects("{\"defaultAction\": \"SCMP_ACT_NOPE\"}"));
+    CHECK(sec_profile_rejects("{\"defaultAction\": \"SCMP_ACT_ERRNO\","
+                              " \"flags\": [\"SECCOMP_FILTER_FLAG_NOPE\"]}"));
+    CHECK(sec_profile_rejects("{\"defaultAction\": \"SCMP_ACT_ERRNO\","
+                              " \"syscalls\": [{\"names\": [\"read\"]}]}"));
+    CHECK(sec_profile_rejects("{\"defaultAction\": \"SCMP_ACT_ERRNO\","
+                              " \"syscalls\": [{\"names\": [\"read\"], \"action\": \"SCMP_ACT_ALLOW\","
+                              "  \"args\": [{\"index\": 6, \"value\": 0, \"op\": \"SCMP_CMP_EQ\"}]}]}"));
+    CHECK(sec_profile_rejects("{\"defaultAction\": \"SCMP_ACT_ERRNO\","
+                              " \"syscalls\": [{\"names\": [\"read\"], \"action\": \"SCMP_ACT_ALLOW\","
+                              "  \"args\": [{\"index\": 0, \"value\": -1, \"op\": \"SCMP_CMP_EQ\"}]}]}"));
+    CHECK(sec_profile_rejects("{\"defaultAction\": \"SCMP_ACT_ERRNO\","
+                              " \"syscalls\": [{\"names\": [\"read\"], \"action\": \"SCMP_ACT_ALLOW\","
+                              "  \"args\": [{\"index\": 0, \"value\": 0, \"op\": \"SCMP_CMP_NOPE\"}]}]}"));
+}
+
+int main(void) {
+    // The errors of the rejected inputs are expected
+    log_set_quiet(true);
+
+    test_sec_profile();
+    return CHECK_RESULT();
+}
@@ -0,0 +1,33 @@
+
+#include "log.h"
+#include "user.h"
+#include "check.h"
+
+// Tests of the ranges given to --user-pool
+
+static void test_user_pool(void) {
+    user_pool_config config = {0};
+
+    CHECK(!user_pool_parse("100000:1024:65536", &config));
+    CHECK(config.start == 100000 && config.slots == 1024 && config.size == 65536);
+
+    CHECK(user_pool_parse("0:1:1", &config));
+    CHECK(user_pool_parse("1:0:1", &config));
+    CHECK(user_pool_parse("1:1:0", &config));
+    CHECK(user_pool_parse("1:-1:1", &config));
+    CHECK(user_pool_parse("100000:1024", &config));
+    CHECK(user_pool_parse("100000:1024:65536x", &config));
+    CHECK(user_pool_parse("100000:65537:1", &config));
+    // Past the last uid
+    CHECK(user_pool_parse("4294901760:2:65536", &config));
+    CHECK(user_pool_parse("4294901760:1:65535", &config));
+    CHECK(!user_pool_parse("4294901760:1:65534", &config));
+}
+
+int main(void) {
+    // The errors of the rejected inputs are expected
+    log_set_quiet(true);
+
+    test_user_pool();
+    return CHECK_RESULT();
+}